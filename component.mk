@@ -5,3 +5,7 @@
 COMPONENT_SRCDIRS := src HDiffPatch/libHDiffPatch/HPatch/
 
 COMPONENT_ADD_INCLUDEDIRS := include src HDiffPatch/libHDiffPatch/
+
+ifdef CONFIG_HDIFFZ_PROFILE_RELEASE
+CFLAGS += -O2
+endif
@@ -0,0 +1,212 @@
+/**
+ * @file flash_model
+ * @brief Apply a diff to an emulated flash partition with each erase
+ * strategy, and print the flash operations, modeled time and wear of each.
+ *
+ *     flash_model old diff [n_updates]
+ *
+ * Strategies:
+ *     wipe  - erase the patched image's sectors up front in 128 KB steps, as
+ *             esp_hdiffz_ota_file() does
+ *     lazy  - erase each sector as the patch reaches it, as the C++
+ *             PartitionSink and rollback partitions do
+ *     full  - erase the whole partition up front, as esp_ota_begin() does
+ *             for an image of unknown size
+ *
+ * Each update is applied to the same slot n_updates times (one in every two
+ * updates of an A/B device).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_hdiffz.h"
+#include "rw.h"
+#include "engine.h"
+#include "miniz_plugin.h"
+
+#define PART_SIZE 0x100000
+#define WIPE_STEP (SPI_FLASH_SEC_SIZE * 32)
+
+typedef enum {
+    STRATEGY_WIPE = 0,
+    STRATEGY_LAZY,
+    STRATEGY_FULL,
+    STRATEGY_N,
+} strategy_t;
+
+static const char *const s_names[STRATEGY_N] = { "wipe", "lazy", "full" };
+
+typedef struct {
+    const esp_partition_t *part;
+    esp_hdiffz_flash_t *flash;
+    strategy_t strategy;
+    size_t erased;
+} dst_t;
+
+typedef struct {
+    const esp_partition_t *part;
+    esp_hdiffz_flash_t *flash;
+} src_t;
+
+static unsigned char *load(const char *name, size_t *size) {
+    unsigned char *data;
+    FILE *f = fopen(name, "rb");
+
+    if( NULL == f ) {
+        printf("Can't open %s\n", name);
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    *size = ftell(f);
+    rewind(f);
+    data = malloc(*size + 1);
+    if( *size != fread(data, 1, *size, f) ) exit(1);
+    fclose(f);
+    return data;
+}
+
+static hpatch_BOOL part_read(const hpatch_TStreamInput *stream, hpatch_StreamPos_t pos,
+        unsigned char *out, unsigned char *out_end) {
+    const src_t *src = (const src_t *)stream->streamImport;
+
+    return ESP_OK == esp_hdiffz_flash_read(src->flash, src->part, pos, out, out_end - out);
+}
+
+static hpatch_BOOL part_write(const hpatch_TStreamOutput *stream, hpatch_StreamPos_t pos,
+        const unsigned char *data, const unsigned char *data_end) {
+    dst_t *dst = (dst_t *)stream->streamImport;
+    size_t end = pos + (data_end - data);
+
+    if( STRATEGY_LAZY == dst->strategy && end > dst->erased ) {
+        size_t size = (end - dst->erased + SPI_FLASH_SEC_SIZE - 1) & ~(size_t)(SPI_FLASH_SEC_SIZE - 1);
+        if( ESP_OK != esp_hdiffz_flash_erase_range(dst->flash, dst->part, dst->erased, size) ) return hpatch_FALSE;
+        dst->erased += size;
+    }
+    return ESP_OK == esp_hdiffz_flash_write(dst->flash, dst->part, pos, data, data_end - data);
+}
+
+/**
+ * @brief One update of dst from src, counted in flash.
+ */
+static esp_err_t update(const esp_partition_t *src_part, const esp_partition_t *dst_part,
+        const unsigned char *diff, size_t diff_size, strategy_t strategy, esp_hdiffz_flash_t *flash) {
+    esp_err_t err;
+    esp_hdiffz_info_t info;
+    hpatch_TStreamInput old_stream = { 0 }, diff_stream;
+    hpatch_TStreamOutput out_stream = { 0 };
+    esp_hdiffz_miniz_plugin_t plugin;
+    esp_hdiffz_engine_cfg_t cfg = { 0 };
+    dst_t dst = { .part = dst_part, .flash = flash, .strategy = strategy };
+    src_t src = { .part = src_part, .flash = flash };
+    size_t wipe_size;
+
+    esp_hdiffz_mem_as_stream_input(&diff_stream, diff, diff_size);
+    err = esp_hdiffz_get_info(&diff_stream, &info);
+    if( ESP_OK != err ) return err;
+    diff_stream.streamSize -= info.old_check_size;
+
+    wipe_size = (info.new_size + SPI_FLASH_SEC_SIZE - 1) & ~(size_t)(SPI_FLASH_SEC_SIZE - 1);
+    if( STRATEGY_FULL == strategy ) wipe_size = dst_part->size;
+    if( STRATEGY_LAZY != strategy ) {
+        for(size_t start = 0; start < wipe_size; start += WIPE_STEP) {
+            size_t size = wipe_size - start < WIPE_STEP ? wipe_size - start : WIPE_STEP;
+            err = esp_hdiffz_flash_erase_range(flash, dst_part, start, size);
+            if( ESP_OK != err ) return err;
+        }
+    }
+
+    old_stream.streamImport = &src;
+    old_stream.streamSize = info.old_size;
+    old_stream.read = part_read;
+    out_stream.streamImport = &dst;
+    out_stream.streamSize = info.new_size;
+    out_stream.write = part_write;
+    esp_hdiffz_miniz_plugin_init(&plugin);
+    plugin.dict_src = &old_stream;
+    cfg.out = &out_stream;
+    cfg.old = &old_stream;
+    cfg.diff = &diff_stream;
+    cfg.plugin = &plugin.base;
+    cfg.align = SPI_FLASH_SEC_SIZE;
+    return esp_hdiffz_engine_patch(&cfg);
+}
+
+int main(int argc, char **argv) {
+    unsigned char *old, *diff, *first = NULL, *out;
+    size_t old_size, diff_size;
+    hpatch_TStreamInput diff_stream;
+    esp_hdiffz_info_t info;
+    int n_updates;
+
+    if( argc < 3 ) {
+        printf("usage: %s old diff [n_updates]\n", argv[0]);
+        return 2;
+    }
+    old = load(argv[1], &old_size);
+    diff = load(argv[2], &diff_size);
+    n_updates = argc > 3 ? atoi(argv[3]) : 10;
+    esp_hdiffz_mem_as_stream_input(&diff_stream, diff, diff_size);
+    if( ESP_OK != esp_hdiffz_get_info(&diff_stream, &info) ) {
+        printf("Failed to parse %s\n", argv[2]);
+        return 1;
+    }
+    out = malloc(info.new_size);
+
+    printf("%-5s %6s %6s %6s %6s %8s %6s %6s %9s %9s %9s %9s %8s %6s\n",
+            "", "reads", "writes", "pages", "sec er", "block er", "wear", "max",
+            "read ms", "write ms", "erase ms", "total ms",
+            "lifetime", "bad wr");
+    for(strategy_t s = 0; s < STRATEGY_N; s++) {
+        const esp_partition_t *src = host_partition_add("ota_0", PART_SIZE);
+        const esp_partition_t *dst = host_partition_add("ota_1", PART_SIZE);
+        esp_hdiffz_flash_report_t report;
+        host_partition_wear_t wear;
+
+        if( NULL == src || NULL == dst ) return 1;
+        esp_partition_write(src, 0, old, old_size);
+        for(int u = 0; u < n_updates; u++) {
+            esp_hdiffz_flash_t flash;
+            esp_err_t err;
+
+            esp_hdiffz_flash_init(&flash, NULL);
+            err = update(src, dst, diff, diff_size, s, &flash);
+            /* The first update's operations; every update repeats them */
+            if( 0 == u ) esp_hdiffz_flash_report(&flash, &report);
+            esp_hdiffz_flash_deinit(&flash);
+            if( ESP_OK != err ) {
+                printf("%s: update %d failed\n", s_names[s], u);
+                return 1;
+            }
+        }
+        host_partition_wear(dst, &wear);
+
+        /* Every strategy must leave the same image */
+        esp_partition_read(dst, 0, out, info.new_size);
+        if( NULL == first ) {
+            first = out;
+            out = malloc(info.new_size);
+        }
+        else if( 0 != memcmp(first, out, info.new_size) ) {
+            printf("%s: patched image differs\n", s_names[s]);
+            return 1;
+        }
+
+        printf("%-5s %6u %6u %6u %6u %8u %6u %6u %9.1f %9.1f %9.1f %9.1f %8u %6u\n",
+                s_names[s], (unsigned)report.n_reads, (unsigned)report.n_writes,
+                (unsigned)report.n_page_programs, (unsigned)report.n_sector_erases,
+                (unsigned)report.n_block_erases, (unsigned)report.sectors_erased,
+                (unsigned)report.max_sector_erases,
+                report.read_us / 1e3, report.write_us / 1e3, report.erase_us / 1e3,
+                (report.read_us + report.write_us + report.erase_us) / 1e3,
+                (unsigned)wear.max_erases, (unsigned)wear.bad_writes);
+        if( wear.bad_writes ) return 1;
+    }
+    printf("wear: sector erase cycles per update; max: most of one sector per update;\n"
+            "lifetime: most of one sector after %d updates; bad wr: writes over unerased data\n", n_updates);
+    free(first);
+    free(out);
+    free(old);
+    free(diff);
+    return 0;
+}
@@ -0,0 +1,90 @@
+#!/usr/bin/env python3
+"""
+Recompress the nodes of an `hdiffz -c-zlib` diff against a preset
+dictionary taken from the old image.
+
+Each compressed section is decoded and deflated again as a raw stream whose
+window starts out filled with a region of the old image. The region is
+searched per section and kept only if the node gets smaller. Such nodes are
+stored as
+
+    window_bits | 0x80, packed dict_pos, packed dict_len, raw deflate
+
+which the esp_hdiffz miniz plugin reads back from the old partition or file
+(see ESP_HDIFFZ_NODE_DICT in src/miniz_plugin.h). Other nodes are copied
+unchanged, so the output is never larger than the input.
+
+    python3 host/hdiffz_dict.py bin/hello_world.bin bin/hello_world_diff.bin out.bin
+"""
+
+import argparse
+import sys
+import zlib
+
+from hdiffz_format import DICT_MAX, NODE_DICT, SECTIONS, deflate_raw, inflate_raw, join, pack_uint, split
+
+
+def best_dict(old, data, window_bits, level, dict_len, step):
+    """Return (node, dict_pos, dict_len) of the smallest node over all regions."""
+    best = None
+    last = max(0, len(old) - dict_len)
+    for pos in list(range(0, last, step)) + [last]:
+        zdict = old[pos:pos + dict_len]
+        node = deflate_raw(data, window_bits, level, zdict)
+        if best is None or len(node) < len(best[0]):
+            best = (node, pos, len(zdict))
+    return best
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    ap.add_argument("old", help="old image the diff applies to")
+    ap.add_argument("diff", help="diff made with hdiffz -c-zlib")
+    ap.add_argument("out", help="diff with dictionary nodes")
+    ap.add_argument("--level", type=int, default=9, help="deflate level (default 9)")
+    ap.add_argument("--window-bits", type=int, default=0,
+                    help="window bits of dictionary nodes; default keeps the node's own")
+    ap.add_argument("--step", type=int, default=0,
+                    help="dictionary search stride in bytes; default half the dictionary")
+    args = ap.parse_args()
+
+    old = open(args.old, "rb").read()
+    diff = open(args.diff, "rb").read()
+    ctype, head, secs = split(diff)
+    if ctype != b"zlib":
+        sys.exit("only zlib diffs are supported, got %r" % ctype)
+    if head[1] != len(old):
+        sys.exit("diff expects %d bytes of old data; got %d" % (head[1], len(old)))
+
+    out_secs = []
+    for name, (size, node, compressed) in zip(SECTIONS, secs):
+        if not compressed:
+            out_secs.append((size, node, False))
+            continue
+
+        wb = node[0]
+        data = zlib.decompress(node[1:], wb)
+        assert len(data) == size
+        if args.window_bits:
+            wb = args.window_bits
+        dict_len = min(DICT_MAX, 1 << wb, len(old))
+        step = args.step or max(1, dict_len // 2)
+
+        raw, dict_pos, dict_len = best_dict(old, data, wb, args.level, dict_len, step)
+        assert inflate_raw(raw, wb, old[dict_pos:dict_pos + dict_len]) == data
+        new_node = bytes([wb | NODE_DICT]) + pack_uint(dict_pos) + pack_uint(dict_len) + raw
+
+        if len(new_node) < len(node):
+            print("%-8s %6d -> %6d bytes (dict %d+%d)" % (name, len(node), len(new_node), dict_pos, dict_len))
+            node = new_node
+        else:
+            print("%-8s %6d bytes (kept)" % (name, len(node)))
+        out_secs.append((size, node, True))
+
+    out = join(ctype, head, out_secs)
+    open(args.out, "wb").write(out)
+    print("total    %6d -> %6d bytes" % (len(diff), len(out)))
+
+
+if __name__ == "__main__":
+    main()
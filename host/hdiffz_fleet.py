@@ -0,0 +1,166 @@
+#!/usr/bin/env python3
+"""
+Build the diffs from every old firmware image in the field to a new one.
+
+Pairs are built in parallel, one hdiffz process per core. Every diff is
+checked by applying it and then cached under the SHA-256 of the old image,
+the new image and the build parameters (hdiffz arguments and the hdiffz
+binary itself), so a release only builds pairs it has not built before.
+
+The output directory gets the diffs and manifest.json:
+
+    {"new": {"sha256": ..., "size": ...}, "params": ...,
+     "diffs": [{"old_sha256": ..., "old_size": ..., "file": ..., "url": ...,
+                "size": ..., "sha256": ...}, ...]}
+
+A device hashes the first old_size bytes of its running partition and
+fetches the entry whose old_sha256 matches; a build time and size report is
+printed and written to report.csv.
+
+    python3 host/hdiffz_fleet.py new.bin old/*.bin -o release/ --hdiffz path/to/hdiffz
+"""
+
+import argparse
+import concurrent.futures
+import csv
+import hashlib
+import json
+import os
+import shlex
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+import hdiffz_format as fmt
+
+
+def sha256_file(path):
+    h = hashlib.sha256()
+    with open(path, "rb") as f:
+        for block in iter(lambda: f.read(1 << 20), b""):
+            h.update(block)
+    return h.hexdigest()
+
+
+def cache_key(old_sha, new_sha, params):
+    return hashlib.sha256(("%s:%s:%s" % (old_sha, new_sha, params)).encode()).hexdigest()
+
+
+def build(hdiffz, args, old_path, new_path, cache_dir, key, verify):
+    """Build one pair into the cache; returns (path, meta). Runs in a worker process."""
+    path = os.path.join(cache_dir, key[:2], key + ".diff")
+    meta_path = path[:-len(".diff")] + ".json"
+    if os.path.exists(path) and os.path.exists(meta_path):
+        meta = json.load(open(meta_path))
+        meta["cached"] = True
+        return path, meta
+
+    os.makedirs(os.path.dirname(path), exist_ok=True)
+    fd, tmp = tempfile.mkstemp(dir=os.path.dirname(path), suffix=".tmp")
+    os.close(fd)
+    try:
+        start = time.monotonic()
+        subprocess.run([hdiffz] + args + ["-f", old_path, new_path, tmp],
+                       check=True, stdout=subprocess.DEVNULL)
+        build_s = time.monotonic() - start
+
+        diff = open(tmp, "rb").read()
+        if verify:
+            old = open(old_path, "rb").read()
+            if fmt.apply(old, fmt.load(diff, old)) != open(new_path, "rb").read():
+                raise RuntimeError("diff from %s does not reproduce the new image" % old_path)
+        meta = {"size": len(diff), "sha256": hashlib.sha256(diff).hexdigest(), "build_s": build_s}
+
+        # Only complete, verified entries ever appear under their key
+        with open(tmp + ".json", "w") as f:
+            json.dump(meta, f)
+        os.replace(tmp, path)
+        os.replace(tmp + ".json", meta_path)
+    finally:
+        for p in (tmp, tmp + ".json"):
+            if os.path.exists(p):
+                os.unlink(p)
+    meta["cached"] = False
+    return path, meta
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    ap.add_argument("new", help="new firmware image")
+    ap.add_argument("old", nargs="+", help="old firmware images still in the field")
+    ap.add_argument("-o", "--out", required=True, help="output directory")
+    ap.add_argument("--hdiffz", required=True, help="hdiffz binary")
+    ap.add_argument("--params", default="-c-zlib", help="hdiffz arguments (default -c-zlib)")
+    ap.add_argument("--cache", default=os.path.join(os.path.expanduser("~"), ".cache", "hdiffz_fleet"),
+                    help="cache directory (default ~/.cache/hdiffz_fleet)")
+    ap.add_argument("-j", "--jobs", type=int, default=os.cpu_count(), help="parallel builds (default: cores)")
+    ap.add_argument("--url-prefix", default="", help="prepended to file names for manifest urls")
+    ap.add_argument("--no-verify", action="store_true", help="skip applying each new diff")
+    args = ap.parse_args()
+
+    hdiffz_args = shlex.split(args.params)
+    # A rebuilt hdiffz may produce different diffs
+    params = "%s %s" % (sha256_file(args.hdiffz), " ".join(hdiffz_args))
+    new_sha = sha256_file(args.new)
+
+    # Identical old images are built once
+    olds = {}
+    for path in args.old:
+        sha = sha256_file(path)
+        if sha == new_sha:
+            print("%s is the new image; skipped" % path)
+            continue
+        olds.setdefault(sha, path)
+
+    os.makedirs(args.out, exist_ok=True)
+    start = time.monotonic()
+    results = {}
+    with concurrent.futures.ProcessPoolExecutor(max_workers=max(1, args.jobs)) as pool:
+        futures = {pool.submit(build, args.hdiffz, hdiffz_args, path, args.new, args.cache,
+                               cache_key(sha, new_sha, params), not args.no_verify): sha
+                   for sha, path in olds.items()}
+        failed = False
+        for fut in concurrent.futures.as_completed(futures):
+            sha = futures[fut]
+            try:
+                results[sha] = fut.result()
+            except Exception as e:
+                print("%s: %s" % (olds[sha], e), file=sys.stderr)
+                failed = True
+    if failed:
+        sys.exit(1)
+    wall_s = time.monotonic() - start
+
+    manifest = {"new": {"sha256": new_sha, "size": os.path.getsize(args.new)},
+                "params": " ".join(hdiffz_args), "diffs": []}
+    rows = []
+    for sha, path in sorted(olds.items(), key=lambda kv: kv[1]):
+        cached_path, meta = results[sha]
+        name = "%s-%s.diff" % (sha[:16], new_sha[:16])
+        shutil.copyfile(cached_path, os.path.join(args.out, name))
+        old_size = os.path.getsize(path)
+        manifest["diffs"].append({"old_sha256": sha, "old_size": old_size, "file": name,
+                                  "url": args.url_prefix + name, "size": meta["size"],
+                                  "sha256": meta["sha256"]})
+        rows.append([path, sha[:16], old_size, meta["size"], "%.3f" % meta["build_s"],
+                     "yes" if meta["cached"] else "no"])
+
+    with open(os.path.join(args.out, "manifest.json"), "w") as f:
+        json.dump(manifest, f, indent=2)
+    header = ["old", "old_sha256", "old_size", "diff_size", "build_s", "cached"]
+    with open(os.path.join(args.out, "report.csv"), "w", newline="") as f:
+        csv.writer(f).writerows([header] + rows)
+
+    print("%-32s %-16s %9s %9s %8s %6s" % tuple(header))
+    for row in rows:
+        print("%-32s %-16s %9d %9d %8s %6s" % tuple(row))
+    built = [r for r in rows if r[5] == "no"]
+    print("%d pairs (%d built, %d cached) in %.1f s wall; %.1f s of builds on %d jobs"
+          % (len(rows), len(built), len(rows) - len(built), wall_s,
+             sum(float(r[4]) for r in built), args.jobs))
+
+
+if __name__ == "__main__":
+    main()
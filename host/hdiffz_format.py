@@ -0,0 +1,228 @@
+"""
+Reading, writing and applying HDiffPatch compressed diffs as esp_hdiffz
+consumes them. Shared by the host tools in this directory.
+
+A diff is
+
+    "HDIFF13&" compress_type '\\0'
+    new_size old_size cover_count (size compressed_size) * 4
+    cover, rle_ctrl, rle_code and new_diff sections
+
+with packed uints throughout. A section is stored raw when its compressed
+size is 0. A compressed section is a node: a window bits byte followed by
+one or more zlib streams, or by a raw deflate stream with a preset
+dictionary when ESP_HDIFFZ_NODE_DICT is set (see src/miniz_plugin.h).
+Checksums of the old data may follow the last section (see src/oldcheck.h).
+"""
+
+import zlib
+
+MAGIC = b"HDIFF13&"
+NODE_DICT = 0x80
+# Sections in header order
+SECTIONS = ("cover", "rle_ctrl", "rle_code", "new_diff")
+# Largest tinfl window; dictionaries can't be any larger on the device
+DICT_MAX = 32768
+# Smallest window the plugin allocates, and its input buffer cap for streamed diffs
+WINDOW_MIN = 512
+IN_BUF_MAX = 4096
+# Ends a diff that carries old data checksums
+OLDCHECK_MAGIC = b"OCRC"
+
+
+class Diff:
+    """Header fields and raw (decompressed) sections of a diff."""
+
+    def __init__(self, new_size, old_size, cover_count, sections):
+        self.new_size = new_size
+        self.old_size = old_size
+        self.cover_count = cover_count
+        self.sections = list(sections)
+
+
+def pack_uint(v):
+    out = [v & 0x7F]
+    v >>= 7
+    while v:
+        out.append(0x80 | (v & 0x7F))
+        v >>= 7
+    return bytes(reversed(out))
+
+
+def unpack_uint(buf, pos):
+    v = 0
+    while True:
+        b = buf[pos]
+        pos += 1
+        v = (v << 7) | (b & 0x7F)
+        if not b & 0x80:
+            return v, pos
+
+
+def unpack_tagged(buf, pos, tag_bits):
+    """Packed uint whose first byte carries tag_bits high bits of tag."""
+    b = buf[pos]
+    pos += 1
+    value_bits = 7 - tag_bits
+    tag = b >> (8 - tag_bits)
+    v = b & ((1 << value_bits) - 1)
+    more = b & (1 << value_bits)
+    while more:
+        b = buf[pos]
+        pos += 1
+        v = (v << 7) | (b & 0x7F)
+        more = b & 0x80
+    return v, tag, pos
+
+
+def split(diff):
+    """Return (compress_type, [new, old, covers], [(size, stored bytes, compressed)])."""
+    if not diff.startswith(MAGIC):
+        raise ValueError("not a compressed HDiffPatch diff")
+    pos = diff.index(b"\0", len(MAGIC))
+    ctype = diff[len(MAGIC):pos]
+    pos += 1
+    fields = []
+    for _ in range(3 + 2 * len(SECTIONS)):
+        v, pos = unpack_uint(diff, pos)
+        fields.append(v)
+    secs = []
+    for i in range(len(SECTIONS)):
+        size, csize = fields[3 + 2 * i], fields[4 + 2 * i]
+        n = csize if csize else size
+        secs.append((size, diff[pos:pos + n], csize != 0))
+        pos += n
+    if pos != len(diff):
+        if diff.endswith(OLDCHECK_MAGIC):
+            raise ValueError("diff has old data checksums; rewrite the diff without them "
+                             "and add them back with hdiffz_oldcheck.py")
+        raise ValueError("diff is %d bytes; sections end at %d" % (len(diff), pos))
+    return ctype, fields[:3], secs
+
+
+def strip_oldcheck(diff):
+    """Return (diff without old data checksums, trailer or None)."""
+    if len(diff) < 8 or not diff.endswith(OLDCHECK_MAGIC):
+        return diff, None
+    n = int.from_bytes(diff[-8:-4], "little")
+    if n + 8 > len(diff):
+        return diff, None
+    return diff[:-n - 8], diff[-n - 8:]
+
+
+def join(ctype, head, secs):
+    """Inverse of split; secs is [(size, stored bytes, compressed)]."""
+    fields = list(head)
+    body = b""
+    for size, data, compressed in secs:
+        fields += [size, len(data) if compressed else 0]
+        body += data
+    return MAGIC + ctype + b"\0" + b"".join(pack_uint(v) for v in fields) + body
+
+
+def deflate_raw(data, window_bits, level, zdict=None):
+    kw = {"zdict": zdict} if zdict else {}
+    c = zlib.compressobj(level, zlib.DEFLATED, -window_bits, 9, zlib.Z_DEFAULT_STRATEGY, **kw)
+    return c.compress(data) + c.flush()
+
+
+def inflate_raw(data, window_bits, zdict):
+    d = zlib.decompressobj(-window_bits, zdict=zdict)
+    return d.decompress(data) + d.flush()
+
+
+def encode_node(data, window_bits, level, chunk=0):
+    """Window bits byte and one zlib stream per chunk bytes (0 for one stream)."""
+    chunk = chunk or max(1, len(data))
+    out = bytes([window_bits])
+    for i in range(0, max(1, len(data)), chunk):
+        c = zlib.compressobj(level, zlib.DEFLATED, window_bits)
+        out += c.compress(data[i:i + chunk]) + c.flush()
+    return out
+
+
+def decode_node(node, old=None):
+    """Decompress a node; old is needed if it has a dictionary."""
+    wb = node[0] & ~NODE_DICT
+    if node[0] & NODE_DICT:
+        dict_pos, pos = unpack_uint(node, 1)
+        dict_len, pos = unpack_uint(node, pos)
+        return inflate_raw(node[pos:], wb, old[dict_pos:dict_pos + dict_len])
+    out = b""
+    rest = node[1:]
+    while rest:
+        d = zlib.decompressobj(wb)
+        out += d.decompress(rest)
+        rest = d.unused_data
+    return out
+
+
+def load(diff, old=None):
+    """Parse a diff into a Diff with decompressed sections."""
+    try:
+        ctype, head, secs = split(diff)
+    except ValueError:
+        ctype, head, secs = split(strip_oldcheck(diff)[0])
+    if ctype not in (b"", b"zlib"):
+        raise ValueError("unsupported compress type %r" % ctype)
+    raw = [decode_node(data, old) if compressed else data for _, data, compressed in secs]
+    for (size, _, _), data in zip(secs, raw):
+        if len(data) != size:
+            raise ValueError("section is %d bytes, header says %d" % (len(data), size))
+    return Diff(head[0], head[1], head[2], raw)
+
+
+def apply(old, diff):
+    """Patch old with a Diff; returns the new data."""
+    cover, ctrl, code, new_diff = diff.sections
+
+    # Deltas run over the whole new data; gaps between covers skip them
+    delta = bytearray(diff.new_size)
+    pos = code_pos = 0
+    ctrl_pos = 0
+    while ctrl_pos < len(ctrl) and pos < diff.new_size:
+        n, tag, ctrl_pos = unpack_tagged(ctrl, ctrl_pos, 2)
+        n += 1
+        if tag == 1:
+            delta[pos:pos + n] = b"\xff" * n
+        elif tag == 2:
+            delta[pos:pos + n] = code[code_pos:code_pos + 1] * n
+            code_pos += 1
+        elif tag == 3:
+            delta[pos:pos + n] = code[code_pos:code_pos + n]
+            code_pos += n
+        pos += n
+    del delta[diff.new_size:]
+
+    out = bytearray()
+    diff_pos = new_end = 0
+    for old_pos, new_pos, length in covers(diff):
+        gap = new_pos - new_end
+        out += new_diff[diff_pos:diff_pos + gap]
+        diff_pos += gap
+        out += bytes((a + b) & 0xFF for a, b in
+                     zip(old[old_pos:old_pos + length], delta[new_pos:new_pos + length]))
+        new_end = new_pos + length
+    out += new_diff[diff_pos:diff_pos + diff.new_size - new_end]
+    return bytes(out)
+
+
+def covers(diff):
+    """Yield (old_pos, new_pos, length) of each cover of a Diff."""
+    cover = diff.sections[0]
+    p = old_end = new_end = 0
+    for _ in range(diff.cover_count):
+        v, back, p = unpack_tagged(cover, p, 1)
+        old_pos = old_end - v if back else old_end + v
+        v, p = unpack_uint(cover, p)
+        new_pos = new_end + v
+        length, p = unpack_uint(cover, p)
+        yield old_pos, new_pos, length
+        old_end = old_pos + length
+        new_end = new_pos + length
+
+
+def node_heap(window_bits, in_place, fixed):
+    """esp_hdiffz_miniz_plugin_node_heap; fixed is its value for an in place node with 9 window bits."""
+    window = max(WINDOW_MIN, 1 << window_bits)
+    return fixed - WINDOW_MIN + window + (0 if in_place else min(IN_BUF_MAX, 1 << window_bits))
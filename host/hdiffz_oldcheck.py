@@ -0,0 +1,84 @@
+#!/usr/bin/env python3
+"""
+Append checksums of the old data a diff uses, so a device verifies only
+those bytes of its running firmware instead of hashing all of it.
+
+The old image is cut into blocks of --block-size bytes. Every block that a
+cover or a preset dictionary reads from gets a CRC-32, stored after the last
+section of the diff as described in src/oldcheck.h. esp_hdiffz checks each
+block the first time the patch reads from it and stops with
+ESP_ERR_HDIFFZ_OLD_MISMATCH on the first one that differs. Checksums already
+on the diff are replaced.
+
+    python3 host/hdiffz_oldcheck.py bin/hello_world.bin bin/hello_world_diff.bin out.bin
+"""
+
+import argparse
+import sys
+import zlib
+
+from hdiffz_format import NODE_DICT, OLDCHECK_MAGIC, covers, load, pack_uint, split, strip_oldcheck, unpack_uint
+
+# Must match ESP_HDIFFZ_OLDCHECK_MIN_BITS and ESP_HDIFFZ_OLDCHECK_MAX_BITS
+MIN_BITS = 9
+MAX_BITS = 16
+
+
+def used_ranges(diff, old):
+    """Yield (pos, len) of every old data range the patch reads."""
+    d = load(diff, old)
+    for old_pos, _, length in covers(d):
+        if length:
+            yield old_pos, length
+    _, _, secs = split(diff)
+    for _, node, compressed in secs:
+        if compressed and node[0] & NODE_DICT:
+            dict_pos, p = unpack_uint(node, 1)
+            dict_len, _ = unpack_uint(node, p)
+            yield dict_pos, dict_len
+
+
+def trailer(old, ranges, block_bits):
+    """Old data checksum trailer for the blocks touched by ranges."""
+    blocks = set()
+    for pos, length in ranges:
+        blocks.update(range(pos >> block_bits, ((pos + length - 1) >> block_bits) + 1))
+    body = bytes([block_bits]) + pack_uint(len(blocks))
+    prev = -1
+    for b in sorted(blocks):
+        crc = zlib.crc32(old[b << block_bits:(b + 1) << block_bits])
+        body += pack_uint(b - prev) + crc.to_bytes(4, "little")
+        prev = b
+    return body + len(body).to_bytes(4, "little") + OLDCHECK_MAGIC, len(blocks)
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    ap.add_argument("old", help="old image the diff applies to")
+    ap.add_argument("diff", help="diff made with hdiffz or the other host tools")
+    ap.add_argument("out", help="diff with old data checksums")
+    ap.add_argument("--block-size", type=int, default=4096,
+                    help="bytes per checksum; a power of two from 512 to 65536 (default 4096)")
+    args = ap.parse_args()
+
+    block_bits = args.block_size.bit_length() - 1
+    if args.block_size != 1 << block_bits or not MIN_BITS <= block_bits <= MAX_BITS:
+        sys.exit("--block-size must be a power of two from %d to %d" % (1 << MIN_BITS, 1 << MAX_BITS))
+
+    old = open(args.old, "rb").read()
+    diff, _ = strip_oldcheck(open(args.diff, "rb").read())
+    _, head, _ = split(diff)
+    if head[1] != len(old):
+        sys.exit("diff expects %d bytes of old data; got %d" % (head[1], len(old)))
+
+    ranges = list(used_ranges(diff, old))
+    tail, n_blocks = trailer(old, ranges, block_bits)
+    open(args.out, "wb").write(diff + tail)
+
+    print("%d of %d old blocks used (%d of %d bytes verified), %d byte trailer" % (
+        n_blocks, (len(old) + args.block_size - 1) // args.block_size,
+        min(n_blocks * args.block_size, len(old)), len(old), len(tail)))
+
+
+if __name__ == "__main__":
+    main()
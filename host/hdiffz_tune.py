@@ -0,0 +1,214 @@
+#!/usr/bin/env python3
+"""
+Build the esp_hdiffz diff with the lowest cost for a firmware pair.
+
+Candidates come from the cover sets of one or more base diffs: given with
+--diff, or made by running the HDiffPatch `hdiffz` tool once per match score.
+Each section of each base is then stored raw or compressed with every
+combination of deflate level, window bits and node chunk size (and
+optionally a preset dictionary from the old image). Every candidate is
+scored as
+
+    cost = diff bytes / link rate + decode time
+
+where decode time comes from per byte costs measured on the device (the
+"Decode profile" perf test in test/test_ota.c prints them). Candidates
+whose decode heap, as esp_hdiffz_get_info() reports it, exceeds the RAM
+limit are dropped. The cheapest one is written and its parameters printed.
+
+    python3 host/hdiffz_tune.py old.bin new.bin -o diff.bin \\
+        --hdiffz HDiffPatch/hdiffz --ram-limit 120000 --link-rate 20000
+"""
+
+import argparse
+import itertools
+import json
+import os
+import subprocess
+import sys
+import tempfile
+
+import hdiffz_format as fmt
+from hdiffz_dict import best_dict
+
+# Used when no --profile is given; rough esp32 figures at 240 MHz. Measure
+# your own with the "Decode profile" perf test.
+DEFAULT_PROFILE = {
+    "inflate_ns_per_byte": 150,     # per decompressed byte of compressed sections
+    "patch_ns_per_byte": 250,       # per byte of new data in a dry run
+    "node_heap_fixed": 11952,       # esp_hdiffz_miniz_plugin_node_heap(9, true)
+    "patch_heap": 7168,             # heap_worst - dec_heap
+}
+
+
+class Option:
+    """How one section is stored."""
+
+    def __init__(self, data, level=0, window_bits=0, chunk=0, dict_pos=None):
+        self.data = data
+        self.level = level
+        self.window_bits = window_bits
+        self.chunk = chunk
+        self.dict_pos = dict_pos
+
+    @property
+    def compressed(self):
+        return self.level > 0
+
+    def describe(self):
+        if not self.compressed:
+            return "raw"
+        s = "zlib-%d-%d" % (self.level, self.window_bits)
+        if self.chunk:
+            s += " chunk %d" % self.chunk
+        if self.dict_pos is not None:
+            s += " dict@%d" % self.dict_pos
+        return s
+
+
+def parse_list(s, lo, hi):
+    out = []
+    for part in s.split(","):
+        if "-" in part:
+            a, b = part.split("-")
+            out += range(int(a), int(b) + 1)
+        else:
+            out.append(int(part))
+    for v in out:
+        if not lo <= v <= hi:
+            sys.exit("%d is outside %d..%d" % (v, lo, hi))
+    return out
+
+
+def run_hdiffz(hdiffz, old_path, new_path, score):
+    """Uncompressed diff from hdiffz with the given match score."""
+    fd, path = tempfile.mkstemp(suffix=".diff")
+    os.close(fd)
+    try:
+        subprocess.run([hdiffz, "-m-%d" % score, "-f", old_path, new_path, path],
+                       check=True, stdout=subprocess.DEVNULL)
+        return open(path, "rb").read()
+    finally:
+        os.unlink(path)
+
+
+def section_options(old, data, args, profile):
+    """Pareto front of (size, heap) over all ways to store data."""
+    opts = [Option(data)]
+    if data:
+        for level, wb, chunk in itertools.product(args.levels, args.window_bits, args.chunks):
+            opts.append(Option(fmt.encode_node(data, wb, level, chunk), level, wb, chunk))
+        if args.dict:
+            level = max(args.levels)
+            for wb in args.window_bits:
+                dict_len = min(fmt.DICT_MAX, 1 << wb, len(old))
+                raw, pos, dict_len = best_dict(old, data, wb, level, dict_len, max(1, dict_len // 2))
+                node = bytes([wb | fmt.NODE_DICT]) + fmt.pack_uint(pos) + fmt.pack_uint(dict_len) + raw
+                opts.append(Option(node, level, wb, 0, pos))
+
+    def heap(o):
+        return fmt.node_heap(o.window_bits, args.in_place, profile["node_heap_fixed"]) if o.compressed else 0
+
+    front = []
+    for o in sorted(opts, key=lambda o: (len(o.data), heap(o))):
+        if not front or heap(o) < heap(front[-1]):
+            o.heap = heap(o)
+            front.append(o)
+    return front
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    ap.add_argument("old", help="old firmware image")
+    ap.add_argument("new", help="new firmware image")
+    ap.add_argument("-o", "--out", required=True, help="where to write the chosen diff")
+    ap.add_argument("--diff", action="append", default=[],
+                    help="base diff made by hdiffz for this pair; may be repeated")
+    ap.add_argument("--hdiffz", help="hdiffz binary; run once per match score for more bases")
+    ap.add_argument("--match-scores", default="4,6,8,12", help="hdiffz -m scores (default 4,6,8,12)")
+    ap.add_argument("--levels", default="1,6,9", help="deflate levels (default 1,6,9)")
+    ap.add_argument("--window-bits", default="9-15", help="window bits (default 9-15)")
+    ap.add_argument("--device-window-bits", type=int, default=15,
+                    help="esp_hdiffz_max_window_bits() of the device; caps --window-bits (default 15)")
+    ap.add_argument("--chunks", default="0",
+                    help="node chunk sizes in bytes; 0 is a single zlib stream (default 0)")
+    ap.add_argument("--dict", action="store_true", help="also try preset dictionaries from old")
+    ap.add_argument("--ram-limit", type=int, default=0, help="max decode heap in bytes; 0 for none")
+    ap.add_argument("--in-place", action="store_true",
+                    help="the device patches from a memory buffer (esp_hdiffz_ota_mem)")
+    ap.add_argument("--link-rate", type=float, default=20000, help="download bytes per second")
+    ap.add_argument("--profile", help="JSON from the Decode profile perf test")
+    ap.add_argument("--top", type=int, default=5, help="candidates to list (default 5)")
+    args = ap.parse_args()
+
+    args.levels = parse_list(args.levels, 1, 9)
+    args.window_bits = [wb for wb in parse_list(args.window_bits, 9, 15) if wb <= args.device_window_bits]
+    if not args.window_bits:
+        sys.exit("no window bits up to the device's %d" % args.device_window_bits)
+    args.chunks = parse_list(args.chunks, 0, 1 << 30)
+    profile = dict(DEFAULT_PROFILE)
+    if args.profile:
+        profile.update(json.load(open(args.profile)))
+
+    old = open(args.old, "rb").read()
+    new = open(args.new, "rb").read()
+
+    bases = []
+    for path in args.diff:
+        bases.append((os.path.basename(path), open(path, "rb").read()))
+    if args.hdiffz:
+        for score in parse_list(args.match_scores, 0, 1 << 16):
+            bases.append(("hdiffz -m-%d" % score, run_hdiffz(args.hdiffz, args.old, args.new, score)))
+    if not bases:
+        sys.exit("give at least one --diff or --hdiffz")
+
+    candidates = []
+    for label, raw in bases:
+        diff = fmt.load(raw, old)
+        if diff.old_size != len(old) or fmt.apply(old, diff) != new:
+            sys.exit("%s does not turn old into new" % label)
+
+        fronts = [section_options(old, data, args, profile) for data in diff.sections]
+        head_size = len(fmt.join(b"", [diff.new_size, diff.old_size, diff.cover_count], []))
+        for opts in itertools.product(*fronts):
+            size = head_size + sum(len(o.data) + len(fmt.pack_uint(len(d)))
+                                   + len(fmt.pack_uint(len(o.data) if o.compressed else 0))
+                                   for d, o in zip(diff.sections, opts))
+            if any(o.compressed for o in opts):
+                size += len(b"zlib")
+            heap = sum(o.heap for o in opts) + profile["patch_heap"]
+            if args.ram_limit and heap > args.ram_limit:
+                continue
+            inflated = sum(len(d) for d, o in zip(diff.sections, opts) if o.compressed)
+            decode_s = (inflated * profile["inflate_ns_per_byte"]
+                        + diff.new_size * profile["patch_ns_per_byte"]) * 1e-9
+            cost = size / args.link_rate + decode_s
+            candidates.append((cost, size, decode_s, heap, label, diff, opts))
+
+    if not candidates:
+        sys.exit("no candidate fits in %d bytes of RAM" % args.ram_limit)
+    candidates.sort(key=lambda c: c[:2])
+
+    print("%-8s %8s %9s %8s  %s" % ("cost s", "bytes", "decode s", "heap", "parameters"))
+    for cost, size, decode_s, heap, label, diff, opts in candidates[:args.top]:
+        params = ", ".join("%s %s" % (name, o.describe())
+                           for name, data, o in zip(fmt.SECTIONS, diff.sections, opts) if data)
+        print("%8.3f %8d %9.3f %8d  %s: %s" % (cost, size, decode_s, heap, label, params))
+
+    cost, size, decode_s, heap, label, diff, opts = candidates[0]
+    ctype = b"zlib" if any(o.compressed for o in opts) else b""
+    out = fmt.join(ctype, [diff.new_size, diff.old_size, diff.cover_count],
+                   [(len(d), o.data, o.compressed) for d, o in zip(diff.sections, opts)])
+    assert len(out) == size
+    assert fmt.apply(old, fmt.load(out, old)) == new
+    open(args.out, "wb").write(out)
+
+    print("\nchose %s" % label)
+    for name, data, o in zip(fmt.SECTIONS, diff.sections, opts):
+        print("  %-8s %6d -> %6d bytes  %s" % (name, len(data), len(o.data), o.describe()))
+    print("  %d bytes, %.1f s download at %d B/s, %.3f s decode, %d bytes heap"
+          % (size, size / args.link_rate, args.link_rate, decode_s, heap))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,43 @@
+/**
+ * @file esp_log.h
+ * @brief Host stand-in; errors and warnings go to stderr, the rest is dropped.
+ *
+ * ESP_LOG_LEVEL is filtered at run time as on the target, by the level given
+ * to esp_log_level_set() for any tag.
+ */
+#ifndef HOST_SHIM_ESP_LOG_H__
+#define HOST_SHIM_ESP_LOG_H__
+
+#include <stdio.h>
+
+#define ESP_LOG_NONE    0
+#define ESP_LOG_ERROR   1
+#define ESP_LOG_WARN    2
+#define ESP_LOG_INFO    3
+#define ESP_LOG_DEBUG   4
+#define ESP_LOG_VERBOSE 5
+
+#define HOST_LOG(letter, tag, fmt, ...) fprintf(stderr, letter " %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define HOST_LOG_NONE(tag, fmt, ...) do { if(0) HOST_LOG("", tag, fmt, ##__VA_ARGS__); } while(0)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+extern int host_log_level;
+void esp_log_level_set(const char *tag, int level);
+#ifdef __cplusplus
+}
+#endif
+
+#define ESP_LOG_LEVEL(level, tag, fmt, ...) do { \
+        if( (level) <= host_log_level ) \
+            fprintf(stderr, "%c %s: " fmt "\n", "-EWIDV"[level], tag, ##__VA_ARGS__); \
+    } while(0)
+
+#define ESP_LOGE(tag, fmt, ...) HOST_LOG("E", tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) HOST_LOG("W", tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) HOST_LOG_NONE(tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...) HOST_LOG_NONE(tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGV(tag, fmt, ...) HOST_LOG_NONE(tag, fmt, ##__VA_ARGS__)
+
+#endif
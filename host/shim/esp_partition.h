@@ -0,0 +1,68 @@
+/**
+ * @file esp_partition.h
+ * @brief Host stand-in; partitions are windows of a flash image in RAM.
+ */
+#ifndef HOST_SHIM_ESP_PARTITION_H__
+#define HOST_SHIM_ESP_PARTITION_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SPI_FLASH_SEC_SIZE 4096
+
+typedef enum {
+    ESP_PARTITION_TYPE_APP = 0,
+    ESP_PARTITION_TYPE_DATA = 1,
+} esp_partition_type_t;
+
+typedef int esp_partition_subtype_t;
+
+typedef struct {
+    esp_partition_type_t type;
+    esp_partition_subtype_t subtype;
+    uint32_t address;
+    uint32_t size;
+    char label[17];
+    bool encrypted;
+} esp_partition_t;
+
+esp_err_t esp_partition_read(const esp_partition_t *part, size_t offset, void *dst, size_t size);
+esp_err_t esp_partition_write(const esp_partition_t *part, size_t offset, const void *src, size_t size);
+esp_err_t esp_partition_erase_range(const esp_partition_t *part, size_t offset, size_t size);
+
+/**
+ * @brief Add a partition of size bytes after the previous one; host only.
+ *
+ * Writes can only clear bits, as on flash; erased bytes read as 0xFF.
+ *
+ * @return The partition; NULL if out of memory.
+ */
+const esp_partition_t *host_partition_add(const char *label, uint32_t size);
+
+/**
+ * @brief Wear of a partition since it was added; host only.
+ */
+typedef struct host_partition_wear_t {
+    uint32_t erases;            /**< Sector erase cycles. */
+    uint32_t max_erases;        /**< Most erase cycles of any one sector. */
+    uint32_t bad_writes;        /**< Writes that needed a 0 bit back at 1; the data would be corrupt on flash. */
+} host_partition_wear_t;
+
+void host_partition_wear(const esp_partition_t *part, host_partition_wear_t *wear);
+
+/**
+ * @brief Erase cycles of the sector at offset since the partition was added; host only.
+ */
+uint32_t host_partition_erase_count(const esp_partition_t *part, size_t offset);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
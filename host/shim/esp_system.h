@@ -0,0 +1,12 @@
+/**
+ * @file esp_system.h
+ * @brief Host stand-in for the ESP-IDF header of the same name.
+ */
+#ifndef HOST_SHIM_ESP_SYSTEM_H__
+#define HOST_SHIM_ESP_SYSTEM_H__
+
+#include <stdlib.h>
+#include <string.h>
+#include "esp_err.h"
+
+#endif
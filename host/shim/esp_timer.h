@@ -0,0 +1,20 @@
+/**
+ * @file esp_timer.h
+ * @brief Host stand-in; microseconds of the monotonic clock.
+ */
+#ifndef HOST_SHIM_ESP_TIMER_H__
+#define HOST_SHIM_ESP_TIMER_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int64_t esp_timer_get_time(void);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,25 @@
+/**
+ * @file FreeRTOS.h
+ * @brief Host stand-in with the types esp_hdiffz's headers use.
+ */
+#ifndef HOST_SHIM_FREERTOS_H__
+#define HOST_SHIM_FREERTOS_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdTRUE          1
+#define pdFALSE         0
+#define portMAX_DELAY   0xffffffffu
+
+typedef pthread_mutex_t portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED    PTHREAD_MUTEX_INITIALIZER
+#define portENTER_CRITICAL(mux)         pthread_mutex_lock(mux)
+#define portEXIT_CRITICAL(mux)          pthread_mutex_unlock(mux)
+
+#endif
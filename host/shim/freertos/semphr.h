@@ -0,0 +1,25 @@
+/**
+ * @file semphr.h
+ * @brief Host stand-in; mutexes are pthread mutexes.
+ */
+#ifndef HOST_SHIM_SEMPHR_H__
+#define HOST_SHIM_SEMPHR_H__
+
+#include "freertos/FreeRTOS.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void *SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem);
+void vSemaphoreDelete(SemaphoreHandle_t sem);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,27 @@
+/**
+ * @file task.h
+ * @brief Host stand-in with the task types esp_hdiffz's headers use.
+ */
+#ifndef HOST_SHIM_TASK_H__
+#define HOST_SHIM_TASK_H__
+
+#include <limits.h>
+#include "freertos/FreeRTOS.h"
+
+typedef void *TaskHandle_t;
+
+#define tskNO_AFFINITY INT_MAX
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Each thread is a task; all are named "host" */
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+char *pcTaskGetTaskName(TaskHandle_t task);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
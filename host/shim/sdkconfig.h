@@ -0,0 +1,4 @@
+/**
+ * @file sdkconfig.h
+ * @brief Host stand-in; every option takes the default from the source file.
+ */
@@ -0,0 +1,181 @@
+/**
+ * @file shim.c
+ * @brief Host implementations of the ESP-IDF functions esp_hdiffz uses.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "esp_err.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_timer.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+/**
+ * @brief A partition and the RAM holding its contents.
+ */
+typedef struct host_partition_t {
+    esp_partition_t part;   /**< Must be first */
+    uint8_t *mem;
+    uint32_t *erases;       /**< Erase cycles per sector */
+    host_partition_wear_t wear;
+} host_partition_t;
+
+static uint32_t s_next_address = 0x10000;
+
+int host_log_level = ESP_LOG_WARN;
+
+const char *esp_err_to_name(esp_err_t code) {
+    switch(code) {
+        case ESP_OK: return "ESP_OK";
+        case ESP_FAIL: return "ESP_FAIL";
+        case ESP_ERR_NO_MEM: return "ESP_ERR_NO_MEM";
+        case ESP_ERR_INVALID_ARG: return "ESP_ERR_INVALID_ARG";
+        case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+        case ESP_ERR_INVALID_SIZE: return "ESP_ERR_INVALID_SIZE";
+        case ESP_ERR_NOT_FOUND: return "ESP_ERR_NOT_FOUND";
+        case ESP_ERR_NOT_SUPPORTED: return "ESP_ERR_NOT_SUPPORTED";
+        case ESP_ERR_TIMEOUT: return "ESP_ERR_TIMEOUT";
+        case ESP_ERR_INVALID_RESPONSE: return "ESP_ERR_INVALID_RESPONSE";
+        case ESP_ERR_INVALID_CRC: return "ESP_ERR_INVALID_CRC";
+        case ESP_ERR_INVALID_VERSION: return "ESP_ERR_INVALID_VERSION";
+        default: return "UNKNOWN ERROR";
+    }
+}
+
+void esp_log_level_set(const char *tag, int level) {
+    (void)tag;
+    host_log_level = level;
+}
+
+void *heap_caps_malloc(size_t size, uint32_t caps) {
+    (void)caps;
+    return malloc(size);
+}
+
+void heap_caps_free(void *ptr) {
+    free(ptr);
+}
+
+size_t heap_caps_get_free_size(uint32_t caps) {
+    (void)caps;
+    /* Host heap isn't tracked; plenty for any patch */
+    return (size_t)4 << 20;
+}
+
+size_t heap_caps_get_largest_free_block(uint32_t caps) {
+    return heap_caps_get_free_size(caps);
+}
+
+int64_t esp_timer_get_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) {
+    return (TaskHandle_t)(uintptr_t)pthread_self();
+}
+
+char *pcTaskGetTaskName(TaskHandle_t task) {
+    (void)task;
+    return "host";
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+    pthread_mutex_t *mutex = malloc(sizeof(pthread_mutex_t));
+    if( NULL != mutex ) pthread_mutex_init(mutex, NULL);
+    return mutex;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks) {
+    (void)ticks;
+    return 0 == pthread_mutex_lock(sem) ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem) {
+    return 0 == pthread_mutex_unlock(sem) ? pdTRUE : pdFALSE;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t sem) {
+    pthread_mutex_destroy(sem);
+    free(sem);
+}
+
+const esp_partition_t *host_partition_add(const char *label, uint32_t size) {
+    host_partition_t *p = calloc(1, sizeof(host_partition_t));
+    if( NULL == p ) return NULL;
+    p->mem = malloc(size);
+    if( NULL == p->mem ) {
+        free(p);
+        return NULL;
+    }
+    p->erases = calloc((size + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE, sizeof(uint32_t));
+    if( NULL == p->erases ) {
+        free(p->mem);
+        free(p);
+        return NULL;
+    }
+    memset(p->mem, 0xFF, size);
+    p->part.type = ESP_PARTITION_TYPE_DATA;
+    p->part.address = s_next_address;
+    p->part.size = size;
+    strncpy(p->part.label, label, sizeof(p->part.label) - 1);
+    s_next_address += (size + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE;
+    return &p->part;
+}
+
+void host_partition_wear(const esp_partition_t *part, host_partition_wear_t *wear) {
+    *wear = ((const host_partition_t *)part)->wear;
+}
+
+uint32_t host_partition_erase_count(const esp_partition_t *part, size_t offset) {
+    if( offset >= part->size ) return 0;
+    return ((const host_partition_t *)part)->erases[offset / SPI_FLASH_SEC_SIZE];
+}
+
+static esp_err_t check_range(const esp_partition_t *part, size_t offset, size_t size) {
+    if( NULL == part ) return ESP_ERR_INVALID_ARG;
+    if( offset > part->size || size > part->size - offset ) return ESP_ERR_INVALID_SIZE;
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *part, size_t offset, void *dst, size_t size) {
+    esp_err_t err = check_range(part, offset, size);
+    if( ESP_OK != err ) return err;
+    memcpy(dst, ((const host_partition_t *)part)->mem + offset, size);
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t *part, size_t offset, const void *src, size_t size) {
+    esp_err_t err = check_range(part, offset, size);
+    if( ESP_OK != err ) return err;
+    host_partition_t *p = (host_partition_t *)part;
+    uint8_t *mem = p->mem + offset;
+    bool bad = false;
+    for(size_t i=0; i < size; i++) {
+        uint8_t b = ((const uint8_t *)src)[i];
+        if( (mem[i] & b) != b ) bad = true;
+        mem[i] &= b;
+    }
+    if( bad ) p->wear.bad_writes++;
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *part, size_t offset, size_t size) {
+    esp_err_t err = check_range(part, offset, size);
+    if( ESP_OK != err ) return err;
+    if( offset % SPI_FLASH_SEC_SIZE || size % SPI_FLASH_SEC_SIZE ) return ESP_ERR_INVALID_ARG;
+    host_partition_t *p = (host_partition_t *)part;
+    memset(p->mem + offset, 0xFF, size);
+    for(size_t sector = offset / SPI_FLASH_SEC_SIZE; sector < (offset + size) / SPI_FLASH_SEC_SIZE; sector++) {
+        p->erases[sector]++;
+        p->wear.erases++;
+        if( p->erases[sector] > p->wear.max_erases ) p->wear.max_erases = p->erases[sector];
+    }
+    return ESP_OK;
+}
@@ -0,0 +1,15 @@
+/**
+ * @file soc_memory_layout.h
+ * @brief Host stand-in; there is no PSRAM.
+ */
+#ifndef HOST_SHIM_SOC_MEMORY_LAYOUT_H__
+#define HOST_SHIM_SOC_MEMORY_LAYOUT_H__
+
+#include <stdbool.h>
+
+static inline bool esp_ptr_external_ram(const void *p) {
+    (void)p;
+    return false;
+}
+
+#endif
@@ -0,0 +1,90 @@
+/**
+ * @file test_add
+ * @brief Host equivalence test and microbenchmark of the add kernels.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "add.h"
+
+#define MAX_LEN 300
+#define BENCH_SIZE (1024*1024)
+#define BENCH_ROUNDS 200
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Compare against the byte loop for every length and alignment pair.
+ */
+static int test_equivalence(void) {
+    static unsigned char src[MAX_LEN + 16], dst[MAX_LEN + 16], exp[MAX_LEN + 16];
+    int n_fail = 0;
+
+    srand(1);
+    for(size_t len = 0; len <= MAX_LEN; len++) {
+        for(size_t dst_off = 0; dst_off < 8; dst_off++) {
+            for(size_t src_off = 0; src_off < 8; src_off++) {
+                unsigned char value = rand();
+
+                for(size_t i=0; i < sizeof(src); i++) src[i] = rand();
+                for(size_t i=0; i < sizeof(dst); i++) dst[i] = exp[i] = rand();
+
+                esp_hdiffz_add_ref(exp + dst_off, src + src_off, len);
+                esp_hdiffz_add(dst + dst_off, src + src_off, len);
+                if( memcmp(dst, exp, sizeof(dst)) ) {
+                    printf("FAIL add len=%d dst_off=%d src_off=%d\n", (int)len, (int)dst_off, (int)src_off);
+                    n_fail++;
+                }
+
+                for(size_t i=0; i < len; i++) exp[dst_off + i] += value;
+                esp_hdiffz_add_byte(dst + dst_off, value, len);
+                if( memcmp(dst, exp, sizeof(dst)) ) {
+                    printf("FAIL add_byte len=%d dst_off=%d value=%d\n", (int)len, (int)dst_off, value);
+                    n_fail++;
+                }
+            }
+        }
+    }
+
+    printf("%s: add kernel %d bits equivalence\n", n_fail ? "FAIL" : "PASS", CONFIG_HDIFFZ_ADD_KERNEL);
+    return n_fail;
+}
+
+static double bench(void (*fn)(unsigned char *, const unsigned char *, size_t),
+        unsigned char *dst, const unsigned char *src) {
+    double t0 = now();
+    for(int r=0; r < BENCH_ROUNDS; r++) fn(dst, src, BENCH_SIZE);
+    return (double)BENCH_SIZE * BENCH_ROUNDS / (now() - t0) / 1e6;
+}
+
+static void run_bench(void) {
+    unsigned char *src = malloc(BENCH_SIZE + 8);
+    unsigned char *dst = malloc(BENCH_SIZE + 8);
+
+    for(size_t i=0; i < BENCH_SIZE + 8; i++) src[i] = dst[i] = i * 7;
+
+    printf("%-24s %10s %10s\n", "case", "ref MB/s", "kernel MB/s");
+    printf("%-24s %10.0f %10.0f\n", "aligned",
+            bench(esp_hdiffz_add_ref, dst, src), bench(esp_hdiffz_add, dst, src));
+    printf("%-24s %10.0f %10.0f\n", "same misalignment",
+            bench(esp_hdiffz_add_ref, dst + 3, src + 3), bench(esp_hdiffz_add, dst + 3, src + 3));
+    printf("%-24s %10.0f %10.0f\n", "different misalignment",
+            bench(esp_hdiffz_add_ref, dst + 1, src + 2), bench(esp_hdiffz_add, dst + 1, src + 2));
+
+    free(src);
+    free(dst);
+}
+
+int main(int argc, char **argv) {
+    int n_fail = test_equivalence();
+
+    if( argc > 1 && 0 == strcmp(argv[1], "--bench") ) run_bench();
+
+    return n_fail ? 1 : 0;
+}
@@ -0,0 +1,319 @@
+/**
+ * @file test_cpp
+ * @brief Host test of esp_hdiffz.hpp, and a benchmark of its stream adapters
+ * against the C function pointer streams.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include "esp_hdiffz.hpp"
+
+#ifndef BIN_DIR
+#define BIN_DIR "../bin"
+#endif
+
+#define MICRO_SIZE (16*1024*1024)
+#define MACRO_ROUNDS 200
+
+using namespace esp_hdiffz;
+
+static int n_fail = 0;
+
+#define CHECK(cond, name) do { \
+    if( !(cond) ) { \
+        printf("FAIL %s (%s:%d)\n", name, __FILE__, __LINE__); \
+        n_fail++; \
+    } \
+} while(0)
+
+static double now(void) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static std::vector<uint8_t> load(const char *name) {
+    std::vector<uint8_t> data;
+    FILE *f = fopen(name, "rb");
+    if( NULL == f ) {
+        printf("Can't open %s\n", name);
+        exit(1);
+    }
+    uint8_t buf[4096];
+    size_t n;
+    while( (n = fread(buf, 1, sizeof(buf), f)) > 0 ) data.insert(data.end(), buf, buf + n);
+    fclose(f);
+    return data;
+}
+
+static FILE *to_tmpfile(const std::vector<uint8_t> &data) {
+    FILE *f = tmpfile();
+    fwrite(data.data(), 1, data.size(), f);
+    rewind(f);
+    return f;
+}
+
+/*********
+ * TESTS *
+ *********/
+
+static void test_diff(const char *label, const std::vector<uint8_t> &old,
+        const std::vector<uint8_t> &diff, const std::vector<uint8_t> &expected) {
+    char name[64];
+
+    /* Memory to memory */
+    {
+        MemorySource old_src(old), diff_src(diff);
+        std::vector<uint8_t> out(expected.size());
+        SpanSink sink(out);
+        Session session(old_src, diff_src);
+        esp_hdiffz_info_t info;
+
+        snprintf(name, sizeof(name), "%s info", label);
+        CHECK(ESP_OK == session.info(info) && info.new_size == expected.size(), name);
+        snprintf(name, sizeof(name), "%s memory", label);
+        CHECK(ESP_OK == session.patch(sink) && out == expected, name);
+        snprintf(name, sizeof(name), "%s stats", label);
+        CHECK(session.stats().n_covers > 0
+                && session.stats().cover_bytes + session.stats().diff_bytes == expected.size(), name);
+
+        /* The session's buffers are reused */
+        std::fill(out.begin(), out.end(), 0);
+        snprintf(name, sizeof(name), "%s session reuse", label);
+        CHECK(ESP_OK == session.patch(sink) && out == expected, name);
+    }
+
+    /* Files, with a lane per diff section */
+    {
+        FILE *old_f = to_tmpfile(old), *diff_f = to_tmpfile(diff), *out_f = tmpfile();
+        FileSource<> old_src(old_f);
+        FileSource<1024, 4> diff_src(diff_f);
+        FileSink sink(out_f);
+
+        snprintf(name, sizeof(name), "%s file", label);
+        CHECK(ESP_OK == patch(old_src, diff_src, sink), name);
+        fflush(out_f);
+        rewind(out_f);
+        std::vector<uint8_t> out(expected.size() + 1);
+        CHECK(expected.size() == fread(out.data(), 1, out.size(), out_f), name);
+        out.resize(expected.size());
+        CHECK(out == expected, name);
+        fclose(old_f);
+        fclose(diff_f);
+        fclose(out_f);
+    }
+
+    /* Partitions */
+    {
+        const esp_partition_t *src = host_partition_add("ota_0", 0x40000);
+        const esp_partition_t *dst = host_partition_add("ota_1", 0x40000);
+        esp_hdiffz_flash_t flash;
+        esp_hdiffz_flash_report_t report;
+        esp_partition_write(src, 0, old.data(), old.size());
+
+        esp_hdiffz_flash_init(&flash, nullptr);
+        PartitionSource old_src(src, old.size());
+        MemorySource diff_src(diff);
+        PartitionSink sink(dst, &flash);
+        snprintf(name, sizeof(name), "%s partition", label);
+        CHECK(ESP_OK == patch(old_src, diff_src, sink), name);
+        std::vector<uint8_t> out(expected.size());
+        esp_partition_read(dst, 0, out.data(), out.size());
+        CHECK(out == expected, name);
+
+        /* Only the sink counts; each sector it reached is erased once */
+        esp_hdiffz_flash_report(&flash, &report);
+        CHECK(0 == report.n_reads && expected.size() == report.write_bytes, name);
+        CHECK(1 == report.max_sector_erases, name);
+        esp_hdiffz_flash_deinit(&flash);
+    }
+
+    /* Callbacks */
+    {
+        CallbackSource old_src(old.size(), [&old](hpatch_StreamPos_t pos, bytes out) {
+            std::memcpy(out.data(), old.data() + pos, out.size());
+            return true;
+        });
+        MemorySource diff_src(diff);
+        std::vector<uint8_t> out;
+        CallbackSink sink([&out](hpatch_StreamPos_t pos, const_bytes data) {
+            if( pos != out.size() ) return false;
+            out.insert(out.end(), data.begin(), data.end());
+            return true;
+        });
+        snprintf(name, sizeof(name), "%s callback", label);
+        CHECK(ESP_OK == patch(old_src, diff_src, sink) && out == expected, name);
+    }
+
+    /* Old data shorter than the diff needs */
+    {
+        MemorySource old_src(old.data(), old.size() - 1), diff_src(diff);
+        std::vector<uint8_t> out(expected.size());
+        SpanSink sink(out);
+        snprintf(name, sizeof(name), "%s short old", label);
+        CHECK(ESP_ERR_INVALID_SIZE == patch(old_src, diff_src, sink), name);
+    }
+}
+
+/*********
+ * BENCH *
+ *********/
+
+/**
+ * @brief The usual C adapter: a stream that forwards to a user callback.
+ */
+typedef struct c_callback_t {
+    hpatch_BOOL (*read)(void *ctx, hpatch_StreamPos_t pos, unsigned char *out, size_t n);
+    void *ctx;
+} c_callback_t;
+
+static hpatch_BOOL c_callback_read(const hpatch_TStreamInput *stream, hpatch_StreamPos_t pos,
+        unsigned char *out, unsigned char *out_end) {
+    const c_callback_t *cb = (const c_callback_t *)stream->streamImport;
+    return cb->read(cb->ctx, pos, out, out_end - out);
+}
+
+static hpatch_BOOL c_mem_read(void *ctx, hpatch_StreamPos_t pos, unsigned char *out, size_t n) {
+    memcpy(out, (const unsigned char *)ctx + pos, n);
+    return hpatch_TRUE;
+}
+
+typedef struct c_sink_t {
+    unsigned char *buf;
+    size_t size;
+} c_sink_t;
+
+static hpatch_BOOL c_sink_write(const hpatch_TStreamOutput *stream, hpatch_StreamPos_t pos,
+        const unsigned char *data, const unsigned char *data_end) {
+    c_sink_t *sink = (c_sink_t *)stream->streamImport;
+    if( pos + (data_end - data) > sink->size ) return hpatch_FALSE;
+    memcpy(sink->buf + pos, data, data_end - data);
+    return hpatch_TRUE;
+}
+
+/**
+ * @brief MB/s of reading MICRO_SIZE bytes in chunks of n through stream.
+ */
+static double bench_reads(const hpatch_TStreamInput *stream, size_t n) {
+    static unsigned char out[4096];
+    hpatch_StreamPos_t size = stream->streamSize - stream->streamSize % n;
+    size_t total = 0;
+    double t0 = now();
+    while( total < MICRO_SIZE ) {
+        for(hpatch_StreamPos_t pos = 0; pos < size && total < MICRO_SIZE; pos += n, total += n) {
+            if( !stream->read(stream, pos, out, out + n) ) {
+                printf("FAIL bench read\n");
+                exit(1);
+            }
+        }
+    }
+    return total / (now() - t0) / 1e6;
+}
+
+static void run_bench(const std::vector<uint8_t> &old, const std::vector<uint8_t> &diff,
+        const std::vector<uint8_t> &expected) {
+    static const size_t chunks[] = {16, 256, 4096};
+
+    printf("%-28s %10s %10s\n", "reads (chunk)", "C MB/s", "C++ MB/s");
+    for(size_t n : chunks) {
+        c_callback_t cb = {c_mem_read, (void *)old.data()};
+        hpatch_TStreamInput c_stream = {};
+        c_stream.streamImport = &cb;
+        c_stream.streamSize = old.size();
+        c_stream.read = c_callback_read;
+
+        CallbackSource src(old.size(), [&old](hpatch_StreamPos_t pos, bytes out) {
+            std::memcpy(out.data(), old.data() + pos, out.size());
+            return true;
+        });
+        hpatch_TStreamInput cpp_stream = as_input(src);
+
+        printf("callback %-19d %10.0f %10.0f\n", (int)n, bench_reads(&c_stream, n), bench_reads(&cpp_stream, n));
+    }
+    for(size_t n : chunks) {
+        FILE *f = to_tmpfile(old);
+        esp_hdiffz_file_stream_t file_stream;
+        hpatch_TStreamInput c_stream;
+        esp_hdiffz_file_stream_init(&file_stream, f, 1024, 1);
+        esp_hdiffz_file_stream_as_input(&file_stream, &c_stream);
+        double c_rate = bench_reads(&c_stream, n);
+        esp_hdiffz_file_stream_deinit(&file_stream);
+
+        rewind(f);
+        FileSource<> src(f);
+        hpatch_TStreamInput cpp_stream = as_input(src);
+        printf("file %-23d %10.0f %10.0f\n", (int)n, c_rate, bench_reads(&cpp_stream, n));
+        fclose(f);
+    }
+
+    /* Whole patch: old from a file, diff in memory, output to memory */
+    std::vector<uint8_t> out(expected.size());
+    FILE *f = to_tmpfile(old);
+    double c_ms, cpp_ms;
+    {
+        esp_hdiffz_file_stream_t file_stream;
+        hpatch_TStreamInput old_stream, diff_stream;
+        hpatch_TStreamOutput out_stream = {};
+        c_sink_t sink = {out.data(), out.size()};
+        esp_hdiffz_miniz_plugin_t plugin;
+        static unsigned char buf[4096];
+
+        esp_hdiffz_file_stream_init(&file_stream, f, 1024, 1);
+        esp_hdiffz_file_stream_as_input(&file_stream, &old_stream);
+        esp_hdiffz_mem_as_stream_input(&diff_stream, diff.data(), diff.size());
+        out_stream.streamImport = &sink;
+        out_stream.streamSize = out.size();
+        out_stream.write = c_sink_write;
+        esp_hdiffz_miniz_plugin_init(&plugin);
+        plugin.dict_src = &old_stream;
+
+        esp_hdiffz_engine_cfg_t cfg = {};
+        cfg.out = &out_stream;
+        cfg.old = &old_stream;
+        cfg.diff = &diff_stream;
+        cfg.plugin = &plugin.base;
+        cfg.buf = buf;
+        cfg.buf_size = sizeof(buf);
+
+        double t0 = now();
+        for(int r=0; r < MACRO_ROUNDS; r++) {
+            if( ESP_OK != esp_hdiffz_engine_patch(&cfg) ) printf("FAIL C patch\n");
+        }
+        c_ms = (now() - t0) * 1e3 / MACRO_ROUNDS;
+        esp_hdiffz_file_stream_deinit(&file_stream);
+        CHECK(out == expected, "bench C patch");
+    }
+    {
+        rewind(f);
+        std::fill(out.begin(), out.end(), 0);
+        FileSource<> old_src(f);
+        MemorySource diff_src(diff);
+        SpanSink sink(out);
+        Session session(old_src, diff_src);
+
+        double t0 = now();
+        for(int r=0; r < MACRO_ROUNDS; r++) {
+            if( ESP_OK != session.patch(sink) ) printf("FAIL C++ patch\n");
+        }
+        cpp_ms = (now() - t0) * 1e3 / MACRO_ROUNDS;
+        CHECK(out == expected, "bench C++ patch");
+    }
+    fclose(f);
+    printf("%-28s %10.3f %10.3f\n", "hello_world patch (ms)", c_ms, cpp_ms);
+    printf("%-28s %10.1f %10.1f\n", "hello_world patch (MB/s)",
+            out.size() / c_ms / 1e3, out.size() / cpp_ms / 1e3);
+}
+
+int main(int argc, char **argv) {
+    std::vector<uint8_t> old = load(BIN_DIR "/hello_world.bin");
+    std::vector<uint8_t> diff = load(BIN_DIR "/hello_world_diff.bin");
+    std::vector<uint8_t> dict_diff = load(BIN_DIR "/hello_world_dict_diff.bin");
+    std::vector<uint8_t> expected = load(BIN_DIR "/hello_world_after_patch.bin");
+
+    test_diff("plain", old, diff, expected);
+    test_diff("dict", old, dict_diff, expected);
+    printf("%s: esp_hdiffz.hpp (C++%ld)\n", n_fail ? "FAIL" : "PASS", __cplusplus / 100 % 100);
+
+    if( argc > 1 && 0 == strcmp(argv[1], "--bench") ) run_bench(old, diff, expected);
+    return n_fail ? 1 : 0;
+}
@@ -0,0 +1,351 @@
+/**
+ * @file test_engine
+ * @brief Host check that the patch engine accepts exactly the diffs
+ * HDiffPatch's patch_decompress accepts, and produces the same output.
+ *
+ *     test_engine [diff ...]
+ *
+ * Diffs default to those in bin/, applied to bin/hello_world.bin. Small
+ * uncompressed diffs are also built here, well formed and with each way a
+ * section can be too short or too long, and every byte of the well formed
+ * one is corrupted in turn.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_hdiffz.h"
+#include "rw.h"
+#include "engine.h"
+#include "miniz_plugin.h"
+
+#ifndef BIN_DIR
+#define BIN_DIR "../bin"
+#endif
+
+#define OLD_SIZE 4096
+#define NEW_SIZE 3000
+#define MAX_SEC 4096
+#define MAX_DIFF (5 * MAX_SEC)
+/* Zeros over the gap, the second cover and the trailing new data */
+#define TAIL_RUN (450 + 800 + 700)
+
+static int n_fail = 0;
+
+#define CHECK(cond, name) do { \
+    if( !(cond) ) { \
+        printf("FAIL %s (%s:%d)\n", name, __FILE__, __LINE__); \
+        n_fail++; \
+    } \
+} while(0)
+
+/**
+ * Sections of an uncompressed diff.
+ */
+typedef struct {
+    unsigned char sec[ESP_HDIFFZ_SEC_N][MAX_SEC];
+    size_t len[ESP_HDIFFZ_SEC_N];
+    size_t new_size;
+    size_t old_size;
+    size_t cover_count;
+} diff_t;
+
+typedef struct {
+    unsigned char *data;
+    size_t size;
+} mem_out_t;
+
+static unsigned char *load(const char *name, size_t *size) {
+    unsigned char *data;
+    FILE *f = fopen(name, "rb");
+
+    if( NULL == f ) {
+        printf("Can't open %s\n", name);
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    *size = ftell(f);
+    rewind(f);
+    data = malloc(*size + 1);
+    if( *size != fread(data, 1, *size, f) ) exit(1);
+    fclose(f);
+    return data;
+}
+
+static hpatch_BOOL mem_write(const hpatch_TStreamOutput *stream, hpatch_StreamPos_t pos,
+        const unsigned char *data, const unsigned char *data_end) {
+    mem_out_t *out = (mem_out_t *)stream->streamImport;
+
+    if( pos + (data_end - data) > out->size ) return hpatch_FALSE;
+    memcpy(out->data + pos, data, data_end - data);
+    return hpatch_TRUE;
+}
+
+/**
+ * @brief Packed uint with tag_bits of tag in the first byte, as HDiffPatch writes it.
+ */
+static size_t pack_uint(unsigned char *dst, hpatch_StreamPos_t v, uint8_t tag_bits, uint8_t tag) {
+    unsigned char tmp[10];
+    size_t n = 0, len = 0;
+    uint8_t first_bits = 7 - tag_bits;
+
+    while( v >> first_bits ) {
+        tmp[n++] = v & 0x7f;
+        v >>= 7;
+    }
+    dst[len++] = (tag << (8 - tag_bits)) | (n ? 1 << first_bits : 0) | (unsigned char)v;
+    while( n > 0 ) {
+        n--;
+        dst[len++] = tmp[n] | (n ? 0x80 : 0);
+    }
+    return len;
+}
+
+static void put_uint(diff_t *d, uint8_t sec, hpatch_StreamPos_t v, uint8_t tag_bits, uint8_t tag) {
+    d->len[sec] += pack_uint(&d->sec[sec][d->len[sec]], v, tag_bits, tag);
+}
+
+static void put_bytes(diff_t *d, uint8_t sec, const unsigned char *data, size_t n) {
+    memcpy(&d->sec[sec][d->len[sec]], data, n);
+    d->len[sec] += n;
+}
+
+/**
+ * @brief Serialize the sections behind an HDIFF13 header with no compressor.
+ */
+static size_t write_diff(const diff_t *d, unsigned char *dst) {
+    size_t len = 0;
+
+    memcpy(dst, "HDIFF13&", 8);
+    len += 8;
+    dst[len++] = '\0';
+    len += pack_uint(&dst[len], d->new_size, 0, 0);
+    len += pack_uint(&dst[len], d->old_size, 0, 0);
+    len += pack_uint(&dst[len], d->cover_count, 0, 0);
+    for(int i=0; i < ESP_HDIFFZ_SEC_N; i++) {
+        len += pack_uint(&dst[len], d->len[i], 0, 0);
+        len += pack_uint(&dst[len], 0, 0, 0);
+    }
+    for(int i=0; i < ESP_HDIFFZ_SEC_N; i++) {
+        memcpy(&dst[len], d->sec[i], d->len[i]);
+        len += d->len[i];
+    }
+    return len;
+}
+
+/**
+ * @brief A diff touching every RLE run type, with new data before, between
+ * and after its two covers.
+ * @param[in] tail Length of the last RLE run; TAIL_RUN spans the new data exactly.
+ */
+static void build_diff(diff_t *d, hpatch_StreamPos_t tail) {
+    unsigned char raw[300];
+
+    memset(d, 0, sizeof(*d));
+    d->new_size = NEW_SIZE;
+    d->old_size = OLD_SIZE;
+    d->cover_count = 2;
+
+    /* old 100..1100 -> new 50..1050, old 2000..2800 -> new 1500..2300 */
+    put_uint(d, ESP_HDIFFZ_SEC_COVER, 100, 1, 0);
+    put_uint(d, ESP_HDIFFZ_SEC_COVER, 50, 0, 0);
+    put_uint(d, ESP_HDIFFZ_SEC_COVER, 1000, 0, 0);
+    put_uint(d, ESP_HDIFFZ_SEC_COVER, 2000 - 1100, 1, 0);
+    put_uint(d, ESP_HDIFFZ_SEC_COVER, 1500 - 1050, 0, 0);
+    put_uint(d, ESP_HDIFFZ_SEC_COVER, 800, 0, 0);
+
+    /* One run per RLE type over the covers, zeros over the new data */
+    for(size_t i=0; i < sizeof(raw); i++) raw[i] = (i * 7) ^ 0x5a;
+    put_uint(d, ESP_HDIFFZ_SEC_RLE_CTRL, 50 - 1, 2, 0);
+    put_uint(d, ESP_HDIFFZ_SEC_RLE_CTRL, 400 - 1, 2, 2);
+    put_bytes(d, ESP_HDIFFZ_SEC_RLE_CODE, (const unsigned char *)"\x03", 1);
+    put_uint(d, ESP_HDIFFZ_SEC_RLE_CTRL, 300 - 1, 2, 3);
+    put_bytes(d, ESP_HDIFFZ_SEC_RLE_CODE, raw, sizeof(raw));
+    put_uint(d, ESP_HDIFFZ_SEC_RLE_CTRL, 300 - 1, 2, 1);
+    put_uint(d, ESP_HDIFFZ_SEC_RLE_CTRL, tail - 1, 2, 0);
+
+    for(size_t i=0; i < 50 + 450 + 700; i++) {
+        unsigned char b = i * 13 + 1;
+        put_bytes(d, ESP_HDIFFZ_SEC_NEW_DIFF, &b, 1);
+    }
+}
+
+/**
+ * @brief Apply diff to old with both patchers.
+ * @param[in] expect_ok 1 or 0 if both must succeed or fail; -1 if they only need to agree.
+ */
+static void check_diff(const char *name, const unsigned char *old, size_t old_size,
+        const unsigned char *diff, size_t diff_size, int expect_ok) {
+    esp_hdiffz_info_t info;
+    hpatch_TStreamInput old_stream, diff_stream;
+    hpatch_TStreamOutput out_stream = { 0 };
+    esp_hdiffz_miniz_plugin_t plugin;
+    esp_hdiffz_engine_cfg_t cfg = { 0 };
+    mem_out_t engine_out, ref_out;
+    size_t new_size = 0;
+    bool engine_ok, ref_ok;
+
+    esp_hdiffz_mem_as_stream_input(&old_stream, old, old_size);
+    esp_hdiffz_mem_as_stream_input(&diff_stream, diff, diff_size);
+    if( ESP_OK == esp_hdiffz_get_info(&diff_stream, &info) ) {
+        /* Old data checksums trail the sections; patch_decompress never reads them */
+        diff_stream.streamSize -= info.old_check_size;
+        new_size = info.new_size;
+    }
+    if( new_size > 64 * 1024 * 1024 ) new_size = 0;
+    engine_out.size = ref_out.size = new_size;
+    engine_out.data = calloc(1, new_size + 1);
+    ref_out.data = calloc(1, new_size + 1);
+    out_stream.streamSize = new_size;
+    out_stream.write = mem_write;
+
+    esp_hdiffz_miniz_plugin_init(&plugin);
+    plugin.dict_src = &old_stream;
+    out_stream.streamImport = &engine_out;
+    cfg.out = &out_stream;
+    cfg.old = &old_stream;
+    cfg.diff = &diff_stream;
+    cfg.plugin = &plugin.base;
+    engine_ok = ESP_OK == esp_hdiffz_engine_patch(&cfg);
+
+    out_stream.streamImport = &ref_out;
+    ref_ok = patch_decompress(&out_stream, &old_stream, &diff_stream, &plugin.base);
+
+    if( engine_ok != ref_ok ) {
+        printf("FAIL %s: engine %s, patch_decompress %s\n", name,
+                engine_ok ? "accepts" : "rejects", ref_ok ? "accepts" : "rejects");
+        n_fail++;
+    }
+    else if( expect_ok >= 0 && engine_ok != (bool)expect_ok ) {
+        printf("FAIL %s: both %s\n", name, engine_ok ? "accept" : "reject");
+        n_fail++;
+    }
+    else if( engine_ok ) {
+        CHECK(0 == memcmp(engine_out.data, ref_out.data, new_size), name);
+    }
+    free(engine_out.data);
+    free(ref_out.data);
+}
+
+/*********
+ * TESTS *
+ *********/
+
+static void test_files(int argc, char **argv) {
+    static const char *const defaults[] = {
+        BIN_DIR "/hello_world_diff.bin",
+        BIN_DIR "/hello_world_dict_diff.bin",
+        BIN_DIR "/hello_world_oldcheck_diff.bin",
+    };
+    const char *const *names = argc > 1 ? (const char *const *)&argv[1] : defaults;
+    int n = argc > 1 ? argc - 1 : (int)(sizeof(defaults) / sizeof(defaults[0]));
+    unsigned char *old, *diff;
+    size_t old_size, diff_size;
+
+    old = load(BIN_DIR "/hello_world.bin", &old_size);
+    for(int i=0; i < n; i++) {
+        hpatch_TStreamInput diff_stream;
+        esp_hdiffz_info_t info;
+
+        diff = load(names[i], &diff_size);
+        esp_hdiffz_mem_as_stream_input(&diff_stream, diff, diff_size);
+        CHECK(ESP_OK == esp_hdiffz_get_info(&diff_stream, &info), names[i]);
+        check_diff(names[i], old, old_size, diff, diff_size, 1);
+        /* Cut into the last section rather than the old data checksums */
+        check_diff(names[i], old, old_size, diff, diff_size - info.old_check_size - 1, 0);
+        free(diff);
+        printf("%s\n", names[i]);
+    }
+    free(old);
+}
+
+static void test_malformed(void) {
+    static unsigned char old[OLD_SIZE], buf[MAX_DIFF];
+    static diff_t d;
+    size_t len;
+    int n_corrupt = 0, n_skipped = 0;
+
+    for(size_t i=0; i < sizeof(old); i++) old[i] = (i * 31) >> 3;
+
+    build_diff(&d, TAIL_RUN);
+    len = write_diff(&d, buf);
+    check_diff("well formed", old, sizeof(old), buf, len, 1);
+
+    /* RLE ending with the last cover, as diffs made on the device used to */
+    build_diff(&d, TAIL_RUN - 700);
+    check_diff("RLE short", old, sizeof(old), buf, write_diff(&d, buf), 0);
+
+    build_diff(&d, TAIL_RUN + 1);
+    check_diff("RLE long", old, sizeof(old), buf, write_diff(&d, buf), 0);
+
+    build_diff(&d, TAIL_RUN);
+    put_uint(&d, ESP_HDIFFZ_SEC_RLE_CTRL, 0, 2, 0);
+    check_diff("RLE run left over", old, sizeof(old), buf, write_diff(&d, buf), 0);
+
+    build_diff(&d, TAIL_RUN);
+    put_bytes(&d, ESP_HDIFFZ_SEC_RLE_CODE, (const unsigned char *)"\x01", 1);
+    check_diff("RLE code left over", old, sizeof(old), buf, write_diff(&d, buf), 0);
+
+    build_diff(&d, TAIL_RUN);
+    d.len[ESP_HDIFFZ_SEC_RLE_CODE]--;
+    check_diff("RLE code short", old, sizeof(old), buf, write_diff(&d, buf), 0);
+
+    build_diff(&d, TAIL_RUN);
+    d.len[ESP_HDIFFZ_SEC_NEW_DIFF]--;
+    check_diff("new data short", old, sizeof(old), buf, write_diff(&d, buf), 0);
+
+    build_diff(&d, TAIL_RUN);
+    put_bytes(&d, ESP_HDIFFZ_SEC_NEW_DIFF, (const unsigned char *)"\x01", 1);
+    check_diff("new data left over", old, sizeof(old), buf, write_diff(&d, buf), 0);
+
+    build_diff(&d, TAIL_RUN);
+    put_uint(&d, ESP_HDIFFZ_SEC_COVER, 0, 1, 0);
+    check_diff("cover left over", old, sizeof(old), buf, write_diff(&d, buf), 0);
+
+    build_diff(&d, TAIL_RUN);
+    d.cover_count = 3;
+    check_diff("cover missing", old, sizeof(old), buf, write_diff(&d, buf), 0);
+
+    build_diff(&d, TAIL_RUN);
+    d.old_size = 2700;
+    check_diff("cover past old data", old, d.old_size, buf, write_diff(&d, buf), 0);
+
+    build_diff(&d, TAIL_RUN);
+    d.new_size = 2200;
+    check_diff("cover past new data", old, sizeof(old), buf, write_diff(&d, buf), 0);
+
+    /* Every byte flipped in turn; the patchers only have to agree */
+    build_diff(&d, TAIL_RUN);
+    len = write_diff(&d, buf);
+    for(size_t i=0; i < len; i++) {
+        hpatch_TStreamInput diff_stream;
+        esp_hdiffz_info_t info;
+        char name[32];
+
+        buf[i] ^= 0x41;
+        snprintf(name, sizeof(name), "byte %d flipped", (int)i);
+        esp_hdiffz_mem_as_stream_input(&diff_stream, buf, len);
+        /* The engine rejects diffs expecting more old data than the stream
+         * holds up front; patch_decompress only once a cover reads past it */
+        if( ESP_OK == esp_hdiffz_get_info(&diff_stream, &info) && info.old_size > sizeof(old) ) {
+            n_skipped++;
+        }
+        else {
+            check_diff(name, old, sizeof(old), buf, len, -1);
+            n_corrupt++;
+        }
+        buf[i] ^= 0x41;
+    }
+    printf("malformed: 12 built, %d corrupted, %d with a larger old size skipped\n", n_corrupt, n_skipped);
+}
+
+int main(int argc, char **argv) {
+    test_files(argc, argv);
+    test_malformed();
+    if( n_fail ) {
+        printf("%d FAILED\n", n_fail);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,215 @@
+/**
+ * @file test_inflate
+ * @brief Host check and microbenchmark of the miniz plugin's tinfl decoder
+ * against an mz_stream inflate loop, on the compressed sections of diffs.
+ *
+ *     test_inflate [--bench] [diff ...]
+ *
+ * Diffs default to bin/hello_world_diff.bin. Nodes with a preset dictionary
+ * are skipped, since inflate can't be given one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "miniz.h"
+#include "esp_hdiffz.h"
+#include "rw.h"
+#include "engine.h"
+#include "miniz_plugin.h"
+
+#ifndef BIN_DIR
+#define BIN_DIR "../bin"
+#endif
+
+#define BENCH_TIME 0.2
+
+static const size_t part_sizes[] = { 64, 512, 4096, 65536 };
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static unsigned char *load(const char *name, size_t *size) {
+    unsigned char *data;
+    FILE *f = fopen(name, "rb");
+
+    if( NULL == f ) {
+        printf("Can't open %s\n", name);
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    *size = ftell(f);
+    rewind(f);
+    data = malloc(*size + 1);
+    if( *size != fread(data, 1, *size, f) ) exit(1);
+    fclose(f);
+    return data;
+}
+
+/**
+ * @brief Decode a section with the plugin, part_size bytes per call.
+ */
+static int plugin_inflate(hpatch_TDecompress *plugin, const hpatch_TStreamInput *diff,
+        hpatch_StreamPos_t begin, hpatch_StreamPos_t end, unsigned char *out, size_t size,
+        size_t part_size) {
+    hpatch_decompressHandle dec;
+    size_t done = 0;
+
+    dec = plugin->open(plugin, size, diff, begin, end);
+    if( NULL == dec ) return -1;
+    while( done < size ) {
+        size_t n = size - done < part_size ? size - done : part_size;
+        if( !plugin->decompress_part(dec, out + done, out + done + n) ) break;
+        done += n;
+    }
+    if( !plugin->close(plugin, dec) ) return -1;
+    return done == size ? 0 : -1;
+}
+
+/**
+ * @brief Decode a section through mz_stream: a partial flush inflate per
+ * request and a fresh inflater per node, as the plugin did before it drove
+ * tinfl directly.
+ */
+static int mz_inflate(const unsigned char *node, size_t node_len, unsigned char *out, size_t size,
+        size_t part_size) {
+    mz_stream s = { 0 };
+    int window_bits = node[0];
+    size_t done = 0;
+    int ret = MZ_OK;
+
+    if( MZ_OK != inflateInit2(&s, window_bits) ) return -1;
+    s.next_in = (unsigned char *)node + 1;
+    s.avail_in = node_len - 1;
+    while( done < size ) {
+        size_t n = size - done < part_size ? size - done : part_size;
+        s.next_out = out + done;
+        s.avail_out = n;
+        while( s.avail_out > 0 ) {
+            ret = inflate(&s, MZ_PARTIAL_FLUSH);
+            if( MZ_STREAM_END == ret && s.avail_in > 0 ) {
+                const unsigned char *next_in = s.next_in;
+                unsigned char *next_out = s.next_out;
+                unsigned int avail_in = s.avail_in, avail_out = s.avail_out;
+
+                /* Next node */
+                inflateEnd(&s);
+                if( MZ_OK != inflateInit2(&s, window_bits) ) return -1;
+                s.next_in = (unsigned char *)next_in;
+                s.avail_in = avail_in;
+                s.next_out = next_out;
+                s.avail_out = avail_out;
+                continue;
+            }
+            if( MZ_OK != ret ) break;
+        }
+        if( s.avail_out > 0 ) break;
+        done += n;
+    }
+    inflateEnd(&s);
+    return done == size ? 0 : -1;
+}
+
+/**
+ * @brief Check and, if bench, time every compressed section of a diff.
+ * @return Number of failures.
+ */
+static int run_diff(const char *name, bool bench) {
+    esp_hdiffz_miniz_plugin_t plugin;
+    hpatch_TStreamInput diff_stream;
+    esp_hdiffz_head_t head;
+    unsigned char *diff, *ref, *out;
+    size_t diff_size;
+    int n_fail = 0;
+
+    diff = load(name, &diff_size);
+    esp_hdiffz_mem_as_stream_input(&diff_stream, diff, diff_size);
+    if( ESP_OK != esp_hdiffz_read_head(&diff_stream, &head) ) {
+        printf("FAIL %s: not a diff\n", name);
+        return 1;
+    }
+    esp_hdiffz_miniz_plugin_init(&plugin);
+
+    for(int i=0; i < ESP_HDIFFZ_SEC_N; i++) {
+        const unsigned char *node = &diff[head.sec[i].pos];
+        size_t size = head.sec[i].size, node_len = head.sec[i].compress_size;
+
+        if( 0 == node_len || 0 == size ) continue;
+        if( node[0] & ESP_HDIFFZ_NODE_DICT ) {
+            printf("%s section %d: has a dictionary, skipped\n", name, i);
+            continue;
+        }
+
+        ref = malloc(size);
+        out = malloc(size);
+        if( 0 != mz_inflate(node, node_len, ref, size, size) ) {
+            printf("FAIL %s section %d: inflate\n", name, i);
+            n_fail++;
+            goto next;
+        }
+        for(size_t p=0; p < sizeof(part_sizes) / sizeof(part_sizes[0]); p++) {
+            memset(out, 0, size);
+            if( 0 != plugin_inflate(&plugin.base, &diff_stream, head.sec[i].pos,
+                        head.sec[i].pos + node_len, out, size, part_sizes[p])
+                    || 0 != memcmp(ref, out, size) ) {
+                printf("FAIL %s section %d: plugin with %d byte parts\n", name, i, (int)part_sizes[p]);
+                n_fail++;
+            }
+        }
+
+        if( bench ) {
+            printf("%s section %d: %d -> %d bytes\n", name, i, (int)node_len, (int)size);
+            printf("%-10s %12s %12s\n", "part", "tinfl MB/s", "mz_stream MB/s");
+            for(size_t p=0; p < sizeof(part_sizes) / sizeof(part_sizes[0]); p++) {
+                double t0, t_tinfl, t_mz;
+                int rounds = 0;
+
+                t0 = now();
+                do {
+                    plugin_inflate(&plugin.base, &diff_stream, head.sec[i].pos,
+                            head.sec[i].pos + node_len, out, size, part_sizes[p]);
+                    rounds++;
+                } while( now() - t0 < BENCH_TIME );
+                t_tinfl = (now() - t0) / rounds;
+
+                rounds = 0;
+                t0 = now();
+                do {
+                    mz_inflate(node, node_len, out, size, part_sizes[p]);
+                    rounds++;
+                } while( now() - t0 < BENCH_TIME );
+                t_mz = (now() - t0) / rounds;
+
+                printf("%-10d %12.1f %12.1f\n", (int)part_sizes[p], size / t_tinfl / 1e6, size / t_mz / 1e6);
+            }
+        }
+next:
+        free(ref);
+        free(out);
+    }
+
+    free(diff);
+    return n_fail;
+}
+
+int main(int argc, char **argv) {
+    bool bench = false;
+    int n_fail = 0, n_diffs = 0;
+
+    for(int i=1; i < argc; i++) {
+        if( 0 == strcmp(argv[i], "--bench") ) {
+            bench = true;
+            continue;
+        }
+        n_fail += run_diff(argv[i], bench);
+        n_diffs++;
+    }
+    if( 0 == n_diffs ) n_fail += run_diff(BIN_DIR "/hello_world_diff.bin", bench);
+
+    printf("%s: tinfl decoder matches inflate\n", n_fail ? "FAIL" : "PASS");
+    return n_fail ? 1 : 0;
+}
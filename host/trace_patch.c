@@ -0,0 +1,92 @@
+/**
+ * @file trace_patch
+ * @brief Apply a diff on the host with the trace recorder on, and export the
+ * timeline for chrome://tracing or Perfetto.
+ *
+ *     trace_patch old diff new trace.json [n_events]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_hdiffz.h"
+#include "rw.h"
+#include "engine.h"
+#include "miniz_plugin.h"
+
+#define DEFAULT_N_EVENTS 65536
+
+static FILE *open_or_die(const char *name, const char *mode) {
+    FILE *f = fopen(name, mode);
+
+    if( NULL == f ) {
+        printf("Can't open %s\n", name);
+        exit(1);
+    }
+    return f;
+}
+
+int main(int argc, char **argv) {
+    esp_err_t err;
+    FILE *old, *diff, *new_file, *trace;
+    esp_hdiffz_file_stream_t old_file, diff_file, out_file;
+    hpatch_TStreamInput old_stream, diff_stream;
+    hpatch_TStreamOutput out_stream = { 0 };
+    esp_hdiffz_miniz_plugin_t plugin;
+    esp_hdiffz_engine_cfg_t cfg = { 0 };
+    esp_hdiffz_info_t info;
+
+    if( argc < 5 ) {
+        printf("usage: %s old diff new trace.json [n_events]\n", argv[0]);
+        return 2;
+    }
+    old = open_or_die(argv[1], "rb");
+    diff = open_or_die(argv[2], "rb");
+    new_file = open_or_die(argv[3], "wb");
+
+    esp_hdiffz_file_stream_init(&old_file, old, 4096, 1);
+    esp_hdiffz_file_stream_init(&diff_file, diff, 1024, ESP_HDIFFZ_FILE_STREAM_MAX_LANES);
+    esp_hdiffz_file_stream_as_input(&old_file, &old_stream);
+    esp_hdiffz_file_stream_as_input(&diff_file, &diff_stream);
+    if( ESP_OK != esp_hdiffz_get_info(&diff_stream, &info) ) {
+        printf("Failed to parse %s\n", argv[2]);
+        return 1;
+    }
+    /* Old data checksums are not checked here */
+    diff_stream.streamSize -= info.old_check_size;
+    esp_hdiffz_file_stream_init(&out_file, new_file, 4096, 1);
+    esp_hdiffz_file_stream_as_output(&out_file, &out_stream, info.new_size);
+
+    esp_hdiffz_miniz_plugin_init(&plugin);
+    plugin.dict_src = &old_stream;
+    cfg.out = &out_stream;
+    cfg.old = &old_stream;
+    cfg.diff = &diff_stream;
+    cfg.plugin = &plugin.base;
+
+    err = esp_hdiffz_trace_start(argc > 5 ? strtoul(argv[5], NULL, 0) : DEFAULT_N_EVENTS);
+    if( ESP_OK != err ) {
+        printf("Failed to start trace: %s\n", esp_err_to_name(err));
+        return 1;
+    }
+    err = esp_hdiffz_engine_patch(&cfg);
+    if( ESP_OK == err ) err = esp_hdiffz_file_stream_flush(&out_file);
+    esp_hdiffz_trace_stop();
+    if( ESP_OK != err ) {
+        printf("Patch failed: %s\n", esp_err_to_name(err));
+        return 1;
+    }
+
+    trace = open_or_die(argv[4], "w");
+    err = esp_hdiffz_trace_export(trace);
+    fclose(trace);
+    esp_hdiffz_trace_free();
+
+    esp_hdiffz_file_stream_deinit(&out_file);
+    esp_hdiffz_file_stream_deinit(&diff_file);
+    esp_hdiffz_file_stream_deinit(&old_file);
+    fclose(new_file);
+    fclose(diff);
+    fclose(old);
+    return ESP_OK == err ? 0 : 1;
+}
@@ -6,10 +6,12 @@
 #include <stdarg.h>
 #include <unistd.h>
 #include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "esp_err.h"
 #include <string.h>
 #include "sdkconfig.h"
 #include "esp_partition.h"
+#include "esp_heap_caps.h"
 
 #include "HPatch/patch.h"
 #include "HPatch/patch_types.h"
@@ -31,6 +33,321 @@ extern "C" {
  */
 #define ESP_HDIFFZ_FORMAT_PROGRESS 20
 
+/********
+ * INFO *
+ ********/
+
+/**
+ * @brief Diff properties read from the header.
+ */
+typedef struct esp_hdiffz_info_t {
+    size_t new_size;            /**< Size of the patched data. */
+    size_t old_size;            /**< Size of the old data the diff applies to. */
+    size_t diff_size;           /**< Size of the diff stream. */
+    size_t old_check_size;      /**< Bytes of old data checksums trailing the sections; 0 if none. */
+    char compress_type[16];     /**< e.g. "zlib"; empty if uncompressed. */
+    uint32_t cover_count;       /**< Number of old data ranges reused. */
+    uint8_t n_nodes;            /**< Number of compressed sections. */
+    int8_t window_bits;         /**< Largest window bits of any node; 0 if none. */
+    size_t dict_size;           /**< Old data read as preset dictionaries by all nodes. */
+    size_t dec_heap;            /**< Worst-case decompressor heap for this diff stream. */
+    size_t heap_worst;          /**< Worst-case heap of the decompressor and patch engine; excludes prefetch, read-ahead and file/partition buffers. */
+} esp_hdiffz_info_t;
+
+/**
+ * @brief Parse a diff header without side effects.
+ *
+ * Only the header and the head of each compressed section are read;
+ * nothing is allocated, erased or written. Use it to reject diffs that do not
+ * fit before any flash work begins.
+ *
+ * @param[in] diff_stream Diff to inspect.
+ * @param[out] info Populated on success.
+ * @return ESP_OK on success;
+ *     ESP_ERR_INVALID_ARG if the header is malformed;
+ *     ESP_ERR_INVALID_SIZE if the stream is shorter than the header says;
+ *     ESP_ERR_NOT_SUPPORTED if the compression can't be decoded.
+ */
+esp_err_t esp_hdiffz_get_info(const hpatch_TStreamInput *diff_stream, esp_hdiffz_info_t *info);
+
+/************
+ * VALIDATE *
+ ************/
+
+typedef struct esp_hdiffz_digest_t {
+    size_t size;                /**< Number of bytes the patch produces. */
+    uint8_t sha256[32];         /**< SHA-256 of the patched data. */
+} esp_hdiffz_digest_t;
+
+/**
+ * @brief Run the complete patch without storing the output.
+ *
+ * The patched data is hashed as it is produced and then discarded. Use it to
+ * check a freshly downloaded diff before committing to erasing flash. The
+ * patch runs through the same engine the OTA functions write flash with.
+ *
+ * @param[in] old_stream Old data the diff applies to.
+ * @param[in] diff_stream Diff to validate.
+ * @param[out] digest Size and SHA-256 of the patched data.
+ * @return ESP_OK if the diff applies cleanly.
+ */
+esp_err_t esp_hdiffz_validate(const hpatch_TStreamInput *old_stream, const hpatch_TStreamInput *diff_stream, esp_hdiffz_digest_t *digest);
+
+/**
+ * @brief esp_hdiffz_validate against a firmware partition.
+ * @param[in] diff hdiffpatch file to validate.
+ * @param[in] src partition to apply the patch from; NULL for the running partition.
+ * @param[out] digest Size and SHA-256 of the patched firmware.
+ * @return ESP_OK if the diff applies cleanly.
+ */
+esp_err_t esp_hdiffz_ota_file_validate(FILE *diff, const esp_partition_t *src, esp_hdiffz_digest_t *digest);
+
+/**
+ * @brief esp_hdiffz_ota_file_validate using a diff from memory.
+ * @param[in] diff Full diff array.
+ * @param[in] diff_size number of bytes in diff.
+ * @param[in] src partition to apply the patch from; NULL for the running partition.
+ * @param[out] digest Size and SHA-256 of the patched firmware.
+ * @return ESP_OK if the diff applies cleanly.
+ */
+esp_err_t esp_hdiffz_ota_mem_validate(const char *diff, size_t diff_size, const esp_partition_t *src, esp_hdiffz_digest_t *digest);
+
+/**
+ * @brief SHA-256 of the first size bytes of a firmware partition.
+ *
+ * Matches the old_sha256 of a host/hdiffz_fleet.py manifest entry when size
+ * is that entry's old_size; use it to pick the diff for this device.
+ *
+ * @param[in] src Partition to hash; NULL for the running partition.
+ * @param[in] size Number of bytes to hash.
+ * @param[out] sha256 Digest.
+ * @return ESP_OK on success.
+ */
+esp_err_t esp_hdiffz_ota_old_sha256(const esp_partition_t *src, size_t size, uint8_t sha256[32]);
+
+/**********
+ * MEMORY *
+ **********/
+
+/**
+ * @brief Kinds of buffer allocated while patching.
+ */
+typedef enum esp_hdiffz_mem_class_t {
+    ESP_HDIFFZ_MEM_STATE = 0,   /**< Inflate state and windows up to 4 KB; touched for every decoded byte. */
+    ESP_HDIFFZ_MEM_IO,          /**< Bounce buffers between streams and flash or files. */
+    ESP_HDIFFZ_MEM_CACHE,       /**< Large caches; patch cache, prefetch slots, OTA copy buffer, larger inflate windows. */
+    ESP_HDIFFZ_MEM_N,
+} esp_hdiffz_mem_class_t;
+
+/**
+ * @brief Where each kind of buffer is allocated.
+ *
+ * Given per patch, e.g. in esp_hdiffz_ota_opts_t or esp_hdiffz_pool_config_t.
+ */
+typedef struct esp_hdiffz_mem_policy_t {
+    uint32_t caps[ESP_HDIFFZ_MEM_N];    /**< heap_caps_malloc capabilities per class; 0 for malloc. */
+    bool fallback;                      /**< Retry with malloc if the capable heaps are full. */
+} esp_hdiffz_mem_policy_t;
+
+/**
+ * Latency critical buffers in internal RAM, large caches in PSRAM, anywhere
+ * if that fails.
+ */
+#define ESP_HDIFFZ_MEM_POLICY_DEFAULT() { \
+    .caps = { \
+        [ESP_HDIFFZ_MEM_STATE] = MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT, \
+        [ESP_HDIFFZ_MEM_IO] = MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT, \
+        [ESP_HDIFFZ_MEM_CACHE] = MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT, \
+    }, \
+    .fallback = true, \
+}
+
+/**
+ * @brief Where the allocations of one class landed.
+ */
+typedef struct esp_hdiffz_mem_usage_t {
+    uint32_t n_allocs;          /**< Successful allocations. */
+    uint32_t n_fallbacks;       /**< Allocations that missed their capabilities and used malloc. */
+    uint32_t n_failed;          /**< Allocations that failed outright. */
+    size_t internal_bytes;      /**< Bytes allocated in internal RAM. */
+    size_t external_bytes;      /**< Bytes allocated in PSRAM. */
+} esp_hdiffz_mem_usage_t;
+
+/**
+ * @brief Where the buffers of one patch were allocated.
+ */
+typedef struct esp_hdiffz_mem_report_t {
+    esp_hdiffz_mem_usage_t cls[ESP_HDIFFZ_MEM_N];   /**< Indexed by esp_hdiffz_mem_class_t. */
+} esp_hdiffz_mem_report_t;
+
+/**
+ * @brief Largest window bits the nodes of a diff for this device may use.
+ *
+ * Send it with the update request so the diff producer can pick the best
+ * window for the device class. It is CONFIG_HDIFFZ_MAX_WINDOW_BITS, lowered
+ * until a window for every section fits in the heap the memory policy
+ * places windows in. Windows over 4 KB are placed with the caches.
+ *
+ * @param[in] policy Policy the patch will run with; NULL for ESP_HDIFFZ_MEM_POLICY_DEFAULT().
+ * @return Value in range [9, 15].
+ */
+int8_t esp_hdiffz_max_window_bits(const esp_hdiffz_mem_policy_t *policy);
+
+/*********
+ * TRACE *
+ *********/
+
+/**
+ * @brief Record a timeline of the following patches.
+ *
+ * Erase chunks, diff reads, inflate calls, old data reads, writes and
+ * yields of every task taking part are recorded with their start, duration
+ * and size. Once the ring is full the oldest events are overwritten. Each
+ * event costs two timer reads and a short critical section; while stopped,
+ * only a branch. Call between patches.
+ *
+ * @param[in] n_events Events the ring holds; 16 bytes each, from the cache memory class.
+ * @return ESP_OK on success; ESP_ERR_NO_MEM on OOM;
+ *     ESP_ERR_NOT_SUPPORTED if built without CONFIG_HDIFFZ_TRACE_RECORDER.
+ */
+esp_err_t esp_hdiffz_trace_start(size_t n_events);
+
+/**
+ * @brief Stop recording; the events are kept for export.
+ */
+void esp_hdiffz_trace_stop(void);
+
+/**
+ * @brief Write the recorded events as Chrome trace JSON.
+ *
+ * Open the file in chrome://tracing or https://ui.perfetto.dev. Each task
+ * gets a track, so work on the patch task and the prefetch and read-ahead
+ * workers lines up.
+ *
+ * @param[in] out Opened file, or stdout.
+ * @return ESP_OK on success; ESP_ERR_INVALID_STATE if recording or nothing
+ *     was recorded; ESP_FAIL on a write error.
+ */
+esp_err_t esp_hdiffz_trace_export(FILE *out);
+
+/**
+ * @brief Stop recording and free the events.
+ */
+void esp_hdiffz_trace_free(void);
+
+/*********
+ * FLASH *
+ *********/
+
+/**
+ * @brief Flash chip timings the operation cost model charges.
+ *
+ * Typical figures from the chip's datasheet, plus the driver's per call
+ * overhead and read rate.
+ */
+typedef struct esp_hdiffz_flash_timing_t {
+    uint32_t sector_erase_us;   /**< tSE: erase of one 4 KB sector. */
+    uint32_t block_erase_us;    /**< tBE: erase of one 64 KB block. */
+    uint32_t page_program_us;   /**< tPP: program of a full 256 byte page. */
+    uint32_t byte_program_us;   /**< tBP: program of a single byte; the least a page program costs. */
+    uint32_t read_us_per_kb;    /**< Read time per KB over the bus. */
+    uint32_t op_us;             /**< Driver overhead per call. */
+} esp_hdiffz_flash_timing_t;
+
+/**
+ * Typical timings of the 4 MB QSPI NOR parts on ESP32 modules, read in DIO
+ * at 40 MHz.
+ */
+#define ESP_HDIFFZ_FLASH_TIMING_DEFAULT() { \
+    .sector_erase_us = 45000, \
+    .block_erase_us = 150000, \
+    .page_program_us = 400, \
+    .byte_program_us = 30, \
+    .read_us_per_kb = 100, \
+    .op_us = 15, \
+}
+
+/**
+ * @brief Flash operations counted by a context and their modeled cost.
+ *
+ * Erases are split as the flash driver splits them: 64 KB blocks where the
+ * range covers an aligned block, 4 KB sectors elsewhere. Writes are split
+ * into programs of the 256 byte pages they touch.
+ */
+typedef struct esp_hdiffz_flash_report_t {
+    uint32_t n_reads;           /**< Read calls. */
+    uint32_t n_writes;          /**< Write calls. */
+    uint32_t n_erases;          /**< Erase calls. */
+    size_t read_bytes;          /**< Bytes read. */
+    size_t write_bytes;         /**< Bytes programmed. */
+    uint32_t n_page_programs;   /**< Page program operations. */
+    uint32_t n_sector_erases;   /**< 4 KB erase operations. */
+    uint32_t n_block_erases;    /**< 64 KB erase operations. */
+    uint32_t sectors_erased;    /**< 4 KB sectors erased by either; each is one erase cycle of wear. */
+    uint32_t sectors_touched;   /**< Distinct sectors erased at least once. */
+    uint32_t max_sector_erases; /**< Most erase cycles of any one sector. */
+    int64_t read_us;            /**< Modeled time reading. */
+    int64_t write_us;           /**< Modeled time programming. */
+    int64_t erase_us;           /**< Modeled time erasing. */
+} esp_hdiffz_flash_report_t;
+
+/**
+ * @brief Counters of the flash operations of one patch.
+ *
+ * Each firmware patch counts into its own context, so patches running side
+ * by side don't mix their counts. Operations may be counted from several
+ * tasks at once. Members other than timing are private; read them with
+ * esp_hdiffz_flash_report().
+ */
+typedef struct esp_hdiffz_flash_t {
+    esp_hdiffz_flash_timing_t timing;   /**< Timings the cost model charges. */
+    esp_hdiffz_flash_report_t report;
+    uint16_t *sectors;                  /**< Erase cycles per sector by flash address */
+    size_t n_sectors;
+    portMUX_TYPE lock;
+} esp_hdiffz_flash_t;
+
+/**
+ * @brief Start counting from zero.
+ * @param[out] flash Context to initialize.
+ * @param[in] timing Copied. NULL for ESP_HDIFFZ_FLASH_TIMING_DEFAULT().
+ */
+void esp_hdiffz_flash_init(esp_hdiffz_flash_t *flash, const esp_hdiffz_flash_timing_t *timing);
+
+/**
+ * @brief Free the per sector erase counts of a context.
+ */
+void esp_hdiffz_flash_deinit(esp_hdiffz_flash_t *flash);
+
+/**
+ * @brief Get the flash operations counted by a context.
+ * @param[out] report Populated with the counters.
+ */
+void esp_hdiffz_flash_report(esp_hdiffz_flash_t *flash, esp_hdiffz_flash_report_t *report);
+
+/**
+ * @brief Erase cycles a context counted of the sector at offset.
+ */
+uint32_t esp_hdiffz_flash_sector_erases(esp_hdiffz_flash_t *flash, const esp_partition_t *part, size_t offset);
+
+/**
+ * @brief esp_partition_read, counted in flash if not NULL.
+ */
+esp_err_t esp_hdiffz_flash_read(esp_hdiffz_flash_t *flash, const esp_partition_t *part,
+        size_t offset, void *dst, size_t size);
+
+/**
+ * @brief esp_partition_write, counted in flash if not NULL.
+ */
+esp_err_t esp_hdiffz_flash_write(esp_hdiffz_flash_t *flash, const esp_partition_t *part,
+        size_t offset, const void *src, size_t size);
+
+/**
+ * @brief esp_partition_erase_range, counted in flash if not NULL.
+ */
+esp_err_t esp_hdiffz_flash_erase_range(esp_hdiffz_flash_t *flash, const esp_partition_t *part,
+        size_t offset, size_t size);
+
 /*********
  * FILES *
  *********/
@@ -61,6 +378,296 @@ esp_err_t esp_hdiffz_patch_file_from_mem(FILE *in, FILE *out, const char *diff,
  */
 esp_err_t esp_hdiffz_patch_file(FILE *in, FILE *out, FILE *diff);
 
+/**
+ * @brief esp_hdiffz_patch_file, but with more explicit parameters.
+ *
+ * Old data and patched output are accessed through buffered adapters that
+ * skip redundant seeks. The output is preallocated to the patched size
+ * from the diff header where the filesystem supports it. With a miniz
+ * plugin instance, all buffers of the patch are placed by its mem_policy
+ * and counted in its mem_report.
+ *
+ * @param[in] in Opened file containing old data.
+ * @param[out] out Opened file to write patched data to.
+ * @param[in] diff_stream Diff to apply.
+ * @param[in] plugin Decompressor; typically minizDecompressPlugin.
+ * @return ESP_OK on success.
+ */
+esp_err_t esp_hdiffz_patch_file_adv(FILE *in, FILE *out, const hpatch_TStreamInput *diff_stream, hpatch_TDecompress *plugin);
+
+/************
+ * CREATING *
+ ************/
+
+/**
+ * @brief Parameters of esp_hdiffz_diff_file_adv.
+ */
+typedef struct esp_hdiffz_diff_config_t {
+    size_t budget;              /**< Heap the diff may be created with, in bytes. */
+    uint8_t level;              /**< Compression level in range [1, 10]. */
+    int8_t window_bits;         /**< Window bits of the nodes in range [9, 15]; no match reaches further back. */
+    const esp_hdiffz_mem_policy_t *mem_policy; /**< Where the buffers go; NULL for ESP_HDIFFZ_MEM_POLICY_DEFAULT(). */
+} esp_hdiffz_diff_config_t;
+
+#define ESP_HDIFFZ_DIFF_CONFIG_DEFAULT() { \
+    .budget = 64 * 1024, \
+    .level = 6, \
+    .window_bits = 12, \
+    .mem_policy = NULL, \
+}
+
+/**
+ * @brief Accounting of a diff created on the device.
+ */
+typedef struct esp_hdiffz_diff_stats_t {
+    size_t diff_size;           /**< Bytes written to the diff. */
+    uint32_t n_covers;          /**< Ranges of new data found in the old data. */
+    size_t cover_bytes;         /**< New bytes those ranges hold. */
+    size_t block_size;          /**< Bytes per old data block of the index. */
+    size_t index_heap;          /**< Heap of the index. */
+    size_t heap;                /**< Heap used in total. */
+    bool compressed;            /**< False if the budget had no room for the compressor. */
+    int64_t time_us;            /**< Time taken. */
+    esp_hdiffz_mem_report_t mem; /**< Where the buffers were allocated. */
+} esp_hdiffz_diff_stats_t;
+
+/**
+ * @brief Create a zlib compressed diff from old to new on the device.
+ *
+ * Whole blocks of old data are hashed into an index; the finest block size
+ * whose index fits the budget is used. New data is looked up at every
+ * position, and each hit is grown into a range equal to old data. The rest
+ * of new data is stored in the diff. Meant for small files such as config
+ * stores, since all of the old file is indexed.
+ *
+ * @param[in] old Opened file containing old data.
+ * @param[in] new_file Opened file containing new data.
+ * @param[out] out Opened file to write the diff to.
+ * @param[in] budget Heap the diff may be created with, in bytes. Includes the
+ *     compressor (sizeof(tdefl_compressor)); with less, the diff is stored
+ *     uncompressed.
+ * @return ESP_OK on success;
+ *     ESP_ERR_NO_MEM if the budget can't hold the coarsest index, or on OOM;
+ *     ESP_ERR_INVALID_SIZE if a file is 4 GB or larger.
+ */
+esp_err_t esp_hdiffz_diff_file(FILE *old, FILE *new_file, FILE *out, size_t budget);
+
+/**
+ * @brief esp_hdiffz_diff_file, but with more explicit parameters.
+ * @param[in] config Budget and compression parameters.
+ * @param[out] stats Diff size, time and memory use. May be NULL.
+ * @return See esp_hdiffz_diff_file; ESP_ERR_INVALID_ARG on a bad config.
+ */
+esp_err_t esp_hdiffz_diff_file_adv(FILE *old, FILE *new_file, FILE *out,
+        const esp_hdiffz_diff_config_t *config, esp_hdiffz_diff_stats_t *stats);
+
+/*********
+ * BATCH *
+ *********/
+
+typedef struct esp_hdiffz_job_t esp_hdiffz_job_t;
+
+/**
+ * @brief Called from a worker task once a job has finished.
+ * @param[in] job Finished job; job->err holds the result.
+ * @param[in] arg cb_arg of the job.
+ */
+typedef void (*esp_hdiffz_job_cb_t)(esp_hdiffz_job_t *job, void *arg);
+
+/**
+ * @brief A single file patch within a batch.
+ *
+ * Every job must use its own FILE handles.
+ */
+struct esp_hdiffz_job_t {
+    FILE *in;                   /**< Opened file containing old data. */
+    FILE *out;                  /**< Opened file to write patched data to. */
+    FILE *diff;                 /**< Opened diff file. Ignored if diff_mem is set. */
+    const char *diff_mem;       /**< Full diff array. May be NULL. */
+    size_t diff_mem_size;       /**< Number of bytes in diff_mem. */
+    size_t mem_limit;           /**< Max decompressor heap for this job in bytes; 0 for unlimited. */
+    esp_hdiffz_job_cb_t cb;     /**< Completion callback. May be NULL. */
+    void *cb_arg;               /**< Passed to cb. */
+
+    /* Populated by esp_hdiffz_patch_file_batch */
+    esp_err_t err;              /**< ESP_OK on success. */
+    size_t new_size;            /**< Patched file size from the diff header. */
+    size_t mem_peak;            /**< Peak decompressor heap used by the job. */
+    esp_hdiffz_mem_report_t mem; /**< Where the buffers of the job were allocated. */
+    uint8_t core;               /**< Core the job ran on. */
+};
+
+typedef struct esp_hdiffz_pool_config_t {
+    uint8_t n_workers;          /**< Number of worker tasks; 0 for one per core. */
+    uint32_t stack_size;        /**< Worker stack size; 0 for default. */
+    UBaseType_t priority;       /**< Worker priority. */
+    const esp_hdiffz_mem_policy_t *mem_policy; /**< Where job buffers go; NULL for ESP_HDIFFZ_MEM_POLICY_DEFAULT(). */
+} esp_hdiffz_pool_config_t;
+
+#define ESP_HDIFFZ_POOL_CONFIG_DEFAULT() { \
+    .n_workers = 0, \
+    .stack_size = 0, \
+    .priority = 5, \
+    .mem_policy = NULL, \
+}
+
+/**
+ * @brief Patch a batch of independent files in parallel.
+ *
+ * Jobs are spread over worker tasks pinned to alternating cores. Jobs with the
+ * largest output are started first so the whole batch finishes sooner.
+ * Decompressor buffers are shared between workers and reused across jobs.
+ *
+ * Blocks until every job has finished.
+ *
+ * @param[in,out] jobs Array of jobs; results are written back into each job.
+ * @param[in] n_jobs Number of jobs.
+ * @param[in] config Pool configuration. May be NULL for defaults.
+ * @return ESP_OK if every job succeeded; ESP_FAIL if any job failed.
+ */
+esp_err_t esp_hdiffz_patch_file_batch(esp_hdiffz_job_t *jobs, size_t n_jobs, const esp_hdiffz_pool_config_t *config);
+
+
+/**
+ * @brief Per-cover accounting of a firmware patch.
+ */
+typedef struct esp_hdiffz_patch_stats_t {
+    uint32_t n_covers;          /**< Covers (old data ranges reused) in the diff. */
+    uint32_t n_copy_covers;     /**< Covers moved entirely as bulk copies. */
+    size_t cover_bytes;         /**< Patched bytes derived from old data. */
+    size_t copy_bytes;          /**< Of cover_bytes, those copied with no add step. */
+    size_t diff_bytes;          /**< Patched bytes taken directly from the diff. */
+    uint32_t n_prefetch;        /**< Old data chunks read ahead on the prefetch task. */
+    uint32_t n_prefetch_ready;  /**< Of n_prefetch, those ready before the patch needed them. */
+    uint32_t n_prefetch_late;   /**< Of n_prefetch, those the patch had to wait for. */
+    uint32_t n_prefetch_unused; /**< Of n_prefetch, those discarded without use. */
+    size_t prefetch_miss_bytes; /**< Old bytes read directly because they weren't prefetched. */
+    size_t old_checked_bytes;   /**< Old bytes verified against the diff's checksums. */
+    size_t old_check_extra_bytes; /**< Of old_checked_bytes, those read only to complete a block. */
+    uint32_t n_diff_reads;      /**< Diff reads by the patch; file diffs only. */
+    uint32_t n_diff_stalls;     /**< Of n_diff_reads, those that waited for the read-ahead task or read storage directly; 0 without read-ahead. */
+    uint32_t n_diff_refills;    /**< Diff reads by the read-ahead task. */
+    int64_t diff_wait_us;       /**< Time the patch spent waiting for diff data; all diff reads without read-ahead. */
+    esp_hdiffz_mem_report_t mem; /**< Where the buffers of the patch were allocated. */
+    esp_hdiffz_flash_report_t flash; /**< Flash operations of a firmware patch; zero for other patches. */
+} esp_hdiffz_patch_stats_t;
+
+/**
+ * @brief Destination of a rollback (reverse) diff.
+ */
+typedef struct esp_hdiffz_rollback_t {
+    FILE *file;                         /**< Write the reverse diff here, if not NULL. */
+    const esp_partition_t *part;        /**< Otherwise, write it here from offset 0. */
+    size_t size;                        /**< Set to the reverse diff size after a patch. */
+    int64_t time_us;                    /**< Set to the time spent writing it. */
+} esp_hdiffz_rollback_t;
+
+/**
+ * @brief Stage of a firmware patch.
+ */
+typedef enum esp_hdiffz_phase_t {
+    ESP_HDIFFZ_PHASE_ERASE = 0,         /**< Erasing the sectors the patched firmware will occupy. */
+    ESP_HDIFFZ_PHASE_PATCH,             /**< Writing the patched firmware. */
+    ESP_HDIFFZ_PHASE_ROLLBACK,          /**< Writing the rollback diff, if requested. */
+    ESP_HDIFFZ_PHASE_DONE,              /**< Finished; see err. Always the last event. */
+} esp_hdiffz_phase_t;
+
+/**
+ * @brief Progress of a firmware patch.
+ *
+ * Rates are in bytes per second of the current phase's stream: erased bytes
+ * while erasing, patched bytes while patching.
+ */
+typedef struct esp_hdiffz_progress_t {
+    esp_hdiffz_phase_t phase;
+    size_t erase_done;          /**< Bytes of the destination erased. */
+    size_t erase_total;         /**< Bytes of the destination to erase. */
+    size_t new_done;            /**< Patched bytes written. */
+    size_t new_total;           /**< Patched firmware size. */
+    uint32_t rate;              /**< Since the previous event. */
+    uint32_t avg_rate;          /**< Since the start of the phase. */
+    uint32_t eta_ms;            /**< Until the patched firmware is written; 0 if unknown. */
+    uint32_t elapsed_ms;        /**< Since the start of the patch. */
+    esp_err_t err;              /**< Result of the patch in the ESP_HDIFFZ_PHASE_DONE event. */
+} esp_hdiffz_progress_t;
+
+/**
+ * @brief Called from the task running the patch; must return quickly.
+ * @param[in] progress Snapshot; only valid during the call.
+ * @param[in] arg arg of the esp_hdiffz_progress_config_t.
+ */
+typedef void (*esp_hdiffz_progress_cb_t)(const esp_hdiffz_progress_t *progress, void *arg);
+
+/**
+ * @brief Progress events of a firmware patch.
+ *
+ * An event is sent at the start of every phase and at the end. In between,
+ * one is sent at most every interval_ms and every byte_step bytes, whichever
+ * is longer; with both 0 the interval defaults to 500 ms. Without a
+ * callback, patches only pay a NULL check per flash write.
+ */
+typedef struct esp_hdiffz_progress_config_t {
+    esp_hdiffz_progress_cb_t cb;
+    void *arg;                  /**< Passed to cb. */
+    uint32_t interval_ms;       /**< Min time between events; 0 for no time limit. */
+    size_t byte_step;           /**< Min bytes of the phase's stream between events; 0 for no byte limit. */
+} esp_hdiffz_progress_config_t;
+
+/**
+ * @brief How the diff file of a firmware patch is read ahead on another task.
+ *
+ * Each section of the diff is read into its own ring of depth refills by a
+ * task on the other core, so filesystem reads overlap with inflate and the
+ * patch. The rings take 4 * depth * refill_size bytes from the cache memory
+ * class. Diffs in memory are not affected. The patch stats report how long
+ * the patch waited for diff data either way.
+ */
+typedef struct esp_hdiffz_readahead_config_t {
+    size_t refill_size;         /**< Bytes per read of the diff file; independent of the inflate window. */
+    uint8_t depth;              /**< Refills buffered per diff section; 0 reads the diff on the patch task. */
+} esp_hdiffz_readahead_config_t;
+
+#define ESP_HDIFFZ_READAHEAD_CONFIG_DEFAULT() { \
+    .refill_size = 2048, \
+    .depth = 2, \
+}
+
+/**
+ * @brief Options of one firmware patch.
+ *
+ * Pointed to structures must stay valid until the patch returns.
+ */
+typedef struct esp_hdiffz_ota_opts_t {
+    /**
+     * Also write a reverse diff, if not NULL. The reverse diff turns the
+     * patched firmware back into the old one. It is derived from the covers
+     * of the forward patch and stored uncompressed, at about twice the size
+     * of a compressed diff. It is applied like any other diff, e.g.
+     * esp_hdiffz_ota_file_adv(rollback_file, patched_partition, old_partition).
+     * A patch that can't write its reverse diff fails before the boot
+     * partition is changed. A rollback partition must not overlap src or dst.
+     */
+    esp_hdiffz_rollback_t *rollback;
+    /** Report the progress of the patch to a callback, if not NULL. */
+    const esp_hdiffz_progress_config_t *progress_cb;
+    /** Read-ahead of a diff file; NULL for ESP_HDIFFZ_READAHEAD_CONFIG_DEFAULT(). */
+    const esp_hdiffz_readahead_config_t *readahead;
+    /** Set to the accounting of the patch once it returns, if not NULL. */
+    esp_hdiffz_patch_stats_t *stats;
+    /** Where the buffers of the patch go; NULL for ESP_HDIFFZ_MEM_POLICY_DEFAULT(). */
+    const esp_hdiffz_mem_policy_t *mem_policy;
+    /** Timings the flash counters of stats charge; NULL for ESP_HDIFFZ_FLASH_TIMING_DEFAULT(). */
+    const esp_hdiffz_flash_timing_t *flash_timing;
+} esp_hdiffz_ota_opts_t;
+
+#define ESP_HDIFFZ_OTA_OPTS_DEFAULT() { \
+    .rollback = NULL, \
+    .progress_cb = NULL, \
+    .readahead = NULL, \
+    .stats = NULL, \
+    .mem_policy = NULL, \
+    .flash_timing = NULL, \
+}
 
 /**
  * @brief Performs an hdiffpatch firmware upgrade.
@@ -101,6 +708,174 @@ esp_err_t esp_hdiffz_ota_file_adv(FILE *diff, const esp_partition_t *src, const
  */
 esp_err_t esp_hdiffz_ota_file_adv_progress(FILE *diff, const esp_partition_t *src, const esp_partition_t *dst, int8_t *progress);
 
+/**
+ * @brief esp_hdiffz_ota_file_adv_progress, with per patch options.
+ * @param[in] diff hdiffpatch file to apply.
+ * @param[in] src partition to be apply patch from
+ * @param[in] dst partition to save the patched firmware
+ * @param[out] progress Progress in range [0, 100]. May be NULL.
+ * @param[in] opts Options of this patch. May be NULL for defaults.
+ * @return ESP_OK on success; ESP_ERR_INVALID_ARG if the rollback partition
+ *     overlaps src or dst.
+ */
+esp_err_t esp_hdiffz_ota_file_opts(FILE *diff, const esp_partition_t *src, const esp_partition_t *dst,
+        int8_t *progress, const esp_hdiffz_ota_opts_t *opts);
+
+/**
+ * @brief Performs an hdiffpatch firmware upgrade using a diff from memory.
+ *
+ * The diff is decompressed directly from the buffer without copying.
+ * If PSRAM is available, decompressor buffers and a working cache large
+ * enough to hold the old firmware are allocated from it.
+ *
+ * Assumes that the diff is applied to the currently running firmware.
+ * Patched firmware will be flashed to the next free OTA partition.
+ *
+ * @param[in] diff Full diff array.
+ * @param[in] diff_size number of bytes in diff.
+ * @return ESP_OK on success.
+ */
+esp_err_t esp_hdiffz_ota_mem(const char *diff, size_t diff_size);
+
+/**
+ * @brief esp_hdiffz_ota_mem but will also update the progress value
+ * @param[in] diff Full diff array.
+ * @param[in] diff_size number of bytes in diff.
+ * @param[out] progress Progress in range [0, 100]. May be NULL.
+ * @return ESP_OK on success.
+ */
+esp_err_t esp_hdiffz_ota_mem_progress(const char *diff, size_t diff_size, int8_t *progress);
+
+/**
+ * @brief esp_hdiffz_ota_mem, but with more explicit parameters.
+ * @param[in] diff Full diff array.
+ * @param[in] diff_size number of bytes in diff.
+ * @param[in] src partition to be apply patch from
+ * @param[in] dst partition to save the patched firmware
+ * @return ESP_OK on success.
+ */
+esp_err_t esp_hdiffz_ota_mem_adv(const char *diff, size_t diff_size, const esp_partition_t *src, const esp_partition_t *dst);
+
+/**
+ * @brief esp_hdiffz_ota_mem, but will also update the progress value
+ * @param[in] diff Full diff array.
+ * @param[in] diff_size number of bytes in diff.
+ * @param[in] src partition to be apply patch from
+ * @param[in] dst partition to save the patched firmware
+ * @param[out] progress Progress in range [0, 100]. May be NULL.
+ * @return ESP_OK on success.
+ */
+esp_err_t esp_hdiffz_ota_mem_adv_progress(const char *diff, size_t diff_size,
+        const esp_partition_t *src, const esp_partition_t *dst, int8_t *progress);
+
+/**
+ * @brief esp_hdiffz_ota_mem_adv_progress, with per patch options.
+ * @param[in] diff Full diff array.
+ * @param[in] diff_size number of bytes in diff.
+ * @param[in] src partition to be apply patch from
+ * @param[in] dst partition to save the patched firmware
+ * @param[out] progress Progress in range [0, 100]. May be NULL.
+ * @param[in] opts Options of this patch. May be NULL for defaults.
+ * @return ESP_OK on success; ESP_ERR_INVALID_ARG if the rollback partition
+ *     overlaps src or dst.
+ */
+esp_err_t esp_hdiffz_ota_mem_opts(const char *diff, size_t diff_size,
+        const esp_partition_t *src, const esp_partition_t *dst, int8_t *progress,
+        const esp_hdiffz_ota_opts_t *opts);
+
+/*************
+ * OTA ASYNC *
+ *************/
+
+#define ESP_ERR_HDIFFZ_BASE         0xF100
+/** The update was stopped by esp_hdiffz_ota_cancel; the boot partition is unchanged. */
+#define ESP_ERR_HDIFFZ_CANCELLED    (ESP_ERR_HDIFFZ_BASE + 1)
+/** Old data read by the patch does not match the checksums the diff carries. */
+#define ESP_ERR_HDIFFZ_OLD_MISMATCH (ESP_ERR_HDIFFZ_BASE + 2)
+
+typedef struct esp_hdiffz_ota_async_t esp_hdiffz_ota_async_t;
+
+typedef struct esp_hdiffz_ota_async_config_t {
+    FILE *diff;                 /**< Opened diff file. Ignored if diff_mem is set. */
+    const char *diff_mem;       /**< Full diff array. May be NULL. */
+    size_t diff_mem_size;       /**< Number of bytes in diff_mem. */
+    const esp_partition_t *src; /**< Partition to apply the patch from; NULL for the running partition. */
+    const esp_partition_t *dst; /**< Partition to write to; NULL for the next OTA partition. */
+    int8_t *progress;           /**< Progress in range [0, 100]. May be NULL. */
+    esp_hdiffz_ota_opts_t opts; /**< Options of the patch. */
+    uint32_t stack_size;        /**< Task stack size; 0 for default. */
+    UBaseType_t priority;       /**< Task priority. */
+    BaseType_t core;            /**< Core to pin the task to; tskNO_AFFINITY for either. */
+} esp_hdiffz_ota_async_config_t;
+
+#define ESP_HDIFFZ_OTA_ASYNC_CONFIG_DEFAULT() { \
+    .diff = NULL, \
+    .diff_mem = NULL, \
+    .diff_mem_size = 0, \
+    .src = NULL, \
+    .dst = NULL, \
+    .progress = NULL, \
+    .opts = ESP_HDIFFZ_OTA_OPTS_DEFAULT(), \
+    .stack_size = 0, \
+    .priority = 5, \
+    .core = tskNO_AFFINITY, \
+}
+
+/**
+ * @brief Run a firmware upgrade on its own task.
+ *
+ * Performs esp_hdiffz_ota_file_opts (or the _mem_ variant if
+ * diff_mem is set) and returns as soon as the task is running. The diff
+ * file or array, and whatever the opts point to, must stay valid until
+ * esp_hdiffz_ota_wait returns the result. The old firmware is read ahead on the core the task isn't
+ * pinned to, so pinning the update to the less busy core keeps the other
+ * for the application.
+ *
+ * @param[in] config Diff, partitions and task settings; copied.
+ * @param[out] handle Pass to esp_hdiffz_ota_cancel, then to esp_hdiffz_ota_wait
+ *     or esp_hdiffz_ota_release.
+ * @return ESP_OK if the task was started;
+ *     ESP_ERR_INVALID_ARG if there is no diff or the core doesn't exist;
+ *     ESP_ERR_NO_MEM if the task can't be created.
+ */
+esp_err_t esp_hdiffz_ota_start_async(const esp_hdiffz_ota_async_config_t *config, esp_hdiffz_ota_async_t **handle);
+
+/**
+ * @brief Ask a running upgrade to stop.
+ *
+ * Returns immediately. The task stops at its next erase step or flash write
+ * and never sets the boot partition afterwards; esp_hdiffz_ota_wait then
+ * returns ESP_ERR_HDIFFZ_CANCELLED. Has no effect once the boot partition
+ * has been set.
+ *
+ * @param[in] handle Running upgrade.
+ */
+void esp_hdiffz_ota_cancel(esp_hdiffz_ota_async_t *handle);
+
+/**
+ * @brief Wait for an upgrade to finish and get its result.
+ *
+ * The handle is freed unless ESP_ERR_TIMEOUT is returned. Call it until it
+ * returns anything else, or hand the handle to esp_hdiffz_ota_release;
+ * otherwise the handle leaks.
+ *
+ * @param[in] handle Upgrade from esp_hdiffz_ota_start_async.
+ * @param[in] timeout Ticks to wait; 0 to poll, portMAX_DELAY to block.
+ * @return ESP_ERR_TIMEOUT if still running; otherwise the result of the upgrade.
+ */
+esp_err_t esp_hdiffz_ota_wait(esp_hdiffz_ota_async_t *handle, TickType_t timeout);
+
+/**
+ * @brief Give up a handle without collecting the result.
+ *
+ * The upgrade keeps running unless cancelled first, and the handle is freed
+ * once it finishes. The diff and whatever the config points to must stay
+ * valid until then, so they can't live on the caller's stack.
+ *
+ * @param[in] handle Upgrade from esp_hdiffz_ota_start_async; invalid afterwards.
+ */
+void esp_hdiffz_ota_release(esp_hdiffz_ota_async_t *handle);
+
 
 /*******
  * OTA *
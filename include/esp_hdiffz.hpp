@@ -0,0 +1,528 @@
+/**
+ * @file esp_hdiffz.hpp
+ * @brief Header-only C++17 interface to esp_hdiffz.
+ *
+ * Sources and sinks are plain classes with
+ *
+ *     hpatch_StreamPos_t size() const;                        // sources only
+ *     bool read(hpatch_StreamPos_t pos, bytes out);           // sources
+ *     bool write(hpatch_StreamPos_t pos, const_bytes data);   // sinks
+ *
+ * They are bound to the C streams through a trampoline instantiated for the
+ * exact adapter type, so each read or write is a single indirect call with
+ * the adapter's body inlined into it. A Session owns the decompressor and
+ * output buffer of a patch and releases them with it:
+ *
+ *     esp_hdiffz::PartitionSource old(running);
+ *     esp_hdiffz::MemorySource diff({diff_buf, diff_len});
+ *     esp_hdiffz::PartitionSink out(next);
+ *     esp_hdiffz::Session session(old, diff);
+ *     esp_err_t err = session.patch(out);
+ *
+ * Nothing throws; errors are returned as esp_err_t like the C API.
+ */
+#ifndef ESP_HDIFFZ_HPP__
+#define ESP_HDIFFZ_HPP__
+
+#if __cplusplus < 201703L
+#error "esp_hdiffz.hpp needs C++17; add -std=gnu++17 to the component's CXXFLAGS"
+#endif
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+#if __has_include(<span>)
+#include <span>
+#endif
+
+#include "esp_hdiffz.h"
+#include "engine.h"
+#include "miniz_plugin.h"
+#include "rw.h"
+
+namespace esp_hdiffz {
+
+/********
+ * SPAN *
+ ********/
+
+#if defined(__cpp_lib_span) && __cpp_lib_span >= 202002L
+using std::span;
+#else
+/**
+ * @brief The part of std::span (C++20) that this header uses.
+ */
+template <class T>
+class span {
+public:
+    using element_type = T;
+    using value_type = std::remove_cv_t<T>;
+    using size_type = std::size_t;
+    using pointer = T *;
+    using iterator = T *;
+
+    constexpr span() noexcept = default;
+    constexpr span(T *data, size_type size) noexcept : data_(data), size_(size) {}
+    template <std::size_t N>
+    constexpr span(T (&arr)[N]) noexcept : data_(arr), size_(N) {}
+    /** Any contiguous container with data() and size(), e.g. std::vector. */
+    template <class C, class = std::enable_if_t<
+            std::is_convertible_v<decltype(std::declval<C &>().data()), T *>>>
+    constexpr span(C &c) noexcept : data_(c.data()), size_(c.size()) {}
+    template <class U, class = std::enable_if_t<std::is_convertible_v<U (*)[], T (*)[]>>>
+    constexpr span(const span<U> &other) noexcept : data_(other.data()), size_(other.size()) {}
+
+    constexpr T *data() const noexcept { return data_; }
+    constexpr size_type size() const noexcept { return size_; }
+    constexpr size_type size_bytes() const noexcept { return size_ * sizeof(T); }
+    constexpr bool empty() const noexcept { return 0 == size_; }
+    constexpr T &operator[](size_type i) const noexcept { return data_[i]; }
+    constexpr iterator begin() const noexcept { return data_; }
+    constexpr iterator end() const noexcept { return data_ + size_; }
+    constexpr span first(size_type n) const noexcept { return {data_, n}; }
+    constexpr span subspan(size_type offset) const noexcept { return {data_ + offset, size_ - offset}; }
+    constexpr span subspan(size_type offset, size_type n) const noexcept { return {data_ + offset, n}; }
+
+private:
+    T *data_ = nullptr;
+    size_type size_ = 0;
+};
+#endif
+
+using bytes = span<uint8_t>;
+using const_bytes = span<const uint8_t>;
+
+/***********
+ * SOURCES *
+ ***********/
+
+/**
+ * @brief Data in memory.
+ *
+ * Bound with esp_hdiffz_mem_as_stream_input, so compressed sections of a
+ * diff held here are inflated in place without copying.
+ */
+class MemorySource {
+public:
+    explicit MemorySource(const_bytes data) : data_(data) {}
+    MemorySource(const void *data, std::size_t size)
+            : data_(static_cast<const uint8_t *>(data), size) {}
+
+    hpatch_StreamPos_t size() const { return data_.size(); }
+    const_bytes data() const { return data_; }
+
+    bool read(hpatch_StreamPos_t pos, bytes out) {
+        if( pos > data_.size() || out.size() > data_.size() - pos ) return false;
+        std::memcpy(out.data(), data_.data() + pos, out.size());
+        return true;
+    }
+
+private:
+    const_bytes data_;
+};
+
+/**
+ * @brief An opened file, read through Lanes windows of BufSize bytes.
+ *
+ * Like esp_hdiffz_file_stream_t, but with the buffers inline. A diff read
+ * from a file wants a lane per section (4); old data wants one. fseek is
+ * only issued when the file is not already at the position.
+ */
+template <std::size_t BufSize = 1024, std::size_t Lanes = 1>
+class FileSource {
+    static_assert(BufSize > 0 && Lanes > 0, "FileSource needs at least one buffer");
+
+public:
+    explicit FileSource(FILE *file) : file_(file), size_(esp_hdiffz_get_file_size(file)) {
+        file_pos_ = std::ftell(file);
+    }
+    FileSource(const FileSource &) = delete;
+    FileSource &operator=(const FileSource &) = delete;
+
+    hpatch_StreamPos_t size() const { return size_; }
+
+    bool read(hpatch_StreamPos_t pos, bytes out) {
+        Lane *lane = &lanes_[0];
+        for(Lane &l : lanes_) {
+            if( pos >= l.pos && pos < l.pos + l.len ) {
+                lane = &l;
+                break;
+            }
+            if( l.last_use < lane->last_use ) lane = &l;
+        }
+        lane->last_use = ++clock_;
+
+        /* Serve what we can from the lane */
+        if( pos >= lane->pos && pos < lane->pos + lane->len ) {
+            std::size_t n = lane->pos + lane->len - pos;
+            if( n > out.size() ) n = out.size();
+            std::memcpy(out.data(), lane->buf + (pos - lane->pos), n);
+            out = out.subspan(n);
+            pos += n;
+            if( out.empty() ) return true;
+        }
+
+        /* Large reads bypass the lane */
+        if( out.size() >= BufSize ) return out.size() == fill(pos, out.data(), out.size());
+
+        lane->pos = pos;
+        lane->len = fill(pos, lane->buf, BufSize);
+        if( lane->len < out.size() ) return false;
+        std::memcpy(out.data(), lane->buf, out.size());
+        return true;
+    }
+
+private:
+    struct Lane {
+        uint8_t buf[BufSize];
+        hpatch_StreamPos_t pos = 0;
+        std::size_t len = 0;
+        uint32_t last_use = 0;
+    };
+
+    /** Read up to n bytes at pos; returns the number read. */
+    std::size_t fill(hpatch_StreamPos_t pos, uint8_t *dst, std::size_t n) {
+        if( static_cast<long>(pos) != file_pos_ ) {
+            if( 0 != std::fseek(file_, static_cast<long>(pos), SEEK_SET) ) {
+                file_pos_ = -1;
+                return 0;
+            }
+        }
+        std::size_t got = std::fread(dst, 1, n, file_);
+        file_pos_ = static_cast<long>(pos + got);
+        return got;
+    }
+
+    FILE *file_;
+    hpatch_StreamPos_t size_;
+    long file_pos_;
+    uint32_t clock_ = 0;
+    Lane lanes_[Lanes];
+};
+
+/**
+ * @brief The first size bytes of a flash partition.
+ *
+ * Reads are counted in flash, if given.
+ */
+class PartitionSource {
+public:
+    explicit PartitionSource(const esp_partition_t *part, esp_hdiffz_flash_t *flash = nullptr)
+        : part_(part), size_(part->size), flash_(flash) {}
+    PartitionSource(const esp_partition_t *part, hpatch_StreamPos_t size, esp_hdiffz_flash_t *flash = nullptr)
+        : part_(part), size_(size), flash_(flash) {}
+
+    hpatch_StreamPos_t size() const { return size_; }
+
+    bool read(hpatch_StreamPos_t pos, bytes out) {
+        return ESP_OK == esp_hdiffz_flash_read(flash_, part_, pos, out.data(), out.size());
+    }
+
+private:
+    const esp_partition_t *part_;
+    hpatch_StreamPos_t size_;
+    esp_hdiffz_flash_t *flash_;
+};
+
+/**
+ * @brief size bytes produced by fn(pos, bytes out) -> bool.
+ *
+ * fn is stored by value and called directly, so a lambda is inlined into
+ * the read trampoline.
+ */
+template <class F>
+class CallbackSource {
+public:
+    CallbackSource(hpatch_StreamPos_t size, F fn) : fn_(std::move(fn)), size_(size) {}
+
+    hpatch_StreamPos_t size() const { return size_; }
+    bool read(hpatch_StreamPos_t pos, bytes out) { return fn_(pos, out); }
+
+private:
+    F fn_;
+    hpatch_StreamPos_t size_;
+};
+
+/*********
+ * SINKS *
+ *********/
+
+/**
+ * @brief Patched data into a caller provided buffer.
+ */
+class SpanSink {
+public:
+    explicit SpanSink(bytes out) : out_(out) {}
+
+    bool write(hpatch_StreamPos_t pos, const_bytes data) {
+        if( pos > out_.size() || data.size() > out_.size() - pos ) return false;
+        std::memcpy(out_.data() + pos, data.data(), data.size());
+        return true;
+    }
+
+private:
+    bytes out_;
+};
+
+/**
+ * @brief Patched data into an opened file.
+ */
+class FileSink {
+public:
+    explicit FileSink(FILE *file) : file_(file), file_pos_(std::ftell(file)) {}
+
+    bool write(hpatch_StreamPos_t pos, const_bytes data) {
+        if( static_cast<long>(pos) != file_pos_ ) {
+            if( 0 != std::fseek(file_, static_cast<long>(pos), SEEK_SET) ) {
+                file_pos_ = -1;
+                return false;
+            }
+        }
+        std::size_t put = std::fwrite(data.data(), 1, data.size(), file_);
+        file_pos_ = static_cast<long>(pos + put);
+        return put == data.size();
+    }
+
+private:
+    FILE *file_;
+    long file_pos_;
+};
+
+/**
+ * @brief Patched data into a flash partition from offset 0.
+ *
+ * Sectors are erased just ahead of the data written into them, so nothing
+ * is erased before the patch gets going. Erases and writes are counted in
+ * flash, if given.
+ */
+class PartitionSink {
+public:
+    /** Bulk copies are split on sector boundaries. */
+    static constexpr std::size_t align = SPI_FLASH_SEC_SIZE;
+
+    explicit PartitionSink(const esp_partition_t *part, esp_hdiffz_flash_t *flash = nullptr)
+        : part_(part), flash_(flash) {}
+
+    bool write(hpatch_StreamPos_t pos, const_bytes data) {
+        hpatch_StreamPos_t end = pos + data.size();
+        if( end > erased_ ) {
+            hpatch_StreamPos_t size = (end - erased_ + SPI_FLASH_SEC_SIZE - 1) & ~(hpatch_StreamPos_t)(SPI_FLASH_SEC_SIZE - 1);
+            if( ESP_OK != esp_hdiffz_flash_erase_range(flash_, part_, erased_, size) ) return false;
+            erased_ += size;
+        }
+        return ESP_OK == esp_hdiffz_flash_write(flash_, part_, pos, data.data(), data.size());
+    }
+
+private:
+    const esp_partition_t *part_;
+    esp_hdiffz_flash_t *flash_;
+    hpatch_StreamPos_t erased_ = 0;
+};
+
+/**
+ * @brief Patched data handed to fn(pos, const_bytes data) -> bool.
+ */
+template <class F>
+class CallbackSink {
+public:
+    explicit CallbackSink(F fn) : fn_(std::move(fn)) {}
+
+    bool write(hpatch_StreamPos_t pos, const_bytes data) { return fn_(pos, data); }
+
+private:
+    F fn_;
+};
+
+/************
+ * BINDINGS *
+ ************/
+
+namespace detail {
+
+template <class Source>
+hpatch_BOOL read(const hpatch_TStreamInput *stream, hpatch_StreamPos_t pos,
+        unsigned char *out, unsigned char *out_end) {
+    return static_cast<Source *>(stream->streamImport)->read(pos, bytes(out, out_end - out));
+}
+
+template <class Sink>
+hpatch_BOOL write(const hpatch_TStreamOutput *stream, hpatch_StreamPos_t pos,
+        const unsigned char *data, const unsigned char *data_end) {
+    return static_cast<Sink *>(stream->streamImport)->write(pos, const_bytes(data, data_end - data));
+}
+
+template <class Sink, class = void>
+struct sink_align : std::integral_constant<std::size_t, 0> {};
+
+template <class Sink>
+struct sink_align<Sink, std::void_t<decltype(Sink::align)>>
+        : std::integral_constant<std::size_t, Sink::align> {};
+
+} // namespace detail
+
+/**
+ * @brief C input stream reading from src; src must outlive it.
+ */
+template <class Source>
+hpatch_TStreamInput as_input(Source &src) {
+    hpatch_TStreamInput in = {};
+    if constexpr( std::is_same_v<Source, MemorySource> ) {
+        esp_hdiffz_mem_as_stream_input(&in, src.data().data(), src.data().size());
+    }
+    else {
+        in.streamImport = &src;
+        in.streamSize = src.size();
+        in.read = &detail::read<Source>;
+    }
+    return in;
+}
+
+/**
+ * @brief C output stream of size bytes writing to sink; sink must outlive it.
+ */
+template <class Sink>
+hpatch_TStreamOutput as_output(Sink &sink, hpatch_StreamPos_t size) {
+    hpatch_TStreamOutput out = {};
+    out.streamImport = &sink;
+    out.streamSize = size;
+    out.write = &detail::write<Sink>;
+    return out;
+}
+
+/***********
+ * SESSION *
+ ***********/
+
+/**
+ * @brief Buffer cache shared by sessions on different tasks.
+ */
+class BufCache {
+public:
+    explicit BufCache(uint8_t n_slots) : cache_(esp_hdiffz_buf_cache_create(n_slots)) {}
+    ~BufCache() { if( nullptr != cache_ ) esp_hdiffz_buf_cache_del(cache_); }
+    BufCache(const BufCache &) = delete;
+    BufCache &operator=(const BufCache &) = delete;
+
+    explicit operator bool() const { return nullptr != cache_; }
+    esp_hdiffz_buf_cache_t *get() const { return cache_; }
+
+private:
+    esp_hdiffz_buf_cache_t *cache_;
+};
+
+/**
+ * @brief Patches of old data with a diff, into any sink.
+ *
+ * Holds a decompressor instance and, after the first patch, the output
+ * buffer; both are reused by following patches and released with the
+ * session. The sources must outlive it.
+ */
+template <class Old, class Diff>
+class Session {
+public:
+    /** Output buffer size; matches the engine's default. */
+    static constexpr std::size_t buf_size = 4096;
+
+    Session(Old &old, Diff &diff) : old_(as_input(old)), diff_(as_input(diff)) {
+        esp_hdiffz_miniz_plugin_init(&plugin_);
+    }
+    ~Session() { std::free(buf_); }
+    Session(const Session &) = delete;
+    Session &operator=(const Session &) = delete;
+
+    /**
+     * Decompressor settings: cache, caps, mem_policy, mem_report and mem_limit
+     * may be changed between patches. mem_policy and mem_report also apply to
+     * the engine's buffers.
+     */
+    esp_hdiffz_miniz_plugin_t &plugin() { return plugin_; }
+    void set_cache(const BufCache &cache) { plugin_.cache = cache.get(); }
+
+    /** Per-cover accounting of the last patch. */
+    const esp_hdiffz_patch_stats_t &stats() const { return stats_; }
+
+    /** See esp_hdiffz_get_info; the header is only parsed once per session. */
+    esp_err_t info(esp_hdiffz_info_t &info) {
+        if( !have_info_ ) {
+            esp_err_t err = esp_hdiffz_get_info(&diff_, &info_);
+            if( ESP_OK != err ) return err;
+            have_info_ = true;
+        }
+        info = info_;
+        return ESP_OK;
+    }
+
+    /** See esp_hdiffz_validate. */
+    esp_err_t validate(esp_hdiffz_digest_t &digest) {
+        plugin_.dict_src = &old_;
+        esp_err_t err = esp_hdiffz_validate(&old_, &diff_, &digest);
+        plugin_.dict_src = nullptr;
+        return err;
+    }
+
+    /**
+     * @brief Write the patched data to sink, in order from offset 0.
+     * @return ESP_OK on success;
+     *     ESP_ERR_INVALID_SIZE if the old data is smaller than the diff needs;
+     *     ESP_ERR_NO_MEM if the output buffer can't be allocated;
+     *     see esp_hdiffz_get_info and esp_hdiffz_engine_patch for others.
+     */
+    template <class Sink>
+    esp_err_t patch(Sink &sink) {
+        esp_hdiffz_info_t info;
+        esp_err_t err = this->info(info);
+        if( ESP_OK != err ) return err;
+        if( info.old_size > old_.streamSize ) return ESP_ERR_INVALID_SIZE;
+
+        if( nullptr == buf_ ) {
+            buf_ = static_cast<unsigned char *>(std::malloc(buf_size));
+            if( nullptr == buf_ ) return ESP_ERR_NO_MEM;
+        }
+
+        hpatch_TStreamOutput out = as_output(sink, info.new_size);
+        esp_hdiffz_engine_cfg_t cfg = {};
+        cfg.out = &out;
+        cfg.old = &old_;
+        cfg.diff = &diff_;
+        cfg.plugin = &plugin_.base;
+        cfg.buf = buf_;
+        cfg.buf_size = buf_size;
+        cfg.align = detail::sink_align<Sink>::value;
+        cfg.stats = &stats_;
+        esp_hdiffz_mem_t mem = {};
+        mem.policy = plugin_.mem_policy;
+        mem.report = plugin_.mem_report;
+        cfg.mem = &mem;
+
+        plugin_.dict_src = &old_;
+        err = esp_hdiffz_engine_patch(&cfg);
+        plugin_.dict_src = nullptr;
+        return err;
+    }
+
+private:
+    hpatch_TStreamInput old_;
+    hpatch_TStreamInput diff_;
+    esp_hdiffz_miniz_plugin_t plugin_;
+    esp_hdiffz_patch_stats_t stats_ = {};
+    esp_hdiffz_info_t info_ = {};
+    bool have_info_ = false;
+    unsigned char *buf_ = nullptr;
+};
+
+/**
+ * @brief Patch old with diff into sink in one call.
+ */
+template <class Old, class Diff, class Sink>
+esp_err_t patch(Old &old, Diff &diff, Sink &sink) {
+    Session<Old, Diff> session(old, diff);
+    return session.patch(sink);
+}
+
+} // namespace esp_hdiffz
+
+#endif
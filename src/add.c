@@ -0,0 +1,111 @@
+/**
+ * @file add
+ * @brief SIMD-within-a-register kernels for adding diff bytes to old data.
+ *
+ * Kept free of esp-idf dependencies so the host tools build it as is.
+ */
+
+#include <string.h>
+#include "add.h"
+
+#if CONFIG_HDIFFZ_ADD_KERNEL == 64
+typedef uint64_t word_t;
+#define WORD_HIGH 0x8080808080808080ULL
+#elif CONFIG_HDIFFZ_ADD_KERNEL == 32
+typedef uint32_t word_t;
+#define WORD_HIGH 0x80808080UL
+#elif CONFIG_HDIFFZ_ADD_KERNEL != 0
+#error "CONFIG_HDIFFZ_ADD_KERNEL must be 0, 32 or 64"
+#endif
+
+#if CONFIG_HDIFFZ_ADD_KERNEL
+/**
+ * @brief Lane-wise a + b modulo 256.
+ *
+ * The low 7 bits of each lane are summed normally; the carry out of bit 6
+ * lands in bit 7 and is combined with the two high bits by xor, so nothing
+ * carries into the next lane.
+ */
+static inline word_t add_lanes(word_t a, word_t b) {
+    return ((a & ~WORD_HIGH) + (b & ~WORD_HIGH)) ^ ((a ^ b) & WORD_HIGH);
+}
+
+static inline word_t load(const unsigned char *p) {
+    word_t w;
+    memcpy(&w, p, sizeof(w));
+    return w;
+}
+
+static inline word_t load_aligned(const unsigned char *p) {
+    word_t w;
+    memcpy(&w, __builtin_assume_aligned(p, sizeof(word_t)), sizeof(w));
+    return w;
+}
+
+static inline void store_aligned(unsigned char *p, word_t w) {
+    memcpy(__builtin_assume_aligned(p, sizeof(word_t)), &w, sizeof(w));
+}
+#endif
+
+/********************
+ * PUBLIC FUNCTIONS *
+ ********************/
+
+void esp_hdiffz_add(unsigned char *dst, const unsigned char *src, size_t n) {
+#if CONFIG_HDIFFZ_ADD_KERNEL
+    /* Head; until dst is word aligned */
+    while( n > 0 && ((uintptr_t)dst & (sizeof(word_t) - 1)) ) {
+        *dst++ += *src++;
+        n--;
+    }
+
+    if( 0 == ((uintptr_t)src & (sizeof(word_t) - 1)) ) {
+        for(; n >= 2 * sizeof(word_t); n -= 2 * sizeof(word_t)) {
+            word_t d0 = load_aligned(dst), d1 = load_aligned(dst + sizeof(word_t));
+            word_t s0 = load_aligned(src), s1 = load_aligned(src + sizeof(word_t));
+            store_aligned(dst, add_lanes(d0, s0));
+            store_aligned(dst + sizeof(word_t), add_lanes(d1, s1));
+            dst += 2 * sizeof(word_t);
+            src += 2 * sizeof(word_t);
+        }
+        if( n >= sizeof(word_t) ) {
+            store_aligned(dst, add_lanes(load_aligned(dst), load_aligned(src)));
+            dst += sizeof(word_t);
+            src += sizeof(word_t);
+            n -= sizeof(word_t);
+        }
+    }
+    else {
+        /* src can't be aligned at the same time; load it piecewise */
+        for(; n >= sizeof(word_t); n -= sizeof(word_t)) {
+            store_aligned(dst, add_lanes(load_aligned(dst), load(src)));
+            dst += sizeof(word_t);
+            src += sizeof(word_t);
+        }
+    }
+#endif
+
+    /* Tail */
+    while( n-- > 0 ) *dst++ += *src++;
+}
+
+void esp_hdiffz_add_byte(unsigned char *dst, unsigned char value, size_t n) {
+#if CONFIG_HDIFFZ_ADD_KERNEL
+    word_t v = (word_t)-1 / 0xFF * value;
+
+    while( n > 0 && ((uintptr_t)dst & (sizeof(word_t) - 1)) ) {
+        *dst++ += value;
+        n--;
+    }
+    for(; n >= sizeof(word_t); n -= sizeof(word_t)) {
+        store_aligned(dst, add_lanes(load_aligned(dst), v));
+        dst += sizeof(word_t);
+    }
+#endif
+
+    while( n-- > 0 ) *dst++ += value;
+}
+
+void esp_hdiffz_add_ref(unsigned char *dst, const unsigned char *src, size_t n) {
+    for(size_t i=0; i < n; i++) dst[i] += src[i];
+}
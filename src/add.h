@@ -0,0 +1,38 @@
+#ifndef ESP_HDIFFZ_ADD_H__
+#define ESP_HDIFFZ_ADD_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Width in bits of the add kernel; 0 for the plain byte loop.
+ * Chosen in menuconfig; builds without an sdkconfig use the native
+ * register width.
+ */
+#ifndef CONFIG_HDIFFZ_ADD_KERNEL
+#if UINTPTR_MAX > 0xFFFFFFFF
+#define CONFIG_HDIFFZ_ADD_KERNEL 64
+#else
+#define CONFIG_HDIFFZ_ADD_KERNEL 32
+#endif
+#endif
+
+/**
+ * @brief dst[i] += src[i] modulo 256 for n bytes.
+ *
+ * Bytes are added CONFIG_HDIFFZ_ADD_KERNEL bits at a time without carries
+ * crossing byte lanes. dst and src may have any alignment.
+ */
+void esp_hdiffz_add(unsigned char *dst, const unsigned char *src, size_t n);
+
+/**
+ * @brief dst[i] += value modulo 256 for n bytes.
+ */
+void esp_hdiffz_add_byte(unsigned char *dst, unsigned char value, size_t n);
+
+/**
+ * @brief Byte at a time reference for esp_hdiffz_add.
+ */
+void esp_hdiffz_add_ref(unsigned char *dst, const unsigned char *src, size_t n);
+
+#endif
@@ -0,0 +1,685 @@
+//#define LOG_LOCAL_LEVEL 4
+
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_hdiffz.h"
+
+#include "esp_timer.h"
+#include "miniz.h"
+#include "rw.h"
+#include "mem.h"
+#include "pack.h"
+
+/* Smallest and largest index block; smaller blocks find shorter matches */
+#define DIFF_BLOCK_MIN 16
+#define DIFF_BLOCK_MAX 4096
+/* Shorter matches far from the last cover cost more than compressed new data */
+#define DIFF_COVER_MIN 64
+/* Matches this close to where the last cover left off are always taken */
+#define DIFF_NEAR 256
+/* Slots probed per index lookup; bounds the cost of colliding blocks */
+#define DIFF_MAX_PROBES 8
+/* Read buffer of the old and new files, and read-ahead of the new window */
+#define DIFF_FILE_BUF_SIZE 1024
+/* Write-behind buffer of the diff */
+#define DIFF_OUT_BUF_SIZE 1024
+/* Chunk in which old and new data are compared and literals are copied */
+#define DIFF_CMP_SIZE 256
+
+/* Header sizes only known at the end are written with this many bytes */
+#define SIZE_FIELD_LEN 5
+/* Multiplier of the rolling hash */
+#define HASH_MUL 0x01000193u
+
+static const char TAG[] = "esp_hdiffz_diff";
+
+/**
+ * Index entry of one block of old data.
+ */
+typedef struct slot_t {
+    uint32_t hash;
+    uint32_t block;                 /**< Block index + 1; 0 if the slot is empty */
+} slot_t;
+
+/**
+ * Range of new data equal to a range of old data.
+ */
+typedef struct cover_t {
+    uint32_t old_pos;
+    uint32_t new_pos;
+    uint32_t length;
+} cover_t;
+
+/**
+ * Diff creation state.
+ */
+typedef struct diff_t {
+    const esp_hdiffz_diff_config_t *config;
+    esp_hdiffz_diff_stats_t *stats;
+    size_t heap;                    /**< Heap in use; never above config->budget */
+    esp_hdiffz_mem_t mem;           /**< config->mem_policy and stats->mem */
+
+    esp_hdiffz_file_stream_t old_file, new_file, out_file;
+    hpatch_TStreamInput old, new;
+    hpatch_TStreamOutput out;
+    hpatch_StreamPos_t out_pos;
+
+    size_t block;                   /**< Bytes per index block */
+    uint32_t hash_out;              /**< HASH_MUL ^ (block - 1); removes the oldest byte */
+    slot_t *slots;
+    uint32_t slot_mask;
+
+    cover_t *covers;
+    uint32_t n_covers;
+    uint32_t max_covers;
+
+    unsigned char *win;             /**< New data from win_pos */
+    size_t win_size;
+    size_t win_len;
+    hpatch_StreamPos_t win_pos;
+
+    unsigned char *cmp;             /**< Two DIFF_CMP_SIZE buffers */
+
+    tdefl_compressor *tdefl;        /**< NULL if the sections are stored raw */
+    size_t chunk_left;              /**< Input the current zlib stream still takes; 0 if none open */
+    unsigned char zhead[2];         /**< zlib header of the current stream */
+    uint8_t zhead_len;
+    size_t sec_size;                /**< Bytes written of the current section */
+    bool out_failed;
+} diff_t;
+
+/**************
+ * PROTOTYPES *
+ **************/
+static void *diff_alloc(diff_t *d, esp_hdiffz_mem_class_t cls, size_t size);
+static size_t index_size(size_t block, size_t old_size, size_t new_size, uint32_t *n_slots, uint32_t *max_covers);
+static esp_err_t index_build(diff_t *d);
+static const slot_t *index_find(const diff_t *d, uint32_t hash);
+static uint32_t hash_block(const unsigned char *data, size_t n);
+static bool win_fill(diff_t *d, hpatch_StreamPos_t pos, size_t n);
+static bool match(diff_t *d, hpatch_StreamPos_t last_end, hpatch_StreamPos_t *new_pos, uint32_t old_pos);
+static esp_err_t find_covers(diff_t *d);
+static bool out_write(diff_t *d, const void *data, size_t n);
+static int tdefl_put(const void *buf, int len, void *user);
+static bool sec_put(diff_t *d, const void *data, size_t n);
+static bool sec_end(diff_t *d);
+static void pack_uint_fixed(unsigned char *buf, uint64_t v);
+static esp_err_t write_diff(diff_t *d);
+
+/********************
+ * PUBLIC FUNCTIONS *
+ ********************/
+
+esp_err_t esp_hdiffz_diff_file(FILE *old, FILE *new_file, FILE *out, size_t budget) {
+    esp_hdiffz_diff_config_t config = ESP_HDIFFZ_DIFF_CONFIG_DEFAULT();
+
+    config.budget = budget;
+    return esp_hdiffz_diff_file_adv(old, new_file, out, &config, NULL);
+}
+
+esp_err_t esp_hdiffz_diff_file_adv(FILE *old, FILE *new_file, FILE *out,
+        const esp_hdiffz_diff_config_t *config, esp_hdiffz_diff_stats_t *stats) {
+    esp_err_t err;
+    diff_t d = { 0 };
+    esp_hdiffz_diff_stats_t local_stats;
+    int64_t t_start = esp_timer_get_time();
+    size_t need;
+    uint32_t n_slots = 0;
+
+    if( NULL == stats ) stats = &local_stats;
+    memset(stats, 0, sizeof(esp_hdiffz_diff_stats_t));
+    d.config = config;
+    d.stats = stats;
+    d.mem.policy = config->mem_policy;
+    d.mem.report = &stats->mem;
+
+    if( config->window_bits < 9 || config->window_bits > 15 ) {
+        ESP_LOGE(TAG, "Window bits must be in range [9, 15]");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    /* The file buffers are needed at any block size */
+    d.heap = 2 * DIFF_FILE_BUF_SIZE + DIFF_OUT_BUF_SIZE;
+    if( d.heap > config->budget ) {
+        err = ESP_ERR_NO_MEM;
+        goto exit;
+    }
+
+    err = esp_hdiffz_file_stream_init_adv(&d.old_file, old, DIFF_FILE_BUF_SIZE, 1, &d.mem);
+    if( ESP_OK != err ) goto exit;
+    err = esp_hdiffz_file_stream_init_adv(&d.new_file, new_file, DIFF_FILE_BUF_SIZE, 1, &d.mem);
+    if( ESP_OK != err ) goto exit;
+    err = esp_hdiffz_file_stream_init_adv(&d.out_file, out, DIFF_OUT_BUF_SIZE, 1, &d.mem);
+    if( ESP_OK != err ) goto exit;
+    esp_hdiffz_file_stream_as_input(&d.old_file, &d.old);
+    esp_hdiffz_file_stream_as_input(&d.new_file, &d.new);
+    esp_hdiffz_file_stream_as_output(&d.out_file, &d.out, UINT32_MAX);
+    if( d.old.streamSize > UINT32_MAX || d.new.streamSize > UINT32_MAX ) {
+        err = ESP_ERR_INVALID_SIZE;
+        goto exit;
+    }
+
+    d.cmp = diff_alloc(&d, ESP_HDIFFZ_MEM_IO, 2 * DIFF_CMP_SIZE);
+    if( NULL == d.cmp ) {
+        err = ESP_ERR_NO_MEM;
+        goto exit;
+    }
+
+    /* The compressor comes first, as long as the coarsest index still fits */
+    if( d.heap + sizeof(tdefl_compressor) + index_size(DIFF_BLOCK_MAX,
+                d.old.streamSize, d.new.streamSize, NULL, NULL) <= config->budget ) {
+        d.tdefl = diff_alloc(&d, ESP_HDIFFZ_MEM_STATE, sizeof(tdefl_compressor));
+    }
+    if( NULL == d.tdefl ) {
+        ESP_LOGW(TAG, "No room for the %d byte compressor; sections are stored raw",
+                (int)sizeof(tdefl_compressor));
+    }
+
+    /* Finest index that fits the rest of the budget */
+    for(d.block = DIFF_BLOCK_MIN; d.block <= DIFF_BLOCK_MAX; d.block *= 2) {
+        need = index_size(d.block, d.old.streamSize, d.new.streamSize, &n_slots, &d.max_covers);
+        if( d.heap + need <= config->budget ) break;
+    }
+    if( d.block > DIFF_BLOCK_MAX ) {
+        ESP_LOGE(TAG, "A %d byte budget can't index %d bytes of old data",
+                (int)config->budget, (int)d.old.streamSize);
+        err = ESP_ERR_NO_MEM;
+        goto exit;
+    }
+
+    d.win_size = d.block + DIFF_FILE_BUF_SIZE;
+    d.win = diff_alloc(&d, ESP_HDIFFZ_MEM_IO, d.win_size);
+    d.covers = diff_alloc(&d, ESP_HDIFFZ_MEM_CACHE, d.max_covers * sizeof(cover_t));
+    if( n_slots > 0 ) {
+        d.slots = diff_alloc(&d, ESP_HDIFFZ_MEM_CACHE, n_slots * sizeof(slot_t));
+        d.slot_mask = n_slots - 1;
+    }
+    if( NULL == d.win || NULL == d.covers || (n_slots > 0 && NULL == d.slots) ) {
+        err = ESP_ERR_NO_MEM;
+        goto exit;
+    }
+    stats->block_size = d.block;
+    stats->index_heap = n_slots * sizeof(slot_t);
+
+    err = index_build(&d);
+    if( ESP_OK != err ) goto exit;
+
+    err = find_covers(&d);
+    if( ESP_OK != err ) goto exit;
+
+    err = write_diff(&d);
+    if( ESP_OK != err ) goto exit;
+
+exit:
+    if( ESP_OK != esp_hdiffz_file_stream_deinit(&d.out_file) && ESP_OK == err ) err = ESP_FAIL;
+    esp_hdiffz_file_stream_deinit(&d.new_file);
+    esp_hdiffz_file_stream_deinit(&d.old_file);
+    stats->heap = d.heap;
+    free(d.slots);
+    free(d.covers);
+    free(d.win);
+    free(d.tdefl);
+    free(d.cmp);
+    stats->time_us = esp_timer_get_time() - t_start;
+    if( ESP_OK == err ) {
+        ESP_LOGI(TAG, "%d byte diff with %d covers (%d byte blocks) in %d ms",
+                (int)stats->diff_size, stats->n_covers, (int)stats->block_size,
+                (int)(stats->time_us / 1000));
+    }
+    return err;
+}
+
+/*********************
+ * PRIVATE FUNCTIONS *
+ *********************/
+
+/**
+ * @brief Allocate size bytes of the budget.
+ * @return Pointer on success; NULL if the budget or the heap is exhausted.
+ */
+static void *diff_alloc(diff_t *d, esp_hdiffz_mem_class_t cls, size_t size) {
+    void *ptr;
+
+    if( d->heap + size > d->config->budget ) return NULL;
+    ptr = esp_hdiffz_mem_alloc(&d->mem, cls, size);
+    if( NULL != ptr ) d->heap += size;
+    return ptr;
+}
+
+/**
+ * @brief Heap of the index, cover list and new data window at a block size.
+ * @param[out] n_slots Power of two number of index slots. May be NULL.
+ * @param[out] max_covers Most covers new data can hold. May be NULL.
+ */
+static size_t index_size(size_t block, size_t old_size, size_t new_size, uint32_t *n_slots, uint32_t *max_covers) {
+    size_t n_blocks = old_size / block;
+    uint32_t slots = 0, covers;
+
+    /* Keep the table at most two thirds full */
+    if( n_blocks > 0 ) {
+        slots = 1;
+        while( slots < n_blocks + n_blocks / 2 ) slots *= 2;
+    }
+    /* Every cover holds a whole block of new data */
+    covers = new_size / block + 1;
+
+    if( NULL != n_slots ) *n_slots = slots;
+    if( NULL != max_covers ) *max_covers = covers;
+    return slots * sizeof(slot_t) + covers * sizeof(cover_t) + block + DIFF_FILE_BUF_SIZE;
+}
+
+/**
+ * @brief Spread a block hash over the index.
+ */
+static inline uint32_t slot_of(const diff_t *d, uint32_t hash) {
+    return (hash * 0x9E3779B1u) >> 7 & d->slot_mask;
+}
+
+/**
+ * @brief Hash every whole block of old data into the index.
+ *
+ * Of blocks with the same hash, only the first is kept.
+ */
+static esp_err_t index_build(diff_t *d) {
+    size_t n_blocks = d->old.streamSize / d->block;
+
+    if( NULL == d->slots ) return ESP_OK;
+    memset(d->slots, 0, (d->slot_mask + 1) * sizeof(slot_t));
+
+    for(size_t i=0; i < n_blocks; i++) {
+        uint32_t hash, s;
+
+        if( !d->old.read(&d->old, i * d->block, d->win, d->win + d->block) ) {
+            ESP_LOGE(TAG, "Failed to read old data");
+            return ESP_FAIL;
+        }
+        hash = hash_block(d->win, d->block);
+        for(s = slot_of(d, hash); 0 != d->slots[s].block; s = (s + 1) & d->slot_mask) {
+            if( d->slots[s].hash == hash ) break;
+        }
+        if( 0 == d->slots[s].block ) {
+            d->slots[s].hash = hash;
+            d->slots[s].block = i + 1;
+        }
+    }
+
+    /* The rolling hash removes the oldest byte with this factor */
+    d->hash_out = 1;
+    for(size_t i=1; i < d->block; i++) d->hash_out *= HASH_MUL;
+
+    return ESP_OK;
+}
+
+/**
+ * @brief Index slot with the hash; NULL if there is none.
+ */
+static const slot_t *index_find(const diff_t *d, uint32_t hash) {
+    uint32_t s = slot_of(d, hash);
+
+    for(int i=0; i < DIFF_MAX_PROBES && 0 != d->slots[s].block; i++) {
+        if( d->slots[s].hash == hash ) return &d->slots[s];
+        s = (s + 1) & d->slot_mask;
+    }
+    return NULL;
+}
+
+static uint32_t hash_block(const unsigned char *data, size_t n) {
+    uint32_t hash = 0;
+
+    for(size_t i=0; i < n; i++) hash = hash * HASH_MUL + data[i];
+    return hash;
+}
+
+/**
+ * @brief Make new data [pos, pos + n) available in the window.
+ * @return False on a read error.
+ */
+static bool win_fill(diff_t *d, hpatch_StreamPos_t pos, size_t n) {
+    size_t keep, len;
+
+    if( pos >= d->win_pos && pos + n <= d->win_pos + d->win_len ) return true;
+
+    /* Keep what is still ahead of pos and read up to a full window */
+    keep = 0;
+    if( pos >= d->win_pos && pos < d->win_pos + d->win_len ) {
+        keep = d->win_pos + d->win_len - pos;
+        memmove(d->win, &d->win[pos - d->win_pos], keep);
+    }
+    len = d->win_size;
+    if( len > d->new.streamSize - pos ) len = d->new.streamSize - pos;
+    if( len > keep && !d->new.read(&d->new, pos + keep, &d->win[keep], &d->win[len]) ) return false;
+    d->win_pos = pos;
+    d->win_len = len;
+    return n <= len;
+}
+
+/**
+ * @brief Check a candidate block and grow it into a cover.
+ *
+ * The block at old_pos must equal new data at *new_pos; the cover is then
+ * extended forward, and backward down to last_end.
+ *
+ * @param[in,out] new_pos Start of the candidate; the end of the cover if one is added.
+ * @return True if a cover was added.
+ */
+static bool match(diff_t *d, hpatch_StreamPos_t last_end, hpatch_StreamPos_t *new_pos, uint32_t old_pos) {
+    unsigned char *a = d->cmp, *b = d->cmp + DIFF_CMP_SIZE;
+    hpatch_StreamPos_t n_pos = *new_pos, o_pos = old_pos, end;
+    size_t length = d->block;
+    cover_t *cover;
+
+    if( d->n_covers == d->max_covers ) return false;
+
+    /* Compare the block in chunks against the window */
+    for(size_t i=0; i < d->block; i += DIFF_CMP_SIZE) {
+        size_t k = d->block - i < DIFF_CMP_SIZE ? d->block - i : DIFF_CMP_SIZE;
+        if( !d->old.read(&d->old, old_pos + i, a, a + k) ) return false;
+        if( 0 != memcmp(a, &d->win[n_pos + i - d->win_pos], k) ) return false;
+    }
+
+    /* Forward */
+    end = d->new.streamSize - n_pos;
+    if( end > d->old.streamSize - o_pos ) end = d->old.streamSize - o_pos;
+    while( length < end ) {
+        size_t k = end - length < DIFF_CMP_SIZE ? end - length : DIFF_CMP_SIZE;
+        size_t j = 0;
+
+        if( !d->old.read(&d->old, o_pos + length, a, a + k)
+                || !d->new.read(&d->new, n_pos + length, b, b + k) ) return false;
+        while( j < k && a[j] == b[j] ) j++;
+        length += j;
+        if( j < k ) break;
+    }
+
+    /* Backward, into the literals since the last cover */
+    while( n_pos > last_end && o_pos > 0 ) {
+        size_t k = n_pos - last_end;
+        size_t j = 0;
+
+        if( k > o_pos ) k = o_pos;
+        if( k > DIFF_CMP_SIZE ) k = DIFF_CMP_SIZE;
+        if( !d->old.read(&d->old, o_pos - k, a, a + k)
+                || !d->new.read(&d->new, n_pos - k, b, b + k) ) return false;
+        while( j < k && a[k - 1 - j] == b[k - 1 - j] ) j++;
+        n_pos -= j;
+        o_pos -= j;
+        length += j;
+        if( j < k ) break;
+    }
+
+    /* Repetitive data matches in many places; only take short matches that
+     * continue the last cover, which are also the cheapest to encode */
+    if( length < DIFF_COVER_MIN ) {
+        hpatch_StreamPos_t expect = n_pos;
+        if( d->n_covers > 0 ) {
+            const cover_t *last = &d->covers[d->n_covers - 1];
+            expect = last->old_pos + last->length + (n_pos - last_end);
+        }
+        if( o_pos + DIFF_NEAR < expect || o_pos > expect + DIFF_NEAR ) return false;
+    }
+
+    cover = &d->covers[d->n_covers++];
+    cover->old_pos = o_pos;
+    cover->new_pos = n_pos;
+    cover->length = length;
+    d->stats->n_covers++;
+    d->stats->cover_bytes += length;
+
+    *new_pos = n_pos + length;
+    return true;
+}
+
+/**
+ * @brief Slide a block-sized window over the new data and look each position up.
+ */
+static esp_err_t find_covers(diff_t *d) {
+    hpatch_StreamPos_t pos = 0, last_end = 0;
+    uint32_t hash = 0;
+    bool fresh = true;
+
+    if( NULL == d->slots ) return ESP_OK;
+
+    while( pos + d->block <= d->new.streamSize ) {
+        const slot_t *slot;
+        unsigned char *w;
+
+        /* One byte past the block, to roll the hash */
+        if( !win_fill(d, pos, d->block) ) goto read_fail;
+        w = &d->win[pos - d->win_pos];
+
+        if( fresh ) {
+            hash = hash_block(w, d->block);
+            fresh = false;
+        }
+
+        slot = index_find(d, hash);
+        if( NULL != slot ) {
+            hpatch_StreamPos_t end = pos;
+            /* Data tends to continue where the last cover left off; repeated
+             * blocks would otherwise all lead to their first occurrence */
+            if( d->n_covers > 0 ) {
+                const cover_t *last = &d->covers[d->n_covers - 1];
+                hpatch_StreamPos_t diag = last->old_pos + last->length + (pos - last_end);
+                if( diag + d->block <= d->old.streamSize && match(d, last_end, &end, diag) ) {
+                    last_end = pos = end;
+                    fresh = true;
+                    continue;
+                }
+            }
+            if( match(d, last_end, &end, (slot->block - 1) * d->block) ) {
+                last_end = pos = end;
+                fresh = true;
+                continue;
+            }
+            if( d->n_covers == d->max_covers ) break;
+        }
+
+        if( pos + d->block == d->new.streamSize ) break;
+        if( !win_fill(d, pos, d->block + 1) ) goto read_fail;
+        w = &d->win[pos - d->win_pos];
+        hash = (hash - w[0] * d->hash_out) * HASH_MUL + w[d->block];
+        pos++;
+    }
+    return ESP_OK;
+
+read_fail:
+    ESP_LOGE(TAG, "Failed to read new data");
+    return ESP_FAIL;
+}
+
+/**
+ * @brief Append to the diff.
+ */
+static bool out_write(diff_t *d, const void *data, size_t n) {
+    const unsigned char *p = data;
+
+    if( d->out_failed ) return false;
+    if( n > 0 && !d->out.write(&d->out, d->out_pos, p, p + n) ) {
+        ESP_LOGE(TAG, "Failed to write the diff");
+        d->out_failed = true;
+        return false;
+    }
+    d->out_pos += n;
+    d->sec_size += n;
+    return true;
+}
+
+/**
+ * @brief tdefl output callback.
+ *
+ * tdefl always declares a 32 KB window in the zlib header; it is replaced by
+ * the node's, which the stream length keeps every match within.
+ */
+static int tdefl_put(const void *buf, int len, void *user) {
+    diff_t *d = user;
+    const unsigned char *p = buf;
+
+    while( len > 0 && d->zhead_len < sizeof(d->zhead) ) {
+        d->zhead[d->zhead_len++] = *p++;
+        len--;
+        if( sizeof(d->zhead) == d->zhead_len ) {
+            unsigned check;
+            d->zhead[0] = (d->config->window_bits - 8) << 4 | (d->zhead[0] & 0x0f);
+            d->zhead[1] &= 0xe0;
+            check = (d->zhead[0] << 8 | d->zhead[1]) % 31;
+            if( check ) d->zhead[1] += 31 - check;
+            if( !out_write(d, d->zhead, sizeof(d->zhead)) ) return 0;
+        }
+    }
+    return out_write(d, p, len);
+}
+
+/**
+ * @brief Append raw section data, compressing it if there is a compressor.
+ *
+ * Compressed data is cut into zlib streams of 1 << window_bits bytes, so no
+ * back reference reaches further than the window the node declares.
+ */
+static bool sec_put(diff_t *d, const void *data, size_t n) {
+    const unsigned char *p = data;
+
+    if( NULL == d->tdefl ) return out_write(d, p, n);
+
+    while( n > 0 ) {
+        size_t k;
+        tdefl_status status;
+
+        if( 0 == d->chunk_left ) {
+            int flags = tdefl_create_comp_flags_from_zip_params(d->config->level, 15, MZ_DEFAULT_STRATEGY);
+            if( TDEFL_STATUS_OKAY != tdefl_init(d->tdefl, tdefl_put, d, flags) ) return false;
+            d->zhead_len = 0;
+            d->chunk_left = (size_t)1 << d->config->window_bits;
+        }
+        k = n < d->chunk_left ? n : d->chunk_left;
+        d->chunk_left -= k;
+        status = tdefl_compress_buffer(d->tdefl, p, k, 0 == d->chunk_left ? TDEFL_FINISH : TDEFL_NO_FLUSH);
+        if( status < TDEFL_STATUS_OKAY || d->out_failed ) return false;
+        p += k;
+        n -= k;
+    }
+    return true;
+}
+
+/**
+ * @brief Finish the zlib stream of the section, if one is open.
+ */
+static bool sec_end(diff_t *d) {
+    if( NULL == d->tdefl || 0 == d->chunk_left ) return !d->out_failed;
+    d->chunk_left = 0;
+    return TDEFL_STATUS_DONE == tdefl_compress_buffer(d->tdefl, NULL, 0, TDEFL_FINISH) && !d->out_failed;
+}
+
+/**
+ * @brief Encode a packed uint in exactly SIZE_FIELD_LEN bytes.
+ *
+ * Leading groups are zero, which decoders read like any other group.
+ */
+static void pack_uint_fixed(unsigned char *buf, uint64_t v) {
+    for(int i=SIZE_FIELD_LEN - 1; i >= 0; i--) {
+        buf[i] = (v & 0x7f) | (i < SIZE_FIELD_LEN - 1 ? 0x80 : 0);
+        v >>= 7;
+    }
+}
+
+/**
+ * @brief Write the header and the cover and new data sections.
+ *
+ * The covers reproduce old data exactly, so the deltas are all zero: the
+ * RLE control stream is one zero run over the whole new data (patchers skip
+ * it between covers) and the RLE code stream is empty. Compressed section
+ * sizes are filled into the header once known.
+ */
+static esp_err_t write_diff(diff_t *d) {
+    unsigned char head[sizeof(ESP_HDIFFZ_DIFFZ_MAGIC) + 8 + ESP_HDIFFZ_PACKED_UINT_MAX * 9 + 2 * SIZE_FIELD_LEN];
+    unsigned char rle_ctrl[ESP_HDIFFZ_PACKED_UINT_MAX];
+    unsigned char *p = head, *a = d->cmp;
+    hpatch_StreamPos_t cover_field, diff_field, last_old = 0, last_new = 0;
+    size_t cover_raw = 0, cover_size, literal_size, rle_size = 0;
+    const char *compress_type = NULL != d->tdefl ? "zlib" : "";
+
+    for(uint32_t i=0; i < d->n_covers; i++) {
+        const cover_t *c = &d->covers[i];
+        bool back = c->old_pos < last_old;
+        cover_raw += esp_hdiffz_pack_uint(a, back ? last_old - c->old_pos : c->old_pos - last_old, 1, back);
+        cover_raw += esp_hdiffz_pack_uint(a, c->new_pos - last_new, 0, 0);
+        cover_raw += esp_hdiffz_pack_uint(a, c->length, 0, 0);
+        last_old = c->old_pos + c->length;
+        last_new = c->new_pos + c->length;
+    }
+    literal_size = d->new.streamSize - d->stats->cover_bytes;
+    if( d->new.streamSize > 0 ) rle_size = esp_hdiffz_pack_uint(rle_ctrl, d->new.streamSize - 1, 2, 0);
+
+    memcpy(p, ESP_HDIFFZ_DIFFZ_MAGIC, strlen(ESP_HDIFFZ_DIFFZ_MAGIC));
+    p += strlen(ESP_HDIFFZ_DIFFZ_MAGIC);
+    memcpy(p, compress_type, strlen(compress_type) + 1);
+    p += strlen(compress_type) + 1;
+    p += esp_hdiffz_pack_uint(p, d->new.streamSize, 0, 0);
+    p += esp_hdiffz_pack_uint(p, d->old.streamSize, 0, 0);
+    p += esp_hdiffz_pack_uint(p, d->n_covers, 0, 0);
+    p += esp_hdiffz_pack_uint(p, cover_raw, 0, 0);
+    cover_field = p - head;
+    p += SIZE_FIELD_LEN;
+    p += esp_hdiffz_pack_uint(p, rle_size, 0, 0);  /* rle_ctrl, stored */
+    *p++ = 0;
+    *p++ = 0;                           /* Empty rle_code */
+    *p++ = 0;
+    p += esp_hdiffz_pack_uint(p, literal_size, 0, 0);
+    diff_field = p - head;
+    p += SIZE_FIELD_LEN;
+    memset(&head[cover_field], 0, SIZE_FIELD_LEN);
+    memset(&head[diff_field], 0, SIZE_FIELD_LEN);
+    if( !out_write(d, head, p - head) ) return ESP_FAIL;
+
+    /* Covers */
+    d->sec_size = 0;
+    if( NULL != d->tdefl && cover_raw > 0 && !out_write(d, &d->config->window_bits, 1) ) return ESP_FAIL;
+    last_old = last_new = 0;
+    for(uint32_t i=0; i < d->n_covers; i++) {
+        const cover_t *c = &d->covers[i];
+        bool back = c->old_pos < last_old;
+        size_t n;
+        n = esp_hdiffz_pack_uint(a, back ? last_old - c->old_pos : c->old_pos - last_old, 1, back);
+        n += esp_hdiffz_pack_uint(&a[n], c->new_pos - last_new, 0, 0);
+        n += esp_hdiffz_pack_uint(&a[n], c->length, 0, 0);
+        if( !sec_put(d, a, n) ) return ESP_FAIL;
+        last_old = c->old_pos + c->length;
+        last_new = c->new_pos + c->length;
+    }
+    if( !sec_end(d) ) return ESP_FAIL;
+    cover_size = NULL != d->tdefl && cover_raw > 0 ? d->sec_size : 0;
+
+    /* Deltas */
+    if( !out_write(d, rle_ctrl, rle_size) ) return ESP_FAIL;
+
+    /* Literals; the new data between covers */
+    d->sec_size = 0;
+    if( NULL != d->tdefl && literal_size > 0 && !out_write(d, &d->config->window_bits, 1) ) return ESP_FAIL;
+    last_new = 0;
+    for(uint32_t i=0; i <= d->n_covers; i++) {
+        hpatch_StreamPos_t end = i < d->n_covers ? d->covers[i].new_pos : d->new.streamSize;
+
+        while( last_new < end ) {
+            size_t k = end - last_new < DIFF_CMP_SIZE ? end - last_new : DIFF_CMP_SIZE;
+            if( !d->new.read(&d->new, last_new, a, a + k) ) {
+                ESP_LOGE(TAG, "Failed to read new data");
+                return ESP_FAIL;
+            }
+            if( !sec_put(d, a, k) ) return ESP_FAIL;
+            last_new += k;
+        }
+        if( i < d->n_covers ) last_new += d->covers[i].length;
+    }
+    if( !sec_end(d) ) return ESP_FAIL;
+    literal_size = NULL != d->tdefl && literal_size > 0 ? d->sec_size : 0;
+    d->stats->diff_size = d->out_pos;
+
+    /* Compressed sizes */
+    pack_uint_fixed(a, cover_size);
+    if( !d->out.write(&d->out, cover_field, a, a + SIZE_FIELD_LEN) ) return ESP_FAIL;
+    pack_uint_fixed(a, literal_size);
+    if( !d->out.write(&d->out, diff_field, a, a + SIZE_FIELD_LEN) ) return ESP_FAIL;
+
+    d->stats->compressed = NULL != d->tdefl;
+    return ESP_OK;
+}
@@ -0,0 +1,640 @@
+/**
+ * @file engine
+ * @brief Cover-level decoder for HDiffPatch compressed diffs.
+ *
+ * Equivalent to patch_decompress, but walks the covers itself so that
+ * unchanged old data can bypass the add step.
+ */
+
+//#define LOG_LOCAL_LEVEL 4
+
+#include "esp_log.h"
+#include "esp_hdiffz.h"
+
+#include "esp_system.h"
+#include "engine.h"
+#include "add.h"
+#include "mem.h"
+#include "profile.h"
+#include "trace.h"
+
+/* Output buffer; bulk copies move this much at a time */
+#define ENGINE_BUF_SIZE 4096
+/* Read buffer of each diff section */
+#define ENGINE_SEC_BUF_SIZE 256
+/* Shorter zero-delta runs aren't worth a separate copy */
+#define ENGINE_COPY_MIN 512
+/* Covers decoded ahead of use, so their old data can be hinted early */
+#define ENGINE_LOOKAHEAD 8
+
+static const char TAG[] = "esp_hdiffz_engine";
+
+/**
+ * RLE control types
+ */
+enum {
+    RLE_ZERO = 0,       /**< Old data copied unchanged */
+    RLE_FF,             /**< 0xFF added to old data */
+    RLE_BYTE,           /**< One code byte added to a run of old data */
+    RLE_RAW,            /**< One code byte added per old byte */
+};
+
+/**
+ * Sequential reader over one diff section, raw or compressed.
+ */
+typedef struct sec_t {
+    const hpatch_TStreamInput *diff;
+    hpatch_TDecompress *plugin;
+    hpatch_decompressHandle dec;       /**< NULL if the section is stored raw */
+    hpatch_StreamPos_t pos;            /**< Raw only: next offset in diff */
+    hpatch_StreamPos_t left;           /**< Bytes not yet pulled into buf */
+    unsigned char *buf;
+    size_t buf_pos;
+    size_t buf_len;
+} sec_t;
+
+/**
+ * Decoder state of the RLE delta stream.
+ */
+typedef struct rle_t {
+    sec_t ctrl;
+    sec_t code;
+    uint8_t type;
+    unsigned char value;               /**< RLE_BYTE only */
+    hpatch_StreamPos_t left;           /**< Bytes remaining in the current run */
+} rle_t;
+
+/**
+ * One cover; old_pos..old_pos+length is added to the delta at new_pos.
+ */
+typedef struct cover_t {
+    hpatch_StreamPos_t old_pos;
+    hpatch_StreamPos_t new_pos;
+    hpatch_StreamPos_t length;
+} cover_t;
+
+/**
+ * Cover decoder with a window of decoded covers not yet applied.
+ */
+typedef struct covers_t {
+    sec_t sec;
+    const esp_hdiffz_head_t *head;
+    hpatch_StreamPos_t n_left;         /**< Covers not yet decoded */
+    hpatch_StreamPos_t last_old_end;
+    hpatch_StreamPos_t last_new_end;
+    void (*hint)(void *ctx, hpatch_StreamPos_t old_pos, hpatch_StreamPos_t len);
+    void *hint_ctx;
+    cover_t ring[ENGINE_LOOKAHEAD];
+    uint8_t ring_head;
+    uint8_t ring_len;
+} covers_t;
+
+/**
+ * In-order writer of the patched data.
+ */
+typedef struct out_t {
+    const hpatch_TStreamOutput *stream;
+    hpatch_StreamPos_t pos;            /**< New data position of buf[0] */
+    unsigned char *buf;
+    size_t buf_size;
+    size_t len;
+} out_t;
+
+/**************
+ * PROTOTYPES *
+ **************/
+static bool sec_open(sec_t *sec, const esp_hdiffz_head_t *head, uint8_t i,
+        const hpatch_TStreamInput *diff, hpatch_TDecompress *plugin, unsigned char *buf);
+static void sec_close(sec_t *sec);
+static bool sec_pull(sec_t *sec, unsigned char *dst, size_t n);
+static bool sec_fill(sec_t *sec);
+static bool sec_read(sec_t *sec, unsigned char *dst, size_t n);
+ESP_HDIFFZ_HOT bool sec_byte(sec_t *sec, unsigned char *byte);
+static bool sec_skip(sec_t *sec, hpatch_StreamPos_t n);
+static bool sec_add(sec_t *sec, unsigned char *dst, size_t n);
+static bool sec_uint(sec_t *sec, uint8_t tag_bits, uint8_t *tag, hpatch_StreamPos_t *value);
+static bool sec_done(const sec_t *sec);
+static bool covers_pop(covers_t *covers, cover_t *cover);
+static bool rle_next(rle_t *rle);
+static bool rle_skip(rle_t *rle, hpatch_StreamPos_t n);
+static bool rle_add(rle_t *rle, unsigned char *dst, size_t n);
+static bool out_flush(out_t *out);
+static bool out_diff(out_t *out, sec_t *new_diff, hpatch_StreamPos_t n);
+static bool out_cover(out_t *out, rle_t *rle, const hpatch_TStreamInput *old,
+        hpatch_StreamPos_t old_pos, size_t n);
+static bool out_copy(out_t *out, const hpatch_TStreamInput *old,
+        hpatch_StreamPos_t old_pos, hpatch_StreamPos_t n, size_t align);
+
+/********************
+ * PUBLIC FUNCTIONS *
+ ********************/
+
+esp_err_t esp_hdiffz_engine_patch(const esp_hdiffz_engine_cfg_t *cfg) {
+    esp_err_t err = ESP_FAIL;
+    esp_hdiffz_head_t head;
+    esp_hdiffz_patch_stats_t stats = { 0 };
+    covers_t covers = { 0 };
+    sec_t new_diff = { 0 };
+    rle_t rle = { 0 };
+    out_t out = { 0 };
+    unsigned char *sec_bufs = NULL, *own_buf = NULL;
+    hpatch_StreamPos_t last_new_end = 0;
+    size_t copy_min = cfg->copy_min ? cfg->copy_min : ENGINE_COPY_MIN;
+
+    err = esp_hdiffz_read_head(cfg->diff, &head);
+    if( ESP_OK != err ) goto exit;
+    err = ESP_FAIL;
+
+    for(uint8_t i=0; i < ESP_HDIFFZ_SEC_N; i++) {
+        if( 0 == head.sec[i].compress_size ) continue;
+        if( NULL == cfg->plugin || !cfg->plugin->is_can_open(head.compress_type) ) {
+            ESP_LOGE(TAG, "No decompressor for \"%s\"", head.compress_type);
+            err = ESP_ERR_NOT_SUPPORTED;
+            goto exit;
+        }
+        break;
+    }
+    if( head.old_size > cfg->old->streamSize || head.new_size > cfg->out->streamSize ) {
+        ESP_LOGE(TAG, "Streams too small for diff");
+        err = ESP_ERR_INVALID_SIZE;
+        goto exit;
+    }
+
+    /* Buffers */
+    out.stream = cfg->out;
+    out.buf = cfg->buf;
+    out.buf_size = cfg->buf_size ? cfg->buf_size : ENGINE_BUF_SIZE;
+    if( NULL == out.buf ) {
+        own_buf = esp_hdiffz_mem_alloc(cfg->mem, ESP_HDIFFZ_MEM_IO, out.buf_size);
+        out.buf = own_buf;
+    }
+    sec_bufs = esp_hdiffz_mem_alloc(cfg->mem, ESP_HDIFFZ_MEM_IO, ESP_HDIFFZ_SEC_N * ENGINE_SEC_BUF_SIZE);
+    if( NULL == out.buf || NULL == sec_bufs ) {
+        ESP_LOGE(TAG, "OOM");
+        err = ESP_ERR_NO_MEM;
+        goto exit;
+    }
+
+#define SEC_BUF(i) (sec_bufs + (i) * ENGINE_SEC_BUF_SIZE)
+    if( !sec_open(&covers.sec, &head, ESP_HDIFFZ_SEC_COVER, cfg->diff, cfg->plugin, SEC_BUF(0))
+            || !sec_open(&rle.ctrl, &head, ESP_HDIFFZ_SEC_RLE_CTRL, cfg->diff, cfg->plugin, SEC_BUF(1))
+            || !sec_open(&rle.code, &head, ESP_HDIFFZ_SEC_RLE_CODE, cfg->diff, cfg->plugin, SEC_BUF(2))
+            || !sec_open(&new_diff, &head, ESP_HDIFFZ_SEC_NEW_DIFF, cfg->diff, cfg->plugin, SEC_BUF(3)) ) {
+        ESP_LOGE(TAG, "Failed to open diff sections");
+        goto exit;
+    }
+#undef SEC_BUF
+    covers.head = &head;
+    covers.n_left = head.cover_count;
+    covers.hint = cfg->hint;
+    covers.hint_ctx = cfg->hint_ctx;
+
+    stats.n_covers = head.cover_count;
+    for(hpatch_StreamPos_t i=0; i < head.cover_count; i++) {
+        cover_t cover;
+        hpatch_StreamPos_t length, old_pos, new_pos, copied = 0;
+
+        if( !covers_pop(&covers, &cover) ) goto exit;
+        old_pos = cover.old_pos;
+        new_pos = cover.new_pos;
+        length = cover.length;
+
+        /* New data between covers comes straight from the diff */
+        if( !out_diff(&out, &new_diff, new_pos - last_new_end)
+                || !rle_skip(&rle, new_pos - last_new_end) ) goto exit;
+        stats.diff_bytes += new_pos - last_new_end;
+
+        for(hpatch_StreamPos_t done = 0; done < length; ) {
+            hpatch_StreamPos_t n = length - done;
+
+            if( !rle_next(&rle) ) goto exit;
+            if( RLE_ZERO == rle.type && rle.left >= copy_min && n >= copy_min ) {
+                /* Unchanged old data; no add step */
+                if( n > rle.left ) n = rle.left;
+                if( !out_copy(&out, cfg->old, old_pos + done, n, cfg->align)
+                        || !rle_skip(&rle, n) ) goto exit;
+                copied += n;
+            }
+            else {
+                /* Stop soon after this run so a following long zero run
+                 * can still take the copy path */
+                hpatch_StreamPos_t lookahead = rle.left > copy_min ? rle.left : copy_min;
+                if( n > lookahead ) n = lookahead;
+                if( out.len == out.buf_size && !out_flush(&out) ) goto exit;
+                if( n > out.buf_size - out.len ) n = out.buf_size - out.len;
+                if( !out_cover(&out, &rle, cfg->old, old_pos + done, n) ) goto exit;
+            }
+            done += n;
+        }
+
+        if( NULL != cfg->cover ) cfg->cover(cfg->cover_ctx, old_pos, new_pos, length);
+        stats.cover_bytes += length;
+        stats.copy_bytes += copied;
+        if( length > 0 && copied == length ) stats.n_copy_covers++;
+
+        last_new_end = new_pos + length;
+    }
+
+    /* Trailing new data */
+    if( !out_diff(&out, &new_diff, head.new_size - last_new_end)
+            || !rle_skip(&rle, head.new_size - last_new_end) ) goto exit;
+    stats.diff_bytes += head.new_size - last_new_end;
+
+    if( !out_flush(&out) ) goto exit;
+    if( out.pos != head.new_size ) {
+        ESP_LOGE(TAG, "Produced %d of %d bytes", (int)out.pos, (int)head.new_size);
+        goto exit;
+    }
+
+    /* As patch_decompress, every section must be used up exactly */
+    if( 0 != rle.left || !sec_done(&rle.ctrl) || !sec_done(&rle.code)
+            || !sec_done(&covers.sec) || !sec_done(&new_diff) ) {
+        ESP_LOGE(TAG, "Diff sections not fully used");
+        goto exit;
+    }
+
+    ESP_LOGI(TAG, "%d covers; %d of %d cover bytes bulk copied (%d whole covers)",
+            (int)stats.n_covers, (int)stats.copy_bytes, (int)stats.cover_bytes,
+            (int)stats.n_copy_covers);
+    err = ESP_OK;
+
+exit:
+    sec_close(&new_diff);
+    sec_close(&rle.code);
+    sec_close(&rle.ctrl);
+    sec_close(&covers.sec);
+    if( NULL != sec_bufs ) free(sec_bufs);
+    if( NULL != own_buf ) free(own_buf);
+    if( NULL != cfg->stats ) *cfg->stats = stats;
+    return err;
+}
+
+size_t esp_hdiffz_engine_heap(const esp_hdiffz_engine_cfg_t *cfg, size_t *largest) {
+    size_t sec_size = ESP_HDIFFZ_SEC_N * ENGINE_SEC_BUF_SIZE, buf_size = 0;
+
+    if( NULL == cfg->buf ) buf_size = cfg->buf_size ? cfg->buf_size : ENGINE_BUF_SIZE;
+    if( NULL != largest ) *largest = buf_size > sec_size ? buf_size : sec_size;
+    return sec_size + buf_size;
+}
+
+/*********************
+ * PRIVATE FUNCTIONS *
+ *********************/
+
+/**
+ * @brief Prepare to read section i of the diff.
+ * @param[in] buf ENGINE_SEC_BUF_SIZE bytes.
+ * @return True on success.
+ */
+static bool sec_open(sec_t *sec, const esp_hdiffz_head_t *head, uint8_t i,
+        const hpatch_TStreamInput *diff, hpatch_TDecompress *plugin, unsigned char *buf) {
+    memset(sec, 0, sizeof(sec_t));
+    sec->diff = diff;
+    sec->plugin = plugin;
+    sec->pos = head->sec[i].pos;
+    sec->left = head->sec[i].size;
+    sec->buf = buf;
+
+    if( head->sec[i].compress_size > 0 && head->sec[i].size > 0 ) {
+        sec->dec = plugin->open(plugin, head->sec[i].size, diff,
+                head->sec[i].pos, head->sec[i].pos + head->sec[i].compress_size);
+        if( NULL == sec->dec ) return false;
+    }
+    return true;
+}
+
+static void sec_close(sec_t *sec) {
+    if( NULL != sec->dec ) sec->plugin->close(sec->plugin, sec->dec);
+    sec->dec = NULL;
+}
+
+/**
+ * @brief Decode or read the next n bytes of the section into dst.
+ * @return True on success.
+ */
+static bool sec_pull(sec_t *sec, unsigned char *dst, size_t n) {
+    int64_t t0 = ESP_HDIFFZ_TRACE_BEGIN();
+
+    if( NULL != sec->dec ) {
+        if( !sec->plugin->decompress_part(sec->dec, dst, dst + n) ) return false;
+        ESP_HDIFFZ_TRACE_END(ESP_HDIFFZ_TRACE_INFLATE, t0, n);
+    }
+    else {
+        if( !sec->diff->read(sec->diff, sec->pos, dst, dst + n) ) return false;
+        ESP_HDIFFZ_TRACE_END(ESP_HDIFFZ_TRACE_DIFF_READ, t0, n);
+        sec->pos += n;
+    }
+    sec->left -= n;
+    return true;
+}
+
+/**
+ * @brief Pull the next chunk of the section into its buffer.
+ * @return False at the end of the section or on error.
+ */
+static bool sec_fill(sec_t *sec) {
+    size_t n = ENGINE_SEC_BUF_SIZE;
+
+    if( n > sec->left ) n = sec->left;
+    if( 0 == n ) return false;
+
+    if( !sec_pull(sec, sec->buf, n) ) return false;
+    sec->buf_pos = 0;
+    sec->buf_len = n;
+    return true;
+}
+
+/**
+ * @brief Copy the next n bytes of the section into dst.
+ *
+ * Large reads bypass the section buffer.
+ */
+static bool sec_read(sec_t *sec, unsigned char *dst, size_t n) {
+    while( n > 0 ) {
+        size_t k;
+
+        if( sec->buf_pos == sec->buf_len ) {
+            if( n >= ENGINE_SEC_BUF_SIZE && n <= sec->left ) return sec_pull(sec, dst, n);
+            if( !sec_fill(sec) ) return false;
+        }
+
+        k = sec->buf_len - sec->buf_pos;
+        if( k > n ) k = n;
+        memcpy(dst, &sec->buf[sec->buf_pos], k);
+        sec->buf_pos += k;
+        dst += k;
+        n -= k;
+    }
+    return true;
+}
+
+/**
+ * @brief Take the next byte of the section.
+ *
+ * Fast path of sec_read for the packed uints of the cover and RLE streams.
+ */
+ESP_HDIFFZ_HOT bool sec_byte(sec_t *sec, unsigned char *byte) {
+    if( sec->buf_pos < sec->buf_len ) {
+        *byte = sec->buf[sec->buf_pos++];
+        return true;
+    }
+    return sec_read(sec, byte, 1);
+}
+
+/**
+ * @brief Discard the next n bytes of the section.
+ */
+static bool sec_skip(sec_t *sec, hpatch_StreamPos_t n) {
+    while( n > 0 ) {
+        size_t k;
+
+        if( sec->buf_pos == sec->buf_len && !sec_fill(sec) ) return false;
+
+        k = sec->buf_len - sec->buf_pos;
+        if( k > n ) k = n;
+        sec->buf_pos += k;
+        n -= k;
+    }
+    return true;
+}
+
+/**
+ * @brief Add the next n bytes of the section onto dst.
+ */
+static bool sec_add(sec_t *sec, unsigned char *dst, size_t n) {
+    while( n > 0 ) {
+        size_t k;
+
+        if( sec->buf_pos == sec->buf_len && !sec_fill(sec) ) return false;
+
+        k = sec->buf_len - sec->buf_pos;
+        if( k > n ) k = n;
+        esp_hdiffz_add(dst, &sec->buf[sec->buf_pos], k);
+        sec->buf_pos += k;
+        dst += k;
+        n -= k;
+    }
+    return true;
+}
+
+/**
+ * @brief Decode a packed uint whose first byte carries tag_bits of tag.
+ * @param[out] tag May be NULL if tag_bits is 0.
+ */
+static bool sec_uint(sec_t *sec, uint8_t tag_bits, uint8_t *tag, hpatch_StreamPos_t *value) {
+    unsigned char byte;
+    hpatch_StreamPos_t v;
+
+    if( !sec_byte(sec, &byte) ) return false;
+    if( tag_bits ) *tag = byte >> (8 - tag_bits);
+    v = byte & ((1 << (7 - tag_bits)) - 1);
+
+    if( byte & (1 << (7 - tag_bits)) ) {
+        do {
+            if( v >> (sizeof(v) * 8 - 7) ) return false;
+            if( !sec_byte(sec, &byte) ) return false;
+            v = (v << 7) | (byte & 0x7f);
+        } while( byte & 0x80 );
+    }
+
+    *value = v;
+    return true;
+}
+
+/**
+ * @brief True once every byte of the section has been taken.
+ */
+static bool sec_done(const sec_t *sec) {
+    return sec->buf_pos == sec->buf_len && 0 == sec->left;
+}
+
+/**
+ * @brief Take the next cover, decoding ahead to keep the window full.
+ *
+ * Each newly decoded cover's old range is passed to the hint callback.
+ * @return True on success; false on a truncated or out of range cover.
+ */
+static bool covers_pop(covers_t *covers, cover_t *cover) {
+    while( covers->n_left > 0 && covers->ring_len < ENGINE_LOOKAHEAD ) {
+        uint8_t sign;
+        hpatch_StreamPos_t old_inc, new_inc;
+        cover_t *next = &covers->ring[(covers->ring_head + covers->ring_len) % ENGINE_LOOKAHEAD];
+
+        if( !sec_uint(&covers->sec, 1, &sign, &old_inc)
+                || !sec_uint(&covers->sec, 0, NULL, &new_inc)
+                || !sec_uint(&covers->sec, 0, NULL, &next->length) ) {
+            ESP_LOGE(TAG, "Truncated cover %d", (int)(covers->head->cover_count - covers->n_left));
+            return false;
+        }
+        next->old_pos = sign ? covers->last_old_end - old_inc : covers->last_old_end + old_inc;
+        next->new_pos = covers->last_new_end + new_inc;
+        if( (sign && old_inc > covers->last_old_end)
+                || next->new_pos + next->length > covers->head->new_size
+                || next->old_pos + next->length > covers->head->old_size ) {
+            ESP_LOGE(TAG, "Cover %d out of range", (int)(covers->head->cover_count - covers->n_left));
+            return false;
+        }
+        covers->last_old_end = next->old_pos + next->length;
+        covers->last_new_end = next->new_pos + next->length;
+        covers->n_left--;
+        covers->ring_len++;
+
+        if( NULL != covers->hint ) covers->hint(covers->hint_ctx, next->old_pos, next->length);
+    }
+
+    if( 0 == covers->ring_len ) return false;
+    *cover = covers->ring[covers->ring_head];
+    covers->ring_head = (covers->ring_head + 1) % ENGINE_LOOKAHEAD;
+    covers->ring_len--;
+    return true;
+}
+
+/**
+ * @brief Load the next run if the current one is exhausted.
+ *
+ * The control stream covers every new byte; running out of it is an error.
+ */
+static bool rle_next(rle_t *rle) {
+    hpatch_StreamPos_t length;
+
+    if( rle->left > 0 ) return true;
+
+    if( sec_done(&rle->ctrl) ) {
+        ESP_LOGE(TAG, "RLE stream shorter than the new data");
+        return false;
+    }
+
+    if( !sec_uint(&rle->ctrl, 2, &rle->type, &length) ) return false;
+    rle->left = length + 1;
+    if( RLE_BYTE == rle->type ) return sec_byte(&rle->code, &rle->value);
+    return true;
+}
+
+/**
+ * @brief Advance the delta stream over n bytes of new data.
+ */
+static bool rle_skip(rle_t *rle, hpatch_StreamPos_t n) {
+    while( n > 0 ) {
+        hpatch_StreamPos_t k;
+
+        if( !rle_next(rle) ) return false;
+        k = rle->left < n ? rle->left : n;
+        if( RLE_RAW == rle->type && !sec_skip(&rle->code, k) ) return false;
+        rle->left -= k;
+        n -= k;
+    }
+    return true;
+}
+
+/**
+ * @brief Add the next n delta bytes onto old data in dst.
+ */
+static bool rle_add(rle_t *rle, unsigned char *dst, size_t n) {
+    while( n > 0 ) {
+        size_t k;
+
+        if( !rle_next(rle) ) return false;
+        k = rle->left < n ? rle->left : n;
+        switch( rle->type ) {
+            case RLE_ZERO:
+                break;
+            case RLE_FF:
+                esp_hdiffz_add_byte(dst, 0xFF, k);
+                break;
+            case RLE_BYTE:
+                esp_hdiffz_add_byte(dst, rle->value, k);
+                break;
+            default:
+                if( !sec_add(&rle->code, dst, k) ) return false;
+                break;
+        }
+        rle->left -= k;
+        dst += k;
+        n -= k;
+    }
+    return true;
+}
+
+/**
+ * @brief Write out everything buffered.
+ */
+static bool out_flush(out_t *out) {
+    int64_t t0;
+
+    if( 0 == out->len ) return true;
+    t0 = ESP_HDIFFZ_TRACE_BEGIN();
+    if( !out->stream->write(out->stream, out->pos, out->buf, out->buf + out->len) ) return false;
+    ESP_HDIFFZ_TRACE_END(ESP_HDIFFZ_TRACE_WRITE, t0, out->len);
+    out->pos += out->len;
+    out->len = 0;
+    return true;
+}
+
+/**
+ * @brief Emit n bytes of new data stored verbatim in the diff.
+ */
+static bool out_diff(out_t *out, sec_t *new_diff, hpatch_StreamPos_t n) {
+    while( n > 0 ) {
+        size_t k = out->buf_size - out->len;
+
+        if( 0 == k ) {
+            if( !out_flush(out) ) return false;
+            continue;
+        }
+        if( k > n ) k = n;
+        if( !sec_read(new_diff, &out->buf[out->len], k) ) return false;
+        out->len += k;
+        n -= k;
+    }
+    return true;
+}
+
+/**
+ * @brief Emit old data plus delta; n must fit in the buffer.
+ */
+static bool out_cover(out_t *out, rle_t *rle, const hpatch_TStreamInput *old,
+        hpatch_StreamPos_t old_pos, size_t n) {
+    unsigned char *dst = &out->buf[out->len];
+    int64_t t0 = ESP_HDIFFZ_TRACE_BEGIN();
+
+    if( !old->read(old, old_pos, dst, dst + n) ) return false;
+    ESP_HDIFFZ_TRACE_END(ESP_HDIFFZ_TRACE_OLD_READ, t0, n);
+    if( !rle_add(rle, dst, n) ) return false;
+    out->len += n;
+    return true;
+}
+
+/**
+ * @brief Move n bytes of unchanged old data.
+ *
+ * Chunks end on multiples of align in the output so that each write covers
+ * whole flash sectors.
+ */
+static bool out_copy(out_t *out, const hpatch_TStreamInput *old,
+        hpatch_StreamPos_t old_pos, hpatch_StreamPos_t n, size_t align) {
+    while( n > 0 ) {
+        hpatch_StreamPos_t new_pos = out->pos + out->len;
+        size_t k = out->buf_size - out->len;
+        int64_t t0;
+
+        if( align > 1 ) {
+            /* Stop on the last aligned output boundary that fits */
+            hpatch_StreamPos_t end = new_pos + k;
+            end -= end % align;
+            if( end > new_pos ) k = end - new_pos;
+        }
+        if( k > n ) k = n;
+
+        t0 = ESP_HDIFFZ_TRACE_BEGIN();
+        if( !old->read(old, old_pos, &out->buf[out->len], &out->buf[out->len] + k) ) return false;
+        ESP_HDIFFZ_TRACE_END(ESP_HDIFFZ_TRACE_OLD_READ, t0, k);
+        out->len += k;
+        old_pos += k;
+        n -= k;
+
+        if( out->len == out->buf_size || (align > 1 && 0 == (out->pos + out->len) % align) ) {
+            if( !out_flush(out) ) return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,101 @@
+#ifndef ESP_HDIFFZ_ENGINE_H__
+#define ESP_HDIFFZ_ENGINE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_hdiffz.h"
+#include "mem.h"
+
+#include "HPatch/patch.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Sections of a compressed diff, in stream order.
+ */
+enum {
+    ESP_HDIFFZ_SEC_COVER = 0,
+    ESP_HDIFFZ_SEC_RLE_CTRL,
+    ESP_HDIFFZ_SEC_RLE_CODE,
+    ESP_HDIFFZ_SEC_NEW_DIFF,
+    ESP_HDIFFZ_SEC_N,
+};
+
+/**
+ * @brief Parsed compressed diff header.
+ */
+typedef struct esp_hdiffz_head_t {
+    char compress_type[16];
+    hpatch_StreamPos_t new_size;
+    hpatch_StreamPos_t old_size;
+    hpatch_StreamPos_t cover_count;
+    struct {
+        hpatch_StreamPos_t pos;            /**< Offset of the section in the diff stream */
+        hpatch_StreamPos_t size;           /**< Uncompressed size */
+        hpatch_StreamPos_t compress_size;  /**< Compressed size; 0 if stored raw */
+    } sec[ESP_HDIFFZ_SEC_N];
+    hpatch_StreamPos_t end;                /**< Offset past the last section; old data checksums may follow */
+} esp_hdiffz_head_t;
+
+/**
+ * @brief Parse the header and locate each section.
+ * @param[in] diff_stream Compressed diff.
+ * @param[out] head Populated on success.
+ * @return ESP_OK on success; see esp_hdiffz_get_info for errors.
+ */
+esp_err_t esp_hdiffz_read_head(const hpatch_TStreamInput *diff_stream, esp_hdiffz_head_t *head);
+
+/**
+ * @brief Configuration for esp_hdiffz_engine_patch.
+ */
+typedef struct esp_hdiffz_engine_cfg_t {
+    const hpatch_TStreamOutput *out;   /**< Patched data; written strictly in order. */
+    const hpatch_TStreamInput *old;    /**< Old data. */
+    const hpatch_TStreamInput *diff;   /**< Compressed diff. */
+    hpatch_TDecompress *plugin;        /**< Decompressor for compressed sections. */
+    unsigned char *buf;                /**< Output buffer. May be NULL to allocate one. */
+    size_t buf_size;                   /**< Size of buf; or size to allocate. 0 for default. */
+    size_t copy_min;                   /**< Shortest zero-delta run moved as a bulk copy; 0 for default. */
+    size_t align;                      /**< Bulk copies are split on this output boundary; 0 for none. */
+    esp_hdiffz_patch_stats_t *stats;   /**< Per-cover accounting; overwritten when the patch ends. May be NULL. */
+    const esp_hdiffz_mem_t *mem;       /**< Placement of the engine's buffers. May be NULL. */
+    /** Called with each cover's old range shortly before it is read, in read order. May be NULL. */
+    void (*hint)(void *ctx, hpatch_StreamPos_t old_pos, hpatch_StreamPos_t len);
+    void *hint_ctx;
+    /** Called with each cover as it is applied. May be NULL. */
+    void (*cover)(void *ctx, hpatch_StreamPos_t old_pos, hpatch_StreamPos_t new_pos, hpatch_StreamPos_t len);
+    void *cover_ctx;
+} esp_hdiffz_engine_cfg_t;
+
+/**
+ * @brief Apply a compressed diff cover by cover.
+ *
+ * Produces the same output as patch_decompress. Runs of old data that the
+ * diff copies unchanged skip the add step entirely and are moved in large
+ * chunks aligned to cfg->align in the output.
+ *
+ * @param[in] cfg Streams and tuning.
+ * @return ESP_OK on success.
+ */
+esp_err_t esp_hdiffz_engine_patch(const esp_hdiffz_engine_cfg_t *cfg);
+
+/**
+ * @brief Heap esp_hdiffz_engine_patch allocates for cfg, besides the decompressor's.
+ *
+ * All of it is of class ESP_HDIFFZ_MEM_IO.
+ *
+ * @param[in] cfg Only buf and buf_size are read.
+ * @param[out] largest Largest single buffer. May be NULL.
+ * @return Bytes of the output buffer, unless cfg->buf is set, and the section buffers.
+ */
+size_t esp_hdiffz_engine_heap(const esp_hdiffz_engine_cfg_t *cfg, size_t *largest);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -1,4 +1,4 @@
-#define LOG_LOCAL_LEVEL 4
+//#define LOG_LOCAL_LEVEL 4
 
 #include "esp_log.h"
 #include "esp_hdiffz.h"
@@ -6,8 +6,15 @@
 #include "esp_system.h"
 #include "miniz_plugin.h"
 #include "rw.h"
+#include "engine.h"
+#include "oldcheck.h"
 
 
+/* Buffer size for old data and patched output */
+#define FILE_BUF_SIZE 4096
+/* Buffer size for each of the diff read-ahead lanes */
+#define FILE_DIFF_BUF_SIZE 2048
+
 static const char TAG[] = "esp_hdiffz_file";
 
 /**************
@@ -19,60 +26,113 @@ static const char TAG[] = "esp_hdiffz_file";
  ********************/
 
 esp_err_t esp_hdiffz_patch_file_from_mem(FILE *in, FILE *out, const char *diff, size_t diff_size) {
-    esp_err_t err = ESP_FAIL;
-
-    hpatch_TStreamOutput out_stream = { 0 };
-    hpatch_TStreamInput  old_stream = { 0 };
     hpatch_TStreamInput  diff_stream;
 
-    old_stream.streamImport = in;
-    old_stream.streamSize = esp_hdiffz_get_file_size(in);
-    old_stream.read = esp_hdiffz_file_read;
+    esp_hdiffz_mem_as_stream_input(&diff_stream, (const unsigned char *)diff, diff_size);
 
-    out_stream.streamImport = out;
-    out_stream.streamSize = UINT32_MAX;
-    out_stream.write = esp_hdiffz_file_write;
+    return esp_hdiffz_patch_file_adv(in, out, &diff_stream, minizDecompressPlugin);
+}
 
-    mem_as_hStreamInput(&diff_stream, (const unsigned char *)diff, (const unsigned char *)&diff[diff_size]);
+esp_err_t esp_hdiffz_patch_file(FILE *in, FILE *out, FILE *diff){
+    esp_err_t err;
+    esp_hdiffz_file_stream_t diff_file;
+    hpatch_TStreamInput  diff_stream = { 0 };
 
-    if(!patch_decompress(&out_stream, &old_stream, &diff_stream, minizDecompressPlugin)){
-        ESP_LOGE(TAG, "Failed to run patch_decompress");
-        goto exit;
-    }
+    err = esp_hdiffz_file_stream_init(&diff_file, diff, FILE_DIFF_BUF_SIZE, ESP_HDIFFZ_FILE_STREAM_MAX_LANES);
+    if( ESP_OK != err ) goto exit;
+    esp_hdiffz_file_stream_as_input(&diff_file, &diff_stream);
 
-    return ESP_OK;
+    err = esp_hdiffz_patch_file_adv(in, out, &diff_stream, minizDecompressPlugin);
 
 exit:
+    esp_hdiffz_file_stream_deinit(&diff_file);
     return err;
 }
 
-esp_err_t esp_hdiffz_patch_file(FILE *in, FILE *out, FILE *diff){
+esp_err_t esp_hdiffz_patch_file_adv(FILE *in, FILE *out, const hpatch_TStreamInput *diff_stream, hpatch_TDecompress *plugin) {
     esp_err_t err = ESP_FAIL;
+    esp_hdiffz_file_stream_t old_file, out_file;
+    esp_hdiffz_info_t info;
 
     hpatch_TStreamOutput out_stream = { 0 };
-    hpatch_TStreamInput  old_stream = { 0 };
-    hpatch_TStreamInput  diff_stream;
+    hpatch_TStreamInput  old_stream = { 0 }, checked_old, sections;
+    esp_hdiffz_engine_cfg_t cfg = { 0 };
+    esp_hdiffz_miniz_plugin_t local, *miniz = NULL;
+    esp_hdiffz_oldcheck_t *oldcheck = NULL;
+    esp_hdiffz_mem_t mem = { 0 };
+
+    /* Both deinits below must be safe even if an init fails */
+    memset(&old_file, 0, sizeof(old_file));
+    memset(&out_file, 0, sizeof(out_file));
+
+    /* A plugin instance carries the memory policy of the patch */
+    if(NULL != plugin && plugin != minizDecompressPlugin && plugin->open == minizDecompressPlugin->open) {
+        miniz = (esp_hdiffz_miniz_plugin_t *)plugin;
+        mem.policy = miniz->mem_policy;
+        mem.report = miniz->mem_report;
+    }
 
-    old_stream.streamImport = in;
-    old_stream.streamSize = esp_hdiffz_get_file_size(in);
-    old_stream.read = esp_hdiffz_file_read;
+    err = esp_hdiffz_get_info(diff_stream, &info);
+    if( ESP_OK != err ) {
+        ESP_LOGE(TAG, "Failed to parse diff header");
+        goto exit;
+    }
 
-    out_stream.streamImport = out;
-    out_stream.streamSize = UINT32_MAX;
-    out_stream.write = esp_hdiffz_file_write;
+    err = esp_hdiffz_file_stream_init_adv(&old_file, in, FILE_BUF_SIZE, 1, &mem);
+    if( ESP_OK != err ) goto exit;
+    err = esp_hdiffz_file_stream_init_adv(&out_file, out, FILE_BUF_SIZE, 1, &mem);
+    if( ESP_OK != err ) goto exit;
 
-    diff_stream.streamImport = diff;
-    diff_stream.streamSize = esp_hdiffz_get_file_size(diff);
-    diff_stream.read = esp_hdiffz_file_read;
+    esp_hdiffz_file_stream_as_input(&old_file, &old_stream);
+    esp_hdiffz_file_stream_as_output(&out_file, &out_stream, info.new_size);
+    esp_hdiffz_file_stream_prealloc(&out_file, info.new_size);
 
-    if(!patch_decompress(&out_stream, &old_stream, &diff_stream, minizDecompressPlugin)){
-        ESP_LOGE(TAG, "Failed to run patch_decompress");
+    /* The engine only gets the sections; old data checksums are checked here */
+    err = esp_hdiffz_oldcheck_create(diff_stream, &old_stream, &mem, &oldcheck);
+    if( ESP_OK != err ) goto exit;
+    if( NULL != oldcheck ) {
+        esp_hdiffz_oldcheck_as_input(oldcheck, &checked_old);
+    }
+    else {
+        checked_old = old_stream;
+    }
+    sections = *diff_stream;
+    sections.streamSize -= info.old_check_size;
+
+    /* Uncompressed diffs, e.g. rollback diffs, need no plugin */
+    if(0 == info.n_nodes) plugin = NULL;
+
+    /* Preset dictionaries are read from the old file. The shared global
+     * plugin is swapped for a local instance so it is never modified. */
+    if(plugin == minizDecompressPlugin) {
+        esp_hdiffz_miniz_plugin_init(&local);
+        plugin = &local.base;
+        miniz = &local;
+    }
+    if(NULL != miniz) miniz->dict_src = &checked_old;
+
+    /* The same engine the OTA patches flash with */
+    cfg.out = &out_stream;
+    cfg.old = &checked_old;
+    cfg.diff = &sections;
+    cfg.plugin = plugin;
+    cfg.mem = &mem;
+    err = esp_hdiffz_engine_patch(&cfg);
+    if( ESP_OK != err ) {
+        ESP_LOGE(TAG, "Failed to apply diff");
+        if( esp_hdiffz_oldcheck_failed(oldcheck) ) err = ESP_ERR_HDIFFZ_OLD_MISMATCH;
         goto exit;
     }
 
-    return ESP_OK;
+    err = esp_hdiffz_oldcheck_finish(oldcheck);
+    if( ESP_OK != err ) goto exit;
+    err = esp_hdiffz_file_stream_flush(&out_file);
 
 exit:
+    if(NULL != miniz) miniz->dict_src = NULL;
+    esp_hdiffz_oldcheck_del(oldcheck, NULL);
+    esp_hdiffz_file_stream_deinit(&old_file);
+    if( ESP_OK != esp_hdiffz_file_stream_deinit(&out_file) && ESP_OK == err ) err = ESP_FAIL;
     return err;
 }
 
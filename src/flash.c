@@ -0,0 +1,187 @@
+//#define LOG_LOCAL_LEVEL 4
+
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_hdiffz.h"
+
+#include "freertos/FreeRTOS.h"
+#include "mem.h"
+
+#define FLASH_SECTOR_SIZE 4096
+#define FLASH_BLOCK_SIZE (64*1024)
+#define FLASH_PAGE_SIZE 256
+
+static const char TAG[] = "hdiffz_flash";
+
+/**************
+ * PROTOTYPES *
+ **************/
+static void count_erase(esp_hdiffz_flash_t *flash, size_t address, size_t size);
+static void count_sector(esp_hdiffz_flash_t *flash, size_t sector);
+static bool grow_sectors(esp_hdiffz_flash_t *flash, size_t n_sectors);
+
+/********************
+ * PUBLIC FUNCTIONS *
+ ********************/
+
+void esp_hdiffz_flash_init(esp_hdiffz_flash_t *flash, const esp_hdiffz_flash_timing_t *timing) {
+    const esp_hdiffz_flash_timing_t def = ESP_HDIFFZ_FLASH_TIMING_DEFAULT();
+    const portMUX_TYPE unlocked = portMUX_INITIALIZER_UNLOCKED;
+
+    memset(flash, 0, sizeof(*flash));
+    flash->timing = NULL != timing ? *timing : def;
+    flash->lock = unlocked;
+}
+
+void esp_hdiffz_flash_deinit(esp_hdiffz_flash_t *flash) {
+    free(flash->sectors);
+    flash->sectors = NULL;
+    flash->n_sectors = 0;
+}
+
+void esp_hdiffz_flash_report(esp_hdiffz_flash_t *flash, esp_hdiffz_flash_report_t *report) {
+    portENTER_CRITICAL(&flash->lock);
+    *report = flash->report;
+    portEXIT_CRITICAL(&flash->lock);
+}
+
+uint32_t esp_hdiffz_flash_sector_erases(esp_hdiffz_flash_t *flash, const esp_partition_t *part, size_t offset) {
+    size_t sector = (part->address + offset) / FLASH_SECTOR_SIZE;
+    uint32_t n = 0;
+
+    portENTER_CRITICAL(&flash->lock);
+    if( sector < flash->n_sectors ) n = flash->sectors[sector];
+    portEXIT_CRITICAL(&flash->lock);
+    return n;
+}
+
+esp_err_t esp_hdiffz_flash_read(esp_hdiffz_flash_t *flash, const esp_partition_t *part,
+        size_t offset, void *dst, size_t size) {
+    esp_err_t err;
+
+    err = esp_partition_read(part, offset, dst, size);
+    if( ESP_OK == err && NULL != flash ) {
+        portENTER_CRITICAL(&flash->lock);
+        flash->report.n_reads++;
+        flash->report.read_bytes += size;
+        flash->report.read_us += flash->timing.op_us
+                + ((int64_t)size * flash->timing.read_us_per_kb) / 1024;
+        portEXIT_CRITICAL(&flash->lock);
+    }
+    return err;
+}
+
+esp_err_t esp_hdiffz_flash_write(esp_hdiffz_flash_t *flash, const esp_partition_t *part,
+        size_t offset, const void *src, size_t size) {
+    esp_err_t err;
+
+    err = esp_partition_write(part, offset, src, size);
+    if( ESP_OK == err && NULL != flash ) {
+        size_t address = part->address + offset;
+        int64_t us = flash->timing.op_us;
+        uint32_t n_pages = 0;
+
+        /* The driver programs each page the range touches separately */
+        for(size_t done = 0; done < size; n_pages++) {
+            size_t n = FLASH_PAGE_SIZE - (address + done) % FLASH_PAGE_SIZE;
+            uint32_t page_us;
+            if( n > size - done ) n = size - done;
+            page_us = (flash->timing.page_program_us * n) / FLASH_PAGE_SIZE;
+            us += page_us > flash->timing.byte_program_us ? page_us : flash->timing.byte_program_us;
+            done += n;
+        }
+
+        portENTER_CRITICAL(&flash->lock);
+        flash->report.n_writes++;
+        flash->report.write_bytes += size;
+        flash->report.n_page_programs += n_pages;
+        flash->report.write_us += us;
+        portEXIT_CRITICAL(&flash->lock);
+    }
+    return err;
+}
+
+esp_err_t esp_hdiffz_flash_erase_range(esp_hdiffz_flash_t *flash, const esp_partition_t *part,
+        size_t offset, size_t size) {
+    esp_err_t err;
+
+    err = esp_partition_erase_range(part, offset, size);
+    if( ESP_OK == err && NULL != flash ) count_erase(flash, part->address + offset, size);
+    return err;
+}
+
+/*********************
+ * PRIVATE FUNCTIONS *
+ *********************/
+
+/**
+ * @brief Charge an erase as the flash driver performs it.
+ *
+ * Erases of one context come from one task at a time.
+ */
+static void count_erase(esp_hdiffz_flash_t *flash, size_t address, size_t size) {
+    size_t end = address + size;
+
+    if( !grow_sectors(flash, (end + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE) ) {
+        ESP_LOGW(TAG, "No memory for per sector erase counts");
+    }
+
+    portENTER_CRITICAL(&flash->lock);
+    flash->report.n_erases++;
+    flash->report.erase_us += flash->timing.op_us;
+    while( address < end ) {
+        if( 0 == address % FLASH_BLOCK_SIZE && end - address >= FLASH_BLOCK_SIZE ) {
+            flash->report.n_block_erases++;
+            flash->report.erase_us += flash->timing.block_erase_us;
+            for(size_t i=0; i < FLASH_BLOCK_SIZE / FLASH_SECTOR_SIZE; i++) {
+                count_sector(flash, address / FLASH_SECTOR_SIZE + i);
+            }
+            address += FLASH_BLOCK_SIZE;
+        }
+        else {
+            flash->report.n_sector_erases++;
+            flash->report.erase_us += flash->timing.sector_erase_us;
+            count_sector(flash, address / FLASH_SECTOR_SIZE);
+            address += FLASH_SECTOR_SIZE;
+        }
+    }
+    portEXIT_CRITICAL(&flash->lock);
+}
+
+/**
+ * @brief Add an erase cycle to a sector. Must hold flash->lock.
+ */
+static void count_sector(esp_hdiffz_flash_t *flash, size_t sector) {
+    esp_hdiffz_flash_report_t *report = &flash->report;
+
+    report->sectors_erased++;
+    if( sector >= flash->n_sectors ) return;
+    if( 0 == flash->sectors[sector] ) report->sectors_touched++;
+    if( UINT16_MAX != flash->sectors[sector] ) flash->sectors[sector]++;
+    if( flash->sectors[sector] > report->max_sector_erases ) report->max_sector_erases = flash->sectors[sector];
+}
+
+/**
+ * @brief Make the per sector counts cover n_sectors sectors.
+ * @return False if out of memory; sectors past the table are then not counted.
+ */
+static bool grow_sectors(esp_hdiffz_flash_t *flash, size_t n_sectors) {
+    uint16_t *sectors, *old;
+
+    if( n_sectors <= flash->n_sectors ) return true;
+
+    /* Allocated outside the critical section */
+    sectors = esp_hdiffz_mem_calloc(NULL, ESP_HDIFFZ_MEM_CACHE, n_sectors, sizeof(*sectors));
+    if( NULL == sectors ) return false;
+
+    portENTER_CRITICAL(&flash->lock);
+    old = flash->sectors;
+    if( NULL != old ) memcpy(sectors, old, flash->n_sectors * sizeof(*sectors));
+    flash->sectors = sectors;
+    flash->n_sectors = n_sectors;
+    portEXIT_CRITICAL(&flash->lock);
+
+    free(old);
+    return true;
+}
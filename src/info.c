@@ -0,0 +1,177 @@
+//#define LOG_LOCAL_LEVEL 4
+
+#include "esp_log.h"
+#include "esp_hdiffz.h"
+
+#include "miniz_plugin.h"
+#include "rw.h"
+#include "engine.h"
+#include "pack.h"
+
+/* Magic + compress type + 11 packed uints fits comfortably */
+#define INFO_HEAD_BUF_SIZE 128
+
+static const char TAG[] = "esp_hdiffz_info";
+
+/**
+ * Order of the sizes following the compress type in the diff header.
+ */
+enum {
+    HEAD_NEW_DATA_SIZE = 0,
+    HEAD_OLD_DATA_SIZE,
+    HEAD_COVER_COUNT,
+    HEAD_COVER_BUF_SIZE,
+    HEAD_COMPRESS_COVER_BUF_SIZE,
+    HEAD_RLE_CTRL_BUF_SIZE,
+    HEAD_COMPRESS_RLE_CTRL_BUF_SIZE,
+    HEAD_RLE_CODE_BUF_SIZE,
+    HEAD_COMPRESS_RLE_CODE_BUF_SIZE,
+    HEAD_NEW_DATA_DIFF_SIZE,
+    HEAD_COMPRESS_NEW_DATA_DIFF_SIZE,
+    HEAD_N_FIELDS,
+};
+
+/**************
+ * PROTOTYPES *
+ **************/
+
+/********************
+ * PUBLIC FUNCTIONS *
+ ********************/
+
+esp_err_t esp_hdiffz_get_info(const hpatch_TStreamInput *diff_stream, esp_hdiffz_info_t *info) {
+    esp_err_t err;
+    esp_hdiffz_head_t head;
+    const esp_hdiffz_engine_cfg_t engine = { 0 };
+    bool in_place;
+
+    memset(info, 0, sizeof(esp_hdiffz_info_t));
+    info->diff_size = diff_stream->streamSize;
+
+    err = esp_hdiffz_read_head(diff_stream, &head);
+    if( ESP_OK != err ) return err;
+
+    memcpy(info->compress_type, head.compress_type, sizeof(info->compress_type));
+    info->new_size = head.new_size;
+    info->old_size = head.old_size;
+    info->cover_count = head.cover_count;
+    info->old_check_size = diff_stream->streamSize - head.end;
+
+    /* A compressed node starts with its window bits */
+    in_place = NULL != esp_hdiffz_stream_mem(diff_stream);
+    for(uint8_t i=0; i < ESP_HDIFFZ_SEC_N; i++) {
+        esp_hdiffz_node_head_t node;
+
+        if( 0 == head.sec[i].compress_size ) continue;
+
+        if( !esp_hdiffz_miniz_node_head(diff_stream, head.sec[i].pos,
+                    head.sec[i].pos + head.sec[i].compress_size, &node) ) {
+            ESP_LOGE(TAG, "Unsupported node");
+            return ESP_ERR_NOT_SUPPORTED;
+        }
+        if( node.has_dict ) {
+            if( node.dict_pos + node.dict_len > info->old_size ) {
+                ESP_LOGE(TAG, "Dictionary outside of old data");
+                return ESP_ERR_INVALID_ARG;
+            }
+            info->dict_size += node.dict_len;
+        }
+
+        info->n_nodes++;
+        if( node.window_bits > info->window_bits ) info->window_bits = node.window_bits;
+        info->dec_heap += esp_hdiffz_miniz_plugin_node_heap(node.window_bits, in_place);
+    }
+
+    /* Every section is open at once while the engine patches */
+    info->heap_worst = info->dec_heap + esp_hdiffz_engine_heap(&engine, NULL);
+
+    ESP_LOGD(TAG, "new %d old %d nodes %d window %d heap %d",
+            (int)info->new_size, (int)info->old_size, info->n_nodes,
+            info->window_bits, (int)info->heap_worst);
+
+    return ESP_OK;
+}
+
+esp_err_t esp_hdiffz_read_head(const hpatch_TStreamInput *diff_stream, esp_hdiffz_head_t *head) {
+    unsigned char buf[INFO_HEAD_BUF_SIZE];
+    hpatch_StreamPos_t fields[HEAD_N_FIELDS];
+    hpatch_StreamPos_t pos;
+    const unsigned char *p, *p_end, *type_end;
+    size_t n_buf, type_len;
+
+    memset(head, 0, sizeof(esp_hdiffz_head_t));
+
+    n_buf = sizeof(buf);
+    if( n_buf > diff_stream->streamSize ) n_buf = diff_stream->streamSize;
+    if( !diff_stream->read(diff_stream, 0, buf, buf + n_buf) ) {
+        ESP_LOGE(TAG, "Failed to read diff header");
+        return ESP_FAIL;
+    }
+    p = buf;
+    p_end = buf + n_buf;
+
+    /* Magic */
+    if( n_buf < sizeof(ESP_HDIFFZ_DIFFZ_MAGIC) - 1
+            || 0 != memcmp(p, ESP_HDIFFZ_DIFFZ_MAGIC, sizeof(ESP_HDIFFZ_DIFFZ_MAGIC) - 1) ) {
+        ESP_LOGE(TAG, "Not a compressed HDiffPatch diff");
+        return ESP_ERR_INVALID_ARG;
+    }
+    p += sizeof(ESP_HDIFFZ_DIFFZ_MAGIC) - 1;
+
+    /* Compress type; NULL-terminated */
+    type_end = memchr(p, '\0', p_end - p);
+    if( NULL == type_end ) {
+        ESP_LOGE(TAG, "Unterminated compress type");
+        return ESP_ERR_INVALID_ARG;
+    }
+    type_len = type_end - p;
+    if( type_len >= sizeof(head->compress_type) ) {
+        ESP_LOGE(TAG, "Unsupported compress type \"%.*s\"", (int)type_len, p);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    memcpy(head->compress_type, p, type_len);
+    p = type_end + 1;
+
+    for(uint8_t i=0; i < HEAD_N_FIELDS; i++) {
+        if( !esp_hdiffz_unpack_uint(&p, p_end, &fields[i]) ) {
+            ESP_LOGE(TAG, "Truncated diff header");
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+    head->new_size = fields[HEAD_NEW_DATA_SIZE];
+    head->old_size = fields[HEAD_OLD_DATA_SIZE];
+    head->cover_count = fields[HEAD_COVER_COUNT];
+
+    /* Sections follow the header back to back */
+    pos = p - buf;
+    for(uint8_t i=0; i < ESP_HDIFFZ_SEC_N; i++) {
+        head->sec[i].pos = pos;
+        head->sec[i].size = fields[HEAD_COVER_BUF_SIZE + 2 * i];
+        head->sec[i].compress_size = fields[HEAD_COVER_BUF_SIZE + 2 * i + 1];
+
+        if( 0 == head->sec[i].compress_size ) {
+            pos += head->sec[i].size;
+            continue;
+        }
+
+        if( !minizDecompressPlugin->is_can_open(head->compress_type) ) {
+            ESP_LOGE(TAG, "Unsupported compress type \"%s\"", head->compress_type);
+            return ESP_ERR_NOT_SUPPORTED;
+        }
+        pos += head->sec[i].compress_size;
+    }
+
+    if( pos > diff_stream->streamSize ) {
+        ESP_LOGE(TAG, "Truncated diff; expected %d bytes, got %d",
+                (int)pos, (int)diff_stream->streamSize);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    head->end = pos;
+
+    return ESP_OK;
+}
+
+/*********************
+ * PRIVATE FUNCTIONS *
+ *********************/
+
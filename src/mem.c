@@ -0,0 +1,128 @@
+//#define LOG_LOCAL_LEVEL 4
+
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_hdiffz.h"
+
+#include "esp_heap_caps.h"
+#include "soc/soc_memory_layout.h"
+#include "mem.h"
+
+static const char TAG[] = "hdiffz_mem";
+
+static const esp_hdiffz_mem_policy_t s_default_policy = ESP_HDIFFZ_MEM_POLICY_DEFAULT();
+
+/**************
+ * PROTOTYPES *
+ **************/
+static const esp_hdiffz_mem_policy_t *mem_policy(const esp_hdiffz_mem_t *mem);
+
+/********************
+ * PUBLIC FUNCTIONS *
+ ********************/
+
+void *esp_hdiffz_mem_alloc(const esp_hdiffz_mem_t *mem, esp_hdiffz_mem_class_t cls, size_t size) {
+    const esp_hdiffz_mem_policy_t *policy = mem_policy(mem);
+    uint32_t caps = policy->caps[cls];
+    bool fallback = false;
+    void *ptr;
+
+    if( caps ) {
+        ptr = heap_caps_malloc(size, caps);
+        if( NULL == ptr && policy->fallback ) {
+            ESP_LOGD(TAG, "No %d bytes with caps 0x%x for class %d; using malloc",
+                    (int)size, caps, cls);
+            ptr = malloc(size);
+            fallback = true;
+        }
+    }
+    else {
+        ptr = malloc(size);
+    }
+
+    if( NULL != mem && NULL != mem->report ) {
+        esp_hdiffz_mem_usage_t *usage = &mem->report->cls[cls];
+        if( NULL == ptr ) {
+            usage->n_failed++;
+        }
+        else {
+            usage->n_allocs++;
+            if( fallback ) usage->n_fallbacks++;
+            if( esp_ptr_external_ram(ptr) ) usage->external_bytes += size;
+            else usage->internal_bytes += size;
+        }
+    }
+
+    return ptr;
+}
+
+void *esp_hdiffz_mem_calloc(const esp_hdiffz_mem_t *mem, esp_hdiffz_mem_class_t cls, size_t n, size_t size) {
+    void *ptr;
+
+    if( 0 != size && n > SIZE_MAX / size ) return NULL;
+    ptr = esp_hdiffz_mem_alloc(mem, cls, n * size);
+    if( NULL != ptr ) memset(ptr, 0, n * size);
+    return ptr;
+}
+
+size_t esp_hdiffz_mem_free(const esp_hdiffz_mem_t *mem, esp_hdiffz_mem_class_t cls) {
+    const esp_hdiffz_mem_policy_t *policy = mem_policy(mem);
+    uint32_t caps = policy->caps[cls];
+    size_t n = 0;
+
+    if( caps ) n = heap_caps_get_free_size(caps);
+    if( 0 == caps || policy->fallback ) {
+        size_t n_default = heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
+        if( n_default > n ) n = n_default;
+    }
+    return n;
+}
+
+size_t esp_hdiffz_mem_largest(const esp_hdiffz_mem_t *mem, esp_hdiffz_mem_class_t cls) {
+    const esp_hdiffz_mem_policy_t *policy = mem_policy(mem);
+    uint32_t caps = policy->caps[cls];
+    size_t n = 0;
+
+    if( caps ) n = heap_caps_get_largest_free_block(caps);
+    if( 0 == caps || policy->fallback ) {
+        size_t n_default = heap_caps_get_largest_free_block(MALLOC_CAP_DEFAULT);
+        if( n_default > n ) n = n_default;
+    }
+    return n;
+}
+
+esp_err_t esp_hdiffz_mem_check(const esp_hdiffz_mem_t *mem, const size_t need[ESP_HDIFFZ_MEM_N],
+        const size_t largest[ESP_HDIFFZ_MEM_N]) {
+    const esp_hdiffz_mem_policy_t *policy = mem_policy(mem);
+
+    for(int cls=0; cls < ESP_HDIFFZ_MEM_N; cls++) {
+        size_t total = 0, n_free, block;
+
+        if( 0 == need[cls] ) continue;
+        for(int other=0; other < ESP_HDIFFZ_MEM_N; other++) {
+            if( policy->caps[other] == policy->caps[cls] ) total += need[other];
+        }
+        n_free = esp_hdiffz_mem_free(mem, cls);
+        block = esp_hdiffz_mem_largest(mem, cls);
+        if( total > n_free || largest[cls] > block ) {
+            ESP_LOGE(TAG, "Class %d needs %d bytes with its heap, up to %d in one block; "
+                    "%d free, largest block %d", cls, (int)total, (int)largest[cls],
+                    (int)n_free, (int)block);
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    return ESP_OK;
+}
+
+/*********************
+ * PRIVATE FUNCTIONS *
+ *********************/
+
+/**
+ * @brief Policy of mem, or the default one.
+ */
+static const esp_hdiffz_mem_policy_t *mem_policy(const esp_hdiffz_mem_t *mem) {
+    if( NULL == mem || NULL == mem->policy ) return &s_default_policy;
+    return mem->policy;
+}
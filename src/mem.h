@@ -0,0 +1,74 @@
+#ifndef ESP_HDIFFZ_MEM_H__
+#define ESP_HDIFFZ_MEM_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_hdiffz.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Placement of the buffers of one patch.
+ *
+ * Functions taking one accept NULL for the default policy and no report.
+ */
+typedef struct esp_hdiffz_mem_t {
+    const esp_hdiffz_mem_policy_t *policy;  /**< NULL for ESP_HDIFFZ_MEM_POLICY_DEFAULT(). */
+    esp_hdiffz_mem_report_t *report;        /**< Counts where allocations landed. May be NULL. */
+} esp_hdiffz_mem_t;
+
+/**
+ * @brief Allocate a buffer where the memory policy places its class.
+ *
+ * Release with free(). The report is not locked; it belongs to a single
+ * patch, whose buffers are allocated by one task at a time.
+ *
+ * @param[in] mem Policy and report. May be NULL.
+ * @param[in] cls Kind of buffer.
+ * @param[in] size Number of bytes.
+ * @return Pointer on success; NULL on OOM.
+ */
+void *esp_hdiffz_mem_alloc(const esp_hdiffz_mem_t *mem, esp_hdiffz_mem_class_t cls, size_t size);
+
+/**
+ * @brief esp_hdiffz_mem_alloc of n zeroed elements.
+ */
+void *esp_hdiffz_mem_calloc(const esp_hdiffz_mem_t *mem, esp_hdiffz_mem_class_t cls, size_t n, size_t size);
+
+/**
+ * @brief Free heap a class can currently be allocated from.
+ *
+ * The larger of the class's capable heaps and, if the policy falls back
+ * to it, the default heap.
+ */
+size_t esp_hdiffz_mem_free(const esp_hdiffz_mem_t *mem, esp_hdiffz_mem_class_t cls);
+
+/**
+ * @brief Largest block a class can currently be allocated in.
+ *
+ * As esp_hdiffz_mem_free, for the largest free block instead.
+ */
+size_t esp_hdiffz_mem_largest(const esp_hdiffz_mem_t *mem, esp_hdiffz_mem_class_t cls);
+
+/**
+ * @brief Check that buffers of each class can currently be allocated.
+ *
+ * Classes the policy places in the same heaps are counted against the same
+ * free bytes. Nothing is allocated.
+ *
+ * @param[in] mem Policy. May be NULL.
+ * @param[in] need Bytes per class.
+ * @param[in] largest Largest single buffer per class.
+ * @return ESP_OK if every class fits; ESP_ERR_NO_MEM otherwise.
+ */
+esp_err_t esp_hdiffz_mem_check(const esp_hdiffz_mem_t *mem, const size_t need[ESP_HDIFFZ_MEM_N],
+        const size_t largest[ESP_HDIFFZ_MEM_N]);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -2,15 +2,36 @@
  * @file miniz_plugin
  * @brief HDiffPatch Plugin to decompress a diff using esp32's miniz ROM.
  *
- * Based off of the zlib plugin in HDiffPatch/decompress_plugin_demo.h
+ * Based off of the zlib plugin in HDiffPatch/decompress_plugin_demo.h, but
+ * drives tinfl directly instead of going through the mz_stream wrapper.
  */
 
-#define LOG_LOCAL_LEVEL 4
+//#define LOG_LOCAL_LEVEL 4
 
 #include "miniz_plugin.h" 
 #include "miniz.h"
+#include "rw.h"
+#include "mem.h"
+#include "engine.h"
+#include "pack.h"
 #include "esp_err.h"
 #include "esp_log.h"
+#include "profile.h"
+#include "trace.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_heap_caps.h"
+
+/* Largest window bits of a node that will be opened; set with menuconfig */
+#ifndef CONFIG_HDIFFZ_MAX_WINDOW_BITS
+#define CONFIG_HDIFFZ_MAX_WINDOW_BITS 15
+#endif
+/* Input buffer of a streamed node; smaller if the window is */
+#define MINIZ_IN_BUF_SIZE 4096
+/* Windows up to this size are inflate state; larger ones are placed with the caches */
+#define MINIZ_STATE_WINDOW_MAX 4096
+/* zlib writes a 512 byte window for window bits 8 */
+#define MIN_WINDOW_BITS 9
 
 /**
  *
@@ -22,17 +43,53 @@ typedef struct _zlib_TDecompress{
     
     unsigned char*  dec_buf;                       /**< */
     size_t          dec_buf_size;                  /**< */
-    mz_stream       d_stream;                      /**< */
+    const unsigned char *next_in;                  /**< Next compressed byte */
+    size_t          avail_in;                      /**< Compressed bytes at next_in */
     signed char     window_bits;                   /**< */
+
+    tinfl_decompressor *tinfl;                     /**< Decoder */
+    int             tinfl_flags;                   /**< zlib header, unless the node has a dictionary */
+    tinfl_status    tinfl_status;                  /**< Status of the last tinfl call */
+    unsigned char  *window;                        /**< Wrapping window, preset with the dictionary if any */
+    size_t          win_size;                      /**< Power of two no smaller than the node's window */
+    size_t          win_ofs;                       /**< Next write position in window */
+    size_t          win_out;                       /**< Start of decoded bytes not yet returned */
+    size_t          win_avail;                     /**< Number of decoded bytes not yet returned */
 } _zlib_TDecompress;
 
+/**
+ * Header prepended to every allocation made on behalf of an instance so that
+ * the size is known when it is released.
+ */
+typedef union {
+    size_t size;
+    long long align;
+} _mem_hdr_t;
+
+struct esp_hdiffz_buf_cache_t {
+    SemaphoreHandle_t mutex;
+    uint8_t n_slots;
+    struct {
+        void *buf;
+        size_t size;
+        bool in_use;
+    } slots[];
+};
+
 static const char TAG[] = "hdiffz_miniz_plugin";
 
 /*********************
  * HELPER PROTOTYPES *
  *********************/
 
-static hpatch_BOOL _zlib_reset_for_next_node(_zlib_TDecompress* self);
+static size_t _window_size(int8_t window_bits);
+static esp_hdiffz_mem_class_t _window_class(int8_t window_bits);
+static size_t _in_buf_size(int8_t window_bits);
+static hpatch_BOOL _fill_input(_zlib_TDecompress* self);
+static hpatch_BOOL _dict_open(esp_hdiffz_miniz_plugin_t *owner, _zlib_TDecompress* self,
+        const esp_hdiffz_node_head_t *head);
+static void *_plugin_malloc(esp_hdiffz_miniz_plugin_t *owner, esp_hdiffz_mem_class_t cls, size_t size);
+static void _plugin_free(esp_hdiffz_miniz_plugin_t *owner, void *ptr);
 
 /****************
  * PLUGIN HOOKS *
@@ -58,7 +115,7 @@ static hpatch_BOOL miniz_is_can_open(const char* compressType) {
 
 /**
  * @brief Allocate and initiate plugin.
- * @param decompressPlugin Not Used.
+ * @param decompressPlugin Instance to allocate from.
  * @param dataSize Not Used.
  * @param[in] codeStream Data producer
  * @param[in] code_begin Pointer to start of data.
@@ -73,28 +130,34 @@ static hpatch_decompressHandle miniz_decompress_open( struct hpatch_TDecompress*
 
     ESP_LOGD(TAG, "miniz_decompress_open");
 
+    esp_hdiffz_miniz_plugin_t *owner = (esp_hdiffz_miniz_plugin_t *)decompressPlugin;
     _zlib_TDecompress* self = NULL;
+    esp_hdiffz_node_head_t head;
     signed char window_bits;
     int decompress_buf_size;
     unsigned char *_mem_buf = NULL;
     size_t _mem_buf_size = 0;
+    const unsigned char *code_mem;
 
     if (code_end-code_begin<1) {
         ESP_LOGE(TAG, "Provided data has length less than 1.");
         goto exit;
     }
 
-    /* Get the number of windowBits */
-    if (!codeStream->read(codeStream,code_begin,(unsigned char*)&window_bits,
-                          (unsigned char*)&window_bits+1)) return 0;
-    decompress_buf_size = 1 << window_bits;
-    ++code_begin;
-    assert(window_bits >= 8);
+    /* Get the number of windowBits and the dictionary, if any */
+    if (!esp_hdiffz_miniz_node_head(codeStream, code_begin, code_end, &head)) return 0;
+    window_bits = head.window_bits;
+    decompress_buf_size = _in_buf_size(window_bits);
+    code_begin += head.size;
     ESP_LOGD(TAG, "WindowBits %d detected.", window_bits);
 
+    /* Memory backed diffs are inflated in place; no input buffer needed */
+    code_mem = esp_hdiffz_stream_mem(codeStream);
+    if( NULL != code_mem ) decompress_buf_size = 0;
+
     /* Allocate space for the decompress object and the decompress buffer */
     _mem_buf_size = sizeof(_zlib_TDecompress) + decompress_buf_size;
-    _mem_buf = malloc(_mem_buf_size);
+    _mem_buf = _plugin_malloc(owner, ESP_HDIFFZ_MEM_IO, _mem_buf_size);
     if (!_mem_buf) {
         ESP_LOGE(TAG, "OOM");
         goto exit;
@@ -108,25 +171,46 @@ static hpatch_decompressHandle miniz_decompress_open( struct hpatch_TDecompress*
     self->code_begin   = code_begin;
     self->code_end     = code_end;
     self->window_bits  = window_bits;
-    
-    /* Init the inflater */
-    int res = inflateInit2(&self->d_stream, self->window_bits);
-    if(res != MZ_OK){
-        ESP_LOGE(TAG, "Failed in init inflate object (Error %d).", res);
+
+    /* The decoder and its window are reused by every node of the section.
+     * tinfl wraps around any power of two window at least as large as the
+     * one in the zlib header, so it only takes the node's window bits. */
+    self->win_size = _window_size(window_bits);
+    self->tinfl = _plugin_malloc(owner, ESP_HDIFFZ_MEM_STATE, sizeof(tinfl_decompressor));
+    self->window = _plugin_malloc(owner, _window_class(window_bits), self->win_size);
+    if( NULL == self->tinfl || NULL == self->window ) {
+        ESP_LOGE(TAG, "OOM");
         goto exit;
     }
+    self->tinfl_flags = TINFL_FLAG_PARSE_ZLIB_HEADER;
+    if( head.has_dict && !_dict_open(owner, self, &head) ) goto exit;
+    tinfl_init(self->tinfl);
+    self->tinfl_status = TINFL_STATUS_NEEDS_MORE_INPUT;
+
+    if( NULL != code_mem ) {
+        /* Hand the whole compressed range to tinfl at once */
+        self->dec_buf = NULL;
+        self->dec_buf_size = 0;
+        self->next_in = &code_mem[code_begin];
+        self->avail_in = (size_t)(code_end - code_begin);
+        self->code_begin = code_end;
+    }
 
     return self;
 
 exit:
-    if( NULL!=_mem_buf ) free(_mem_buf);
+    if( NULL!=self ) {
+        _plugin_free(owner, self->window);
+        _plugin_free(owner, self->tinfl);
+    }
+    if( NULL!=_mem_buf ) _plugin_free(owner, _mem_buf);
     return NULL;
 }
 
 
 /**
  * @brief Deinit and de-allocate the plugin.
- * @param[in,out] decompressPlugin Not Used.
+ * @param[in,out] decompressPlugin Instance the handle was allocated from.
  * @param[in,out] decompressHandle Decompress Object.
  * @return True on success; False otherwise.
  */
@@ -134,17 +218,19 @@ static hpatch_BOOL miniz_decompress_close(struct hpatch_TDecompress* decompressP
         hpatch_decompressHandle decompressHandle) {
 
     ESP_LOGD(TAG, "miniz_decompress_close");
+    esp_hdiffz_miniz_plugin_t *owner = (esp_hdiffz_miniz_plugin_t *)decompressPlugin;
     _zlib_TDecompress* self;
     hpatch_BOOL result = hpatch_TRUE;
 
     self = (_zlib_TDecompress*)decompressHandle;
     if ( !self ) return result;
 
-    if ( 0 != self->dec_buf ) _close_check(MZ_OK == inflateEnd(&self->d_stream));
+    _plugin_free(owner, self->window);
+    _plugin_free(owner, self->tinfl);
 
     memset(self,0,sizeof(_zlib_TDecompress));
 
-    if (self) free(self);
+    if (self) _plugin_free(owner, self);
     return result;
 }
 
@@ -159,66 +245,186 @@ static hpatch_BOOL miniz_decompress_part(hpatch_decompressHandle decompressHandl
         unsigned char* out_part_data, 
         unsigned char* out_part_data_end) {
 
-    ESP_LOGD(TAG, "miniz_decompress_part");
+    ESP_HDIFFZ_TRACE(TAG, "miniz_decompress_part");
     _zlib_TDecompress* self;
     self = (_zlib_TDecompress*)decompressHandle;
 
     assert( out_part_data != out_part_data_end );
-    
-    self->d_stream.next_out = out_part_data;
-    self->d_stream.avail_out = (uInt)(out_part_data_end-out_part_data);
-
-    while (self->d_stream.avail_out>0) {
-        ESP_LOGD(TAG, "Running avail_out %d", self->d_stream.avail_out);
-        uInt avail_out_back,avail_in_back;
-        int ret;
-        hpatch_StreamPos_t codeLen=(self->code_end - self->code_begin);
-        if ((self->d_stream.avail_in==0)&&(codeLen>0)) {
-            size_t readLen=self->dec_buf_size;
-            if (readLen>codeLen) readLen=(size_t)codeLen;
-            self->d_stream.next_in=self->dec_buf;
-            if (!self->codeStream->read(self->codeStream,self->code_begin,self->dec_buf,
-                                        self->dec_buf+readLen)) return hpatch_FALSE;//error;
-            self->d_stream.avail_in=(uInt)readLen;
-            self->code_begin+=readLen;
-            codeLen-=readLen;
+
+    /* tinfl decodes into the wrapping window, from which the output is
+     * copied. Each call decodes up to the end of the window, so a large
+     * request takes one call per window of output. */
+    while (out_part_data < out_part_data_end) {
+        size_t in_n, out_n;
+        hpatch_StreamPos_t codeLen;
+        tinfl_status status;
+
+        /* Return what was decoded last time first */
+        if (self->win_avail > 0) {
+            size_t n = out_part_data_end - out_part_data;
+            if (n > self->win_avail) n = self->win_avail;
+            memcpy(out_part_data, &self->window[self->win_out], n);
+            out_part_data += n;
+            self->win_out += n;
+            self->win_avail -= n;
+            continue;
         }
-        
-        avail_out_back=self->d_stream.avail_out;
-        avail_in_back=self->d_stream.avail_in;
-        ret=inflate(&self->d_stream,Z_PARTIAL_FLUSH);
-        if (ret==MZ_OK){
-            if ((self->d_stream.avail_in==avail_in_back)&&(self->d_stream.avail_out==avail_out_back)) {
-                ESP_LOGE(TAG, "No available in/out data");
+
+        if (!_fill_input(self)) return hpatch_FALSE;
+        codeLen = self->code_end - self->code_begin;
+        if (TINFL_STATUS_DONE == self->tinfl_status) {
+            if (self->avail_in + codeLen == 0) {
+                ESP_LOGE(TAG, "Stream complete");
                 return hpatch_FALSE;
             }
-        }else if (ret==Z_STREAM_END){
-            if (self->d_stream.avail_in+codeLen>0){ //next compress node!
-                if (!_zlib_reset_for_next_node(self)){
-                    ESP_LOGE(TAG, "Node complete");
-                    return hpatch_FALSE;
-                }
-            }else{//all end
-                if (self->d_stream.avail_out!=0){
-                    ESP_LOGE(TAG, "Stream complete");
-                    return hpatch_FALSE;
-                }
-            }
-        }else{
-            ESP_LOGE(TAG, "Unknown Error");
+            /* Next node; only the first one starts from the dictionary */
+            tinfl_init(self->tinfl);
+        }
+
+        if (self->win_ofs == self->win_size) self->win_ofs = 0;
+        in_n = self->avail_in;
+        out_n = self->win_size - self->win_ofs;
+        status = tinfl_decompress(self->tinfl, self->next_in, &in_n,
+                self->window, &self->window[self->win_ofs], &out_n,
+                self->tinfl_flags | (codeLen > 0 ? TINFL_FLAG_HAS_MORE_INPUT : 0));
+        self->tinfl_status = status;
+        self->next_in += in_n;
+        self->avail_in -= in_n;
+        self->win_out = self->win_ofs;
+        self->win_avail = out_n;
+        self->win_ofs += out_n;
+
+        if (status < TINFL_STATUS_DONE) {
+            ESP_LOGE(TAG, "Corrupt node (%d)", status);
+            return hpatch_FALSE;
+        }
+        if (0 == in_n && 0 == out_n && TINFL_STATUS_DONE != status) {
+            ESP_LOGE(TAG, "No available in/out data");
             return hpatch_FALSE;
         }
     }
     return hpatch_TRUE;
 }
 
-static hpatch_TDecompress _minizDecompressPlugin = {
-    .is_can_open = miniz_is_can_open,
-    .open = miniz_decompress_open,
-    .close = miniz_decompress_close,
-    .decompress_part = miniz_decompress_part,
+static esp_hdiffz_miniz_plugin_t _minizDecompressPlugin = {
+    .base = {
+        .is_can_open = miniz_is_can_open,
+        .open = miniz_decompress_open,
+        .close = miniz_decompress_close,
+        .decompress_part = miniz_decompress_part,
+    },
 };
-hpatch_TDecompress *minizDecompressPlugin = &_minizDecompressPlugin;
+hpatch_TDecompress *minizDecompressPlugin = &_minizDecompressPlugin.base;
+
+/********************
+ * PUBLIC FUNCTIONS *
+ ********************/
+
+void esp_hdiffz_miniz_plugin_init(esp_hdiffz_miniz_plugin_t *plugin) {
+    memset(plugin, 0, sizeof(esp_hdiffz_miniz_plugin_t));
+    plugin->base = _minizDecompressPlugin.base;
+}
+
+bool esp_hdiffz_miniz_node_head(const hpatch_TStreamInput *stream, hpatch_StreamPos_t begin,
+        hpatch_StreamPos_t end, esp_hdiffz_node_head_t *head) {
+    /* Window bits byte and up to two packed 64 bit uints */
+    unsigned char buf[1 + 2 * 10];
+    const unsigned char *p;
+    size_t n = sizeof(buf);
+
+    memset(head, 0, sizeof(esp_hdiffz_node_head_t));
+    if( end <= begin ) return false;
+    if( n > end - begin ) n = end - begin;
+    if( !stream->read(stream, begin, buf, buf + n) ) return false;
+
+    head->window_bits = buf[0] & ~ESP_HDIFFZ_NODE_DICT;
+    head->has_dict = 0 != (buf[0] & ESP_HDIFFZ_NODE_DICT);
+    if( head->window_bits < 8 || head->window_bits > CONFIG_HDIFFZ_MAX_WINDOW_BITS ) {
+        ESP_LOGE(TAG, "Unsupported window bits %d; at most %d", head->window_bits, CONFIG_HDIFFZ_MAX_WINDOW_BITS);
+        return false;
+    }
+
+    p = buf + 1;
+    if( head->has_dict ) {
+        if( !esp_hdiffz_unpack_uint(&p, buf + n, &head->dict_pos) || !esp_hdiffz_unpack_uint(&p, buf + n, &head->dict_len) ) {
+            ESP_LOGE(TAG, "Truncated node dictionary");
+            return false;
+        }
+        if( head->dict_len > ((hpatch_StreamPos_t)1 << head->window_bits) ) {
+            ESP_LOGE(TAG, "Dictionary of %d bytes exceeds window", (int)head->dict_len);
+            return false;
+        }
+    }
+    head->size = p - buf;
+
+    return true;
+}
+
+size_t esp_hdiffz_miniz_plugin_node_heap(int8_t window_bits, bool in_place) {
+    size_t heap[ESP_HDIFFZ_MEM_N] = { 0 }, largest[ESP_HDIFFZ_MEM_N] = { 0 };
+
+    esp_hdiffz_miniz_plugin_node_heap_cls(window_bits, in_place, heap, largest);
+    return heap[ESP_HDIFFZ_MEM_STATE] + heap[ESP_HDIFFZ_MEM_IO] + heap[ESP_HDIFFZ_MEM_CACHE];
+}
+
+void esp_hdiffz_miniz_plugin_node_heap_cls(int8_t window_bits, bool in_place, size_t *heap, size_t *largest) {
+    /* Same allocations as miniz_decompress_open */
+    const struct {
+        esp_hdiffz_mem_class_t cls;
+        size_t size;
+    } bufs[] = {
+        /* Decompress object and, unless inflating in place, the input buffer */
+        { ESP_HDIFFZ_MEM_IO, sizeof(_mem_hdr_t) + sizeof(_zlib_TDecompress)
+            + (in_place ? 0 : _in_buf_size(window_bits)) },
+        /* The decompressor and its window */
+        { ESP_HDIFFZ_MEM_STATE, sizeof(_mem_hdr_t) + sizeof(tinfl_decompressor) },
+        { _window_class(window_bits), sizeof(_mem_hdr_t) + _window_size(window_bits) },
+    };
+
+    for(int i=0; i < sizeof(bufs) / sizeof(bufs[0]); i++) {
+        heap[bufs[i].cls] += bufs[i].size;
+        if( bufs[i].size > largest[bufs[i].cls] ) largest[bufs[i].cls] = bufs[i].size;
+    }
+}
+
+int8_t esp_hdiffz_max_window_bits(const esp_hdiffz_mem_policy_t *policy) {
+    const esp_hdiffz_mem_t mem = { .policy = policy };
+    int8_t window_bits;
+
+    /* Only the window grows past 4 KB; every section may have one open */
+    for(window_bits = CONFIG_HDIFFZ_MAX_WINDOW_BITS; window_bits > MIN_WINDOW_BITS; window_bits--) {
+        size_t need = ESP_HDIFFZ_SEC_N * (sizeof(_mem_hdr_t) + _window_size(window_bits));
+        if( need <= esp_hdiffz_mem_free(&mem, _window_class(window_bits)) ) break;
+    }
+    ESP_LOGD(TAG, "Max window bits %d", window_bits);
+    return window_bits;
+}
+
+esp_hdiffz_buf_cache_t *esp_hdiffz_buf_cache_create(uint8_t n_slots) {
+    esp_hdiffz_buf_cache_t *cache;
+
+    cache = calloc(1, sizeof(esp_hdiffz_buf_cache_t) + n_slots * sizeof(cache->slots[0]));
+    if( NULL == cache ) return NULL;
+
+    cache->mutex = xSemaphoreCreateMutex();
+    if( NULL == cache->mutex ) {
+        free(cache);
+        return NULL;
+    }
+    cache->n_slots = n_slots;
+
+    return cache;
+}
+
+void esp_hdiffz_buf_cache_del(esp_hdiffz_buf_cache_t *cache) {
+    if( NULL == cache ) return;
+    for(uint8_t i=0; i < cache->n_slots; i++) {
+        assert(!cache->slots[i].in_use);
+        free(cache->slots[i].buf);
+    }
+    vSemaphoreDelete(cache->mutex);
+    free(cache);
+}
 
 
 /***********
@@ -226,25 +432,207 @@ hpatch_TDecompress *minizDecompressPlugin = &_minizDecompressPlugin;
  ***********/
 
 /**
- * @brief
- * @param self
+ * @brief Bytes of the window of a node.
+ */
+static size_t _window_size(int8_t window_bits) {
+    if( window_bits < MIN_WINDOW_BITS ) window_bits = MIN_WINDOW_BITS;
+    return (size_t)1 << window_bits;
+}
+
+/**
+ * @brief Memory class of the window of a node.
+ *
+ * Small windows stay with the rest of the inflate state. 32 KB windows
+ * would take more internal RAM than most boards can spare, so large ones
+ * are placed like the other caches.
+ */
+static esp_hdiffz_mem_class_t _window_class(int8_t window_bits) {
+    return _window_size(window_bits) <= MINIZ_STATE_WINDOW_MAX ?
+            ESP_HDIFFZ_MEM_STATE : ESP_HDIFFZ_MEM_CACHE;
+}
+
+/**
+ * @brief Bytes of the input buffer of a streamed node.
+ *
+ * Capped apart from the window, so a 32 KB window doesn't also bring a
+ * 32 KB input buffer.
+ */
+static size_t _in_buf_size(int8_t window_bits) {
+    size_t size = (size_t)1 << window_bits;
+    return size < MINIZ_IN_BUF_SIZE ? size : MINIZ_IN_BUF_SIZE;
+}
+
+/**
+ * @brief Refill the input buffer if it is empty and the node isn't fully read.
+ * @return True on success; False on a read error.
+ */
+static hpatch_BOOL _fill_input(_zlib_TDecompress* self){
+    hpatch_StreamPos_t codeLen=(self->code_end - self->code_begin);
+    size_t readLen;
+    int64_t t0;
+
+    if ((self->avail_in!=0)||(codeLen==0)) return hpatch_TRUE;
+
+    readLen=self->dec_buf_size;
+    if (readLen>codeLen) readLen=(size_t)codeLen;
+    self->next_in=self->dec_buf;
+    t0 = ESP_HDIFFZ_TRACE_BEGIN();
+    if (!self->codeStream->read(self->codeStream,self->code_begin,self->dec_buf,
+                                self->dec_buf+readLen)) return hpatch_FALSE;
+    ESP_HDIFFZ_TRACE_END(ESP_HDIFFZ_TRACE_DIFF_READ, t0, readLen);
+    self->avail_in=readLen;
+    self->code_begin+=readLen;
+    return hpatch_TRUE;
+}
+
+/**
+ * @brief Preset the window with the node's dictionary.
+ *
+ * Dictionary nodes are raw deflate streams.
+ *
  * @return True on success; False otherwise.
  */
-static hpatch_BOOL _zlib_reset_for_next_node(_zlib_TDecompress* self){
-    //backup
-    Bytef*   next_out_back      = self->d_stream.next_out;
-    Bytef*   next_in_back       = (Bytef*)self->d_stream.next_in;
-    unsigned int avail_out_back = self->d_stream.avail_out;
-    unsigned int avail_in_back  = self->d_stream.avail_in;
-    //reset
-    if (Z_OK!=inflateEnd(&self->d_stream)) return hpatch_FALSE;
-    if (Z_OK!=inflateInit2(&self->d_stream,self->window_bits)) return hpatch_FALSE;
-    //if (MZ_OK != inflateReset(&self->d_stream)) return hpatch_FALSE;
-    //restore
-    self->d_stream.next_out  = next_out_back;
-    self->d_stream.next_in   = next_in_back;
-    self->d_stream.avail_out = avail_out_back;
-    self->d_stream.avail_in  = avail_in_back;
+static hpatch_BOOL _dict_open(esp_hdiffz_miniz_plugin_t *owner, _zlib_TDecompress* self,
+        const esp_hdiffz_node_head_t *head){
+    const hpatch_TStreamInput *src = owner->dict_src;
+
+    if( NULL == src ) {
+        ESP_LOGE(TAG, "Node has a dictionary, but the plugin has no old data");
+        return hpatch_FALSE;
+    }
+    if( head->dict_pos + head->dict_len > src->streamSize ) {
+        ESP_LOGE(TAG, "Dictionary outside of old data");
+        return hpatch_FALSE;
+    }
+
+    if( !src->read(src, head->dict_pos, self->window, self->window + head->dict_len) ) {
+        ESP_LOGE(TAG, "Failed to read dictionary");
+        return hpatch_FALSE;
+    }
+    /* Output continues right after the dictionary, so back references
+     * reach into it */
+    self->win_ofs = head->dict_len;
+    self->tinfl_flags = 0;
     return hpatch_TRUE;
 }
 
+/**
+ * @brief Take a buffer of at least size bytes from the cache.
+ *
+ * Picks the smallest free buffer that fits. If none fit, a new buffer is
+ * allocated and retained in an empty slot if there is one.
+ *
+ * @return Buffer on success; NULL on OOM.
+ */
+static void *_buf_cache_get(esp_hdiffz_buf_cache_t *cache, const esp_hdiffz_mem_t *mem,
+        esp_hdiffz_mem_class_t cls, size_t size) {
+    void *buf = NULL;
+    int best = -1, empty = -1;
+
+    xSemaphoreTake(cache->mutex, portMAX_DELAY);
+    for(int i=0; i < cache->n_slots; i++) {
+        if( cache->slots[i].in_use ) continue;
+        if( NULL == cache->slots[i].buf ) {
+            if( empty < 0 ) empty = i;
+            continue;
+        }
+        if( cache->slots[i].size < size ) continue;
+        if( best < 0 || cache->slots[i].size < cache->slots[best].size ) best = i;
+    }
+    if( best >= 0 ) {
+        cache->slots[best].in_use = true;
+        buf = cache->slots[best].buf;
+    }
+    else if( empty >= 0 ) {
+        buf = esp_hdiffz_mem_alloc(mem, cls, size);
+        if( NULL != buf ) {
+            cache->slots[empty].buf = buf;
+            cache->slots[empty].size = size;
+            cache->slots[empty].in_use = true;
+        }
+    }
+    xSemaphoreGive(cache->mutex);
+
+    if( best < 0 && empty < 0 ) buf = esp_hdiffz_mem_alloc(mem, cls, size);
+    return buf;
+}
+
+/**
+ * @brief Return a buffer obtained from _buf_cache_get.
+ */
+static void _buf_cache_put(esp_hdiffz_buf_cache_t *cache, void *buf) {
+    bool cached = false;
+
+    xSemaphoreTake(cache->mutex, portMAX_DELAY);
+    for(int i=0; i < cache->n_slots; i++) {
+        if( cache->slots[i].buf == buf ) {
+            cache->slots[i].in_use = false;
+            cached = true;
+            break;
+        }
+    }
+    xSemaphoreGive(cache->mutex);
+
+    if( !cached ) free(buf);
+}
+
+/**
+ * @brief Allocate memory on behalf of a plugin instance.
+ *
+ * Honors the instance's memory limit, buffer cache and heap capabilities;
+ * otherwise the buffer is placed by the memory policy for its class. The
+ * shared minizDecompressPlugin may run several patches at once, so it keeps
+ * no counters; only instances of one patch do.
+ *
+ * @return Pointer on success; NULL on OOM or if the limit would be exceeded.
+ */
+static void *_plugin_malloc(esp_hdiffz_miniz_plugin_t *owner, esp_hdiffz_mem_class_t cls, size_t size) {
+    const esp_hdiffz_mem_t mem = { .policy = owner->mem_policy, .report = owner->mem_report };
+    _mem_hdr_t *hdr;
+
+    size += sizeof(_mem_hdr_t);
+    if( owner == &_minizDecompressPlugin ) {
+        hdr = esp_hdiffz_mem_alloc(NULL, cls, size);
+        if( NULL == hdr ) return NULL;
+        hdr->size = size;
+        return hdr + 1;
+    }
+    if( owner->mem_limit && owner->mem_used + size > owner->mem_limit ) {
+        ESP_LOGE(TAG, "Allocating %d bytes would exceed the %d byte limit.",
+                (int)size, (int)owner->mem_limit);
+        owner->oom = true;
+        return NULL;
+    }
+
+    if( owner->cache ) hdr = _buf_cache_get(owner->cache, &mem, cls, size);
+    else if( owner->caps ) hdr = heap_caps_malloc(size, owner->caps);
+    else hdr = esp_hdiffz_mem_alloc(&mem, cls, size);
+    if( NULL == hdr ) {
+        owner->oom = true;
+        return NULL;
+    }
+
+    hdr->size = size;
+    owner->mem_used += size;
+    if( owner->mem_used > owner->mem_peak ) owner->mem_peak = owner->mem_used;
+
+    return hdr + 1;
+}
+
+/**
+ * @brief Free memory allocated by _plugin_malloc.
+ */
+static void _plugin_free(esp_hdiffz_miniz_plugin_t *owner, void *ptr) {
+    _mem_hdr_t *hdr;
+
+    if( NULL == ptr ) return;
+    hdr = (_mem_hdr_t *)ptr - 1;
+    if( owner == &_minizDecompressPlugin ) {
+        free(hdr);
+        return;
+    }
+    owner->mem_used -= hdr->size;
+
+    if( owner->cache ) _buf_cache_put(owner->cache, hdr);
+    else free(hdr);
+}
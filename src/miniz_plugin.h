@@ -1,11 +1,116 @@
 #ifndef ESP_HDIFFZ_MINIZ_PLUGIN_H__
 #define ESP_HDIFFZ_MINIZ_PLUGIN_H__
 
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
 #include "HPatch/patch.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Cache of decompressor buffers that may be shared between plugin
+ * instances running on different tasks.
+ */
+typedef struct esp_hdiffz_buf_cache_t esp_hdiffz_buf_cache_t;
+
+/**
+ * @brief Plugin instance.
+ *
+ * An instance must only be used by one patch at a time.
+ */
+typedef struct esp_hdiffz_miniz_plugin_t {
+    hpatch_TDecompress base;           /**< Must be first; pass &base to patch_decompress */
+    esp_hdiffz_buf_cache_t *cache;     /**< Buffer cache to allocate from. May be NULL. */
+    uint32_t caps;                     /**< heap_caps_malloc capabilities when not using cache; 0 for the memory policy. */
+    const struct esp_hdiffz_mem_policy_t *mem_policy; /**< Placement when caps is 0; NULL for ESP_HDIFFZ_MEM_POLICY_DEFAULT(). */
+    struct esp_hdiffz_mem_report_t *mem_report; /**< Counts where the buffers landed. May be NULL. */
+    const hpatch_TStreamInput *dict_src; /**< Old data that node dictionaries are read from. May be NULL. */
+    size_t mem_limit;                  /**< Max bytes held at once; 0 for unlimited. */
+    size_t mem_used;                   /**< Bytes currently held. */
+    size_t mem_peak;                   /**< High water mark of mem_used. */
+    bool oom;                          /**< Set if an allocation failed or was refused. */
+} esp_hdiffz_miniz_plugin_t;
+
+/**
+ * Set in the window bits byte of a node whose deflate stream starts from a
+ * preset dictionary. Two packed uints follow: the offset and length of the
+ * dictionary in the old data. The deflate stream is then raw (no zlib
+ * wrapper) and may refer back into the dictionary as if it had just been
+ * decompressed.
+ */
+#define ESP_HDIFFZ_NODE_DICT 0x80
+
+/**
+ * @brief Header at the start of every compressed node.
+ */
+typedef struct esp_hdiffz_node_head_t {
+    int8_t window_bits;
+    bool has_dict;
+    hpatch_StreamPos_t dict_pos;       /**< Offset of the dictionary in the old data */
+    hpatch_StreamPos_t dict_len;       /**< At most 1 << window_bits */
+    uint8_t size;                      /**< Bytes before the deflate stream */
+} esp_hdiffz_node_head_t;
+
 /**
  * @brief Plugin Object
+ *
+ * Has no dict_src; nodes with a dictionary fail to open. The patch functions
+ * of this library use their own instances that can read the old data.
+ * Safe to use from several tasks at once; it keeps no memory counters.
  */
 extern hpatch_TDecompress *minizDecompressPlugin;
 
+/**
+ * @brief Initialize a plugin instance with no cache and no memory limit.
+ * @param[out] plugin Instance to initialize.
+ */
+void esp_hdiffz_miniz_plugin_init(esp_hdiffz_miniz_plugin_t *plugin);
+
+/**
+ * @brief Parse the header of a compressed node.
+ * @param[in] stream Diff stream.
+ * @param[in] begin Offset of the node.
+ * @param[in] end End of the node.
+ * @param[out] head Parsed header.
+ * @return True on success; false if unreadable, truncated or unsupported.
+ */
+bool esp_hdiffz_miniz_node_head(const hpatch_TStreamInput *stream, hpatch_StreamPos_t begin,
+        hpatch_StreamPos_t end, esp_hdiffz_node_head_t *head);
+
+/**
+ * @brief Heap a plugin instance holds while a single compressed node is open.
+ * @param[in] window_bits Window bits stored at the start of the node.
+ * @param[in] in_place True if the diff stream is memory backed.
+ * @return Number of bytes, including allocation headers.
+ */
+size_t esp_hdiffz_miniz_plugin_node_heap(int8_t window_bits, bool in_place);
+
+/**
+ * @brief esp_hdiffz_miniz_plugin_node_heap, by the memory class of each buffer.
+ * @param[in,out] heap Bytes added to each esp_hdiffz_mem_class_t.
+ * @param[in,out] largest Raised to the largest single buffer of each class.
+ */
+void esp_hdiffz_miniz_plugin_node_heap_cls(int8_t window_bits, bool in_place, size_t *heap, size_t *largest);
+
+/**
+ * @brief Allocate a buffer cache.
+ * @param[in] n_slots Maximum number of buffers retained by the cache.
+ * @return Cache on success; NULL on OOM.
+ */
+esp_hdiffz_buf_cache_t *esp_hdiffz_buf_cache_create(uint8_t n_slots);
+
+/**
+ * @brief Free a buffer cache and all the buffers it retains.
+ *
+ * No buffers may be in use when this is called.
+ */
+void esp_hdiffz_buf_cache_del(esp_hdiffz_buf_cache_t *cache);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
 #endif
@@ -0,0 +1,337 @@
+//#define LOG_LOCAL_LEVEL 4
+
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_hdiffz.h"
+
+#include "esp_system.h"
+#include "engine.h"
+#include "oldcheck.h"
+#include "pack.h"
+#include "mem.h"
+#include "miniz.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+/* Magic and trailer length at the very end of the diff */
+#define OLDCHECK_TAIL_SIZE 8
+/* Largest trailer accepted; a packed gap and a CRC per block */
+#define OLDCHECK_MAX_TRAILER (64*1024)
+
+static const char TAG[] = "esp_hdiffz_oldcheck";
+
+struct esp_hdiffz_oldcheck_t {
+    const hpatch_TStreamInput *old;
+    hpatch_StreamPos_t old_size;       /**< Old data size the checksums were made over */
+    SemaphoreHandle_t mutex;           /**< Protects everything below the block list */
+    uint8_t block_bits;
+    uint32_t n_blocks;
+    uint32_t *blocks;                  /**< Block indices, ascending */
+    uint32_t *crcs;                    /**< CRC-32 of each block */
+    uint32_t *verified;                /**< Bit per entry of blocks; only ever set */
+    unsigned char *buf;                /**< Gaps between reads within a block are read here */
+    int32_t cur;                       /**< Entry being hashed; -1 for none */
+    size_t cur_ofs;                    /**< Bytes of cur hashed so far */
+    size_t cur_size;                   /**< Size of cur's block */
+    uint32_t cur_crc;                  /**< Running CRC-32 of cur */
+    volatile bool failed;
+    size_t checked_bytes;
+    size_t extra_bytes;
+};
+
+/**************
+ * PROTOTYPES *
+ **************/
+static hpatch_BOOL oldcheck_read(const struct hpatch_TStreamInput* stream,
+        hpatch_StreamPos_t readFromPos,
+        unsigned char* out_data,
+        unsigned char* out_data_end);
+static bool oldcheck_hash(esp_hdiffz_oldcheck_t *oc, int32_t i,
+        size_t ofs, const unsigned char *data, size_t n);
+static bool oldcheck_fill(esp_hdiffz_oldcheck_t *oc, size_t to);
+static bool oldcheck_close(esp_hdiffz_oldcheck_t *oc);
+static int32_t oldcheck_find(const esp_hdiffz_oldcheck_t *oc, uint32_t block);
+
+/********************
+ * PUBLIC FUNCTIONS *
+ ********************/
+
+esp_err_t esp_hdiffz_oldcheck_create(const hpatch_TStreamInput *diff_stream,
+        const hpatch_TStreamInput *old, const esp_hdiffz_mem_t *mem, esp_hdiffz_oldcheck_t **out) {
+    esp_err_t err;
+    esp_hdiffz_head_t head;
+    esp_hdiffz_oldcheck_t *oc = NULL;
+    unsigned char tail[OLDCHECK_TAIL_SIZE];
+    unsigned char *trailer = NULL;
+    const unsigned char *p, *p_end;
+    hpatch_StreamPos_t n_blocks, block = 0;
+    uint32_t len;
+
+    *out = NULL;
+    err = esp_hdiffz_read_head(diff_stream, &head);
+    if( ESP_OK != err ) return err;
+    if( head.end == diff_stream->streamSize ) return ESP_OK;
+
+    err = ESP_ERR_INVALID_ARG;
+    if( diff_stream->streamSize - head.end < OLDCHECK_TAIL_SIZE
+            || !diff_stream->read(diff_stream, diff_stream->streamSize - OLDCHECK_TAIL_SIZE,
+                tail, tail + OLDCHECK_TAIL_SIZE)
+            || 0 != memcmp(tail + 4, ESP_HDIFFZ_OLDCHECK_MAGIC, 4) ) {
+        ESP_LOGE(TAG, "%d unknown bytes after the last section",
+                (int)(diff_stream->streamSize - head.end));
+        return err;
+    }
+    len = tail[0] | tail[1] << 8 | tail[2] << 16 | (uint32_t)tail[3] << 24;
+    if( head.end + len + OLDCHECK_TAIL_SIZE != diff_stream->streamSize
+            || len > OLDCHECK_MAX_TRAILER ) {
+        ESP_LOGE(TAG, "Bad old data checksum trailer length %u", len);
+        return err;
+    }
+
+    trailer = malloc(len);
+    if( NULL == trailer ) {
+        err = ESP_ERR_NO_MEM;
+        goto exit;
+    }
+    if( !diff_stream->read(diff_stream, head.end, trailer, trailer + len) ) {
+        err = ESP_FAIL;
+        goto exit;
+    }
+    p = trailer;
+    p_end = trailer + len;
+
+    if( len < 1 || p[0] < ESP_HDIFFZ_OLDCHECK_MIN_BITS || p[0] > ESP_HDIFFZ_OLDCHECK_MAX_BITS ) {
+        ESP_LOGE(TAG, "Unsupported old data block size");
+        goto exit;
+    }
+    p++;
+    if( !esp_hdiffz_unpack_uint(&p, p_end, &n_blocks) || n_blocks > (hpatch_StreamPos_t)(p_end - p) / 5 ) {
+        ESP_LOGE(TAG, "Bad old data block count");
+        goto exit;
+    }
+
+    oc = calloc(1, sizeof(esp_hdiffz_oldcheck_t));
+    if( NULL == oc ) {
+        err = ESP_ERR_NO_MEM;
+        goto exit;
+    }
+    oc->old = old;
+    oc->old_size = head.old_size;
+    oc->cur = -1;
+    oc->block_bits = trailer[0];
+    oc->n_blocks = n_blocks;
+    oc->mutex = xSemaphoreCreateMutex();
+    oc->blocks = malloc(n_blocks * sizeof(uint32_t) + 1);
+    oc->crcs = malloc(n_blocks * sizeof(uint32_t) + 1);
+    oc->verified = calloc((n_blocks + 31) / 32 + 1, sizeof(uint32_t));
+    oc->buf = esp_hdiffz_mem_alloc(mem, ESP_HDIFFZ_MEM_IO, 1 << oc->block_bits);
+    if( NULL == oc->mutex || NULL == oc->blocks || NULL == oc->crcs
+            || NULL == oc->verified || NULL == oc->buf ) {
+        err = ESP_ERR_NO_MEM;
+        goto exit;
+    }
+
+    for(uint32_t i=0; i < oc->n_blocks; i++) {
+        hpatch_StreamPos_t gap;
+
+        if( !esp_hdiffz_unpack_uint(&p, p_end, &gap) || p_end - p < 4 ) {
+            ESP_LOGE(TAG, "Truncated old data checksums");
+            goto exit;
+        }
+        /* Gaps count from block -1, so none is 0 */
+        block += gap;
+        if( 0 == gap || ((block - 1) << oc->block_bits) >= head.old_size ) {
+            ESP_LOGE(TAG, "Old data checksum outside of old data");
+            goto exit;
+        }
+        oc->blocks[i] = block - 1;
+        oc->crcs[i] = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+        p += 4;
+    }
+    if( p != p_end ) {
+        ESP_LOGE(TAG, "%d extra bytes in old data checksums", (int)(p_end - p));
+        goto exit;
+    }
+
+    ESP_LOGI(TAG, "%d old data blocks of %d bytes to verify",
+            (int)oc->n_blocks, 1 << oc->block_bits);
+    *out = oc;
+    oc = NULL;
+    err = ESP_OK;
+
+exit:
+    esp_hdiffz_oldcheck_del(oc, NULL);
+    if( NULL != trailer ) free(trailer);
+    return err;
+}
+
+void esp_hdiffz_oldcheck_as_input(esp_hdiffz_oldcheck_t *oc, hpatch_TStreamInput *in) {
+    in->streamImport = oc;
+    in->streamSize = oc->old->streamSize;
+    in->read = oldcheck_read;
+}
+
+bool esp_hdiffz_oldcheck_failed(const esp_hdiffz_oldcheck_t *oc) {
+    return NULL != oc && oc->failed;
+}
+
+esp_err_t esp_hdiffz_oldcheck_finish(esp_hdiffz_oldcheck_t *oc) {
+    bool ok;
+
+    if( NULL == oc ) return ESP_OK;
+    xSemaphoreTake(oc->mutex, portMAX_DELAY);
+    ok = !oc->failed && oldcheck_close(oc);
+    xSemaphoreGive(oc->mutex);
+    return ok ? ESP_OK : ESP_ERR_HDIFFZ_OLD_MISMATCH;
+}
+
+void esp_hdiffz_oldcheck_del(esp_hdiffz_oldcheck_t *oc, esp_hdiffz_patch_stats_t *stats) {
+    if( NULL == oc ) return;
+
+    if( NULL != stats ) {
+        stats->old_checked_bytes = oc->checked_bytes;
+        stats->old_check_extra_bytes = oc->extra_bytes;
+    }
+    ESP_LOGD(TAG, "%d old bytes verified; %d read only to complete a block",
+            (int)oc->checked_bytes, (int)oc->extra_bytes);
+
+    if( NULL != oc->mutex ) vSemaphoreDelete(oc->mutex);
+    if( NULL != oc->blocks ) free(oc->blocks);
+    if( NULL != oc->crcs ) free(oc->crcs);
+    if( NULL != oc->verified ) free(oc->verified);
+    if( NULL != oc->buf ) free(oc->buf);
+    free(oc);
+}
+
+/*********************
+ * PRIVATE FUNCTIONS *
+ *********************/
+
+/**
+ * @brief Read old data, hashing it into the checksum of each listed block.
+ *
+ * A block is hashed in order as reads arrive. Bytes that a read skips over
+ * within the block are read separately, so only gaps between the ranges the
+ * patch uses cost extra reads.
+ */
+static hpatch_BOOL oldcheck_read(const struct hpatch_TStreamInput* stream,
+        hpatch_StreamPos_t readFromPos,
+        unsigned char* out_data,
+        unsigned char* out_data_end) {
+    esp_hdiffz_oldcheck_t *oc = (esp_hdiffz_oldcheck_t *)stream->streamImport;
+    hpatch_StreamPos_t end = readFromPos + (out_data_end - out_data);
+    uint32_t first, last;
+    bool ok = true;
+
+    if( oc->failed ) return hpatch_FALSE;
+    if( out_data == out_data_end ) return hpatch_TRUE;
+    if( !oc->old->read(oc->old, readFromPos, out_data, out_data_end) ) return hpatch_FALSE;
+
+    first = readFromPos >> oc->block_bits;
+    last = (end - 1) >> oc->block_bits;
+    for(uint32_t block = first; ok && block <= last; block++) {
+        int32_t i = oldcheck_find(oc, block);
+        hpatch_StreamPos_t block_pos = (hpatch_StreamPos_t)block << oc->block_bits;
+        hpatch_StreamPos_t from = readFromPos > block_pos ? readFromPos : block_pos;
+        hpatch_StreamPos_t to = end < block_pos + (1 << oc->block_bits) ? end : block_pos + (1 << oc->block_bits);
+
+        if( i < 0 ) {
+            ESP_LOGE(TAG, "Old data at %d has no checksum", (int)block_pos);
+            oc->failed = true;
+            return hpatch_FALSE;
+        }
+        if( oc->verified[i / 32] & (1u << (i % 32)) ) continue;
+
+        xSemaphoreTake(oc->mutex, portMAX_DELAY);
+        if( !(oc->verified[i / 32] & (1u << (i % 32))) ) {
+            ok = oldcheck_hash(oc, i, from - block_pos, out_data + (from - readFromPos), to - from);
+        }
+        xSemaphoreGive(oc->mutex);
+    }
+
+    return ok;
+}
+
+/**
+ * @brief Hash n bytes at ofs of entry i's block; closes the block once complete.
+ *
+ * A different open block is completed and checked first.
+ * @return False on a mismatch or read error.
+ */
+static bool oldcheck_hash(esp_hdiffz_oldcheck_t *oc, int32_t i,
+        size_t ofs, const unsigned char *data, size_t n) {
+    if( oc->cur != i ) {
+        hpatch_StreamPos_t block_pos = (hpatch_StreamPos_t)oc->blocks[i] << oc->block_bits;
+
+        if( !oldcheck_close(oc) ) return false;
+        oc->cur = i;
+        oc->cur_ofs = 0;
+        oc->cur_crc = MZ_CRC32_INIT;
+        oc->cur_size = 1 << oc->block_bits;
+        if( oc->cur_size > oc->old_size - block_pos ) oc->cur_size = oc->old_size - block_pos;
+    }
+    if( ofs + n > oc->cur_size ) n = ofs < oc->cur_size ? oc->cur_size - ofs : 0;
+
+    if( ofs > oc->cur_ofs && !oldcheck_fill(oc, ofs) ) return false;
+    if( ofs + n > oc->cur_ofs ) {
+        size_t skip = oc->cur_ofs - ofs;
+        oc->cur_crc = mz_crc32(oc->cur_crc, data + skip, n - skip);
+        oc->checked_bytes += n - skip;
+        oc->cur_ofs = ofs + n;
+    }
+    if( oc->cur_ofs == oc->cur_size ) return oldcheck_close(oc);
+    return true;
+}
+
+/**
+ * @brief Read and hash the open block up to offset to.
+ */
+static bool oldcheck_fill(esp_hdiffz_oldcheck_t *oc, size_t to) {
+    hpatch_StreamPos_t block_pos = (hpatch_StreamPos_t)oc->blocks[oc->cur] << oc->block_bits;
+    size_t n = to - oc->cur_ofs;
+
+    if( !oc->old->read(oc->old, block_pos + oc->cur_ofs, oc->buf, oc->buf + n) ) return false;
+    oc->cur_crc = mz_crc32(oc->cur_crc, oc->buf, n);
+    oc->checked_bytes += n;
+    oc->extra_bytes += n;
+    oc->cur_ofs = to;
+    return true;
+}
+
+/**
+ * @brief Complete the open block, if any, and compare its checksum.
+ * @return False on a mismatch or read error.
+ */
+static bool oldcheck_close(esp_hdiffz_oldcheck_t *oc) {
+    int32_t i = oc->cur;
+
+    if( i < 0 ) return true;
+    if( oc->cur_ofs < oc->cur_size && !oldcheck_fill(oc, oc->cur_size) ) return false;
+    oc->cur = -1;
+
+    if( oc->cur_crc != oc->crcs[i] ) {
+        ESP_LOGE(TAG, "Old data at %d does not match the diff (CRC %08x, expected %08x)",
+                (int)((hpatch_StreamPos_t)oc->blocks[i] << oc->block_bits), oc->cur_crc, oc->crcs[i]);
+        oc->failed = true;
+        return false;
+    }
+    oc->verified[i / 32] |= 1u << (i % 32);
+    return true;
+}
+
+/**
+ * @brief Index of block in oc->blocks; -1 if it isn't listed.
+ */
+static int32_t oldcheck_find(const esp_hdiffz_oldcheck_t *oc, uint32_t block) {
+    uint32_t lo = 0, hi = oc->n_blocks;
+
+    while( lo < hi ) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if( oc->blocks[mid] < block ) lo = mid + 1;
+        else hi = mid;
+    }
+    if( lo < oc->n_blocks && oc->blocks[lo] == block ) return lo;
+    return -1;
+}
+
@@ -0,0 +1,83 @@
+#ifndef ESP_HDIFFZ_OLDCHECK_H__
+#define ESP_HDIFFZ_OLDCHECK_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_hdiffz.h"
+#include "mem.h"
+
+#include "HPatch/patch.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Old data checksums may trail the last section of a diff:
+ *
+ *     block_bits, packed n_blocks, (packed block gap, CRC-32 LE) * n_blocks,
+ *     trailer length LE32, "OCRC"
+ *
+ * Each entry is the CRC-32 of one block of 1 << block_bits bytes of old data
+ * (shorter at the end of the old data). A block gap is the difference to the
+ * previous block index, the first counted from -1, so blocks ascend.
+ * Listed blocks cover every old byte the covers and preset dictionaries use.
+ */
+#define ESP_HDIFFZ_OLDCHECK_MAGIC "OCRC"
+#define ESP_HDIFFZ_OLDCHECK_MIN_BITS 9
+#define ESP_HDIFFZ_OLDCHECK_MAX_BITS 16
+
+/**
+ * @brief Verifies old data against a diff's checksums as it is read.
+ */
+typedef struct esp_hdiffz_oldcheck_t esp_hdiffz_oldcheck_t;
+
+/**
+ * @brief Load the old data checksums of a diff.
+ * @param[in] diff_stream Diff.
+ * @param[in] old Old data to verify; may be read from several tasks.
+ * @param[in] mem Placement of the block buffer. May be NULL.
+ * @param[out] out Checker; NULL if the diff has no checksums.
+ * @return ESP_OK on success, also if the diff has no checksums;
+ *     ESP_ERR_INVALID_ARG if they are malformed;
+ *     ESP_ERR_NO_MEM on OOM.
+ */
+esp_err_t esp_hdiffz_oldcheck_create(const hpatch_TStreamInput *diff_stream,
+        const hpatch_TStreamInput *old, const esp_hdiffz_mem_t *mem, esp_hdiffz_oldcheck_t **out);
+
+/**
+ * @brief Populate an input stream that reads old data through the checker.
+ *
+ * Listed blocks are hashed as they are read and compared once complete.
+ * Reads fail once any block mismatched, and for blocks the diff did not list.
+ */
+void esp_hdiffz_oldcheck_as_input(esp_hdiffz_oldcheck_t *oc, hpatch_TStreamInput *in);
+
+/**
+ * @brief Check the block still being read, if any.
+ *
+ * Call once the patch has run; the last block the patch read from is only
+ * compared once it is complete.
+ *
+ * @return ESP_OK if all old data read matched; ESP_ERR_HDIFFZ_OLD_MISMATCH otherwise.
+ */
+esp_err_t esp_hdiffz_oldcheck_finish(esp_hdiffz_oldcheck_t *oc);
+
+/**
+ * @brief True if a block of old data did not match its checksum.
+ */
+bool esp_hdiffz_oldcheck_failed(const esp_hdiffz_oldcheck_t *oc);
+
+/**
+ * @brief Free the checker. May be NULL.
+ * @param[out] stats Verified byte counts are written here. May be NULL.
+ */
+void esp_hdiffz_oldcheck_del(esp_hdiffz_oldcheck_t *oc, esp_hdiffz_patch_stats_t *stats);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
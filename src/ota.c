@@ -7,7 +7,19 @@
 
 #include "esp_system.h"
 #include "miniz_plugin.h"
+#include "engine.h"
+#include "prefetch.h"
+#include "readahead.h"
+#include "reverse.h"
+#include "progress.h"
+#include "mem.h"
+#include "oldcheck.h"
+#include "profile.h"
+#include "trace.h"
 #include "esp_ota_ops.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "mbedtls/sha256.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/ringbuf.h"
@@ -18,9 +30,54 @@
 #define CONFIG_HDIFFZ_OTA_TASK_SIZE 20000
 #define CONFIG_HDIFFZ_OTA_TASK_PRIORITY 5
 #define CONFIG_HDIFFZ_OTA_TASK_NAME "hdiffz_ota"
+#define OTA_DIFF_BUF_SIZE 2048
+/* Output buffer used when patching from a PSRAM diff; multiple of a sector */
+#define OTA_BUF_SIZE (64*1024)
+/* Old firmware read ahead of use; 0 slots disables the prefetch task */
+#ifndef CONFIG_HDIFFZ_OTA_PREFETCH_SLOTS
+#define CONFIG_HDIFFZ_OTA_PREFETCH_SLOTS 4
+#endif
+#ifndef CONFIG_HDIFFZ_OTA_PREFETCH_SLOT_SIZE
+#define CONFIG_HDIFFZ_OTA_PREFETCH_SLOT_SIZE 4096
+#endif
+/* Write-behind buffer of a rollback file */
+#define OTA_ROLLBACK_BUF_SIZE 4096
+/* Read size when hashing old firmware */
+#define OTA_HASH_BUF_SIZE 1024
 
 static const char TAG[] = "esp_hdiffz_ota";
 
+#define OTA_SECTOR_SIZE 4096
+
+/**
+ * Destination of the patched firmware.
+ */
+/**
+ * Partition read through partition_read.
+ */
+typedef struct ota_src_t {
+    const esp_partition_t *part;
+    esp_hdiffz_flash_t *flash;         /**< Counts the reads. May be NULL. */
+} ota_src_t;
+
+typedef struct ota_dst_t {
+    const esp_partition_t *part;
+    esp_hdiffz_flash_t *flash;         /**< Counts the writes. */
+    int8_t *progress;                  /**< Updated on every write. May be NULL. */
+    const volatile bool *cancel;       /**< Writes fail once set. May be NULL. */
+    esp_hdiffz_progress_tracker_t *tracker; /**< Progress events. May be NULL. */
+    hpatch_StreamPos_t new_size;       /**< Patched firmware size from the diff header */
+} ota_dst_t;
+
+/**
+ * Destination of a reverse diff in a partition; sectors are erased as reached.
+ */
+typedef struct rollback_dst_t {
+    const esp_partition_t *part;
+    esp_hdiffz_flash_t *flash;         /**< Counts the erases and writes. */
+    size_t erased;                     /**< Bytes erased from the start of part */
+} rollback_dst_t;
+
 typedef struct esp_hdiffz_ota_handle_t{
     struct {
         const esp_partition_t *src;
@@ -35,9 +92,38 @@ typedef struct esp_hdiffz_ota_handle_t{
     size_t diff_size;
 }esp_hdiffz_ota_handle_t;
 
+/**
+ * An upgrade running on its own task.
+ */
+struct esp_hdiffz_ota_async_t {
+    esp_hdiffz_ota_async_config_t config;
+    volatile bool cancel;
+    esp_err_t err;                     /**< Result; valid once done is given */
+    SemaphoreHandle_t done;            /**< Given by the task when it finishes */
+    bool finished;                     /**< The task is about to give done */
+    bool released;                     /**< The task frees the handle instead of giving done */
+};
+
+/* Guards finished and released of every handle */
+static portMUX_TYPE s_async_lock = portMUX_INITIALIZER_UNLOCKED;
+
 /**************
  * PROTOTYPES *
  **************/
+static void ota_get_partitions(const esp_partition_t **src, const esp_partition_t **dst);
+static esp_err_t ota_file(FILE *diff, const esp_partition_t *src, const esp_partition_t *dst,
+        int8_t *progress, const esp_hdiffz_ota_opts_t *opts, const volatile bool *cancel);
+static esp_err_t ota_mem(const char *diff, size_t diff_size, const esp_partition_t *src,
+        const esp_partition_t *dst, int8_t *progress, const esp_hdiffz_ota_opts_t *opts,
+        const volatile bool *cancel);
+static void ota_async_task(void *params);
+static esp_err_t ota_patch(const hpatch_TStreamInput *diff_stream,
+        const esp_partition_t *src, const esp_partition_t *dst, int8_t *progress,
+        const esp_hdiffz_ota_opts_t *opts, const volatile bool *cancel,
+        esp_hdiffz_miniz_plugin_t *plugin, const esp_hdiffz_mem_t *mem,
+        unsigned char *buf, size_t buf_size, size_t held, esp_hdiffz_patch_stats_t *stats);
+static esp_err_t ota_validate(const hpatch_TStreamInput *diff_stream,
+        const esp_partition_t *src, esp_hdiffz_digest_t *digest);
 static hpatch_BOOL partition_read(const struct hpatch_TStreamInput* stream,
         hpatch_StreamPos_t readFromPos,
         unsigned char* out_data,
@@ -46,6 +132,14 @@ static hpatch_BOOL partition_write(const struct hpatch_TStreamOutput* stream,
         hpatch_StreamPos_t writeToPos,
         const unsigned char* data,
         const unsigned char* data_end);
+static bool parts_overlap(const esp_partition_t *a, const esp_partition_t *b);
+static esp_err_t ota_rollback(esp_hdiffz_rollback_t *rollback, esp_hdiffz_reverse_t *rev,
+        const esp_hdiffz_info_t *info, const esp_partition_t *src, const esp_partition_t *dst,
+        const esp_hdiffz_mem_t *mem, esp_hdiffz_flash_t *flash);
+static hpatch_BOOL rollback_write(const struct hpatch_TStreamOutput* stream,
+        hpatch_StreamPos_t writeToPos,
+        const unsigned char* data,
+        const unsigned char* data_end);
 
 #if 0
 static hpatch_BOOL ringbuf_read(const struct hpatch_TStreamInput* stream,
@@ -67,28 +161,10 @@ esp_err_t esp_hdiffz_ota_file(FILE *diff){
 }
 
 esp_err_t esp_hdiffz_ota_file_progress(FILE *diff, int8_t *progress){
-    /******************
-     * Get Partitions *
-     ******************/
     const esp_partition_t *src;
     const esp_partition_t *dst;
-    {
-        const esp_partition_t *configured = esp_ota_get_boot_partition();
-        src = esp_ota_get_running_partition();
-        if (configured != src) {
-            ESP_LOGW(TAG, "Configured OTA boot partition at offset 0x%08x, "
-                    "but running from offset 0x%08x",
-                     configured->address, src->address);
-            ESP_LOGW(TAG, "(This can happen if either the OTA boot data or "
-                    "preferred boot image become corrupted somehow.)");
-        }
-        ESP_LOGI(TAG, "Running partition type %d subtype %d (offset 0x%08x)",
-                src->type, src->subtype, src->address);
-
-        dst = esp_ota_get_next_update_partition(NULL);
-        assert(dst != NULL);
-    }
 
+    ota_get_partitions(&src, &dst);
     return esp_hdiffz_ota_file_adv_progress(diff, src, dst, progress);
 }
 
@@ -97,69 +173,124 @@ esp_err_t esp_hdiffz_ota_file_adv(FILE *diff, const esp_partition_t *src, const
 }
 
 esp_err_t esp_hdiffz_ota_file_adv_progress(FILE *diff, const esp_partition_t *src, const esp_partition_t *dst, int8_t *progress){
-    esp_err_t err = ESP_FAIL;
+    return esp_hdiffz_ota_file_opts(diff, src, dst, progress, NULL);
+}
 
-    if(progress) *progress = 0;
+esp_err_t esp_hdiffz_ota_file_opts(FILE *diff, const esp_partition_t *src, const esp_partition_t *dst,
+        int8_t *progress, const esp_hdiffz_ota_opts_t *opts){
+    const esp_hdiffz_ota_opts_t defaults = ESP_HDIFFZ_OTA_OPTS_DEFAULT();
+    return ota_file(diff, src, dst, progress, NULL == opts ? &defaults : opts, NULL);
+}
 
-    // Wipe destination partition
-    ESP_LOGI(TAG, "Wiping destination partition");
-#define PARTITION_STEP_SIZE (4096*32)
-    for(size_t start=0; start < dst->size; start += PARTITION_STEP_SIZE) {
-        size_t size = PARTITION_STEP_SIZE;
-        if(size > (dst->size - start)) size = dst->size - start;
-        err = esp_partition_erase_range(dst, start, size);
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Failed to wipe dst partition");
-            goto exit;
-        }
-        if(progress) {
-            *progress = (start * ESP_HDIFFZ_FORMAT_PROGRESS) / dst->size;
-        }
-        /* Allow some other tasks to do stuff */
-        taskYIELD();
-    }
-#undef PARTITION_STEP_SIZE
-    ESP_LOGI(TAG, "Wiping destination complete");
+esp_err_t esp_hdiffz_ota_mem(const char *diff, size_t diff_size){
+    return esp_hdiffz_ota_mem_progress(diff, diff_size, NULL);
+}
 
-    // Perform patch
-    {
-        hpatch_TStreamOutput out_stream = { 0 };
-        hpatch_TStreamInput  old_stream = { 0 };
-        hpatch_TStreamInput  diff_stream = { 0 };
+esp_err_t esp_hdiffz_ota_mem_progress(const char *diff, size_t diff_size, int8_t *progress){
+    const esp_partition_t *src;
+    const esp_partition_t *dst;
 
-        out_stream.streamImport = (void *)dst;
-        out_stream.streamSize = dst->size;
-        out_stream.write = partition_write;
+    ota_get_partitions(&src, &dst);
+    return esp_hdiffz_ota_mem_adv_progress(diff, diff_size, src, dst, progress);
+}
+
+esp_err_t esp_hdiffz_ota_mem_adv(const char *diff, size_t diff_size, const esp_partition_t *src, const esp_partition_t *dst){
+    return esp_hdiffz_ota_mem_adv_progress(diff, diff_size, src, dst, NULL);
+}
 
-        old_stream.streamImport = (void *)src;
-        old_stream.streamSize = src->size;
-        old_stream.read = partition_read;
+esp_err_t esp_hdiffz_ota_mem_adv_progress(const char *diff, size_t diff_size,
+        const esp_partition_t *src, const esp_partition_t *dst, int8_t *progress){
+    return esp_hdiffz_ota_mem_opts(diff, diff_size, src, dst, progress, NULL);
+}
 
-        diff_stream.streamImport = diff;
-        diff_stream.streamSize = esp_hdiffz_get_file_size(diff);
-        diff_stream.read = esp_hdiffz_file_read;
+esp_err_t esp_hdiffz_ota_mem_opts(const char *diff, size_t diff_size,
+        const esp_partition_t *src, const esp_partition_t *dst, int8_t *progress,
+        const esp_hdiffz_ota_opts_t *opts){
+    const esp_hdiffz_ota_opts_t defaults = ESP_HDIFFZ_OTA_OPTS_DEFAULT();
+    return ota_mem(diff, diff_size, src, dst, progress, NULL == opts ? &defaults : opts, NULL);
+}
 
-        if(!patch_decompress_progress(&out_stream, &old_stream, &diff_stream, minizDecompressPlugin, progress)){
-            ESP_LOGE(TAG, "Failed to run patch_decompress");
-            err = ESP_FAIL;
-            goto exit;
-        }
+esp_err_t esp_hdiffz_ota_start_async(const esp_hdiffz_ota_async_config_t *config, esp_hdiffz_ota_async_t **handle){
+    esp_err_t err = ESP_FAIL;
+    esp_hdiffz_ota_async_t *h = NULL;
+    BaseType_t res;
+
+    *handle = NULL;
+    if( NULL == config->diff && NULL == config->diff_mem ) {
+        ESP_LOGE(TAG, "No diff to apply");
+        return ESP_ERR_INVALID_ARG;
+    }
+    if( tskNO_AFFINITY != config->core && (config->core < 0 || config->core >= portNUM_PROCESSORS) ) {
+        ESP_LOGE(TAG, "No core %d", (int)config->core);
+        return ESP_ERR_INVALID_ARG;
     }
 
-    err = esp_ota_set_boot_partition(dst);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "esp_ota_set_boot_partition failed (%s)!", esp_err_to_name(err));
+    h = calloc(1, sizeof(esp_hdiffz_ota_async_t));
+    if( NULL == h ) {
+        err = ESP_ERR_NO_MEM;
         goto exit;
     }
+    h->config = *config;
+    if( NULL == h->config.src || NULL == h->config.dst ) {
+        const esp_partition_t *src, *dst;
+        ota_get_partitions(&src, &dst);
+        if( NULL == h->config.src ) h->config.src = src;
+        if( NULL == h->config.dst ) h->config.dst = dst;
+    }
+    if( 0 == h->config.stack_size ) h->config.stack_size = CONFIG_HDIFFZ_OTA_TASK_SIZE;
 
-    ESP_LOGI(TAG, "OTA Complete. Please Reboot System");
+    h->done = xSemaphoreCreateBinary();
+    if( NULL == h->done ) {
+        err = ESP_ERR_NO_MEM;
+        goto exit;
+    }
 
-    err = ESP_OK;
+    res = xTaskCreatePinnedToCore(ota_async_task, CONFIG_HDIFFZ_OTA_TASK_NAME,
+            h->config.stack_size, h, h->config.priority, NULL, h->config.core);
+    if( pdPASS != res ) {
+        ESP_LOGE(TAG, "Failed to create OTA task.");
+        err = ESP_ERR_NO_MEM;
+        goto exit;
+    }
+
+    *handle = h;
+    return ESP_OK;
 
 exit:
+    if( NULL != h ) {
+        if( NULL != h->done ) vSemaphoreDelete(h->done);
+        free(h);
+    }
+    return err;
+}
+
+void esp_hdiffz_ota_cancel(esp_hdiffz_ota_async_t *handle){
+    handle->cancel = true;
+}
+
+esp_err_t esp_hdiffz_ota_wait(esp_hdiffz_ota_async_t *handle, TickType_t timeout){
+    esp_err_t err;
+
+    if( pdTRUE != xSemaphoreTake(handle->done, timeout) ) return ESP_ERR_TIMEOUT;
+
+    err = handle->err;
+    vSemaphoreDelete(handle->done);
+    free(handle);
     return err;
 }
 
+void esp_hdiffz_ota_release(esp_hdiffz_ota_async_t *handle){
+    bool finished;
+
+    portENTER_CRITICAL(&s_async_lock);
+    handle->released = true;
+    finished = handle->finished;
+    portEXIT_CRITICAL(&s_async_lock);
+
+    /* A task that already finished gives done instead of freeing the handle */
+    if( finished ) esp_hdiffz_ota_wait(handle, portMAX_DELAY);
+}
+
 #if 0
 /**
  * @brief Apply 
@@ -293,10 +424,541 @@ exit:
 }
 #endif
 
+esp_err_t esp_hdiffz_ota_file_validate(FILE *diff, const esp_partition_t *src, esp_hdiffz_digest_t *digest){
+    esp_err_t err;
+    hpatch_TStreamInput diff_stream = { 0 };
+    esp_hdiffz_file_stream_t diff_file;
+
+    err = esp_hdiffz_file_stream_init(&diff_file, diff,
+            OTA_DIFF_BUF_SIZE, ESP_HDIFFZ_FILE_STREAM_MAX_LANES);
+    if( ESP_OK != err ) goto exit;
+    esp_hdiffz_file_stream_as_input(&diff_file, &diff_stream);
+
+    err = ota_validate(&diff_stream, src, digest);
+
+exit:
+    esp_hdiffz_file_stream_deinit(&diff_file);
+    return err;
+}
+
+esp_err_t esp_hdiffz_ota_mem_validate(const char *diff, size_t diff_size, const esp_partition_t *src, esp_hdiffz_digest_t *digest){
+    hpatch_TStreamInput diff_stream = { 0 };
+
+    esp_hdiffz_mem_as_stream_input(&diff_stream, (const unsigned char *)diff, diff_size);
+    return ota_validate(&diff_stream, src, digest);
+}
+
+esp_err_t esp_hdiffz_ota_old_sha256(const esp_partition_t *src, size_t size, uint8_t sha256[32]){
+    esp_err_t err = ESP_OK;
+    mbedtls_sha256_context sha;
+    unsigned char *buf;
+
+    if(NULL == src) src = esp_ota_get_running_partition();
+    if(size > src->size) return ESP_ERR_INVALID_SIZE;
+
+    buf = esp_hdiffz_mem_alloc(NULL, ESP_HDIFFZ_MEM_IO, OTA_HASH_BUF_SIZE);
+    if(NULL == buf) return ESP_ERR_NO_MEM;
+
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts_ret(&sha, 0);
+    for(size_t offset = 0; offset < size; offset += OTA_HASH_BUF_SIZE) {
+        size_t n = size - offset;
+        if(n > OTA_HASH_BUF_SIZE) n = OTA_HASH_BUF_SIZE;
+        err = esp_hdiffz_flash_read(NULL, src, offset, buf, n);
+        if(ESP_OK != err) goto exit;
+        mbedtls_sha256_update_ret(&sha, buf, n);
+    }
+    mbedtls_sha256_finish_ret(&sha, sha256);
+
+exit:
+    mbedtls_sha256_free(&sha);
+    free(buf);
+    return err;
+}
+
 /*********************
  * PRIVATE FUNCTIONS *
  *********************/
 
+/**
+ * @brief Get the running partition and the next OTA partition.
+ */
+static void ota_get_partitions(const esp_partition_t **src, const esp_partition_t **dst) {
+    const esp_partition_t *configured = esp_ota_get_boot_partition();
+    *src = esp_ota_get_running_partition();
+    if (configured != *src) {
+        ESP_LOGW(TAG, "Configured OTA boot partition at offset 0x%08x, "
+                "but running from offset 0x%08x",
+                 configured->address, (*src)->address);
+        ESP_LOGW(TAG, "(This can happen if either the OTA boot data or "
+                "preferred boot image become corrupted somehow.)");
+    }
+    ESP_LOGI(TAG, "Running partition type %d subtype %d (offset 0x%08x)",
+            (*src)->type, (*src)->subtype, (*src)->address);
+
+    *dst = esp_ota_get_next_update_partition(NULL);
+    assert(*dst != NULL);
+}
+
+/**
+ * @brief Firmware upgrade from a diff file.
+ * @param[in] opts Options of this patch.
+ * @param[in] cancel Stop once set. May be NULL.
+ */
+static esp_err_t ota_file(FILE *diff, const esp_partition_t *src, const esp_partition_t *dst,
+        int8_t *progress, const esp_hdiffz_ota_opts_t *opts, const volatile bool *cancel) {
+    esp_err_t err;
+    hpatch_TStreamInput file_stream = { 0 }, diff_stream = { 0 };
+    esp_hdiffz_file_stream_t diff_file;
+    esp_hdiffz_readahead_t *readahead = NULL;
+    esp_hdiffz_miniz_plugin_t plugin;
+    esp_hdiffz_patch_stats_t stats = { 0 };
+    esp_hdiffz_mem_report_t report = { 0 };
+    const esp_hdiffz_mem_t mem = { .policy = opts->mem_policy, .report = &report };
+    const esp_hdiffz_readahead_config_t defaults = ESP_HDIFFZ_READAHEAD_CONFIG_DEFAULT();
+    const esp_hdiffz_readahead_config_t *ra = NULL != opts->readahead ? opts->readahead : &defaults;
+    bool ahead = ra->depth > 0 && ra->refill_size > 0;
+    size_t held;
+
+    /* The read-ahead rings replace the lane buffers */
+    err = esp_hdiffz_file_stream_init_adv(&diff_file, diff,
+            ahead ? 0 : OTA_DIFF_BUF_SIZE, ESP_HDIFFZ_FILE_STREAM_MAX_LANES, &mem);
+    if( ESP_OK != err ) goto exit;
+    esp_hdiffz_file_stream_as_input(&diff_file, &file_stream);
+
+    err = esp_hdiffz_readahead_create(&file_stream, ra->refill_size, ra->depth,
+            ESP_HDIFFZ_READAHEAD_MAX_LANES, &mem, &readahead);
+    if( ESP_OK != err && ahead ) {
+        ESP_LOGW(TAG, "Patching without read-ahead");
+        ahead = false;
+        err = esp_hdiffz_readahead_create(&file_stream, 0, 0, 1, &mem, &readahead);
+    }
+    if( ESP_OK != err ) goto exit;
+    esp_hdiffz_readahead_as_input(readahead, &diff_stream);
+
+    esp_hdiffz_miniz_plugin_init(&plugin);
+    plugin.mem_policy = mem.policy;
+    plugin.mem_report = &report;
+    held = ahead ? esp_hdiffz_readahead_heap(ra->refill_size, ra->depth, ESP_HDIFFZ_READAHEAD_MAX_LANES)
+        : esp_hdiffz_readahead_heap(0, 0, 1);
+    err = ota_patch(&diff_stream, src, dst, progress, opts, cancel, &plugin, &mem, NULL, 0, held, &stats);
+
+exit:
+    /* After the patch; it resets the stats */
+    esp_hdiffz_readahead_del(readahead, &stats);
+    esp_hdiffz_file_stream_deinit(&diff_file);
+    stats.mem = report;
+    if( NULL != opts->stats ) *opts->stats = stats;
+    return err;
+}
+
+/**
+ * @brief Firmware upgrade from a diff in memory.
+ * @param[in] opts Options of this patch.
+ * @param[in] cancel Stop once set. May be NULL.
+ */
+static esp_err_t ota_mem(const char *diff, size_t diff_size, const esp_partition_t *src,
+        const esp_partition_t *dst, int8_t *progress, const esp_hdiffz_ota_opts_t *opts,
+        const volatile bool *cancel) {
+    esp_err_t err;
+    hpatch_TStreamInput diff_stream = { 0 };
+    esp_hdiffz_miniz_plugin_t plugin;
+    unsigned char *buf = NULL;
+    size_t buf_size = 0;
+    esp_hdiffz_patch_stats_t stats = { 0 };
+    esp_hdiffz_mem_report_t report = { 0 };
+    const esp_hdiffz_mem_t mem = { .policy = opts->mem_policy, .report = &report };
+
+    esp_hdiffz_mem_as_stream_input(&diff_stream, (const unsigned char *)diff, diff_size);
+
+    esp_hdiffz_miniz_plugin_init(&plugin);
+    plugin.mem_policy = mem.policy;
+    plugin.mem_report = &report;
+    if( heap_caps_get_free_size(MALLOC_CAP_SPIRAM) > 0 ) {
+        /* Larger output buffer; bulk copies move this much per flash op.
+         * The inflate state stays where the memory policy puts it. */
+        buf = esp_hdiffz_mem_alloc(&mem, ESP_HDIFFZ_MEM_CACHE, OTA_BUF_SIZE);
+        if( NULL != buf ) buf_size = OTA_BUF_SIZE;
+        ESP_LOGI(TAG, "Using %d byte copy buffer", (int)buf_size);
+    }
+
+    err = ota_patch(&diff_stream, src, dst, progress, opts, cancel, &plugin, &mem, buf, buf_size, buf_size, &stats);
+
+    if( NULL != buf ) free(buf);
+    stats.mem = report;
+    if( NULL != opts->stats ) *opts->stats = stats;
+    return err;
+}
+
+/**
+ * @brief Task started by esp_hdiffz_ota_start_async.
+ */
+static void ota_async_task(void *params) {
+    esp_hdiffz_ota_async_t *h = params;
+    const esp_hdiffz_ota_async_config_t *config = &h->config;
+    bool released;
+
+    if( NULL != config->diff_mem ) {
+        h->err = ota_mem(config->diff_mem, config->diff_mem_size, config->src, config->dst,
+                config->progress, &config->opts, &h->cancel);
+    }
+    else {
+        h->err = ota_file(config->diff, config->src, config->dst, config->progress,
+                &config->opts, &h->cancel);
+    }
+
+    portENTER_CRITICAL(&s_async_lock);
+    h->finished = true;
+    released = h->released;
+    portEXIT_CRITICAL(&s_async_lock);
+
+    if( released ) {
+        vSemaphoreDelete(h->done);
+        free(h);
+    }
+    else {
+        /* h may be freed by esp_hdiffz_ota_wait or esp_hdiffz_ota_release from here on */
+        xSemaphoreGive(h->done);
+    }
+    vTaskDelete(NULL);
+}
+
+/**
+ * @brief Dry run the diff against src; nothing is erased or written.
+ * @param[in] src Partition to apply the patch from; NULL for the running partition.
+ */
+static esp_err_t ota_validate(const hpatch_TStreamInput *diff_stream,
+        const esp_partition_t *src, esp_hdiffz_digest_t *digest) {
+    hpatch_TStreamInput old_stream = { 0 };
+    ota_src_t old_src = { 0 };
+
+    if(NULL == src) src = esp_ota_get_running_partition();
+
+    old_src.part = src;
+    old_stream.streamImport = &old_src;
+    old_stream.streamSize = src->size;
+    old_stream.read = partition_read;
+
+    return esp_hdiffz_validate(&old_stream, diff_stream, digest);
+}
+
+/**
+ * @brief Wipe dst, apply the diff from src into it and set it as boot partition.
+ * @param[in] diff_stream Diff to apply.
+ * @param[in] src partition to be apply patch from
+ * @param[in] dst partition to save the patched firmware
+ * @param[out] progress Progress in range [0, 100]. May be NULL.
+ * @param[in] opts Options of this patch.
+ * @param[in] cancel Stop before the boot partition is set once this is set. May be NULL.
+ * @param[in] plugin Decompressor; its dict_src is set to src for the duration.
+ * @param[in] mem Policy and report of this patch, for the buffers allocated here.
+ * @param[in] buf Output buffer; a multiple of the sector size. May be NULL.
+ * @param[in] buf_size Number of bytes in buf.
+ * @param[in] held Heap the caller already allocated for this patch, e.g. buf
+ *     and the read-ahead rings; only reported.
+ * @param[out] stats Overwritten with the engine's accounting of the patch, then the
+ *     prefetch and flash counters. The caller fills in its own counters, e.g. the
+ *     read-ahead's, afterwards.
+ * @return ESP_OK on success.
+ */
+static esp_err_t ota_patch(const hpatch_TStreamInput *diff_stream,
+        const esp_partition_t *src, const esp_partition_t *dst, int8_t *progress,
+        const esp_hdiffz_ota_opts_t *opts, const volatile bool *cancel,
+        esp_hdiffz_miniz_plugin_t *plugin, const esp_hdiffz_mem_t *mem,
+        unsigned char *buf, size_t buf_size, size_t held, esp_hdiffz_patch_stats_t *stats) {
+    esp_err_t err = ESP_FAIL;
+    esp_hdiffz_info_t info;
+    ota_dst_t out = { 0 };
+    size_t wipe_size;
+    esp_hdiffz_reverse_t *rev = NULL;
+    esp_hdiffz_progress_tracker_t tracker, *track = NULL;
+    hpatch_TStreamInput src_stream = { 0 };
+    esp_hdiffz_oldcheck_t *oldcheck = NULL;
+    ota_src_t old_src = { 0 };
+    esp_hdiffz_flash_t flash;
+
+    /* Flash operations of this update are counted from here on */
+    esp_hdiffz_flash_init(&flash, opts->flash_timing);
+    if(progress) *progress = 0;
+
+    /* Reject diffs that can't be applied before touching flash */
+    err = esp_hdiffz_get_info(diff_stream, &info);
+    if(ESP_OK != err) {
+        ESP_LOGE(TAG, "Failed to parse diff header");
+        goto exit;
+    }
+    if(info.new_size > dst->size) {
+        ESP_LOGE(TAG, "Patched firmware (%d bytes) does not fit in dst partition (%d bytes)",
+                (int)info.new_size, dst->size);
+        err = ESP_ERR_INVALID_SIZE;
+        goto exit;
+    }
+    if(info.old_size > src->size) {
+        ESP_LOGE(TAG, "Diff expects %d bytes of old firmware; src partition is %d bytes",
+                (int)info.old_size, src->size);
+        err = ESP_ERR_INVALID_SIZE;
+        goto exit;
+    }
+    if(NULL != opts->rollback && NULL == opts->rollback->file && NULL != opts->rollback->part
+            && (parts_overlap(opts->rollback->part, src) || parts_overlap(opts->rollback->part, dst))) {
+        ESP_LOGE(TAG, "Rollback partition overlaps the src or dst partition");
+        err = ESP_ERR_INVALID_ARG;
+        goto exit;
+    }
+    /* What the engine and decompressor will still allocate, in the heaps the
+     * policy places each class in. The prefetcher is left out: it is optional
+     * and the patch runs without it when its slots don't fit. */
+    {
+        const esp_hdiffz_engine_cfg_t engine = { .buf = buf, .buf_size = buf_size };
+        const bool in_place = NULL != esp_hdiffz_stream_mem(diff_stream);
+        size_t need[ESP_HDIFFZ_MEM_N] = { 0 }, largest[ESP_HDIFFZ_MEM_N] = { 0 };
+        size_t engine_largest;
+
+        /* Every node is counted at the largest window; never less than the diff needs */
+        for(int i=0; i < info.n_nodes; i++) {
+            esp_hdiffz_miniz_plugin_node_heap_cls(info.window_bits, in_place, need, largest);
+        }
+        need[ESP_HDIFFZ_MEM_IO] += esp_hdiffz_engine_heap(&engine, &engine_largest);
+        if( engine_largest > largest[ESP_HDIFFZ_MEM_IO] ) largest[ESP_HDIFFZ_MEM_IO] = engine_largest;
+        err = esp_hdiffz_mem_check(mem, need, largest);
+        if(ESP_OK != err) {
+            ESP_LOGE(TAG, "Not enough heap to patch; %d bytes already allocated", (int)held);
+            goto exit;
+        }
+    }
+
+    /* Old data the diff carries checksums for is verified as it is read */
+    old_src.part = src;
+    old_src.flash = &flash;
+    src_stream.streamImport = &old_src;
+    src_stream.streamSize = src->size;
+    src_stream.read = partition_read;
+    err = esp_hdiffz_oldcheck_create(diff_stream, &src_stream, mem, &oldcheck);
+    if(ESP_OK != err) {
+        ESP_LOGE(TAG, "Failed to load old firmware checksums");
+        goto exit;
+    }
+
+    // Wipe only the sectors the patched firmware will occupy
+    wipe_size = (info.new_size + OTA_SECTOR_SIZE - 1) & ~(OTA_SECTOR_SIZE - 1);
+    if(wipe_size > dst->size) wipe_size = dst->size;
+    ESP_LOGI(TAG, "Wiping %d bytes of destination partition", (int)wipe_size);
+    if(NULL != opts->progress_cb && NULL != opts->progress_cb->cb) {
+        track = &tracker;
+        esp_hdiffz_progress_start(track, opts->progress_cb, wipe_size, info.new_size);
+    }
+#define PARTITION_STEP_SIZE (OTA_SECTOR_SIZE*32)
+    for(size_t start=0; start < wipe_size; start += PARTITION_STEP_SIZE) {
+        size_t size = PARTITION_STEP_SIZE;
+        int64_t t0;
+        if(cancel && *cancel) goto cancelled;
+        if(size > (wipe_size - start)) size = wipe_size - start;
+        t0 = ESP_HDIFFZ_TRACE_BEGIN();
+        err = esp_hdiffz_flash_erase_range(&flash, dst, start, size);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to wipe dst partition");
+            goto exit;
+        }
+        ESP_HDIFFZ_TRACE_END(ESP_HDIFFZ_TRACE_ERASE, t0, size);
+        if(progress) {
+            *progress = (start * ESP_HDIFFZ_FORMAT_PROGRESS) / wipe_size;
+        }
+        if(track) esp_hdiffz_progress_update(track, start + size);
+        /* Allow some other tasks to do stuff */
+        t0 = ESP_HDIFFZ_TRACE_BEGIN();
+        taskYIELD();
+        ESP_HDIFFZ_TRACE_END(ESP_HDIFFZ_TRACE_YIELD, t0, 0);
+    }
+#undef PARTITION_STEP_SIZE
+    ESP_LOGI(TAG, "Wiping destination complete");
+    if(track) esp_hdiffz_progress_phase(track, ESP_HDIFFZ_PHASE_PATCH);
+
+    // Perform patch
+    {
+        hpatch_TStreamOutput out_stream = { 0 };
+        hpatch_TStreamInput  old_stream = { 0 }, prefetch_stream = { 0 };
+        esp_hdiffz_engine_cfg_t cfg = { 0 };
+        esp_hdiffz_prefetch_t *prefetch = NULL;
+
+        out.part = dst;
+        out.flash = &flash;
+        out.progress = progress;
+        out.cancel = cancel;
+        out.tracker = track;
+        out.new_size = info.new_size;
+
+        out_stream.streamImport = &out;
+        out_stream.streamSize = info.new_size;
+        out_stream.write = partition_write;
+
+        if(NULL != oldcheck) esp_hdiffz_oldcheck_as_input(oldcheck, &old_stream);
+        else old_stream = src_stream;
+
+        /* Unchanged regions are moved flash to flash in whole sectors */
+        cfg.out = &out_stream;
+        cfg.old = &old_stream;
+        cfg.diff = diff_stream;
+        cfg.plugin = &plugin->base;
+
+        /* Preset dictionaries bypass the prefetcher; they are read once at open */
+        plugin->dict_src = &old_stream;
+        cfg.buf = buf;
+        cfg.buf_size = buf_size;
+        cfg.align = OTA_SECTOR_SIZE;
+        cfg.stats = stats;
+        cfg.mem = mem;
+
+        /* Old ranges of upcoming covers are read on the other core */
+        if(CONFIG_HDIFFZ_OTA_PREFETCH_SLOTS > 0) {
+            if(ESP_OK == esp_hdiffz_prefetch_create(&old_stream, CONFIG_HDIFFZ_OTA_PREFETCH_SLOT_SIZE,
+                        CONFIG_HDIFFZ_OTA_PREFETCH_SLOTS, mem, &prefetch)) {
+                esp_hdiffz_prefetch_as_input(prefetch, &prefetch_stream);
+                cfg.old = &prefetch_stream;
+                cfg.hint = esp_hdiffz_prefetch_hint;
+                cfg.hint_ctx = prefetch;
+            }
+            else {
+                ESP_LOGW(TAG, "Patching without prefetch");
+            }
+        }
+
+        /* Covers are recorded for the reverse diff */
+        if(NULL != opts->rollback) {
+            err = esp_hdiffz_reverse_create(mem, &rev);
+            if(ESP_OK != err) {
+                esp_hdiffz_prefetch_del(prefetch, NULL);
+                goto exit;
+            }
+            cfg.cover = esp_hdiffz_reverse_cover;
+            cfg.cover_ctx = rev;
+        }
+
+        err = esp_hdiffz_engine_patch(&cfg);
+        plugin->dict_src = NULL;
+        esp_hdiffz_prefetch_del(prefetch, stats);
+        if(cancel && *cancel) goto cancelled;
+        if(esp_hdiffz_oldcheck_failed(oldcheck)
+                || (ESP_OK == err && ESP_OK != esp_hdiffz_oldcheck_finish(oldcheck))) {
+            ESP_LOGE(TAG, "Old firmware does not match the diff");
+            err = ESP_ERR_HDIFFZ_OLD_MISMATCH;
+            goto exit;
+        }
+        if(ESP_OK != err){
+            ESP_LOGE(TAG, "Failed to apply patch");
+            goto exit;
+        }
+    }
+
+    if(NULL != rev) {
+        if(track) esp_hdiffz_progress_phase(track, ESP_HDIFFZ_PHASE_ROLLBACK);
+        err = ota_rollback(opts->rollback, rev, &info, src, dst, mem, &flash);
+        if(ESP_OK != err) goto exit;
+    }
+
+    /* Last point to back out; the old firmware still boots */
+    if(cancel && *cancel) goto cancelled;
+
+    err = esp_ota_set_boot_partition(dst);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "esp_ota_set_boot_partition failed (%s)!", esp_err_to_name(err));
+        goto exit;
+    }
+
+    esp_hdiffz_flash_report(&flash, &stats->flash);
+    ESP_LOGI(TAG, "Flash: %d sectors erased (at most %d times each), %d bytes in %d page programs,"
+            " %d bytes read; modeled %d ms",
+            (int)stats->flash.sectors_erased, (int)stats->flash.max_sector_erases,
+            (int)stats->flash.write_bytes, (int)stats->flash.n_page_programs,
+            (int)stats->flash.read_bytes,
+            (int)((stats->flash.erase_us + stats->flash.write_us + stats->flash.read_us) / 1000));
+    ESP_LOGI(TAG, "OTA Complete. Please Reboot System");
+
+    err = ESP_OK;
+    goto exit;
+
+cancelled:
+    ESP_LOGW(TAG, "OTA cancelled; boot partition unchanged");
+    err = ESP_ERR_HDIFFZ_CANCELLED;
+
+exit:
+    esp_hdiffz_oldcheck_del(oldcheck, stats);
+    esp_hdiffz_reverse_del(rev);
+    esp_hdiffz_flash_report(&flash, &stats->flash);
+    esp_hdiffz_flash_deinit(&flash);
+    if(track) esp_hdiffz_progress_end(track, err);
+    return err;
+}
+
+/**
+ * @brief True if two partitions share any flash.
+ */
+static bool parts_overlap(const esp_partition_t *a, const esp_partition_t *b) {
+    return a->address < b->address + b->size && b->address < a->address + a->size;
+}
+
+/**
+ * @brief Write the reverse diff of a completed patch to rollback.
+ *
+ * Both images are read back from flash; src is still intact at this point.
+ */
+static esp_err_t ota_rollback(esp_hdiffz_rollback_t *rollback, esp_hdiffz_reverse_t *rev,
+        const esp_hdiffz_info_t *info, const esp_partition_t *src, const esp_partition_t *dst,
+        const esp_hdiffz_mem_t *mem, esp_hdiffz_flash_t *flash) {
+    esp_err_t err;
+    hpatch_TStreamInput old_stream = { 0 }, new_stream = { 0 };
+    hpatch_TStreamOutput out_stream = { 0 };
+    rollback_dst_t part_dst = { 0 };
+    ota_src_t old_src = { 0 }, new_src = { 0 };
+    esp_hdiffz_file_stream_t file_dst;
+    int64_t start = esp_timer_get_time();
+
+    /* The deinit below must be safe on every path */
+    memset(&file_dst, 0, sizeof(file_dst));
+
+    old_src.part = src;
+    old_src.flash = flash;
+    new_src.part = dst;
+    new_src.flash = flash;
+    old_stream.streamImport = &old_src;
+    old_stream.streamSize = info->old_size;
+    old_stream.read = partition_read;
+    new_stream.streamImport = &new_src;
+    new_stream.streamSize = info->new_size;
+    new_stream.read = partition_read;
+
+    if(NULL != rollback->file) {
+        /* The diff is written in small sequential pieces; buffer them */
+        err = esp_hdiffz_file_stream_init_adv(&file_dst, rollback->file, OTA_ROLLBACK_BUF_SIZE, 1, mem);
+        if(ESP_OK != err) return err;
+        esp_hdiffz_file_stream_as_output(&file_dst, &out_stream, (hpatch_StreamPos_t)-1);
+    }
+    else if(NULL != rollback->part) {
+        part_dst.part = rollback->part;
+        part_dst.flash = flash;
+        out_stream.streamImport = &part_dst;
+        out_stream.write = rollback_write;
+    }
+    else {
+        ESP_LOGE(TAG, "No rollback destination");
+        return ESP_ERR_INVALID_ARG;
+    }
+    out_stream.streamSize = (hpatch_StreamPos_t)-1;
+
+    err = esp_hdiffz_reverse_write(rev, &old_stream, &new_stream, &out_stream, &rollback->size);
+    if(ESP_OK == err && NULL != rollback->file) err = esp_hdiffz_file_stream_flush(&file_dst);
+    esp_hdiffz_file_stream_deinit(&file_dst);
+    if(ESP_OK != err) {
+        ESP_LOGE(TAG, "Failed to write rollback diff");
+        return err;
+    }
+    if(NULL != rollback->file) fflush(rollback->file);
+    rollback->time_us = esp_timer_get_time() - start;
+    ESP_LOGI(TAG, "Rollback diff of %d bytes written in %d ms",
+            (int)rollback->size, (int)(rollback->time_us / 1000));
+    return ESP_OK;
+}
+
+
 
 /**
  * @brief Read data from partition.
@@ -312,9 +974,9 @@ static hpatch_BOOL partition_read(const struct hpatch_TStreamInput* stream,
     esp_err_t err;
     int n_bytes = out_data_end - out_data;
 
-    esp_partition_t *part = (esp_partition_t*)stream->streamImport;
+    ota_src_t *src = (ota_src_t*)stream->streamImport;
 
-    err = esp_partition_read(part, readFromPos, out_data, n_bytes);
+    err = esp_hdiffz_flash_read(src->flash, src->part, readFromPos, out_data, n_bytes);
 
     switch(err){
         case ESP_OK:
@@ -347,9 +1009,12 @@ static hpatch_BOOL partition_write(const struct hpatch_TStreamOutput* stream,
     esp_err_t err;
     int n_bytes = data_end - data;
 
-    esp_partition_t *part = (esp_partition_t*)stream->streamImport;
+    ota_dst_t *out = (ota_dst_t*)stream->streamImport;
+
+    /* Fails the patch without an error log; ota_patch reports the cancel */
+    if(out->cancel && *out->cancel) return hpatch_FALSE;
 
-    err = esp_partition_write(part, writeToPos, data, n_bytes);
+    err = esp_hdiffz_flash_write(out->flash, out->part, writeToPos, data, n_bytes);
 
     switch(err){
         case ESP_OK:
@@ -365,6 +1030,43 @@ static hpatch_BOOL partition_write(const struct hpatch_TStreamOutput* stream,
             ESP_LOGE(TAG, "Unknown error reading from partition (%s)", esp_err_to_name(err));
             return hpatch_FALSE;
     }
+
+    if(out->progress) {
+        *out->progress = ESP_HDIFFZ_FORMAT_PROGRESS
+                + ((writeToPos + n_bytes) * (100 - ESP_HDIFFZ_FORMAT_PROGRESS)) / out->new_size;
+    }
+    if(out->tracker) esp_hdiffz_progress_update(out->tracker, writeToPos + n_bytes);
+    return hpatch_TRUE;
+}
+
+/**
+ * @brief Write a reverse diff to a partition, erasing sectors on the way.
+ */
+static hpatch_BOOL rollback_write(const struct hpatch_TStreamOutput* stream,
+        hpatch_StreamPos_t writeToPos,
+        const unsigned char* data,
+        const unsigned char* data_end) {
+    esp_err_t err;
+    rollback_dst_t *out = (rollback_dst_t*)stream->streamImport;
+    size_t end = writeToPos + (data_end - data);
+
+    if(end > out->erased) {
+        size_t size = ((end - out->erased) + OTA_SECTOR_SIZE - 1) & ~(OTA_SECTOR_SIZE - 1);
+        int64_t t0 = ESP_HDIFFZ_TRACE_BEGIN();
+        err = esp_hdiffz_flash_erase_range(out->flash, out->part, out->erased, size);
+        if(ESP_OK != err) {
+            ESP_LOGE(TAG, "Failed to erase rollback partition (%s)", esp_err_to_name(err));
+            return hpatch_FALSE;
+        }
+        ESP_HDIFFZ_TRACE_END(ESP_HDIFFZ_TRACE_ERASE, t0, size);
+        out->erased += size;
+    }
+
+    err = esp_hdiffz_flash_write(out->flash, out->part, writeToPos, data, data_end - data);
+    if(ESP_OK != err) {
+        ESP_LOGE(TAG, "Failed to write rollback partition (%s)", esp_err_to_name(err));
+        return hpatch_FALSE;
+    }
     return hpatch_TRUE;
 }
 
@@ -383,7 +1085,7 @@ static hpatch_BOOL ringbuf_read(const struct hpatch_TStreamInput* stream,
     char *ringbuf_ptr;
     size_t n_bytes = out_data_end - out_data;
 
-    ESP_LOGD(TAG, "Attempting to receive %d bytes from %d.", n_bytes, (int)readFromPos);
+    ESP_HDIFFZ_TRACE(TAG, "Attempting to receive %d bytes from %d.", n_bytes, (int)readFromPos);
 
     while(n_bytes > 0){
         size_t bytes_received = 0;
@@ -391,7 +1093,7 @@ static hpatch_BOOL ringbuf_read(const struct hpatch_TStreamInput* stream,
                 CONFIG_HDIFFZ_OTA_RINGBUF_TIMEOUT, n_bytes);
         n_bytes -= bytes_received;
         if( 0 == bytes_received ) {
-            ESP_LOGD(TAG, "0 bytes received");
+            ESP_HDIFFZ_TRACE(TAG, "0 bytes received");
             return hpatch_FALSE;
         }
         memcpy(out_data, ringbuf_ptr, bytes_received);
@@ -400,7 +1102,7 @@ static hpatch_BOOL ringbuf_read(const struct hpatch_TStreamInput* stream,
     }
 
     assert(out_data == out_data_end);
-    ESP_LOGD(TAG, "All bytes received");
+    ESP_HDIFFZ_TRACE(TAG, "All bytes received");
 
     return hpatch_TRUE;
 }
@@ -0,0 +1,47 @@
+/**
+ * @file pack
+ * @brief HDiffPatch packed uint codec shared by the diff readers and writers.
+ *
+ * Kept free of esp-idf dependencies so the host tools build it as is.
+ */
+
+#include "pack.h"
+
+/********************
+ * PUBLIC FUNCTIONS *
+ ********************/
+
+size_t esp_hdiffz_pack_uint(unsigned char *buf, hpatch_StreamPos_t value, uint8_t tag_bits, uint8_t tag) {
+    unsigned char groups[ESP_HDIFFZ_PACKED_UINT_MAX];
+    size_t n_groups = 0, n = 0;
+    const uint8_t first_bits = 7 - tag_bits;
+
+    /* 7 bit groups from the least significant; the first byte holds fewer */
+    while( value >> first_bits ) {
+        groups[n_groups++] = value & 0x7f;
+        value >>= 7;
+    }
+    buf[n++] = (tag << (8 - tag_bits)) | (n_groups ? 1 << first_bits : 0) | value;
+    while( n_groups > 0 ) {
+        n_groups--;
+        buf[n++] = groups[n_groups] | (n_groups ? 0x80 : 0);
+    }
+    return n;
+}
+
+bool esp_hdiffz_unpack_uint(const unsigned char **src, const unsigned char *src_end, hpatch_StreamPos_t *out) {
+    const unsigned char *p = *src;
+    hpatch_StreamPos_t value = 0;
+    unsigned char byte;
+
+    do {
+        if( p >= src_end ) return false;
+        if( value >> (sizeof(value) * 8 - 7) ) return false;
+        byte = *p++;
+        value = (value << 7) | (byte & 0x7f);
+    } while( byte & 0x80 );
+
+    *src = p;
+    *out = value;
+    return true;
+}
@@ -0,0 +1,48 @@
+#ifndef ESP_HDIFFZ_PACK_H__
+#define ESP_HDIFFZ_PACK_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "HPatch/patch_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Leads every compressed diff; followed by the compress type and the sizes.
+ */
+#define ESP_HDIFFZ_DIFFZ_MAGIC "HDIFF13&"
+
+/**
+ * Longest packed encoding of a 64 bit value.
+ */
+#define ESP_HDIFFZ_PACKED_UINT_MAX 10
+
+/**
+ * @brief Encode an HDiffPatch packed uint whose first byte carries tag_bits of tag.
+ *
+ * Values are stored as big endian 7 bit groups, each but the last with its
+ * high bit set. The first byte gives its top tag_bits bits to the tag.
+ *
+ * @param[out] buf At least ESP_HDIFFZ_PACKED_UINT_MAX bytes.
+ * @return Number of bytes written.
+ */
+size_t esp_hdiffz_pack_uint(unsigned char *buf, hpatch_StreamPos_t value, uint8_t tag_bits, uint8_t tag);
+
+/**
+ * @brief Decode an HDiffPatch packed uint without a tag.
+ * @param[in,out] src Cursor; advanced past the value.
+ * @param[in] src_end End of the readable bytes.
+ * @param[out] out Decoded value.
+ * @return True on success; False if truncated or overflowing.
+ */
+bool esp_hdiffz_unpack_uint(const unsigned char **src, const unsigned char *src_end, hpatch_StreamPos_t *out);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
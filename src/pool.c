@@ -0,0 +1,227 @@
+//#define LOG_LOCAL_LEVEL 4
+
+#include <string.h>
+#include "esp_log.h"
+#include "esp_hdiffz.h"
+
+#include "esp_system.h"
+#include "miniz_plugin.h"
+#include "rw.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#define POOL_TASK_SIZE 16384
+#define POOL_TASK_NAME "hdiffz_pool"
+#define POOL_DIFF_BUF_SIZE 1024
+/* Each job may hold a decompressor per compressed section (4), and each
+ * decompressor makes 2 allocations. */
+#define POOL_CACHE_SLOTS_PER_WORKER 8
+
+static const char TAG[] = "esp_hdiffz_pool";
+
+typedef struct pool_t {
+    esp_hdiffz_job_t **queue;      /**< Jobs sorted by descending new_size */
+    size_t n_queue;
+    size_t next;                   /**< Index of next job to hand out */
+    SemaphoreHandle_t mutex;       /**< Protects next */
+    SemaphoreHandle_t done;        /**< Given once by each worker when it exits */
+    esp_hdiffz_buf_cache_t *cache;
+    const esp_hdiffz_mem_policy_t *mem_policy;
+} pool_t;
+
+/**************
+ * PROTOTYPES *
+ **************/
+static void pool_worker_task(void *params);
+static esp_err_t pool_run_job(pool_t *pool, esp_hdiffz_job_t *job);
+static void pool_job_diff_stream(esp_hdiffz_job_t *job, hpatch_TStreamInput *diff_stream);
+static void pool_job_finish(esp_hdiffz_job_t *job, esp_err_t err);
+
+/********************
+ * PUBLIC FUNCTIONS *
+ ********************/
+
+esp_err_t esp_hdiffz_patch_file_batch(esp_hdiffz_job_t *jobs, size_t n_jobs, const esp_hdiffz_pool_config_t *config) {
+    esp_err_t err = ESP_FAIL;
+    pool_t pool = { 0 };
+    esp_hdiffz_pool_config_t default_config = ESP_HDIFFZ_POOL_CONFIG_DEFAULT();
+    uint8_t n_workers, n_started = 0;
+    uint32_t stack_size;
+
+    if( NULL == config ) config = &default_config;
+    n_workers = config->n_workers ? config->n_workers : portNUM_PROCESSORS;
+    stack_size = config->stack_size ? config->stack_size : POOL_TASK_SIZE;
+
+    pool.queue = calloc(n_jobs, sizeof(esp_hdiffz_job_t *));
+    pool.mutex = xSemaphoreCreateMutex();
+    pool.done = xSemaphoreCreateCounting(n_workers, 0);
+    pool.cache = esp_hdiffz_buf_cache_create(n_workers * POOL_CACHE_SLOTS_PER_WORKER);
+    pool.mem_policy = config->mem_policy;
+    if( (n_jobs && NULL == pool.queue) || NULL == pool.mutex || NULL == pool.done || NULL == pool.cache ) {
+        ESP_LOGE(TAG, "OOM");
+        err = ESP_ERR_NO_MEM;
+        goto exit;
+    }
+
+    /* Read each diff header so jobs can be ordered by output size */
+    for(size_t i=0; i < n_jobs; i++) {
+        esp_hdiffz_job_t *job = &jobs[i];
+        hpatch_TStreamInput diff_stream = { 0 };
+        esp_hdiffz_info_t info;
+        esp_err_t info_err;
+
+        job->err = ESP_FAIL;
+        job->new_size = 0;
+        job->mem_peak = 0;
+        memset(&job->mem, 0, sizeof(job->mem));
+        job->core = 0;
+
+        pool_job_diff_stream(job, &diff_stream);
+        info_err = esp_hdiffz_get_info(&diff_stream, &info);
+        if( ESP_OK != info_err ) {
+            ESP_LOGE(TAG, "Job %d has an invalid diff header", (int)i);
+            pool_job_finish(job, info_err);
+            continue;
+        }
+        job->new_size = info.new_size;
+
+        /* Jobs that can't fit their limit are refused without running */
+        if( job->mem_limit && info.dec_heap > job->mem_limit ) {
+            ESP_LOGE(TAG, "Job %d needs up to %d bytes; limit is %d", (int)i,
+                    (int)info.dec_heap, (int)job->mem_limit);
+            pool_job_finish(job, ESP_ERR_NO_MEM);
+            continue;
+        }
+
+        /* Insertion sort; batches are small */
+        size_t j = pool.n_queue++;
+        for(; j > 0 && pool.queue[j-1]->new_size < job->new_size; j--) {
+            pool.queue[j] = pool.queue[j-1];
+        }
+        pool.queue[j] = job;
+    }
+
+    if( n_workers > pool.n_queue ) n_workers = pool.n_queue;
+
+    for(; n_started < n_workers; n_started++) {
+        BaseType_t res;
+        res = xTaskCreatePinnedToCore(pool_worker_task,
+                POOL_TASK_NAME,
+                stack_size, &pool,
+                config->priority,
+                NULL, n_started % portNUM_PROCESSORS);
+        if(pdPASS != res) {
+            ESP_LOGE(TAG, "Failed to create worker task %d.", n_started);
+            break;
+        }
+    }
+    if( 0 == n_started && n_workers > 0 ) {
+        err = ESP_ERR_NO_MEM;
+        goto exit;
+    }
+
+    /* Wait for all workers to drain the queue */
+    for(uint8_t i=0; i < n_started; i++) {
+        xSemaphoreTake(pool.done, portMAX_DELAY);
+    }
+
+    err = ESP_OK;
+    for(size_t i=0; i < n_jobs; i++) {
+        if( ESP_OK != jobs[i].err ) err = ESP_FAIL;
+    }
+
+exit:
+    if( NULL != pool.cache ) esp_hdiffz_buf_cache_del(pool.cache);
+    if( NULL != pool.done ) vSemaphoreDelete(pool.done);
+    if( NULL != pool.mutex ) vSemaphoreDelete(pool.mutex);
+    if( NULL != pool.queue ) free(pool.queue);
+    return err;
+}
+
+/*********************
+ * PRIVATE FUNCTIONS *
+ *********************/
+
+/**
+ * @brief Worker task; runs queued jobs until the queue is empty.
+ */
+static void pool_worker_task(void *params) {
+    pool_t *pool = params;
+
+    for(;;) {
+        esp_hdiffz_job_t *job = NULL;
+
+        xSemaphoreTake(pool->mutex, portMAX_DELAY);
+        if( pool->next < pool->n_queue ) job = pool->queue[pool->next++];
+        xSemaphoreGive(pool->mutex);
+
+        if( NULL == job ) break;
+
+        job->core = xPortGetCoreID();
+        pool_job_finish(job, pool_run_job(pool, job));
+    }
+
+    xSemaphoreGive(pool->done);
+    vTaskDelete(NULL);
+}
+
+/**
+ * @brief Patch a single job with its own plugin instance.
+ */
+static esp_err_t pool_run_job(pool_t *pool, esp_hdiffz_job_t *job) {
+    esp_err_t err;
+    esp_hdiffz_miniz_plugin_t plugin;
+    esp_hdiffz_file_stream_t diff_file;
+    hpatch_TStreamInput diff_stream = { 0 };
+    const esp_hdiffz_mem_t mem = { .policy = pool->mem_policy, .report = &job->mem };
+
+    /* Every buffer of the job is placed through the plugin's policy */
+    esp_hdiffz_miniz_plugin_init(&plugin);
+    plugin.cache = pool->cache;
+    plugin.mem_limit = job->mem_limit;
+    plugin.mem_policy = mem.policy;
+    plugin.mem_report = mem.report;
+
+    if( NULL != job->diff_mem ) {
+        pool_job_diff_stream(job, &diff_stream);
+        err = esp_hdiffz_patch_file_adv(job->in, job->out, &diff_stream, &plugin.base);
+    }
+    else {
+        err = esp_hdiffz_file_stream_init_adv(&diff_file, job->diff,
+                POOL_DIFF_BUF_SIZE, ESP_HDIFFZ_FILE_STREAM_MAX_LANES, &mem);
+        if( ESP_OK == err ) {
+            esp_hdiffz_file_stream_as_input(&diff_file, &diff_stream);
+            err = esp_hdiffz_patch_file_adv(job->in, job->out, &diff_stream, &plugin.base);
+        }
+        esp_hdiffz_file_stream_deinit(&diff_file);
+    }
+
+    job->mem_peak = plugin.mem_peak;
+    if( ESP_FAIL == err && plugin.oom ) err = ESP_ERR_NO_MEM;
+
+    return err;
+}
+
+/**
+ * @brief Populate the diff input stream for a job.
+ */
+static void pool_job_diff_stream(esp_hdiffz_job_t *job, hpatch_TStreamInput *diff_stream) {
+    if( NULL != job->diff_mem ) {
+        esp_hdiffz_mem_as_stream_input(diff_stream, (const unsigned char *)job->diff_mem,
+                job->diff_mem_size);
+    }
+    else {
+        diff_stream->streamImport = job->diff;
+        diff_stream->streamSize = esp_hdiffz_get_file_size(job->diff);
+        diff_stream->read = esp_hdiffz_file_read;
+    }
+}
+
+/**
+ * @brief Record the result of a job and notify the caller.
+ */
+static void pool_job_finish(esp_hdiffz_job_t *job, esp_err_t err) {
+    job->err = err;
+    if( NULL != job->cb ) job->cb(job, job->cb_arg);
+}
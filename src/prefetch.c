@@ -0,0 +1,332 @@
+//#define LOG_LOCAL_LEVEL 4
+
+#include <string.h>
+#include "esp_log.h"
+#include "esp_hdiffz.h"
+
+#include "esp_system.h"
+#include "prefetch.h"
+#include "mem.h"
+#include "trace.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#define PREFETCH_TASK_SIZE 3072
+#define PREFETCH_TASK_NAME "hdiffz_prefetch"
+/* Hinted ranges not yet assigned to a buffer */
+#define PREFETCH_HINTS 16
+
+static const char TAG[] = "esp_hdiffz_prefetch";
+
+typedef enum {
+    SLOT_PENDING = 0,       /**< Worker is reading into the slot */
+    SLOT_READY,             /**< Data is available */
+} slot_state_t;
+
+typedef struct range_t {
+    hpatch_StreamPos_t pos;
+    hpatch_StreamPos_t len;
+} range_t;
+
+typedef struct slot_t {
+    unsigned char *buf;
+    range_t range;
+    slot_state_t state;
+    bool touched;                      /**< Counted as ready or late */
+} slot_t;
+
+struct esp_hdiffz_prefetch_t {
+    const hpatch_TStreamInput *src;
+    SemaphoreHandle_t mutex;           /**< Protects everything below */
+    SemaphoreHandle_t work;            /**< Given when the worker may have something to do */
+    SemaphoreHandle_t ready;           /**< Given when a slot becomes ready */
+    SemaphoreHandle_t done;            /**< Given by the worker when it exits */
+    bool stop;
+
+    range_t hints[PREFETCH_HINTS];
+    uint8_t hint_head;
+    uint8_t n_hints;
+
+    size_t slot_size;
+    uint8_t n_slots;
+    uint8_t slot_head;                 /**< Oldest slot; next to be read */
+    uint8_t n_used;                    /**< Slots holding or receiving data */
+    slot_t *slots;
+
+    uint32_t n_prefetch;
+    uint32_t n_ready;
+    uint32_t n_late;
+    uint32_t n_unused;
+    size_t miss_bytes;
+};
+
+/**************
+ * PROTOTYPES *
+ **************/
+static void prefetch_task(void *params);
+static hpatch_BOOL prefetch_read(const struct hpatch_TStreamInput* stream,
+        hpatch_StreamPos_t readFromPos,
+        unsigned char* out_data,
+        unsigned char* out_data_end);
+static void prefetch_trim_hints(esp_hdiffz_prefetch_t *pf, hpatch_StreamPos_t pos, hpatch_StreamPos_t len);
+
+/********************
+ * PUBLIC FUNCTIONS *
+ ********************/
+
+esp_err_t esp_hdiffz_prefetch_create(const hpatch_TStreamInput *src, size_t slot_size, uint8_t n_slots,
+        const esp_hdiffz_mem_t *mem, esp_hdiffz_prefetch_t **out) {
+    esp_hdiffz_prefetch_t *pf;
+    BaseType_t core = tskNO_AFFINITY;
+
+    *out = NULL;
+
+    pf = calloc(1, sizeof(esp_hdiffz_prefetch_t));
+    if( NULL == pf ) return ESP_ERR_NO_MEM;
+
+    pf->src = src;
+    pf->slot_size = slot_size;
+    pf->n_slots = n_slots;
+    pf->slots = calloc(n_slots, sizeof(pf->slots[0]));
+    pf->mutex = xSemaphoreCreateMutex();
+    pf->work = xSemaphoreCreateBinary();
+    pf->ready = xSemaphoreCreateBinary();
+    pf->done = xSemaphoreCreateBinary();
+    if( NULL == pf->slots || NULL == pf->mutex || NULL == pf->work
+            || NULL == pf->ready || NULL == pf->done ) goto oom;
+    for(uint8_t i=0; i < n_slots; i++) {
+        pf->slots[i].buf = esp_hdiffz_mem_alloc(mem, ESP_HDIFFZ_MEM_CACHE, slot_size);
+        if( NULL == pf->slots[i].buf ) goto oom;
+    }
+
+    /* Overlap reads with the caller's work on the other core */
+    if( portNUM_PROCESSORS > 1 ) core = !xPortGetCoreID();
+    if( pdPASS != xTaskCreatePinnedToCore(prefetch_task, PREFETCH_TASK_NAME,
+                PREFETCH_TASK_SIZE, pf, uxTaskPriorityGet(NULL), NULL, core) ) {
+        goto oom;
+    }
+
+    *out = pf;
+    return ESP_OK;
+
+oom:
+    ESP_LOGE(TAG, "OOM");
+    /* Worker never started; make del skip waiting for it */
+    if( NULL != pf->done ) xSemaphoreGive(pf->done);
+    esp_hdiffz_prefetch_del(pf, NULL);
+    return ESP_ERR_NO_MEM;
+}
+
+size_t esp_hdiffz_prefetch_heap(size_t slot_size, uint8_t n_slots) {
+    return sizeof(esp_hdiffz_prefetch_t) + n_slots * (sizeof(slot_t) + slot_size)
+        + PREFETCH_TASK_SIZE;
+}
+
+void esp_hdiffz_prefetch_as_input(esp_hdiffz_prefetch_t *pf, hpatch_TStreamInput *in) {
+    in->streamImport = pf;
+    in->streamSize = pf->src->streamSize;
+    in->read = prefetch_read;
+}
+
+void esp_hdiffz_prefetch_hint(void *arg, hpatch_StreamPos_t pos, hpatch_StreamPos_t len) {
+    esp_hdiffz_prefetch_t *pf = arg;
+
+    if( 0 == len ) return;
+
+    xSemaphoreTake(pf->mutex, portMAX_DELAY);
+    if( pf->n_hints < PREFETCH_HINTS ) {
+        range_t *hint = &pf->hints[(pf->hint_head + pf->n_hints) % PREFETCH_HINTS];
+        hint->pos = pos;
+        hint->len = len;
+        pf->n_hints++;
+    }
+    xSemaphoreGive(pf->mutex);
+
+    xSemaphoreGive(pf->work);
+}
+
+void esp_hdiffz_prefetch_del(esp_hdiffz_prefetch_t *pf, esp_hdiffz_patch_stats_t *stats) {
+    if( NULL == pf ) return;
+
+    if( NULL != pf->done ) {
+        pf->stop = true;
+        if( NULL != pf->work ) xSemaphoreGive(pf->work);
+        xSemaphoreTake(pf->done, portMAX_DELAY);
+    }
+
+    if( NULL != stats ) {
+        for(uint8_t i=0; i < pf->n_used; i++) {
+            if( !pf->slots[(pf->slot_head + i) % pf->n_slots].touched ) pf->n_unused++;
+        }
+        stats->n_prefetch = pf->n_prefetch;
+        stats->n_prefetch_ready = pf->n_ready;
+        stats->n_prefetch_late = pf->n_late;
+        stats->n_prefetch_unused = pf->n_unused;
+        stats->prefetch_miss_bytes = pf->miss_bytes;
+        ESP_LOGI(TAG, "%d prefetched: %d in time, %d late, %d unused; %d bytes read directly",
+                pf->n_prefetch, pf->n_ready, pf->n_late, pf->n_unused, (int)pf->miss_bytes);
+    }
+
+    if( NULL != pf->slots ) {
+        for(uint8_t i=0; i < pf->n_slots; i++) free(pf->slots[i].buf);
+        free(pf->slots);
+    }
+    if( NULL != pf->done ) vSemaphoreDelete(pf->done);
+    if( NULL != pf->ready ) vSemaphoreDelete(pf->ready);
+    if( NULL != pf->work ) vSemaphoreDelete(pf->work);
+    if( NULL != pf->mutex ) vSemaphoreDelete(pf->mutex);
+    free(pf);
+}
+
+/*********************
+ * PRIVATE FUNCTIONS *
+ *********************/
+
+/**
+ * @brief Worker; fills free slots from the hinted ranges in order.
+ */
+static void prefetch_task(void *params) {
+    esp_hdiffz_prefetch_t *pf = params;
+
+    while( !pf->stop ) {
+        uint8_t i;
+        range_t chunk;
+        int64_t t0;
+        bool ok;
+
+        xSemaphoreTake(pf->mutex, portMAX_DELAY);
+        if( 0 == pf->n_hints || pf->n_used == pf->n_slots ) {
+            xSemaphoreGive(pf->mutex);
+            xSemaphoreTake(pf->work, portMAX_DELAY);
+            continue;
+        }
+
+        /* Claim the next chunk of the oldest hint */
+        range_t *hint = &pf->hints[pf->hint_head];
+        chunk.pos = hint->pos;
+        chunk.len = hint->len < pf->slot_size ? hint->len : pf->slot_size;
+        hint->pos += chunk.len;
+        hint->len -= chunk.len;
+        if( 0 == hint->len ) {
+            pf->hint_head = (pf->hint_head + 1) % PREFETCH_HINTS;
+            pf->n_hints--;
+        }
+
+        i = (pf->slot_head + pf->n_used) % pf->n_slots;
+        pf->slots[i].range = chunk;
+        pf->slots[i].state = SLOT_PENDING;
+        pf->slots[i].touched = false;
+        pf->n_used++;
+        xSemaphoreGive(pf->mutex);
+
+        t0 = ESP_HDIFFZ_TRACE_BEGIN();
+        ok = pf->src->read(pf->src, chunk.pos, pf->slots[i].buf, pf->slots[i].buf + chunk.len);
+        ESP_HDIFFZ_TRACE_END(ESP_HDIFFZ_TRACE_OLD_READ, t0, chunk.len);
+
+        xSemaphoreTake(pf->mutex, portMAX_DELAY);
+        /* A failed read leaves an empty range that the reader will skip */
+        if( !ok ) pf->slots[i].range.len = 0;
+        pf->slots[i].state = SLOT_READY;
+        pf->n_prefetch++;
+        xSemaphoreGive(pf->mutex);
+        xSemaphoreGive(pf->ready);
+    }
+
+    xSemaphoreGive(pf->done);
+    vTaskDelete(NULL);
+}
+
+/**
+ * @brief Serve a read from the oldest slot if it holds the data.
+ *
+ * Reads arrive in hint order, so a slot that does not hold the requested
+ * position will never be read and is recycled.
+ */
+static hpatch_BOOL prefetch_read(const struct hpatch_TStreamInput* stream,
+        hpatch_StreamPos_t readFromPos,
+        unsigned char* out_data,
+        unsigned char* out_data_end) {
+    esp_hdiffz_prefetch_t *pf = (esp_hdiffz_prefetch_t *)stream->streamImport;
+
+    while( out_data < out_data_end ) {
+        size_t n = out_data_end - out_data;
+
+        xSemaphoreTake(pf->mutex, portMAX_DELAY);
+        if( pf->n_used > 0 ) {
+            slot_t *slot = &pf->slots[pf->slot_head];
+            hpatch_StreamPos_t end = slot->range.pos + slot->range.len;
+
+            if( SLOT_PENDING == slot->state ) {
+                bool wanted = readFromPos >= slot->range.pos && readFromPos < end;
+                if( wanted && !slot->touched ) {
+                    slot->touched = true;
+                    pf->n_late++;
+                }
+                xSemaphoreGive(pf->mutex);
+                xSemaphoreTake(pf->ready, portMAX_DELAY);
+                continue;
+            }
+
+            if( readFromPos >= slot->range.pos && readFromPos < end ) {
+                if( !slot->touched ) {
+                    slot->touched = true;
+                    pf->n_ready++;
+                }
+                if( n > end - readFromPos ) n = end - readFromPos;
+                memcpy(out_data, &slot->buf[readFromPos - slot->range.pos], n);
+                out_data += n;
+                readFromPos += n;
+                if( readFromPos == end ) {
+                    pf->slot_head = (pf->slot_head + 1) % pf->n_slots;
+                    pf->n_used--;
+                    xSemaphoreGive(pf->work);
+                }
+                xSemaphoreGive(pf->mutex);
+                continue;
+            }
+
+            /* Stale; recycle it and look at the next one */
+            if( !slot->touched ) pf->n_unused++;
+            pf->slot_head = (pf->slot_head + 1) % pf->n_slots;
+            pf->n_used--;
+            xSemaphoreGive(pf->mutex);
+            xSemaphoreGive(pf->work);
+            continue;
+        }
+
+        /* Not prefetched (yet); don't let the worker fetch it afterwards */
+        prefetch_trim_hints(pf, readFromPos, n);
+        xSemaphoreGive(pf->mutex);
+
+        if( !pf->src->read(pf->src, readFromPos, out_data, out_data + n) ) return hpatch_FALSE;
+        pf->miss_bytes += n;
+        out_data += n;
+        readFromPos += n;
+    }
+
+    return hpatch_TRUE;
+}
+
+/**
+ * @brief Remove [pos, pos+len) from the front of the hint queue.
+ *
+ * Must hold the mutex.
+ */
+static void prefetch_trim_hints(esp_hdiffz_prefetch_t *pf, hpatch_StreamPos_t pos, hpatch_StreamPos_t len) {
+    while( pf->n_hints > 0 && len > 0 ) {
+        range_t *hint = &pf->hints[pf->hint_head];
+        hpatch_StreamPos_t k;
+
+        if( pos != hint->pos ) break;
+        k = hint->len < len ? hint->len : len;
+        hint->pos += k;
+        hint->len -= k;
+        pos += k;
+        len -= k;
+        if( 0 == hint->len ) {
+            pf->hint_head = (pf->hint_head + 1) % PREFETCH_HINTS;
+            pf->n_hints--;
+        }
+    }
+}
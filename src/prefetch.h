@@ -0,0 +1,59 @@
+#ifndef ESP_HDIFFZ_PREFETCH_H__
+#define ESP_HDIFFZ_PREFETCH_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "esp_hdiffz.h"
+#include "mem.h"
+
+#include "HPatch/patch.h"
+
+/**
+ * @brief Reads ranges of an input stream ahead of use on another task.
+ *
+ * Ranges are hinted in the order they will later be read. A worker task
+ * pinned to the other core fills a bounded pool of buffers with them, so
+ * that read latency overlaps with the caller's own work.
+ */
+typedef struct esp_hdiffz_prefetch_t esp_hdiffz_prefetch_t;
+
+/**
+ * @brief Start a prefetcher.
+ * @param[in] src Stream to read ahead from; must be safe to read from another task.
+ * @param[in] slot_size Bytes per pool buffer.
+ * @param[in] n_slots Number of pool buffers.
+ * @param[in] mem Placement of the pool buffers. May be NULL.
+ * @param[out] out Prefetcher on success.
+ * @return ESP_OK on success; ESP_ERR_NO_MEM on OOM.
+ */
+esp_err_t esp_hdiffz_prefetch_create(const hpatch_TStreamInput *src, size_t slot_size, uint8_t n_slots,
+        const esp_hdiffz_mem_t *mem, esp_hdiffz_prefetch_t **out);
+
+/**
+ * @brief Heap esp_hdiffz_prefetch_create allocates, including the worker's stack.
+ */
+size_t esp_hdiffz_prefetch_heap(size_t slot_size, uint8_t n_slots);
+
+/**
+ * @brief Populate an input stream that reads through the prefetcher.
+ *
+ * Reads of hinted ranges are served from the pool; anything else is read
+ * directly from src.
+ */
+void esp_hdiffz_prefetch_as_input(esp_hdiffz_prefetch_t *pf, hpatch_TStreamInput *in);
+
+/**
+ * @brief Announce a range that will be read after all previously hinted ones.
+ *
+ * Signature matches esp_hdiffz_engine_cfg_t.hint.
+ */
+void esp_hdiffz_prefetch_hint(void *pf, hpatch_StreamPos_t pos, hpatch_StreamPos_t len);
+
+/**
+ * @brief Stop the worker and free the prefetcher.
+ * @param[out] stats Prefetch counters are written here. May be NULL.
+ */
+void esp_hdiffz_prefetch_del(esp_hdiffz_prefetch_t *pf, esp_hdiffz_patch_stats_t *stats);
+
+#endif
@@ -0,0 +1,49 @@
+/**
+ * @file profile
+ * @brief Switches of the debug and release build profiles.
+ *
+ * The profile is picked in the HDiffz menu of menuconfig. The release
+ * profile also builds the component with -O2 rather than the project's
+ * optimization level.
+ */
+#ifndef ESP_HDIFFZ_PROFILE_H__
+#define ESP_HDIFFZ_PROFILE_H__
+
+#include "sdkconfig.h"
+#include "esp_log.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Debug log on a per-chunk path.
+ *
+ * Compiled in with CONFIG_HDIFFZ_TRACE regardless of LOG_LOCAL_LEVEL; shown
+ * once the tag's level is raised with esp_log_level_set(). Otherwise the
+ * arguments are type checked, but no code or format string is left behind.
+ */
+#if CONFIG_HDIFFZ_TRACE
+#define ESP_HDIFFZ_TRACE(tag, fmt, ...) ESP_LOG_LEVEL(ESP_LOG_DEBUG, tag, fmt, ##__VA_ARGS__)
+#else
+#define ESP_HDIFFZ_TRACE(tag, fmt, ...) \
+    do { if(0) ESP_LOG_LEVEL(ESP_LOG_DEBUG, tag, fmt, ##__VA_ARGS__); } while(0)
+#endif
+
+/**
+ * @brief Storage class of small helpers called per byte or per chunk.
+ *
+ * Forced inline in the release profile; left to the compiler otherwise, so
+ * they stay visible to a debugger at -Og.
+ */
+#if CONFIG_HDIFFZ_PROFILE_RELEASE
+#define ESP_HDIFFZ_HOT static inline __attribute__((always_inline))
+#else
+#define ESP_HDIFFZ_HOT static inline
+#endif
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,129 @@
+//#define LOG_LOCAL_LEVEL 4
+
+#include <string.h>
+#include "esp_log.h"
+#include "esp_hdiffz.h"
+
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "progress.h"
+
+/* Event interval when neither interval_ms nor byte_step is set */
+#define PROGRESS_INTERVAL_MS 500
+
+/* Patch rate of the last completed patch; estimates the patch phase while erasing */
+static uint32_t s_patch_rate;
+
+/**************
+ * PROTOTYPES *
+ **************/
+static void progress_send(esp_hdiffz_progress_tracker_t *tracker, int64_t now, size_t done);
+static size_t *progress_done(esp_hdiffz_progress_tracker_t *tracker);
+
+/********************
+ * PUBLIC FUNCTIONS *
+ ********************/
+
+void esp_hdiffz_progress_start(esp_hdiffz_progress_tracker_t *tracker,
+        const esp_hdiffz_progress_config_t *config, size_t erase_total, size_t new_total) {
+    memset(tracker, 0, sizeof(*tracker));
+    tracker->config = *config;
+    if( 0 == tracker->config.interval_ms && 0 == tracker->config.byte_step ) {
+        tracker->config.interval_ms = PROGRESS_INTERVAL_MS;
+    }
+    tracker->state.erase_total = erase_total;
+    tracker->state.new_total = new_total;
+    tracker->state.phase = ESP_HDIFFZ_PHASE_ERASE;
+    tracker->start_us = esp_timer_get_time();
+    tracker->phase_us = tracker->start_us;
+    tracker->last_us = tracker->start_us;
+    progress_send(tracker, tracker->start_us, 0);
+}
+
+void esp_hdiffz_progress_phase(esp_hdiffz_progress_tracker_t *tracker, esp_hdiffz_phase_t phase) {
+    int64_t now = esp_timer_get_time();
+    size_t *counter = progress_done(tracker);
+
+    /* Moving on without an error means the previous phase's stream is complete */
+    if( ESP_OK == tracker->state.err && NULL != counter ) {
+        *counter = ESP_HDIFFZ_PHASE_ERASE == tracker->state.phase
+                ? tracker->state.erase_total : tracker->state.new_total;
+    }
+
+    /* Remember how fast this device patches for the next erase phase's ETA */
+    if( ESP_HDIFFZ_PHASE_PATCH == tracker->state.phase && now > tracker->phase_us ) {
+        s_patch_rate = tracker->state.new_done * 1000000LL / (now - tracker->phase_us);
+    }
+
+    tracker->state.phase = phase;
+    tracker->phase_us = now;
+    tracker->last_us = now;
+    tracker->last_done = 0;
+    progress_send(tracker, now, 0);
+}
+
+void esp_hdiffz_progress_poll(esp_hdiffz_progress_tracker_t *tracker, size_t done) {
+    int64_t now = esp_timer_get_time();
+
+    if( now - tracker->last_us < (int64_t)tracker->config.interval_ms * 1000 ) {
+        /* Not yet; check again after a little more data */
+        tracker->next_done = done + 1;
+        return;
+    }
+    progress_send(tracker, now, done);
+}
+
+void esp_hdiffz_progress_end(esp_hdiffz_progress_tracker_t *tracker, esp_err_t err) {
+    tracker->state.err = err;
+    esp_hdiffz_progress_phase(tracker, ESP_HDIFFZ_PHASE_DONE);
+}
+
+/*********************
+ * PRIVATE FUNCTIONS *
+ *********************/
+
+/**
+ * @brief Counter of the current phase's stream; NULL if it has none.
+ */
+static size_t *progress_done(esp_hdiffz_progress_tracker_t *tracker) {
+    switch( tracker->state.phase ) {
+        case ESP_HDIFFZ_PHASE_ERASE: return &tracker->state.erase_done;
+        case ESP_HDIFFZ_PHASE_PATCH: return &tracker->state.new_done;
+        default: return NULL;
+    }
+}
+
+/**
+ * @brief Update the rates and ETA and call the callback.
+ * @param[in] done Bytes of the phase's stream; ignored for phases without one.
+ */
+static void progress_send(esp_hdiffz_progress_tracker_t *tracker, int64_t now, size_t done) {
+    esp_hdiffz_progress_t *s = &tracker->state;
+    size_t *counter = progress_done(tracker);
+    uint64_t eta_us = 0;
+
+    if( NULL != counter ) *counter = done;
+    s->rate = now > tracker->last_us ? (done - tracker->last_done) * 1000000LL / (now - tracker->last_us) : 0;
+    s->avg_rate = now > tracker->phase_us ? done * 1000000LL / (now - tracker->phase_us) : 0;
+    s->elapsed_ms = (now - tracker->start_us) / 1000;
+
+    switch( s->phase ) {
+        case ESP_HDIFFZ_PHASE_ERASE:
+            if( 0 == s_patch_rate || (0 == s->avg_rate && s->erase_done < s->erase_total) ) break;
+            if( s->avg_rate ) eta_us = (uint64_t)(s->erase_total - s->erase_done) * 1000000 / s->avg_rate;
+            eta_us += (uint64_t)s->new_total * 1000000 / s_patch_rate;
+            break;
+        case ESP_HDIFFZ_PHASE_PATCH:
+            if( s->avg_rate ) eta_us = (uint64_t)(s->new_total - s->new_done) * 1000000 / s->avg_rate;
+            break;
+        default:
+            break;
+    }
+    s->eta_ms = eta_us / 1000;
+
+    tracker->last_us = now;
+    tracker->last_done = done;
+    tracker->next_done = done + (tracker->config.byte_step ? tracker->config.byte_step : 1);
+
+    tracker->config.cb(s, tracker->config.arg);
+}
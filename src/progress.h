@@ -0,0 +1,61 @@
+#ifndef ESP_HDIFFZ_PROGRESS_H__
+#define ESP_HDIFFZ_PROGRESS_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_hdiffz.h"
+
+/**
+ * @brief Rate limited progress events of one firmware patch.
+ */
+typedef struct esp_hdiffz_progress_tracker_t {
+    esp_hdiffz_progress_config_t config;
+    esp_hdiffz_progress_t state;
+    int64_t start_us;               /**< Start of the patch */
+    int64_t phase_us;               /**< Start of the current phase */
+    int64_t last_us;                /**< Time of the previous event */
+    size_t last_done;               /**< Phase bytes at the previous event */
+    size_t next_done;               /**< Phase bytes at which the byte step is reached */
+} esp_hdiffz_progress_tracker_t;
+
+/**
+ * @brief Start tracking a patch; sends the ESP_HDIFFZ_PHASE_ERASE event.
+ * @param[out] tracker Tracker to initialize.
+ * @param[in] config Callback and limits; must have a cb.
+ * @param[in] erase_total Bytes that will be erased.
+ * @param[in] new_total Bytes that will be patched.
+ */
+void esp_hdiffz_progress_start(esp_hdiffz_progress_tracker_t *tracker,
+        const esp_hdiffz_progress_config_t *config, size_t erase_total, size_t new_total);
+
+/**
+ * @brief Move to the next phase and send its first event.
+ */
+void esp_hdiffz_progress_phase(esp_hdiffz_progress_tracker_t *tracker, esp_hdiffz_phase_t phase);
+
+/**
+ * @brief Send an event if one is due.
+ *
+ * Internal; call esp_hdiffz_progress_update.
+ */
+void esp_hdiffz_progress_poll(esp_hdiffz_progress_tracker_t *tracker, size_t done);
+
+/**
+ * @brief Record the bytes done in the current phase's stream.
+ *
+ * Only the byte step is checked inline; the clock is read once it has been
+ * reached.
+ */
+static inline void esp_hdiffz_progress_update(esp_hdiffz_progress_tracker_t *tracker, size_t done) {
+    if( done >= tracker->next_done ) esp_hdiffz_progress_poll(tracker, done);
+}
+
+/**
+ * @brief Send the ESP_HDIFFZ_PHASE_DONE event.
+ * @param[in] err Result of the patch.
+ */
+void esp_hdiffz_progress_end(esp_hdiffz_progress_tracker_t *tracker, esp_err_t err);
+
+#endif
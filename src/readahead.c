@@ -0,0 +1,374 @@
+//#define LOG_LOCAL_LEVEL 4
+
+#include <string.h>
+#include "esp_log.h"
+#include "esp_hdiffz.h"
+
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "readahead.h"
+#include "mem.h"
+#include "profile.h"
+#include "trace.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#define READAHEAD_TASK_SIZE 3072
+#define READAHEAD_TASK_NAME "hdiffz_readahead"
+
+static const char TAG[] = "esp_hdiffz_readahead";
+
+/**
+ * Ring of diff data following one section. Refills are appended at the ring
+ * offset after filled and pending bytes; that offset stays a multiple of the
+ * refill size, since a lane restarts at offset 0 whenever it runs empty.
+ */
+typedef struct lane_t {
+    unsigned char *buf;                /**< depth * refill_size bytes */
+    hpatch_StreamPos_t pos;            /**< Stream position of the oldest byte held */
+    size_t head;                       /**< Ring offset of pos */
+    size_t filled;                     /**< Bytes ready from head */
+    size_t pending;                    /**< Bytes the worker is reading after them */
+    uint32_t gen;                      /**< Bumped when the lane moves; stale refills are dropped */
+    uint32_t last_use;                 /**< For least-recently-used replacement */
+    bool active;                       /**< The worker fills the lane; otherwise pos is where a direct read ended */
+} lane_t;
+
+struct esp_hdiffz_readahead_t {
+    const hpatch_TStreamInput *src;
+    SemaphoreHandle_t mutex;           /**< Protects everything below */
+    SemaphoreHandle_t io;              /**< Held while reading src */
+    SemaphoreHandle_t work;            /**< Given when the worker may have something to do */
+    SemaphoreHandle_t ready;           /**< Given when a refill completes */
+    SemaphoreHandle_t done;            /**< Given by the worker when it exits */
+    bool stop;
+
+    size_t refill_size;
+    size_t ring_size;
+    uint8_t n_lanes;
+    uint32_t clock;
+    lane_t lanes[ESP_HDIFFZ_READAHEAD_MAX_LANES];
+
+    uint32_t n_reads;
+    uint32_t n_stalls;
+    uint32_t n_refills;
+    size_t miss_bytes;
+    int64_t wait_us;
+};
+
+/**************
+ * PROTOTYPES *
+ **************/
+static void readahead_task(void *params);
+static hpatch_BOOL readahead_read(const struct hpatch_TStreamInput* stream,
+        hpatch_StreamPos_t readFromPos,
+        unsigned char* out_data,
+        unsigned char* out_data_end);
+static hpatch_BOOL readahead_read_direct(const struct hpatch_TStreamInput* stream,
+        hpatch_StreamPos_t readFromPos,
+        unsigned char* out_data,
+        unsigned char* out_data_end);
+
+/********************
+ * PUBLIC FUNCTIONS *
+ ********************/
+
+esp_err_t esp_hdiffz_readahead_create(const hpatch_TStreamInput *src, size_t refill_size, uint8_t depth,
+        uint8_t n_lanes, const esp_hdiffz_mem_t *mem, esp_hdiffz_readahead_t **out) {
+    esp_hdiffz_readahead_t *ra;
+    BaseType_t core = tskNO_AFFINITY;
+
+    assert(n_lanes >= 1 && n_lanes <= ESP_HDIFFZ_READAHEAD_MAX_LANES);
+    *out = NULL;
+
+    ra = calloc(1, sizeof(esp_hdiffz_readahead_t));
+    if( NULL == ra ) return ESP_ERR_NO_MEM;
+
+    ra->src = src;
+    if( 0 == depth || 0 == refill_size ) {
+        /* Nothing to run; reads are only timed */
+        *out = ra;
+        return ESP_OK;
+    }
+
+    ra->refill_size = refill_size;
+    ra->ring_size = depth * refill_size;
+    ra->n_lanes = n_lanes;
+    ra->mutex = xSemaphoreCreateMutex();
+    ra->io = xSemaphoreCreateMutex();
+    ra->work = xSemaphoreCreateBinary();
+    ra->ready = xSemaphoreCreateBinary();
+    ra->done = xSemaphoreCreateBinary();
+    if( NULL == ra->mutex || NULL == ra->io || NULL == ra->work
+            || NULL == ra->ready || NULL == ra->done ) goto oom;
+    for(uint8_t i=0; i < n_lanes; i++) {
+        ra->lanes[i].buf = esp_hdiffz_mem_alloc(mem, ESP_HDIFFZ_MEM_CACHE, ra->ring_size);
+        if( NULL == ra->lanes[i].buf ) goto oom;
+    }
+
+    /* Overlap reads with inflate and the patch on the other core */
+    if( portNUM_PROCESSORS > 1 ) core = !xPortGetCoreID();
+    if( pdPASS != xTaskCreatePinnedToCore(readahead_task, READAHEAD_TASK_NAME,
+                READAHEAD_TASK_SIZE, ra, uxTaskPriorityGet(NULL), NULL, core) ) {
+        goto oom;
+    }
+
+    *out = ra;
+    return ESP_OK;
+
+oom:
+    ESP_LOGE(TAG, "OOM");
+    /* Worker never started; make del skip waiting for it */
+    if( NULL != ra->done ) xSemaphoreGive(ra->done);
+    esp_hdiffz_readahead_del(ra, NULL);
+    return ESP_ERR_NO_MEM;
+}
+
+size_t esp_hdiffz_readahead_heap(size_t refill_size, uint8_t depth, uint8_t n_lanes) {
+    /* Same shortcut as esp_hdiffz_readahead_create */
+    if( 0 == depth || 0 == refill_size ) return sizeof(esp_hdiffz_readahead_t);
+    return sizeof(esp_hdiffz_readahead_t) + n_lanes * depth * refill_size + READAHEAD_TASK_SIZE;
+}
+
+void esp_hdiffz_readahead_as_input(esp_hdiffz_readahead_t *ra, hpatch_TStreamInput *in) {
+    in->streamImport = ra;
+    in->streamSize = ra->src->streamSize;
+    in->read = ra->n_lanes > 0 ? readahead_read : readahead_read_direct;
+}
+
+void esp_hdiffz_readahead_del(esp_hdiffz_readahead_t *ra, esp_hdiffz_patch_stats_t *stats) {
+    if( NULL == ra ) return;
+
+    if( NULL != ra->done ) {
+        ra->stop = true;
+        if( NULL != ra->work ) xSemaphoreGive(ra->work);
+        xSemaphoreTake(ra->done, portMAX_DELAY);
+    }
+
+    if( NULL != stats ) {
+        stats->n_diff_reads = ra->n_reads;
+        stats->n_diff_stalls = ra->n_stalls;
+        stats->n_diff_refills = ra->n_refills;
+        stats->diff_wait_us = ra->wait_us;
+        ESP_LOGI(TAG, "%d diff reads, %d stalled for %d us; %d refills, %d bytes read directly",
+                ra->n_reads, ra->n_stalls, (int)ra->wait_us, ra->n_refills, (int)ra->miss_bytes);
+    }
+
+    for(uint8_t i=0; i < ESP_HDIFFZ_READAHEAD_MAX_LANES; i++) free(ra->lanes[i].buf);
+    if( NULL != ra->done ) vSemaphoreDelete(ra->done);
+    if( NULL != ra->ready ) vSemaphoreDelete(ra->ready);
+    if( NULL != ra->work ) vSemaphoreDelete(ra->work);
+    if( NULL != ra->io ) vSemaphoreDelete(ra->io);
+    if( NULL != ra->mutex ) vSemaphoreDelete(ra->mutex);
+    free(ra);
+}
+
+/*********************
+ * PRIVATE FUNCTIONS *
+ *********************/
+
+/**
+ * @brief Worker; tops up the emptiest active lane one refill at a time.
+ */
+static void readahead_task(void *params) {
+    esp_hdiffz_readahead_t *ra = params;
+
+    while( !ra->stop ) {
+        lane_t *lane = NULL;
+        hpatch_StreamPos_t end;
+        size_t tail, n = 0;
+        uint32_t gen;
+        int64_t t0;
+        bool ok;
+
+        xSemaphoreTake(ra->mutex, portMAX_DELAY);
+        for(uint8_t i=0; i < ra->n_lanes; i++) {
+            lane_t *l = &ra->lanes[i];
+            hpatch_StreamPos_t l_end = l->pos + l->filled + l->pending;
+            size_t want;
+
+            if( !l->active || l_end >= ra->src->streamSize ) continue;
+            want = ra->refill_size;
+            if( want > ra->src->streamSize - l_end ) want = ra->src->streamSize - l_end;
+            if( ra->ring_size - l->filled - l->pending < want ) continue;
+            if( NULL == lane || l->filled + l->pending < lane->filled + lane->pending ) {
+                lane = l;
+                n = want;
+            }
+        }
+        if( NULL == lane ) {
+            xSemaphoreGive(ra->mutex);
+            xSemaphoreTake(ra->work, portMAX_DELAY);
+            continue;
+        }
+
+        end = lane->pos + lane->filled + lane->pending;
+        tail = (lane->head + lane->filled + lane->pending) % ra->ring_size;
+        lane->pending = n;
+        gen = lane->gen;
+        xSemaphoreGive(ra->mutex);
+
+        xSemaphoreTake(ra->io, portMAX_DELAY);
+        ESP_HDIFFZ_TRACE(TAG, "Refill %d bytes at %d", (int)n, (int)end);
+        t0 = ESP_HDIFFZ_TRACE_BEGIN();
+        ok = ra->src->read(ra->src, end, &lane->buf[tail], &lane->buf[tail + n]);
+        ESP_HDIFFZ_TRACE_END(ESP_HDIFFZ_TRACE_DIFF_READ, t0, n);
+        xSemaphoreGive(ra->io);
+
+        xSemaphoreTake(ra->mutex, portMAX_DELAY);
+        if( gen == lane->gen ) {
+            lane->pending = 0;
+            /* The patch reads a failed range itself and gets the error */
+            if( ok ) lane->filled += n;
+            else lane->active = false;
+        }
+        ra->n_refills++;
+        xSemaphoreGive(ra->mutex);
+        xSemaphoreGive(ra->ready);
+    }
+
+    xSemaphoreGive(ra->done);
+    vTaskDelete(NULL);
+}
+
+/**
+ * @brief Pick the lane following pos; NULL if none does.
+ *
+ * An active lane follows the positions it holds or is reading; an inactive
+ * one only the position its last direct read ended at.
+ *
+ * Must hold the mutex.
+ */
+static lane_t *readahead_lane(esp_hdiffz_readahead_t *ra, hpatch_StreamPos_t pos) {
+    lane_t *parked = NULL;
+
+    for(uint8_t i=0; i < ra->n_lanes; i++) {
+        lane_t *lane = &ra->lanes[i];
+        if( !lane->active ) {
+            if( pos == lane->pos && lane->last_use > 0 ) parked = lane;
+            continue;
+        }
+        if( pos >= lane->pos && pos <= lane->pos + lane->filled + lane->pending ) return lane;
+    }
+    return parked;
+}
+
+/**
+ * @brief Serve a read from the lane following it, waiting for refills.
+ *
+ * Bytes a lane holds before the read are skipped. Other reads are read
+ * directly, and the least recently used lane is parked after them. The
+ * worker only starts filling a lane once the next read continues there, so
+ * one-off reads of the diff header don't cost refills.
+ */
+static hpatch_BOOL readahead_read(const struct hpatch_TStreamInput* stream,
+        hpatch_StreamPos_t readFromPos,
+        unsigned char* out_data,
+        unsigned char* out_data_end) {
+    esp_hdiffz_readahead_t *ra = (esp_hdiffz_readahead_t *)stream->streamImport;
+    bool stalled = false;
+
+    ra->n_reads++;
+    while( out_data < out_data_end ) {
+        size_t n = out_data_end - out_data;
+        lane_t *lane;
+        bool activate;
+        int64_t t0;
+
+        xSemaphoreTake(ra->mutex, portMAX_DELAY);
+        lane = readahead_lane(ra, readFromPos);
+        if( NULL != lane && lane->active ) {
+            size_t skip = readFromPos - lane->pos;
+
+            lane->last_use = ++ra->clock;
+            if( skip > lane->filled ) skip = lane->filled;
+            lane->head = (lane->head + skip) % ra->ring_size;
+            lane->filled -= skip;
+            lane->pos += skip;
+
+            if( lane->pos == readFromPos && lane->filled > 0 ) {
+                if( n > lane->filled ) n = lane->filled;
+                if( n > ra->ring_size - lane->head ) n = ra->ring_size - lane->head;
+                memcpy(out_data, &lane->buf[lane->head], n);
+                lane->head = (lane->head + n) % ra->ring_size;
+                lane->filled -= n;
+                lane->pos += n;
+                if( 0 == lane->filled && 0 == lane->pending ) lane->head = 0;
+                out_data += n;
+                readFromPos += n;
+                xSemaphoreGive(ra->mutex);
+                xSemaphoreGive(ra->work);
+                continue;
+            }
+
+            /* Ran dry, or the data is still being read */
+            if( 0 == lane->pending ) lane->head = 0;
+            xSemaphoreGive(ra->mutex);
+            xSemaphoreGive(ra->work);
+            stalled = true;
+            t0 = esp_timer_get_time();
+            xSemaphoreTake(ra->ready, portMAX_DELAY);
+            ra->wait_us += esp_timer_get_time() - t0;
+            continue;
+        }
+
+        /* Park the least recently used lane past this read, or start
+         * filling the lane this read continues */
+        activate = NULL != lane;
+        if( NULL == lane ) {
+            lane = &ra->lanes[0];
+            for(uint8_t i=1; i < ra->n_lanes; i++) {
+                if( ra->lanes[i].last_use < lane->last_use ) lane = &ra->lanes[i];
+            }
+        }
+        lane->gen++;
+        lane->last_use = ++ra->clock;
+        lane->pos = readFromPos + n;
+        lane->head = 0;
+        lane->filled = 0;
+        lane->pending = 0;
+        lane->active = false;
+        xSemaphoreGive(ra->mutex);
+
+        stalled = true;
+        t0 = esp_timer_get_time();
+        xSemaphoreTake(ra->io, portMAX_DELAY);
+        if( !ra->src->read(ra->src, readFromPos, out_data, out_data_end) ) {
+            xSemaphoreGive(ra->io);
+            return hpatch_FALSE;
+        }
+        xSemaphoreGive(ra->io);
+        ra->wait_us += esp_timer_get_time() - t0;
+        ra->miss_bytes += n;
+        out_data += n;
+        readFromPos += n;
+
+        if( activate ) {
+            xSemaphoreTake(ra->mutex, portMAX_DELAY);
+            lane->active = true;
+            xSemaphoreGive(ra->mutex);
+            xSemaphoreGive(ra->work);
+        }
+    }
+    if( stalled ) ra->n_stalls++;
+
+    return hpatch_TRUE;
+}
+
+/**
+ * @brief Read straight from the source, timing it.
+ */
+static hpatch_BOOL readahead_read_direct(const struct hpatch_TStreamInput* stream,
+        hpatch_StreamPos_t readFromPos,
+        unsigned char* out_data,
+        unsigned char* out_data_end) {
+    esp_hdiffz_readahead_t *ra = (esp_hdiffz_readahead_t *)stream->streamImport;
+    int64_t t0 = esp_timer_get_time();
+    hpatch_BOOL ok;
+
+    ok = ra->src->read(ra->src, readFromPos, out_data, out_data_end);
+    ra->n_reads++;
+    ra->wait_us += esp_timer_get_time() - t0;
+    return ok;
+}
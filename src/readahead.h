@@ -0,0 +1,66 @@
+#ifndef ESP_HDIFFZ_READAHEAD_H__
+#define ESP_HDIFFZ_READAHEAD_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "esp_hdiffz.h"
+#include "mem.h"
+
+#include "HPatch/patch.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ESP_HDIFFZ_READAHEAD_MAX_LANES 4
+
+/**
+ * @brief Reads a diff ahead of the patch on another task.
+ *
+ * HDiffPatch reads each section of a diff front to back, several sections at
+ * once. Each section gets a lane: a ring of refills that a worker task pinned
+ * to the other core keeps full, so storage reads overlap with inflate and the
+ * patch. A read no lane follows is served directly from the source and parks
+ * the least recently used lane after it; the lane is filled once the next
+ * read continues there.
+ */
+typedef struct esp_hdiffz_readahead_t esp_hdiffz_readahead_t;
+
+/**
+ * @brief Start a read-ahead.
+ * @param[in] src Stream to read ahead from. Only read by one task at a time.
+ * @param[in] refill_size Bytes per read of src.
+ * @param[in] depth Refills buffered per lane. 0 starts no task; reads go
+ *     straight to src and are only timed.
+ * @param[in] n_lanes Number of lanes in range [1, ESP_HDIFFZ_READAHEAD_MAX_LANES].
+ * @param[in] mem Placement of the lane rings. May be NULL.
+ * @param[out] out Read-ahead on success.
+ * @return ESP_OK on success; ESP_ERR_NO_MEM on OOM.
+ */
+esp_err_t esp_hdiffz_readahead_create(const hpatch_TStreamInput *src, size_t refill_size, uint8_t depth,
+        uint8_t n_lanes, const esp_hdiffz_mem_t *mem, esp_hdiffz_readahead_t **out);
+
+/**
+ * @brief Heap esp_hdiffz_readahead_create allocates, including the worker's stack.
+ */
+size_t esp_hdiffz_readahead_heap(size_t refill_size, uint8_t depth, uint8_t n_lanes);
+
+/**
+ * @brief Populate an input stream that reads through the read-ahead.
+ *
+ * Only one task may read from it.
+ */
+void esp_hdiffz_readahead_as_input(esp_hdiffz_readahead_t *ra, hpatch_TStreamInput *in);
+
+/**
+ * @brief Stop the worker and free the read-ahead.
+ * @param[out] stats Diff read counters are written here. May be NULL.
+ */
+void esp_hdiffz_readahead_del(esp_hdiffz_readahead_t *ra, esp_hdiffz_patch_stats_t *stats);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
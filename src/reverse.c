@@ -0,0 +1,428 @@
+/**
+ * @file reverse
+ * @brief Reverse (rollback) diff derived from the covers of a forward patch.
+ *
+ * A forward cover says new[n..n+len) = old[o..o+len) + delta. Swapped, it
+ * becomes a cover of the reverse diff with delta old - new. Old data no
+ * cover reaches is stored verbatim. Sections are stored uncompressed, so
+ * the ctrl/code streams are computed once per section from the two images.
+ */
+
+//#define LOG_LOCAL_LEVEL 4
+
+#include "esp_log.h"
+#include "esp_hdiffz.h"
+
+#include "esp_system.h"
+#include "engine.h"
+#include "reverse.h"
+#include "pack.h"
+#include "mem.h"
+
+/* Initial capacity of the cover list; doubled as needed */
+#define REVERSE_COVERS_INIT 64
+/* Read chunk of each image while computing the delta */
+#define REVERSE_BUF_SIZE 1024
+/* Output is written in chunks of this size */
+#define REVERSE_OUT_BUF_SIZE 256
+/* Same-byte runs at least this long get their own RLE entry */
+#define REVERSE_RLE_MIN 3
+
+static const char TAG[] = "esp_hdiffz_reverse";
+
+/**
+ * RLE control types; see engine.c
+ */
+enum {
+    RLE_ZERO = 0,
+    RLE_FF,
+    RLE_BYTE,
+    RLE_RAW,
+};
+
+/**
+ * Output sections; the diff sections plus the header.
+ */
+enum {
+    SINK_HEAD = ESP_HDIFFZ_SEC_N,
+    SINK_N,
+    SINK_NONE = SINK_N,
+};
+
+/**
+ * One cover; forward coordinates until esp_hdiffz_reverse_write clips them.
+ */
+typedef struct rcover_t {
+    uint32_t old_pos;
+    uint32_t new_pos;
+    uint32_t len;
+} rcover_t;
+
+struct esp_hdiffz_reverse_t {
+    rcover_t *covers;
+    size_t n_covers;
+    size_t cap;
+    bool oom;
+    const esp_hdiffz_mem_t *mem;
+};
+
+/**
+ * Sequential writer of one section at a time; the rest are only measured.
+ */
+typedef struct sink_t {
+    const hpatch_TStreamOutput *out;
+    hpatch_StreamPos_t pos;            /**< Bytes written to out */
+    uint8_t active;                    /**< Section being written; SINK_NONE to only measure */
+    hpatch_StreamPos_t size[SINK_N];
+    bool ok;
+    unsigned char buf[REVERSE_OUT_BUF_SIZE];
+    size_t len;
+} sink_t;
+
+/**
+ * RLE encoder of the reverse delta.
+ */
+typedef struct rle_enc_t {
+    sink_t *sink;
+    unsigned char value;               /**< Byte of the pending run */
+    hpatch_StreamPos_t run;            /**< Length of the pending run */
+    hpatch_StreamPos_t raw;            /**< Code bytes emitted for the open RAW entry */
+} rle_enc_t;
+
+/**************
+ * PROTOTYPES *
+ **************/
+static int cover_cmp(const void *a, const void *b);
+static size_t covers_clip(rcover_t *covers, size_t n);
+static void sink_put(sink_t *sink, uint8_t sec, const unsigned char *data, size_t n);
+static void sink_uint(sink_t *sink, uint8_t sec, uint8_t tag, uint8_t tag_bits, hpatch_StreamPos_t value);
+static bool sink_flush(sink_t *sink);
+static void rle_enc_end(rle_enc_t *enc);
+static void rle_enc_run(rle_enc_t *enc, unsigned char value, hpatch_StreamPos_t n);
+static void rle_enc_finish(rle_enc_t *enc);
+static bool put_covers(sink_t *sink, const rcover_t *covers, size_t n);
+static bool put_rle(sink_t *sink, const rcover_t *covers, size_t n,
+        const hpatch_TStreamInput *old_stream, const hpatch_TStreamInput *new_stream, unsigned char *buf);
+static bool put_new_diff(sink_t *sink, const rcover_t *covers, size_t n,
+        const hpatch_TStreamInput *old_stream, unsigned char *buf);
+
+/********************
+ * PUBLIC FUNCTIONS *
+ ********************/
+
+esp_err_t esp_hdiffz_reverse_create(const esp_hdiffz_mem_t *mem, esp_hdiffz_reverse_t **out) {
+    esp_hdiffz_reverse_t *rev;
+
+    *out = NULL;
+    rev = calloc(1, sizeof(esp_hdiffz_reverse_t));
+    if( NULL == rev ) return ESP_ERR_NO_MEM;
+    rev->mem = mem;
+    rev->cap = REVERSE_COVERS_INIT;
+    rev->covers = malloc(rev->cap * sizeof(rcover_t));
+    if( NULL == rev->covers ) {
+        free(rev);
+        return ESP_ERR_NO_MEM;
+    }
+    *out = rev;
+    return ESP_OK;
+}
+
+void esp_hdiffz_reverse_cover(void *arg, hpatch_StreamPos_t old_pos,
+        hpatch_StreamPos_t new_pos, hpatch_StreamPos_t len) {
+    esp_hdiffz_reverse_t *rev = arg;
+
+    if( 0 == len || rev->oom ) return;
+    if( rev->n_covers == rev->cap ) {
+        rcover_t *covers = realloc(rev->covers, 2 * rev->cap * sizeof(rcover_t));
+        if( NULL == covers ) {
+            rev->oom = true;
+            return;
+        }
+        rev->covers = covers;
+        rev->cap *= 2;
+    }
+    rev->covers[rev->n_covers].old_pos = old_pos;
+    rev->covers[rev->n_covers].new_pos = new_pos;
+    rev->covers[rev->n_covers].len = len;
+    rev->n_covers++;
+}
+
+esp_err_t esp_hdiffz_reverse_write(esp_hdiffz_reverse_t *rev,
+        const hpatch_TStreamInput *old_stream, const hpatch_TStreamInput *new_stream,
+        const hpatch_TStreamOutput *out, size_t *size) {
+    esp_err_t err = ESP_FAIL;
+    sink_t *sink = NULL;
+    unsigned char *buf = NULL;
+    hpatch_StreamPos_t sizes[SINK_N];
+    size_t n;
+
+    if( rev->oom ) {
+        ESP_LOGE(TAG, "Ran out of memory recording %d covers", (int)rev->n_covers);
+        return ESP_ERR_NO_MEM;
+    }
+
+    sink = calloc(1, sizeof(sink_t));
+    buf = esp_hdiffz_mem_alloc(rev->mem, ESP_HDIFFZ_MEM_IO, 2 * REVERSE_BUF_SIZE);
+    if( NULL == sink || NULL == buf ) {
+        ESP_LOGE(TAG, "OOM");
+        err = ESP_ERR_NO_MEM;
+        goto exit;
+    }
+
+    /* Reverse covers must be ordered and disjoint in old data */
+    qsort(rev->covers, rev->n_covers, sizeof(rcover_t), cover_cmp);
+    n = covers_clip(rev->covers, rev->n_covers);
+
+    /* Measure every section before writing the header */
+    sink->out = out;
+    sink->ok = true;
+    sink->active = SINK_NONE;
+    if( !put_covers(sink, rev->covers, n)
+            || !put_rle(sink, rev->covers, n, old_stream, new_stream, buf)
+            || !put_new_diff(sink, rev->covers, n, old_stream, NULL) ) goto exit;
+    memcpy(sizes, sink->size, sizeof(sizes));
+
+    sink->active = SINK_HEAD;
+    sink_put(sink, SINK_HEAD, (const unsigned char *)ESP_HDIFFZ_DIFFZ_MAGIC, sizeof(ESP_HDIFFZ_DIFFZ_MAGIC) - 1);
+    sink_put(sink, SINK_HEAD, (const unsigned char *)"", 1);   /* Uncompressed */
+    sink_uint(sink, SINK_HEAD, 0, 0, old_stream->streamSize);
+    sink_uint(sink, SINK_HEAD, 0, 0, new_stream->streamSize);
+    sink_uint(sink, SINK_HEAD, 0, 0, n);
+    for(uint8_t i=0; i < ESP_HDIFFZ_SEC_N; i++) {
+        sink_uint(sink, SINK_HEAD, 0, 0, sizes[i]);
+        sink_uint(sink, SINK_HEAD, 0, 0, 0);
+    }
+
+    sink->active = ESP_HDIFFZ_SEC_COVER;
+    if( !put_covers(sink, rev->covers, n) ) goto exit;
+    sink->active = ESP_HDIFFZ_SEC_RLE_CTRL;
+    if( !put_rle(sink, rev->covers, n, old_stream, new_stream, buf) ) goto exit;
+    sink->active = ESP_HDIFFZ_SEC_RLE_CODE;
+    if( !put_rle(sink, rev->covers, n, old_stream, new_stream, buf) ) goto exit;
+    sink->active = ESP_HDIFFZ_SEC_NEW_DIFF;
+    if( !put_new_diff(sink, rev->covers, n, old_stream, buf) ) goto exit;
+    if( !sink_flush(sink) ) goto exit;
+
+    ESP_LOGI(TAG, "Reverse diff: %d bytes; %d covers, %d ctrl, %d code, %d verbatim",
+            (int)sink->pos, (int)n, (int)sizes[ESP_HDIFFZ_SEC_RLE_CTRL],
+            (int)sizes[ESP_HDIFFZ_SEC_RLE_CODE], (int)sizes[ESP_HDIFFZ_SEC_NEW_DIFF]);
+    if( NULL != size ) *size = sink->pos;
+    err = ESP_OK;
+
+exit:
+    if( ESP_OK != err && NULL != sink && !sink->ok ) ESP_LOGE(TAG, "Failed to write reverse diff");
+    if( NULL != buf ) free(buf);
+    if( NULL != sink ) free(sink);
+    return err;
+}
+
+void esp_hdiffz_reverse_del(esp_hdiffz_reverse_t *rev) {
+    if( NULL == rev ) return;
+    free(rev->covers);
+    free(rev);
+}
+
+/*********************
+ * PRIVATE FUNCTIONS *
+ *********************/
+
+/**
+ * @brief Order by old position; longer first on ties so it wins the clip.
+ */
+static int cover_cmp(const void *a, const void *b) {
+    const rcover_t *x = a, *y = b;
+    if( x->old_pos != y->old_pos ) return x->old_pos < y->old_pos ? -1 : 1;
+    if( x->len != y->len ) return x->len > y->len ? -1 : 1;
+    return 0;
+}
+
+/**
+ * @brief Trim sorted covers so no two share old data.
+ * @return Number of covers left; compacted to the front.
+ */
+static size_t covers_clip(rcover_t *covers, size_t n) {
+    size_t n_out = 0;
+    uint32_t end = 0;
+
+    for(size_t i=0; i < n; i++) {
+        rcover_t c = covers[i];
+        if( c.old_pos + c.len <= end ) continue;
+        if( c.old_pos < end ) {
+            uint32_t skip = end - c.old_pos;
+            c.old_pos += skip;
+            c.new_pos += skip;
+            c.len -= skip;
+        }
+        covers[n_out++] = c;
+        end = c.old_pos + c.len;
+    }
+    return n_out;
+}
+
+/**
+ * @brief Append to a section; written only if it is the active one.
+ */
+static void sink_put(sink_t *sink, uint8_t sec, const unsigned char *data, size_t n) {
+    sink->size[sec] += n;
+    if( sec != sink->active ) return;
+
+    while( n > 0 ) {
+        size_t k = sizeof(sink->buf) - sink->len;
+        if( k > n ) k = n;
+        memcpy(&sink->buf[sink->len], data, k);
+        sink->len += k;
+        data += k;
+        n -= k;
+        if( sink->len == sizeof(sink->buf) ) sink_flush(sink);
+    }
+}
+
+/**
+ * @brief Append an HDiffPatch packed uint with tag_bits of tag in the first byte.
+ */
+static void sink_uint(sink_t *sink, uint8_t sec, uint8_t tag, uint8_t tag_bits, hpatch_StreamPos_t value) {
+    unsigned char code[ESP_HDIFFZ_PACKED_UINT_MAX];
+
+    sink_put(sink, sec, code, esp_hdiffz_pack_uint(code, value, tag_bits, tag));
+}
+
+static bool sink_flush(sink_t *sink) {
+    /* After a failure, data is dropped; the caller sees it at the end */
+    if( sink->len > 0 && sink->ok
+            && !sink->out->write(sink->out, sink->pos, sink->buf, sink->buf + sink->len) ) {
+        sink->ok = false;
+    }
+    sink->pos += sink->len;
+    sink->len = 0;
+    return sink->ok;
+}
+
+/**
+ * @brief Emit the pending run; short runs join the open RAW entry.
+ */
+static void rle_enc_end(rle_enc_t *enc) {
+    sink_t *sink = enc->sink;
+
+    if( 0 == enc->run ) return;
+
+    if( enc->run >= REVERSE_RLE_MIN
+            || (enc->run >= 2 && (0x00 == enc->value || 0xFF == enc->value)) ) {
+        uint8_t type = 0x00 == enc->value ? RLE_ZERO : 0xFF == enc->value ? RLE_FF : RLE_BYTE;
+        if( enc->raw > 0 ) {
+            sink_uint(sink, ESP_HDIFFZ_SEC_RLE_CTRL, RLE_RAW, 2, enc->raw - 1);
+            enc->raw = 0;
+        }
+        sink_uint(sink, ESP_HDIFFZ_SEC_RLE_CTRL, type, 2, enc->run - 1);
+        if( RLE_BYTE == type ) sink_put(sink, ESP_HDIFFZ_SEC_RLE_CODE, &enc->value, 1);
+    }
+    else {
+        for(hpatch_StreamPos_t i=0; i < enc->run; i++) {
+            sink_put(sink, ESP_HDIFFZ_SEC_RLE_CODE, &enc->value, 1);
+        }
+        enc->raw += enc->run;
+    }
+    enc->run = 0;
+}
+
+/**
+ * @brief Append n delta bytes of the same value.
+ */
+static void rle_enc_run(rle_enc_t *enc, unsigned char value, hpatch_StreamPos_t n) {
+    if( enc->run > 0 && value != enc->value ) rle_enc_end(enc);
+    enc->value = value;
+    enc->run += n;
+}
+
+static void rle_enc_finish(rle_enc_t *enc) {
+    rle_enc_end(enc);
+    if( enc->raw > 0 ) {
+        sink_uint(enc->sink, ESP_HDIFFZ_SEC_RLE_CTRL, RLE_RAW, 2, enc->raw - 1);
+        enc->raw = 0;
+    }
+}
+
+/**
+ * @brief Cover section; reverse old is forward new and vice versa.
+ */
+static bool put_covers(sink_t *sink, const rcover_t *covers, size_t n) {
+    hpatch_StreamPos_t last_old_end = 0, last_new_end = 0;
+
+    for(size_t i=0; i < n; i++) {
+        hpatch_StreamPos_t old_pos = covers[i].new_pos, new_pos = covers[i].old_pos;
+
+        if( old_pos >= last_old_end ) {
+            sink_uint(sink, ESP_HDIFFZ_SEC_COVER, 0, 1, old_pos - last_old_end);
+        }
+        else {
+            sink_uint(sink, ESP_HDIFFZ_SEC_COVER, 1, 1, last_old_end - old_pos);
+        }
+        sink_uint(sink, ESP_HDIFFZ_SEC_COVER, 0, 0, new_pos - last_new_end);
+        sink_uint(sink, ESP_HDIFFZ_SEC_COVER, 0, 0, covers[i].len);
+        last_old_end = old_pos + covers[i].len;
+        last_new_end = new_pos + covers[i].len;
+    }
+    return sink_flush(sink);
+}
+
+/**
+ * @brief RLE ctrl and code sections of old - new over each cover.
+ *
+ * The delta spans every byte of the old image: the gaps between covers and
+ * the tail after the last one are zeros, as the patcher skips over them.
+ * @param[in] buf 2 * REVERSE_BUF_SIZE bytes.
+ */
+static bool put_rle(sink_t *sink, const rcover_t *covers, size_t n,
+        const hpatch_TStreamInput *old_stream, const hpatch_TStreamInput *new_stream, unsigned char *buf) {
+    rle_enc_t enc = { .sink = sink };
+    unsigned char *old_buf = buf, *new_buf = buf + REVERSE_BUF_SIZE;
+    hpatch_StreamPos_t end = 0;
+
+    for(size_t i=0; i < n; i++) {
+        if( covers[i].old_pos > end ) rle_enc_run(&enc, 0, covers[i].old_pos - end);
+
+        for(uint32_t done = 0; done < covers[i].len; ) {
+            size_t k = covers[i].len - done;
+            if( k > REVERSE_BUF_SIZE ) k = REVERSE_BUF_SIZE;
+            if( !old_stream->read(old_stream, covers[i].old_pos + done, old_buf, old_buf + k)
+                    || !new_stream->read(new_stream, covers[i].new_pos + done, new_buf, new_buf + k) ) {
+                ESP_LOGE(TAG, "Failed to read images");
+                return false;
+            }
+            for(size_t j=0; j < k; j++) rle_enc_run(&enc, old_buf[j] - new_buf[j], 1);
+            done += k;
+        }
+        end = covers[i].old_pos + covers[i].len;
+    }
+    if( end < old_stream->streamSize ) rle_enc_run(&enc, 0, old_stream->streamSize - end);
+    rle_enc_finish(&enc);
+    return sink_flush(sink);
+}
+
+/**
+ * @brief Old data outside every cover, verbatim.
+ * @param[in] buf REVERSE_BUF_SIZE bytes; NULL to only measure.
+ */
+static bool put_new_diff(sink_t *sink, const rcover_t *covers, size_t n,
+        const hpatch_TStreamInput *old_stream, unsigned char *buf) {
+    hpatch_StreamPos_t pos = 0;
+
+    for(size_t i=0; i <= n; i++) {
+        hpatch_StreamPos_t gap_end = i < n ? covers[i].old_pos : old_stream->streamSize;
+
+        if( NULL == buf ) {
+            sink->size[ESP_HDIFFZ_SEC_NEW_DIFF] += gap_end - pos;
+        }
+        while( NULL != buf && pos < gap_end ) {
+            size_t k = gap_end - pos;
+            if( k > REVERSE_BUF_SIZE ) k = REVERSE_BUF_SIZE;
+            if( !old_stream->read(old_stream, pos, buf, buf + k) ) {
+                ESP_LOGE(TAG, "Failed to read old image");
+                return false;
+            }
+            sink_put(sink, ESP_HDIFFZ_SEC_NEW_DIFF, buf, k);
+            pos += k;
+        }
+        if( i < n ) pos = covers[i].old_pos + covers[i].len;
+    }
+    return sink_flush(sink);
+}
@@ -0,0 +1,58 @@
+#ifndef ESP_HDIFFZ_REVERSE_H__
+#define ESP_HDIFFZ_REVERSE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+#include "HPatch/patch.h"
+#include "mem.h"
+
+/**
+ * @brief Builds a reverse (new to old) diff from the covers of a forward patch.
+ *
+ * Covers are collected while the forward patch runs. Afterwards the reverse
+ * diff is derived from them and from both images, and written as an
+ * uncompressed HDiffPatch diff that the normal patch path applies.
+ */
+typedef struct esp_hdiffz_reverse_t esp_hdiffz_reverse_t;
+
+/**
+ * @brief Allocate an empty cover list.
+ * @param[in] mem Placement of the buffers esp_hdiffz_reverse_write allocates;
+ *     must outlive the builder. May be NULL.
+ * @param[out] out Builder on success.
+ * @return ESP_OK on success; ESP_ERR_NO_MEM on OOM.
+ */
+esp_err_t esp_hdiffz_reverse_create(const esp_hdiffz_mem_t *mem, esp_hdiffz_reverse_t **out);
+
+/**
+ * @brief Record one forward cover.
+ *
+ * Signature matches esp_hdiffz_engine_cfg_t.cover. An allocation failure is
+ * remembered and reported by esp_hdiffz_reverse_write.
+ */
+void esp_hdiffz_reverse_cover(void *rev, hpatch_StreamPos_t old_pos,
+        hpatch_StreamPos_t new_pos, hpatch_StreamPos_t len);
+
+/**
+ * @brief Write the reverse diff.
+ *
+ * The output is written strictly in order from offset 0.
+ *
+ * @param[in] old_stream Old data of the forward patch; restored by the reverse diff.
+ * @param[in] new_stream Patched data of the forward patch; input of the reverse diff.
+ * @param[in] out Reverse diff destination.
+ * @param[out] size Bytes written. May be NULL.
+ * @return ESP_OK on success.
+ */
+esp_err_t esp_hdiffz_reverse_write(esp_hdiffz_reverse_t *rev,
+        const hpatch_TStreamInput *old_stream, const hpatch_TStreamInput *new_stream,
+        const hpatch_TStreamOutput *out, size_t *size);
+
+/**
+ * @brief Free the cover list.
+ */
+void esp_hdiffz_reverse_del(esp_hdiffz_reverse_t *rev);
+
+#endif
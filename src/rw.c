@@ -1,7 +1,10 @@
-#define LOG_LOCAL_LEVEL 4
+//#define LOG_LOCAL_LEVEL 4
 
+#include <unistd.h>
 #include "rw.h"
+#include "mem.h"
 #include "esp_log.h"
+#include "profile.h"
 
 static const char TAG[] = "hdiffz_rw";
 
@@ -14,7 +17,7 @@ hpatch_BOOL esp_hdiffz_file_read(const struct hpatch_TStreamInput* stream,
         unsigned char* out_data,
         unsigned char* out_data_end) {
     int n_bytes = out_data_end - out_data;
-    ESP_LOGD(TAG, "Reading %d bytes from file.", n_bytes);
+    ESP_HDIFFZ_TRACE(TAG, "Reading %d bytes from file at %d.", n_bytes, (int)readFromPos);
 
     FILE *file = (FILE*)stream->streamImport;
 
@@ -35,7 +38,7 @@ hpatch_BOOL esp_hdiffz_file_write(const struct hpatch_TStreamOutput* stream,
         const unsigned char* data,
         const unsigned char* data_end) {
     int n_bytes = data_end - data;
-    ESP_LOGD(TAG, "Writing %d bytes to file. \"%.*s\"", n_bytes, n_bytes, data);
+    ESP_HDIFFZ_TRACE(TAG, "Writing %d bytes to file at %d.", n_bytes, (int)writeToPos);
 
     FILE *file = (FILE*)stream->streamImport;
 
@@ -45,12 +48,277 @@ hpatch_BOOL esp_hdiffz_file_write(const struct hpatch_TStreamOutput* stream,
     return hpatch_TRUE;
 }
 
+/**
+ * @brief Read data from memory.
+ * @return True on success, False otherwise
+ */
+static hpatch_BOOL esp_hdiffz_mem_read(const struct hpatch_TStreamInput* stream,
+        hpatch_StreamPos_t readFromPos,
+        unsigned char* out_data,
+        unsigned char* out_data_end) {
+    size_t n_bytes = out_data_end - out_data;
+
+    if( readFromPos + n_bytes > stream->streamSize ) return hpatch_FALSE;
+    memcpy(out_data, (const unsigned char *)stream->streamImport + readFromPos, n_bytes);
+    return hpatch_TRUE;
+}
+
+void esp_hdiffz_mem_as_stream_input(hpatch_TStreamInput *stream, const unsigned char *mem, size_t size) {
+    stream->streamImport = (void *)mem;
+    stream->streamSize = size;
+    stream->read = esp_hdiffz_mem_read;
+}
+
+const unsigned char *esp_hdiffz_stream_mem(const hpatch_TStreamInput *stream) {
+    if( esp_hdiffz_mem_read != stream->read ) return NULL;
+    return stream->streamImport;
+}
+
 size_t esp_hdiffz_get_file_size(FILE *f) {
     size_t size;
     long int pos;
     pos = ftell(f);
     fseek(f, 0, SEEK_END);
     size = ftell(f);
-    fseek(f, 0, pos);
+    fseek(f, pos, SEEK_SET);
     return size;
 }
+
+/**********************
+ * BUFFERED FILE I/O *
+ **********************/
+
+static hpatch_BOOL file_stream_read(const struct hpatch_TStreamInput* stream,
+        hpatch_StreamPos_t readFromPos,
+        unsigned char* out_data,
+        unsigned char* out_data_end);
+static hpatch_BOOL file_stream_write(const struct hpatch_TStreamOutput* stream,
+        hpatch_StreamPos_t writeToPos,
+        const unsigned char* data,
+        const unsigned char* data_end);
+
+esp_err_t esp_hdiffz_file_stream_init(esp_hdiffz_file_stream_t *stream, FILE *file, size_t buf_size, uint8_t n_lanes) {
+    return esp_hdiffz_file_stream_init_adv(stream, file, buf_size, n_lanes, NULL);
+}
+
+esp_err_t esp_hdiffz_file_stream_init_adv(esp_hdiffz_file_stream_t *stream, FILE *file, size_t buf_size, uint8_t n_lanes,
+        const esp_hdiffz_mem_t *mem) {
+    assert(n_lanes >= 1 && n_lanes <= ESP_HDIFFZ_FILE_STREAM_MAX_LANES);
+
+    memset(stream, 0, sizeof(esp_hdiffz_file_stream_t));
+    stream->file = file;
+    stream->pos = ftell(file);
+    stream->n_lanes = n_lanes;
+
+    if( buf_size > 0 ) {
+        for(uint8_t i=0; i < n_lanes; i++) {
+            stream->lanes[i].buf = esp_hdiffz_mem_alloc(mem, ESP_HDIFFZ_MEM_IO, buf_size);
+            if( NULL == stream->lanes[i].buf ) {
+                esp_hdiffz_file_stream_deinit(stream);
+                return ESP_ERR_NO_MEM;
+            }
+        }
+        stream->buf_size = buf_size;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t esp_hdiffz_file_stream_deinit(esp_hdiffz_file_stream_t *stream) {
+    esp_err_t err;
+
+    err = esp_hdiffz_file_stream_flush(stream);
+    for(uint8_t i=0; i < stream->n_lanes; i++) {
+        if( NULL != stream->lanes[i].buf ) free(stream->lanes[i].buf);
+        stream->lanes[i].buf = NULL;
+    }
+    stream->buf_size = 0;
+    ESP_LOGD(TAG, "fseek: %d (%d skipped), fread: %d, fwrite: %d",
+            stream->stats.n_fseek, stream->stats.n_fseek_skipped,
+            stream->stats.n_fread, stream->stats.n_fwrite);
+
+    return err;
+}
+
+/**
+ * @brief Move the FILE to pos, skipping the fseek if it is already there.
+ * @return True on success, False otherwise
+ */
+static hpatch_BOOL file_stream_seek(esp_hdiffz_file_stream_t *stream, hpatch_StreamPos_t pos) {
+    if( stream->pos >= 0 && (hpatch_StreamPos_t)stream->pos == pos ) {
+        stream->stats.n_fseek_skipped++;
+        return hpatch_TRUE;
+    }
+    stream->stats.n_fseek++;
+    if( 0 != fseek(stream->file, pos, SEEK_SET) ) {
+        stream->pos = -1;
+        return hpatch_FALSE;
+    }
+    stream->pos = pos;
+    return hpatch_TRUE;
+}
+
+/**
+ * @brief fread at pos; returns the number of bytes read.
+ */
+static size_t file_stream_pread(esp_hdiffz_file_stream_t *stream, hpatch_StreamPos_t pos,
+        unsigned char *data, size_t n_bytes) {
+    size_t n;
+
+    if(!file_stream_seek(stream, pos)) return 0;
+    stream->stats.n_fread++;
+    n = fread(data, 1, n_bytes, stream->file);
+    stream->pos += n;
+    return n;
+}
+
+/**
+ * @brief fwrite at pos.
+ * @return True on success, False otherwise
+ */
+static hpatch_BOOL file_stream_pwrite(esp_hdiffz_file_stream_t *stream, hpatch_StreamPos_t pos,
+        const unsigned char *data, size_t n_bytes) {
+    size_t n;
+
+    if(!file_stream_seek(stream, pos)) return hpatch_FALSE;
+    stream->stats.n_fwrite++;
+    n = fwrite(data, 1, n_bytes, stream->file);
+    stream->pos += n;
+    return n == n_bytes;
+}
+
+esp_err_t esp_hdiffz_file_stream_flush(esp_hdiffz_file_stream_t *stream) {
+    esp_hdiffz_file_lane_t *lane = &stream->lanes[0];
+
+    if( stream->dirty ) {
+        stream->dirty = false;
+        if(!file_stream_pwrite(stream, lane->pos, lane->buf, lane->len)) {
+            ESP_LOGE(TAG, "Failed to write %d bytes at offset %d.",
+                    (int)lane->len, (uint32_t)lane->pos);
+            lane->len = 0;
+            return ESP_FAIL;
+        }
+        lane->len = 0;
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_hdiffz_file_stream_prealloc(esp_hdiffz_file_stream_t *stream, size_t size) {
+    if( 0 != fflush(stream->file) ) return ESP_FAIL;
+    if( 0 != ftruncate(fileno(stream->file), size) ) {
+        ESP_LOGD(TAG, "Filesystem cannot preallocate %d bytes.", (int)size);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    return ESP_OK;
+}
+
+void esp_hdiffz_file_stream_as_input(esp_hdiffz_file_stream_t *stream, hpatch_TStreamInput *in) {
+    in->streamImport = stream;
+    in->streamSize = esp_hdiffz_get_file_size(stream->file);
+    in->read = file_stream_read;
+}
+
+void esp_hdiffz_file_stream_as_output(esp_hdiffz_file_stream_t *stream, hpatch_TStreamOutput *out, hpatch_StreamPos_t size) {
+    out->streamImport = stream;
+    out->streamSize = size;
+    out->write = file_stream_write;
+}
+
+/**
+ * @brief Pick the lane to serve a read at pos.
+ *
+ * Prefers a lane holding pos, then a lane whose data ends at pos (the next
+ * read of a sequential section), then the least recently used lane.
+ */
+ESP_HDIFFZ_HOT esp_hdiffz_file_lane_t *file_stream_lane(esp_hdiffz_file_stream_t *stream, hpatch_StreamPos_t pos) {
+    esp_hdiffz_file_lane_t *seq = NULL, *lru = &stream->lanes[0];
+
+    for(uint8_t i=0; i < stream->n_lanes; i++) {
+        esp_hdiffz_file_lane_t *lane = &stream->lanes[i];
+        if( pos >= lane->pos && pos < lane->pos + lane->len ) return lane;
+        if( lane->len > 0 && pos == lane->pos + lane->len ) seq = lane;
+        if( lane->last_use < lru->last_use ) lru = lane;
+    }
+    return seq ? seq : lru;
+}
+
+/**
+ * @brief Read data through the read-ahead lanes.
+ * @return True on success, False otherwise
+ */
+static hpatch_BOOL file_stream_read(const struct hpatch_TStreamInput* in,
+        hpatch_StreamPos_t readFromPos,
+        unsigned char* out_data,
+        unsigned char* out_data_end) {
+    esp_hdiffz_file_stream_t *stream = in->streamImport;
+    esp_hdiffz_file_lane_t *lane;
+    size_t n_bytes = out_data_end - out_data;
+
+    stream->stats.n_read++;
+
+    if( stream->dirty && ESP_OK != esp_hdiffz_file_stream_flush(stream) ) return hpatch_FALSE;
+
+    lane = file_stream_lane(stream, readFromPos);
+    lane->last_use = ++stream->clock;
+
+    /* Serve what we can from the lane */
+    if( readFromPos >= lane->pos && readFromPos < lane->pos + lane->len ) {
+        size_t offset = readFromPos - lane->pos;
+        size_t n = lane->len - offset;
+        if( n > n_bytes ) n = n_bytes;
+        memcpy(out_data, &lane->buf[offset], n);
+        out_data += n;
+        readFromPos += n;
+        n_bytes -= n;
+        if( 0 == n_bytes ) {
+            stream->stats.n_buf_hit++;
+            return hpatch_TRUE;
+        }
+    }
+
+    /* Large reads bypass the lane */
+    if( n_bytes >= stream->buf_size ) {
+        return n_bytes == file_stream_pread(stream, readFromPos, out_data, n_bytes);
+    }
+
+    /* Refill; a short read is fine as long as it covers the request */
+    lane->pos = readFromPos;
+    lane->len = file_stream_pread(stream, readFromPos, lane->buf, stream->buf_size);
+    if( lane->len < n_bytes ) return hpatch_FALSE;
+    memcpy(out_data, lane->buf, n_bytes);
+
+    return hpatch_TRUE;
+}
+
+/**
+ * @brief Write data through the write-behind buffer.
+ * @return True on success, False otherwise
+ */
+static hpatch_BOOL file_stream_write(const struct hpatch_TStreamOutput* out,
+        hpatch_StreamPos_t writeToPos,
+        const unsigned char* data,
+        const unsigned char* data_end) {
+    esp_hdiffz_file_stream_t *stream = out->streamImport;
+    esp_hdiffz_file_lane_t *lane = &stream->lanes[0];
+    size_t n_bytes = data_end - data;
+
+    stream->stats.n_write++;
+
+    /* Drop read-ahead data, and pending data that this write doesn't extend */
+    if( !stream->dirty || writeToPos != lane->pos + lane->len
+            || lane->len + n_bytes > stream->buf_size ) {
+        if( ESP_OK != esp_hdiffz_file_stream_flush(stream) ) return hpatch_FALSE;
+        for(uint8_t i=0; i < stream->n_lanes; i++) stream->lanes[i].len = 0;
+        lane->pos = writeToPos;
+    }
+
+    if( n_bytes >= stream->buf_size ) {
+        return file_stream_pwrite(stream, writeToPos, data, n_bytes);
+    }
+
+    memcpy(&lane->buf[lane->len], data, n_bytes);
+    lane->len += n_bytes;
+    stream->dirty = true;
+
+    return hpatch_TRUE;
+}
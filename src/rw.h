@@ -1,10 +1,16 @@
 #ifndef ESP_HDIFFZ_RW_H__ 
 #define ESP_HDIFFZ_RW_H__ 
 
+#include <stdbool.h>
 #include "esp_system.h"
 #include "esp_partition.h"
 
 #include "HPatch/patch.h"
+#include "mem.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 hpatch_BOOL esp_hdiffz_file_read(const struct hpatch_TStreamInput* stream,
         hpatch_StreamPos_t readFromPos,
@@ -18,5 +24,114 @@ hpatch_BOOL esp_hdiffz_file_write(const struct hpatch_TStreamOutput* stream,
 
 size_t esp_hdiffz_get_file_size(FILE *f);
 
+/**
+ * @brief Wrap a memory buffer as an input stream.
+ *
+ * Unlike mem_as_hStreamInput, streams created here can be recognized by
+ * esp_hdiffz_stream_mem so consumers may access the bytes in place.
+ *
+ * @param[out] stream Stream to populate.
+ * @param[in] mem Start of buffer; must outlive the stream.
+ * @param[in] size Number of bytes in buffer.
+ */
+void esp_hdiffz_mem_as_stream_input(hpatch_TStreamInput *stream, const unsigned char *mem, size_t size);
+
+/**
+ * @brief Get the backing buffer of a memory stream.
+ * @param[in] stream Any input stream.
+ * @return Start of the buffer if created by esp_hdiffz_mem_as_stream_input; NULL otherwise.
+ */
+const unsigned char *esp_hdiffz_stream_mem(const hpatch_TStreamInput *stream);
+
+/**
+ * @brief Counters kept by a buffered file stream.
+ */
+typedef struct esp_hdiffz_file_stats_t {
+    uint32_t n_read;            /**< read() calls from HDiffPatch */
+    uint32_t n_write;           /**< write() calls from HDiffPatch */
+    uint32_t n_fseek;           /**< fseek() calls issued */
+    uint32_t n_fseek_skipped;   /**< fseek() calls avoided because the position was already correct */
+    uint32_t n_fread;           /**< fread() calls issued */
+    uint32_t n_fwrite;          /**< fwrite() calls issued */
+    uint32_t n_buf_hit;         /**< read() calls served entirely from the buffer */
+} esp_hdiffz_file_stats_t;
+
+#define ESP_HDIFFZ_FILE_STREAM_MAX_LANES 4
+
+/**
+ * @brief A buffered window of the file.
+ */
+typedef struct esp_hdiffz_file_lane_t {
+    unsigned char *buf;
+    hpatch_StreamPos_t pos;         /**< File offset of buf[0] */
+    size_t len;                     /**< Valid (read) or pending (write) bytes in buf */
+    uint32_t last_use;              /**< For least-recently-used replacement */
+} esp_hdiffz_file_lane_t;
+
+/**
+ * @brief FILE adapter that tracks the file position and buffers data.
+ *
+ * Reads are served from read-ahead lanes. HDiffPatch reads the diff from
+ * several sections at once, so each section can keep its own lane instead of
+ * evicting the others. Writes are collected in a write-behind buffer (lane 0)
+ * and only issued to the filesystem when it is full, a non-contiguous write
+ * comes in, or on flush. fseek is only called when the file is not already at
+ * the required position.
+ */
+typedef struct esp_hdiffz_file_stream_t {
+    FILE *file;
+    long pos;                       /**< Current FILE position; -1 if unknown */
+    size_t buf_size;                /**< Size of each lane buffer */
+    uint8_t n_lanes;
+    uint32_t clock;
+    bool dirty;                     /**< Lane 0 holds pending write data */
+    esp_hdiffz_file_lane_t lanes[ESP_HDIFFZ_FILE_STREAM_MAX_LANES];
+    esp_hdiffz_file_stats_t stats;
+} esp_hdiffz_file_stream_t;
+
+/**
+ * @brief Allocate the buffers and sync with the current FILE position.
+ * @param[out] stream Object to initialize.
+ * @param[in] file Opened file.
+ * @param[in] buf_size Size of each lane in bytes. 0 for unbuffered.
+ * @param[in] n_lanes Number of read-ahead lanes in range [1, ESP_HDIFFZ_FILE_STREAM_MAX_LANES].
+ * @return ESP_OK on success.
+ */
+esp_err_t esp_hdiffz_file_stream_init(esp_hdiffz_file_stream_t *stream, FILE *file, size_t buf_size, uint8_t n_lanes);
+
+/**
+ * @brief esp_hdiffz_file_stream_init, with the lanes placed by a patch's policy.
+ * @param[in] mem Policy and report of the patch. May be NULL.
+ */
+esp_err_t esp_hdiffz_file_stream_init_adv(esp_hdiffz_file_stream_t *stream, FILE *file, size_t buf_size, uint8_t n_lanes,
+        const esp_hdiffz_mem_t *mem);
+
+/**
+ * @brief Flush pending writes and free the buffers.
+ * @return ESP_OK on success.
+ */
+esp_err_t esp_hdiffz_file_stream_deinit(esp_hdiffz_file_stream_t *stream);
+
+/**
+ * @brief Write out any pending data.
+ * @return ESP_OK on success.
+ */
+esp_err_t esp_hdiffz_file_stream_flush(esp_hdiffz_file_stream_t *stream);
+
+/**
+ * @brief Reserve size bytes of storage for the file ahead of writing.
+ *
+ * Failure is not fatal; not all filesystems support it.
+ *
+ * @return ESP_OK if the filesystem reserved the space.
+ */
+esp_err_t esp_hdiffz_file_stream_prealloc(esp_hdiffz_file_stream_t *stream, size_t size);
+
+void esp_hdiffz_file_stream_as_input(esp_hdiffz_file_stream_t *stream, hpatch_TStreamInput *in);
+void esp_hdiffz_file_stream_as_output(esp_hdiffz_file_stream_t *stream, hpatch_TStreamOutput *out, hpatch_StreamPos_t size);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
 
 #endif
@@ -0,0 +1,217 @@
+//#define LOG_LOCAL_LEVEL 4
+
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_hdiffz.h"
+
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "mem.h"
+#include "trace.h"
+
+/* Tasks with a track of their own in an export; any more share the last one */
+#define TRACE_MAX_TASKS 8
+
+static const char TAG[] = "hdiffz_trace";
+
+/**
+ * One complete event; 16 bytes.
+ */
+typedef struct trace_event_t {
+    uint32_t ts;                       /**< Start, in us since esp_hdiffz_trace_start */
+    uint32_t dur;                      /**< Duration in us */
+    uint32_t size;                     /**< Bytes moved */
+    uint8_t type;                      /**< esp_hdiffz_trace_type_t */
+    uint8_t task;                      /**< Index in tasks */
+} trace_event_t;
+
+static const char *const s_names[ESP_HDIFFZ_TRACE_N] = {
+    [ESP_HDIFFZ_TRACE_ERASE] = "erase",
+    [ESP_HDIFFZ_TRACE_DIFF_READ] = "diff read",
+    [ESP_HDIFFZ_TRACE_INFLATE] = "inflate",
+    [ESP_HDIFFZ_TRACE_OLD_READ] = "old read",
+    [ESP_HDIFFZ_TRACE_WRITE] = "write",
+    [ESP_HDIFFZ_TRACE_YIELD] = "yield",
+};
+
+static struct {
+    trace_event_t *ring;
+    size_t size;                       /**< Events the ring holds */
+    uint32_t n;                        /**< Events recorded since start */
+    int64_t start_us;
+    volatile bool on;
+    uint8_t n_tasks;
+    struct {
+        TaskHandle_t handle;
+        char name[16];
+    } tasks[TRACE_MAX_TASKS];
+} s_trace;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/**************
+ * PROTOTYPES *
+ **************/
+static uint8_t trace_task(void);
+
+/********************
+ * PUBLIC FUNCTIONS *
+ ********************/
+
+#if CONFIG_HDIFFZ_TRACE_RECORDER
+
+esp_err_t esp_hdiffz_trace_start(size_t n_events) {
+    trace_event_t *ring = NULL, *old = NULL;
+
+    if( 0 == n_events ) return ESP_ERR_INVALID_ARG;
+
+    /* Allocated outside the lock; workers may be recording into the old ring */
+    if( n_events != s_trace.size ) {
+        ring = esp_hdiffz_mem_calloc(NULL, ESP_HDIFFZ_MEM_CACHE, n_events, sizeof(trace_event_t));
+        if( NULL == ring ) {
+            ESP_LOGE(TAG, "No memory for %d events", (int)n_events);
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    portENTER_CRITICAL(&s_lock);
+    if( NULL != ring ) {
+        old = s_trace.ring;
+        s_trace.ring = ring;
+        s_trace.size = n_events;
+    }
+    s_trace.n = 0;
+    s_trace.n_tasks = 0;
+    s_trace.start_us = esp_timer_get_time();
+    s_trace.on = true;
+    portEXIT_CRITICAL(&s_lock);
+
+    free(old);
+    return ESP_OK;
+}
+
+void esp_hdiffz_trace_stop(void) {
+    portENTER_CRITICAL(&s_lock);
+    s_trace.on = false;
+    portEXIT_CRITICAL(&s_lock);
+}
+
+esp_err_t esp_hdiffz_trace_export(FILE *out) {
+    uint32_t first, n;
+
+    if( s_trace.on || NULL == s_trace.ring ) return ESP_ERR_INVALID_STATE;
+
+    /* Oldest first; the ring holds the last size events */
+    n = s_trace.n < s_trace.size ? s_trace.n : s_trace.size;
+    first = s_trace.n - n;
+
+    fprintf(out, "{\"traceEvents\":[\n");
+    for(uint8_t i=0; i < s_trace.n_tasks; i++) {
+        fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}},\n",
+                i, s_trace.tasks[i].name);
+    }
+    for(uint32_t i=0; i < n; i++) {
+        const trace_event_t *ev = &s_trace.ring[(first + i) % s_trace.size];
+        fprintf(out, "{\"name\":\"%s\",\"cat\":\"hdiffz\",\"ph\":\"X\",\"ts\":%u,\"dur\":%u,"
+                "\"pid\":1,\"tid\":%d,\"args\":{\"bytes\":%u}},\n",
+                s_names[ev->type], (unsigned)ev->ts, (unsigned)ev->dur, ev->task, (unsigned)ev->size);
+    }
+    /* Metadata last, so every event line ends with a comma */
+    fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"esp_hdiffz\"}}\n");
+    fprintf(out, "],\"displayTimeUnit\":\"ms\",\"otherData\":{\"events\":%u,\"dropped\":%u}}\n",
+            (unsigned)s_trace.n, (unsigned)first);
+
+    if( ferror(out) ) {
+        ESP_LOGE(TAG, "Failed to write trace");
+        return ESP_FAIL;
+    }
+    ESP_LOGI(TAG, "Exported %u events; %u overwritten", (unsigned)n, (unsigned)first);
+    return ESP_OK;
+}
+
+void esp_hdiffz_trace_free(void) {
+    trace_event_t *ring;
+
+    /* Detached under the lock, so no event is written into it once freed */
+    portENTER_CRITICAL(&s_lock);
+    s_trace.on = false;
+    ring = s_trace.ring;
+    s_trace.ring = NULL;
+    s_trace.size = 0;
+    s_trace.n = 0;
+    portEXIT_CRITICAL(&s_lock);
+
+    free(ring);
+}
+
+#else
+
+esp_err_t esp_hdiffz_trace_start(size_t n_events) {
+    ESP_LOGE(TAG, "Built without CONFIG_HDIFFZ_TRACE_RECORDER");
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+void esp_hdiffz_trace_stop(void) {
+}
+
+esp_err_t esp_hdiffz_trace_export(FILE *out) {
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+void esp_hdiffz_trace_free(void) {
+}
+
+#endif
+
+int64_t esp_hdiffz_trace_begin(void) {
+    return s_trace.on ? esp_timer_get_time() : -1;
+}
+
+void esp_hdiffz_trace_end(esp_hdiffz_trace_type_t type, int64_t t0, size_t size) {
+    trace_event_t *ev;
+    int64_t t1;
+
+    if( t0 < 0 || !s_trace.on ) return;
+    t1 = esp_timer_get_time();
+
+    portENTER_CRITICAL(&s_lock);
+    /* Stopped or freed since the check above */
+    if( !s_trace.on || NULL == s_trace.ring ) {
+        portEXIT_CRITICAL(&s_lock);
+        return;
+    }
+    ev = &s_trace.ring[s_trace.n % s_trace.size];
+    s_trace.n++;
+    ev->ts = (uint32_t)(t0 - s_trace.start_us);
+    ev->dur = (uint32_t)(t1 - t0);
+    ev->size = size;
+    ev->type = type;
+    ev->task = trace_task();
+    portEXIT_CRITICAL(&s_lock);
+}
+
+/*********************
+ * PRIVATE FUNCTIONS *
+ *********************/
+
+/**
+ * @brief Track of the calling task, added on first use.
+ *
+ * Must hold s_lock.
+ */
+static uint8_t trace_task(void) {
+    TaskHandle_t handle = xTaskGetCurrentTaskHandle();
+    uint8_t i;
+
+    for(i=0; i < s_trace.n_tasks; i++) {
+        if( s_trace.tasks[i].handle == handle ) return i;
+    }
+    if( i == TRACE_MAX_TASKS ) return i - 1;
+
+    s_trace.tasks[i].handle = handle;
+    strncpy(s_trace.tasks[i].name, pcTaskGetTaskName(handle), sizeof(s_trace.tasks[i].name) - 1);
+    s_trace.tasks[i].name[sizeof(s_trace.tasks[i].name) - 1] = '\0';
+    s_trace.n_tasks++;
+    return i;
+}
@@ -0,0 +1,60 @@
+#ifndef ESP_HDIFFZ_TRACE_H__
+#define ESP_HDIFFZ_TRACE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "sdkconfig.h"
+#include "esp_hdiffz.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Kinds of timed event in a trace.
+ */
+typedef enum esp_hdiffz_trace_type_t {
+    ESP_HDIFFZ_TRACE_ERASE = 0,        /**< Erase of a chunk of the destination */
+    ESP_HDIFFZ_TRACE_DIFF_READ,        /**< Read of the diff stream */
+    ESP_HDIFFZ_TRACE_INFLATE,          /**< One decompress call; includes its diff reads */
+    ESP_HDIFFZ_TRACE_OLD_READ,         /**< Read of old data */
+    ESP_HDIFFZ_TRACE_WRITE,            /**< Write of patched data to flash or a file */
+    ESP_HDIFFZ_TRACE_YIELD,            /**< Time given to other tasks */
+    ESP_HDIFFZ_TRACE_N,
+} esp_hdiffz_trace_type_t;
+
+/**
+ * @brief Start of an event.
+ * @return Timestamp to pass to esp_hdiffz_trace_end; -1 if not recording.
+ */
+int64_t esp_hdiffz_trace_begin(void);
+
+/**
+ * @brief Record an event that started at t0 and ends now.
+ *
+ * Safe to call from any task. Does nothing if t0 is -1.
+ *
+ * @param[in] type Kind of event.
+ * @param[in] t0 Return value of esp_hdiffz_trace_begin.
+ * @param[in] size Bytes the event moved.
+ */
+void esp_hdiffz_trace_end(esp_hdiffz_trace_type_t type, int64_t t0, size_t size);
+
+/**
+ * @brief Time the code between them as one event.
+ *
+ * Without CONFIG_HDIFFZ_TRACE_RECORDER no code is left behind.
+ */
+#if CONFIG_HDIFFZ_TRACE_RECORDER
+#define ESP_HDIFFZ_TRACE_BEGIN() esp_hdiffz_trace_begin()
+#define ESP_HDIFFZ_TRACE_END(type, t0, size) esp_hdiffz_trace_end(type, t0, size)
+#else
+#define ESP_HDIFFZ_TRACE_BEGIN() ((int64_t)-1)
+#define ESP_HDIFFZ_TRACE_END(type, t0, size) do { (void)(t0); (void)(size); } while(0)
+#endif
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,149 @@
+//#define LOG_LOCAL_LEVEL 4
+
+#include "esp_log.h"
+#include "esp_hdiffz.h"
+
+#include "esp_system.h"
+#include "miniz_plugin.h"
+#include "engine.h"
+#include "mem.h"
+#include "oldcheck.h"
+#include "mbedtls/sha256.h"
+
+/* Engine output buffer; unchanged old data is hashed this much at a time */
+#define VALIDATE_BUF_SIZE (32*1024)
+/* Smallest buffer worth trying before leaving it to the engine's default */
+#define VALIDATE_BUF_SIZE_MIN (4*1024)
+
+static const char TAG[] = "esp_hdiffz_validate";
+
+/**
+ * Output stream that hashes the patched data and discards it.
+ */
+typedef struct hash_sink_t {
+    mbedtls_sha256_context sha;
+    hpatch_StreamPos_t pos;            /**< Next expected write position */
+} hash_sink_t;
+
+/**************
+ * PROTOTYPES *
+ **************/
+static hpatch_BOOL hash_sink_write(const struct hpatch_TStreamOutput* stream,
+        hpatch_StreamPos_t writeToPos,
+        const unsigned char* data,
+        const unsigned char* data_end);
+
+/********************
+ * PUBLIC FUNCTIONS *
+ ********************/
+
+esp_err_t esp_hdiffz_validate(const hpatch_TStreamInput *old_stream, const hpatch_TStreamInput *diff_stream, esp_hdiffz_digest_t *digest) {
+    esp_err_t err;
+    esp_hdiffz_info_t info;
+    hash_sink_t sink;
+    hpatch_TStreamOutput out_stream = { 0 };
+    unsigned char *buf = NULL;
+    size_t buf_size;
+    esp_hdiffz_engine_cfg_t cfg = { 0 };
+    esp_hdiffz_miniz_plugin_t miniz;
+    hpatch_TDecompress *plugin = &miniz.base;
+    hpatch_TStreamInput sections, checked_old;
+    esp_hdiffz_oldcheck_t *oldcheck = NULL;
+
+    memset(digest, 0, sizeof(esp_hdiffz_digest_t));
+    mbedtls_sha256_init(&sink.sha);
+    sink.pos = 0;
+
+    err = esp_hdiffz_get_info(diff_stream, &info);
+    if( ESP_OK != err ) goto exit;
+    if( info.old_size > old_stream->streamSize ) {
+        ESP_LOGE(TAG, "Diff expects %d bytes of old data; got %d",
+                (int)info.old_size, (int)old_stream->streamSize);
+        err = ESP_ERR_INVALID_SIZE;
+        goto exit;
+    }
+
+    /* The engine only gets the sections; old data checksums are checked here */
+    err = esp_hdiffz_oldcheck_create(diff_stream, old_stream, NULL, &oldcheck);
+    if( ESP_OK != err ) goto exit;
+    if( NULL != oldcheck ) {
+        esp_hdiffz_oldcheck_as_input(oldcheck, &checked_old);
+        old_stream = &checked_old;
+    }
+    sections = *diff_stream;
+    sections.streamSize -= info.old_check_size;
+    diff_stream = &sections;
+
+    for(buf_size = VALIDATE_BUF_SIZE;
+            buf_size >= VALIDATE_BUF_SIZE_MIN; buf_size /= 2) {
+        buf = esp_hdiffz_mem_alloc(NULL, ESP_HDIFFZ_MEM_CACHE, buf_size);
+        if( NULL != buf ) break;
+    }
+
+    /* Preset dictionaries are read from the old data being validated
+     * against; uncompressed diffs, e.g. rollback diffs, need no plugin. */
+    esp_hdiffz_miniz_plugin_init(&miniz);
+    miniz.dict_src = old_stream;
+    if( 0 == info.n_nodes ) plugin = NULL;
+
+    mbedtls_sha256_starts_ret(&sink.sha, 0);
+    out_stream.streamImport = &sink;
+    out_stream.streamSize = info.new_size;
+    out_stream.write = hash_sink_write;
+
+    /* The same engine the OTA writes flash with, into the hash instead */
+    cfg.out = &out_stream;
+    cfg.old = old_stream;
+    cfg.diff = diff_stream;
+    cfg.plugin = plugin;
+    if( NULL != buf ) {
+        cfg.buf = buf;
+        cfg.buf_size = buf_size;
+    }
+    err = esp_hdiffz_engine_patch(&cfg);
+    if( esp_hdiffz_oldcheck_failed(oldcheck)
+            || (ESP_OK == err && ESP_OK != esp_hdiffz_oldcheck_finish(oldcheck)) ) {
+        err = ESP_ERR_HDIFFZ_OLD_MISMATCH;
+        goto exit;
+    }
+    if( ESP_OK != err || sink.pos != info.new_size ) {
+        ESP_LOGE(TAG, "Diff failed to apply after %d of %d bytes",
+                (int)sink.pos, (int)info.new_size);
+        if( ESP_OK == err ) err = ESP_FAIL;
+        goto exit;
+    }
+    mbedtls_sha256_finish_ret(&sink.sha, digest->sha256);
+    digest->size = info.new_size;
+    err = ESP_OK;
+
+exit:
+    mbedtls_sha256_free(&sink.sha);
+    esp_hdiffz_oldcheck_del(oldcheck, NULL);
+    if( NULL != buf ) free(buf);
+    return err;
+}
+
+/*********************
+ * PRIVATE FUNCTIONS *
+ *********************/
+
+/**
+ * @brief Hash patched data; the engine writes its output strictly in order.
+ */
+static hpatch_BOOL hash_sink_write(const struct hpatch_TStreamOutput* stream,
+        hpatch_StreamPos_t writeToPos,
+        const unsigned char* data,
+        const unsigned char* data_end) {
+    hash_sink_t *sink = (hash_sink_t *)stream->streamImport;
+    size_t n_bytes = data_end - data;
+
+    if( writeToPos != sink->pos ) {
+        ESP_LOGE(TAG, "Out of order write at %d; expected %d",
+                (int)writeToPos, (int)sink->pos);
+        return hpatch_FALSE;
+    }
+    mbedtls_sha256_update_ret(&sink->sha, data, n_bytes);
+    sink->pos += n_bytes;
+
+    return hpatch_TRUE;
+}
@@ -37,3 +37,16 @@ void test_spiffs_create_file_with_text(const char* name, const char* text)
 }
 
 
+void test_spiffs_create_file_from_partition(const char *name, const esp_partition_t *part, size_t len) {
+    char buf[512];
+    FILE* f = fopen(name, "wb");
+    TEST_ASSERT_NOT_NULL(f);
+    for(size_t offset = 0; offset < len; offset += sizeof(buf)) {
+        size_t n = len - offset;
+        if(n > sizeof(buf)) n = sizeof(buf);
+        TEST_ESP_OK(esp_partition_read(part, offset, buf, n));
+        TEST_ASSERT_EQUAL(n, fwrite(buf, 1, n, f));
+    }
+    TEST_ASSERT_EQUAL(0, fclose(f));
+}
+
@@ -2,10 +2,16 @@
 #define ESP_HDIFFZ_TEST_COMMON_H__
 
 #include "stddef.h"
+#include "esp_partition.h"
 
 void test_fs_setup(void);
 void test_fs_teardown(void);
 void test_spiffs_create_file_with_data(const char *name, const char* data, size_t len);
 void test_spiffs_create_file_with_text(const char* name, const char* text);
+void test_spiffs_create_file_from_partition(const char *name, const esp_partition_t *part, size_t len);
+
+/* Diff from bin/hello_world.bin to bin/hello_world_after_patch.bin */
+extern char hello_world_diff[];
+extern const size_t hello_world_diff_size;
 
 #endif
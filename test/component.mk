@@ -1 +1,4 @@
 COMPONENT_ADD_LDFLAGS = -Wl,--whole-archive -l$(COMPONENT_NAME) -Wl,--no-whole-archive
+
+# test_cpp.cpp uses esp_hdiffz.hpp
+CXXFLAGS += -std=gnu++17
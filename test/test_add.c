@@ -0,0 +1,75 @@
+#include <stdlib.h>
+#include <string.h>
+#include "add.h"
+
+#include "unity.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+
+TEST_CASE("Add kernel matches byte loop", "[hdiffz]")
+{
+    unsigned char src[80], dst[80], exp[80];
+
+    /* Every length and alignment pair over a couple of words */
+    for(size_t len = 0; len <= 64; len++) {
+        for(size_t dst_off = 0; dst_off < 8; dst_off++) {
+            for(size_t src_off = 0; src_off < 8; src_off++) {
+                unsigned char value = esp_random();
+
+                esp_fill_random(src, sizeof(src));
+                esp_fill_random(dst, sizeof(dst));
+                memcpy(exp, dst, sizeof(dst));
+
+                esp_hdiffz_add_ref(exp + dst_off, src + src_off, len);
+                esp_hdiffz_add(dst + dst_off, src + src_off, len);
+                TEST_ASSERT_EQUAL_HEX8_ARRAY(exp, dst, sizeof(dst));
+
+                for(size_t i=0; i < len; i++) exp[dst_off + i] += value;
+                esp_hdiffz_add_byte(dst + dst_off, value, len);
+                TEST_ASSERT_EQUAL_HEX8_ARRAY(exp, dst, sizeof(dst));
+            }
+        }
+    }
+}
+
+TEST_CASE("Add kernel benchmark", "[hdiffz][perf]")
+{
+    const size_t size = 16384;
+    const int rounds = 64;
+    unsigned char *src = malloc(size + 8);
+    unsigned char *dst = malloc(size + 8);
+    TEST_ASSERT_NOT_NULL(src);
+    TEST_ASSERT_NOT_NULL(dst);
+    esp_fill_random(src, size + 8);
+    esp_fill_random(dst, size + 8);
+
+    const struct {
+        const char *name;
+        size_t dst_off;
+        size_t src_off;
+    } cases[] = {
+        { "aligned", 0, 0 },
+        { "same misalignment", 3, 3 },
+        { "different misalignment", 1, 2 },
+    };
+
+    printf("add kernel: %d bits\n", CONFIG_HDIFFZ_ADD_KERNEL);
+    for(size_t c=0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        int64_t t0, t_ref, t_kernel;
+
+        t0 = esp_timer_get_time();
+        for(int r=0; r < rounds; r++) esp_hdiffz_add_ref(dst + cases[c].dst_off, src + cases[c].src_off, size);
+        t_ref = esp_timer_get_time() - t0;
+
+        t0 = esp_timer_get_time();
+        for(int r=0; r < rounds; r++) esp_hdiffz_add(dst + cases[c].dst_off, src + cases[c].src_off, size);
+        t_kernel = esp_timer_get_time() - t0;
+
+        printf("%-24s ref %6d KB/s, kernel %6d KB/s\n", cases[c].name,
+                (int)((int64_t)size * rounds * 1000 / 1024 / t_ref),
+                (int)((int64_t)size * rounds * 1000 / 1024 / t_kernel));
+    }
+
+    free(src);
+    free(dst);
+}
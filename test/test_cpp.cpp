@@ -0,0 +1,51 @@
+#include "esp_hdiffz.hpp"
+
+#include "unity.h"
+#include "common.h"
+
+#include "esp_ota_ops.h"
+
+using namespace esp_hdiffz;
+
+/**
+ * Same patch as ota_from_mem through esp_hdiffz.hpp, twice with one session.
+ */
+TEST_CASE("cpp_session", "[hdiffz]")
+{
+    const esp_partition_t *ota_0, *ota_1, *ota_2;
+    uint8_t ota_1_sha256[32], ota_2_sha256[32];
+    esp_hdiffz_info_t info;
+
+    ota_0 = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, NULL);
+    TEST_ASSERT_NOT_NULL(ota_0);
+    ota_1 = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_1, NULL);
+    TEST_ASSERT_NOT_NULL(ota_1);
+    ota_2 = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_2, NULL);
+    TEST_ASSERT_NOT_NULL(ota_2);
+    TEST_ESP_OK(esp_partition_get_sha256(ota_2, ota_2_sha256));
+
+    PartitionSource old(ota_0);
+    MemorySource diff(hello_world_diff, hello_world_diff_size);
+    Session session(old, diff);
+    TEST_ESP_OK(session.info(info));
+    TEST_ASSERT_EQUAL(149216, info.new_size);
+
+    for(int i=0; i < 2; i++) {
+        PartitionSink out(ota_1);
+        TEST_ESP_OK(session.patch(out));
+        TEST_ASSERT_EQUAL(12, session.stats().n_covers);
+
+        TEST_ESP_OK(esp_partition_get_sha256(ota_1, ota_1_sha256));
+        TEST_ASSERT_EQUAL_HEX8_ARRAY(ota_2_sha256, ota_1_sha256, 32);
+    }
+
+    /* Callbacks see every byte in order */
+    size_t n_written = 0;
+    CallbackSink count([&n_written](hpatch_StreamPos_t pos, const_bytes data) {
+        if( pos != n_written ) return false;
+        n_written += data.size();
+        return true;
+    });
+    TEST_ESP_OK(session.patch(count));
+    TEST_ASSERT_EQUAL(info.new_size, n_written);
+}
@@ -1,7 +1,10 @@
 #include "esp_hdiffz.h"
+#include "rw.h"
 
 #include "unity.h"
 #include "common.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
 
 /**
  * Simplest file test case with patch all in one go.
@@ -92,3 +95,471 @@ TEST_CASE("Small file apply patch from file", "[hdiffz]")
 }
 
 
+static portMUX_TYPE s_batch_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/* Jobs finish on the pool's workers, possibly at the same time */
+static void batch_job_cb(esp_hdiffz_job_t *job, void *arg) {
+    int *n_complete = arg;
+    portENTER_CRITICAL(&s_batch_lock);
+    (*n_complete)++;
+    portEXIT_CRITICAL(&s_batch_lock);
+}
+
+TEST_CASE("Small file batch apply patch", "[hdiffz]")
+{
+    int cb, n_complete = 0;
+    char buf[100];
+    esp_hdiffz_job_t jobs[3] = { 0 };
+
+    const char soln[] = "foobar\n";
+    const char fn_old[] = "/spiffs/old.txt";
+    const char *fn_new[3] = { "/spiffs/new0.txt", "/spiffs/new1.txt", "/spiffs/new2.txt" };
+    const char fn_diff[] = "/spiffs/diff.txt";
+    const char old_txt[] = "foo\n";
+    const char diff[] = {
+      0x48, 0x44, 0x49, 0x46, 0x46, 0x31, 0x33, 0x26, 0x7a, 0x6c, 0x69, 0x62,
+      0x00, 0x07, 0x04, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x07, 0x00,
+      0x06, 0x66, 0x6f, 0x6f, 0x62, 0x61, 0x72, 0x0a
+    };
+
+    test_fs_setup();
+
+    test_spiffs_create_file_with_text(fn_old, old_txt);
+    test_spiffs_create_file_with_data(fn_diff, diff, sizeof(diff));
+
+    for(int i=0; i < 3; i++) {
+        jobs[i].in = fopen(fn_old, "rb");
+        jobs[i].out = fopen(fn_new[i], "wb");
+        jobs[i].cb = batch_job_cb;
+        jobs[i].cb_arg = &n_complete;
+    }
+    /* Mix of diff sources */
+    jobs[0].diff = fopen(fn_diff, "rb");
+    jobs[1].diff = fopen(fn_diff, "rb");
+    jobs[2].diff_mem = diff;
+    jobs[2].diff_mem_size = sizeof(diff);
+
+    TEST_ESP_OK(esp_hdiffz_patch_file_batch(jobs, 3, NULL));
+    TEST_ASSERT_EQUAL(3, n_complete);
+
+    for(int i=0; i < 3; i++) {
+        fclose(jobs[i].in);
+        fclose(jobs[i].out);
+        if(jobs[i].diff) fclose(jobs[i].diff);
+
+        TEST_ESP_OK(jobs[i].err);
+        TEST_ASSERT_EQUAL(strlen(soln), jobs[i].new_size);
+        /* Each job counts its own stream buffers */
+        TEST_ASSERT_GREATER_THAN(0, jobs[i].mem.cls[ESP_HDIFFZ_MEM_IO].n_allocs);
+
+        FILE *f_new = fopen(fn_new[i], "rb");
+        cb = fread(buf, 1, sizeof(buf), f_new);
+        fclose(f_new);
+
+        TEST_ASSERT_EQUAL(strlen(soln), cb);
+        TEST_ASSERT_EQUAL_STRING_LEN(soln, buf, cb);
+    }
+
+    test_fs_teardown();
+}
+
+static struct {
+    uint32_t n_read;
+    uint32_t n_write;
+} legacy_stats;
+
+static hpatch_BOOL legacy_read(const struct hpatch_TStreamInput* stream,
+        hpatch_StreamPos_t readFromPos, unsigned char* out_data, unsigned char* out_data_end) {
+    legacy_stats.n_read++;
+    return esp_hdiffz_file_read(stream, readFromPos, out_data, out_data_end);
+}
+
+static hpatch_BOOL legacy_write(const struct hpatch_TStreamOutput* stream,
+        hpatch_StreamPos_t writeToPos, const unsigned char* data, const unsigned char* data_end) {
+    legacy_stats.n_write++;
+    return esp_hdiffz_file_write(stream, writeToPos, data, data_end);
+}
+
+static void print_file_stats(const char *msg, const esp_hdiffz_file_stream_t *stream) {
+    printf("%s read: %d, write: %d, fseek: %d (%d skipped), fread: %d, fwrite: %d\n",
+            msg, stream->stats.n_read, stream->stats.n_write,
+            stream->stats.n_fseek, stream->stats.n_fseek_skipped,
+            stream->stats.n_fread, stream->stats.n_fwrite);
+}
+
+/**
+ * Compares the unbuffered adapters (one fseek per call) against the buffered
+ * adapters on the hello_world firmware pair.
+ *
+ * Requires ota_0 to be flashed via flash-unit-test.sh
+ */
+TEST_CASE("File adapter benchmark", "[hdiffz][perf]")
+{
+    int64_t t_legacy, t_buffered;
+    const char fn_old[] = "/spiffs/old.bin";
+    const char fn_new_legacy[] = "/spiffs/new_legacy.bin";
+    const char fn_new[] = "/spiffs/new.bin";
+    const char fn_diff[] = "/spiffs/diff.bin";
+    FILE *f_old, *f_new, *f_diff;
+    hpatch_compressedDiffInfo info;
+    hpatch_TStreamInput old_stream = { 0 }, diff_stream = { 0 };
+    hpatch_TStreamOutput out_stream = { 0 };
+
+    test_fs_setup();
+
+    const esp_partition_t *ota_0 = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, NULL);
+    TEST_ASSERT_NOT_NULL(ota_0);
+    {
+        hpatch_TStreamInput mem_diff;
+        mem_as_hStreamInput(&mem_diff, (const unsigned char *)hello_world_diff,
+                (const unsigned char *)hello_world_diff + hello_world_diff_size);
+        TEST_ASSERT_TRUE(getCompressedDiffInfo(&info, &mem_diff));
+    }
+    test_spiffs_create_file_from_partition(fn_old, ota_0, info.oldDataSize);
+    test_spiffs_create_file_with_data(fn_diff, hello_world_diff, hello_world_diff_size);
+
+    /* Unbuffered adapters */
+    f_old = fopen(fn_old, "rb");
+    f_new = fopen(fn_new_legacy, "wb");
+    f_diff = fopen(fn_diff, "rb");
+    old_stream.streamImport = f_old;
+    old_stream.streamSize = esp_hdiffz_get_file_size(f_old);
+    old_stream.read = legacy_read;
+    diff_stream.streamImport = f_diff;
+    diff_stream.streamSize = esp_hdiffz_get_file_size(f_diff);
+    diff_stream.read = legacy_read;
+    out_stream.streamImport = f_new;
+    out_stream.streamSize = UINT32_MAX;
+    out_stream.write = legacy_write;
+
+    t_legacy = esp_timer_get_time();
+    TEST_ASSERT_TRUE(patch_decompress(&out_stream, &old_stream, &diff_stream, minizDecompressPlugin));
+    t_legacy = esp_timer_get_time() - t_legacy;
+    fclose(f_old);
+    fclose(f_new);
+    fclose(f_diff);
+
+    /* Buffered adapters */
+    {
+        esp_hdiffz_file_stream_t old_file, new_file, diff_file;
+
+        f_old = fopen(fn_old, "rb");
+        f_new = fopen(fn_new, "wb");
+        f_diff = fopen(fn_diff, "rb");
+        TEST_ESP_OK(esp_hdiffz_file_stream_init(&old_file, f_old, 4096, 1));
+        TEST_ESP_OK(esp_hdiffz_file_stream_init(&new_file, f_new, 4096, 1));
+        TEST_ESP_OK(esp_hdiffz_file_stream_init(&diff_file, f_diff, 2048, ESP_HDIFFZ_FILE_STREAM_MAX_LANES));
+        esp_hdiffz_file_stream_as_input(&old_file, &old_stream);
+        esp_hdiffz_file_stream_as_input(&diff_file, &diff_stream);
+        esp_hdiffz_file_stream_as_output(&new_file, &out_stream, info.newDataSize);
+
+        t_buffered = esp_timer_get_time();
+        esp_hdiffz_file_stream_prealloc(&new_file, info.newDataSize);
+        TEST_ASSERT_TRUE(patch_decompress(&out_stream, &old_stream, &diff_stream, minizDecompressPlugin));
+        TEST_ESP_OK(esp_hdiffz_file_stream_flush(&new_file));
+        t_buffered = esp_timer_get_time() - t_buffered;
+
+        print_file_stats("old: ", &old_file);
+        print_file_stats("diff:", &diff_file);
+        print_file_stats("new: ", &new_file);
+        TEST_ESP_OK(esp_hdiffz_file_stream_deinit(&old_file));
+        TEST_ESP_OK(esp_hdiffz_file_stream_deinit(&new_file));
+        TEST_ESP_OK(esp_hdiffz_file_stream_deinit(&diff_file));
+        fclose(f_old);
+        fclose(f_new);
+        fclose(f_diff);
+    }
+
+    printf("Unbuffered: %d reads + %d writes (1 fseek each) in %d ms; %d KB/s\n",
+            legacy_stats.n_read, legacy_stats.n_write, (int)(t_legacy / 1000),
+            (int)(info.newDataSize * 1000 / t_legacy));
+    printf("Buffered: %d ms; %d KB/s\n",
+            (int)(t_buffered / 1000), (int)(info.newDataSize * 1000 / t_buffered));
+
+    /* Both must produce the same file */
+    {
+        char buf_a[256], buf_b[256];
+        size_t n_a, n_b;
+        FILE *f_a = fopen(fn_new_legacy, "rb");
+        FILE *f_b = fopen(fn_new, "rb");
+        TEST_ASSERT_EQUAL(info.newDataSize, esp_hdiffz_get_file_size(f_b));
+        do {
+            n_a = fread(buf_a, 1, sizeof(buf_a), f_a);
+            n_b = fread(buf_b, 1, sizeof(buf_b), f_b);
+            TEST_ASSERT_EQUAL(n_a, n_b);
+            TEST_ASSERT_EQUAL_HEX8_ARRAY(buf_a, buf_b, n_a);
+        } while(n_a > 0);
+        fclose(f_a);
+        fclose(f_b);
+    }
+
+    unlink(fn_old);
+    unlink(fn_new_legacy);
+    unlink(fn_new);
+    unlink(fn_diff);
+
+    test_fs_teardown();
+}
+
+/**
+ * Compressed diff held in memory; inflated in place without copying.
+ *
+ * Requires ota_0 and ota_2 to be flashed via flash-unit-test.sh
+ */
+TEST_CASE("Firmware file apply patch from mem", "[hdiffz]")
+{
+    const char fn_old[] = "/spiffs/old.bin";
+    const char fn_new[] = "/spiffs/new.bin";
+    FILE *f_old, *f_new;
+    hpatch_compressedDiffInfo info;
+    hpatch_TStreamInput mem_diff;
+
+    test_fs_setup();
+
+    const esp_partition_t *ota_0 = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, NULL);
+    const esp_partition_t *ota_2 = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_2, NULL);
+    TEST_ASSERT_NOT_NULL(ota_0);
+    TEST_ASSERT_NOT_NULL(ota_2);
+
+    esp_hdiffz_mem_as_stream_input(&mem_diff, (const unsigned char *)hello_world_diff, hello_world_diff_size);
+    TEST_ASSERT_EQUAL_PTR(hello_world_diff, esp_hdiffz_stream_mem(&mem_diff));
+    TEST_ASSERT_TRUE(getCompressedDiffInfo(&info, &mem_diff));
+    test_spiffs_create_file_from_partition(fn_old, ota_0, info.oldDataSize);
+
+    f_old = fopen(fn_old, "rb");
+    f_new = fopen(fn_new, "wb");
+    TEST_ESP_OK(esp_hdiffz_patch_file_from_mem(f_old, f_new, hello_world_diff, hello_world_diff_size));
+    fclose(f_old);
+    fclose(f_new);
+
+    /* Compare against the expected firmware */
+    {
+        char buf_new[256], buf_exp[256];
+        size_t n, offset = 0;
+        f_new = fopen(fn_new, "rb");
+        while((n = fread(buf_new, 1, sizeof(buf_new), f_new)) > 0) {
+            TEST_ESP_OK(esp_partition_read(ota_2, offset, buf_exp, n));
+            TEST_ASSERT_EQUAL_HEX8_ARRAY(buf_exp, buf_new, n);
+            offset += n;
+        }
+        fclose(f_new);
+        TEST_ASSERT_EQUAL(info.newDataSize, offset);
+    }
+
+    unlink(fn_old);
+    unlink(fn_new);
+
+    test_fs_teardown();
+}
+
+
+TEST_CASE("Diff info", "[hdiffz]")
+{
+    esp_hdiffz_info_t info;
+    hpatch_TStreamInput mem_diff;
+
+    esp_hdiffz_mem_as_stream_input(&mem_diff, (const unsigned char *)hello_world_diff, hello_world_diff_size);
+    TEST_ESP_OK(esp_hdiffz_get_info(&mem_diff, &info));
+    TEST_ASSERT_EQUAL(149216, info.new_size);
+    TEST_ASSERT_EQUAL(149200, info.old_size);
+    TEST_ASSERT_EQUAL(hello_world_diff_size, info.diff_size);
+    TEST_ASSERT_EQUAL_STRING("zlib", info.compress_type);
+    TEST_ASSERT_EQUAL(12, info.cover_count);
+    TEST_ASSERT_EQUAL(2, info.n_nodes);
+    TEST_ASSERT_EQUAL(12, info.window_bits);
+    TEST_ASSERT_GREATER_THAN(info.dec_heap, info.heap_worst);
+
+    /* Truncated diffs are rejected from the header alone */
+    esp_hdiffz_mem_as_stream_input(&mem_diff, (const unsigned char *)hello_world_diff, hello_world_diff_size - 1);
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_SIZE, esp_hdiffz_get_info(&mem_diff, &info));
+
+    /* Not a diff */
+    esp_hdiffz_mem_as_stream_input(&mem_diff, (const unsigned char *)hello_world_diff + 1, hello_world_diff_size - 1);
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, esp_hdiffz_get_info(&mem_diff, &info));
+}
+
+/**
+ * Write a config store of n records; every step-th threshold is changed.
+ */
+static void write_config(const char *name, int n, int step) {
+    FILE *f = fopen(name, "wb");
+    TEST_ASSERT_NOT_NULL(f);
+    for(int i=0; i < n; i++) {
+        int thr = (i * 7919) % 1000;
+        if( step && 0 == i % step ) thr++;
+        fprintf(f, "dev%04d name=sensor-%d thr=%d en=%d\n", i, i, thr, i % 3 == 0);
+    }
+    fclose(f);
+}
+
+/**
+ * Diff the config stores, patch the diff back and compare.
+ */
+static void diff_round_trip(const char *fn_old, const char *fn_new, const esp_hdiffz_diff_config_t *config,
+        esp_hdiffz_diff_stats_t *stats) {
+    const char fn_diff[] = "/spiffs/diff.bin";
+    const char fn_out[] = "/spiffs/out.txt";
+    FILE *f_old, *f_new, *f_diff, *f_out;
+
+    f_old = fopen(fn_old, "rb");
+    f_new = fopen(fn_new, "rb");
+    f_diff = fopen(fn_diff, "wb");
+    TEST_ESP_OK(esp_hdiffz_diff_file_adv(f_old, f_new, f_diff, config, stats));
+    fclose(f_diff);
+    TEST_ASSERT_LESS_OR_EQUAL(config->budget, stats->heap);
+
+    f_diff = fopen(fn_diff, "rb");
+    TEST_ASSERT_EQUAL(stats->diff_size, esp_hdiffz_get_file_size(f_diff));
+
+    /* The diff must hold up in HDiffPatch's own patcher, not just the OTA engine */
+    {
+        esp_hdiffz_file_stream_t old_file, diff_file;
+        hpatch_TStreamInput old_stream, diff_stream;
+        esp_hdiffz_digest_t digest;
+
+        rewind(f_old);
+        TEST_ESP_OK(esp_hdiffz_file_stream_init(&old_file, f_old, 4096, 1));
+        TEST_ESP_OK(esp_hdiffz_file_stream_init(&diff_file, f_diff, 2048, ESP_HDIFFZ_FILE_STREAM_MAX_LANES));
+        esp_hdiffz_file_stream_as_input(&old_file, &old_stream);
+        esp_hdiffz_file_stream_as_input(&diff_file, &diff_stream);
+        TEST_ESP_OK(esp_hdiffz_validate(&old_stream, &diff_stream, &digest));
+        TEST_ASSERT_EQUAL(esp_hdiffz_get_file_size(f_new), digest.size);
+        esp_hdiffz_file_stream_deinit(&diff_file);
+        esp_hdiffz_file_stream_deinit(&old_file);
+    }
+
+    f_out = fopen(fn_out, "wb");
+    rewind(f_old);
+    rewind(f_diff);
+    TEST_ESP_OK(esp_hdiffz_patch_file(f_old, f_out, f_diff));
+    fclose(f_out);
+    fclose(f_diff);
+
+    {
+        char buf_a[256], buf_b[256];
+        size_t n_a, n_b;
+        f_out = fopen(fn_out, "rb");
+        rewind(f_new);
+        do {
+            n_a = fread(buf_a, 1, sizeof(buf_a), f_new);
+            n_b = fread(buf_b, 1, sizeof(buf_b), f_out);
+            TEST_ASSERT_EQUAL(n_a, n_b);
+            TEST_ASSERT_EQUAL_HEX8_ARRAY(buf_a, buf_b, n_a);
+        } while(n_a > 0);
+        fclose(f_out);
+    }
+
+    fclose(f_old);
+    fclose(f_new);
+    unlink(fn_diff);
+    unlink(fn_out);
+}
+
+TEST_CASE("Small file create diff", "[hdiffz]")
+{
+    const char fn_old[] = "/spiffs/old.txt";
+    const char fn_new[] = "/spiffs/new.txt";
+    esp_hdiffz_diff_config_t config = ESP_HDIFFZ_DIFF_CONFIG_DEFAULT();
+    esp_hdiffz_diff_stats_t stats;
+    FILE *f_old, *f_new, *f_diff;
+
+    test_fs_setup();
+
+    write_config(fn_old, 1000, 0);
+    write_config(fn_new, 1000, 97);
+    config.budget = 16 * 1024;
+    diff_round_trip(fn_old, fn_new, &config, &stats);
+    TEST_ASSERT_GREATER_THAN(0, stats.n_covers);
+    TEST_ASSERT_LESS_THAN(stats.cover_bytes / 10, stats.diff_size);
+
+    /* Less than the file buffers */
+    f_old = fopen(fn_old, "rb");
+    f_new = fopen(fn_new, "rb");
+    f_diff = fopen("/spiffs/diff.bin", "wb");
+    TEST_ASSERT_EQUAL(ESP_ERR_NO_MEM, esp_hdiffz_diff_file(f_old, f_new, f_diff, 1024));
+    fclose(f_old);
+    fclose(f_new);
+    fclose(f_diff);
+
+    unlink("/spiffs/diff.bin");
+    unlink(fn_old);
+    unlink(fn_new);
+
+    test_fs_teardown();
+}
+
+TEST_CASE("Create diff benchmark", "[hdiffz][perf]")
+{
+    const char fn_old[] = "/spiffs/old.txt";
+    const char fn_new[] = "/spiffs/new.txt";
+    const size_t budgets[] = { 16 * 1024, 32 * 1024, 64 * 1024, 128 * 1024, 512 * 1024 };
+
+    test_fs_setup();
+
+    write_config(fn_old, 4000, 0);
+    write_config(fn_new, 4000, 211);
+
+    printf("%10s %8s %10s %8s %10s\n", "budget", "block", "diff", "zlib", "ms");
+    for(int i=0; i < sizeof(budgets) / sizeof(budgets[0]); i++) {
+        esp_hdiffz_diff_config_t config = ESP_HDIFFZ_DIFF_CONFIG_DEFAULT();
+        esp_hdiffz_diff_stats_t stats;
+
+        config.budget = budgets[i];
+        diff_round_trip(fn_old, fn_new, &config, &stats);
+        printf("%10d %8d %10d %8s %10d\n", (int)budgets[i], (int)stats.block_size,
+                (int)stats.diff_size, stats.compressed ? "yes" : "no", (int)(stats.time_us / 1000));
+    }
+
+    unlink(fn_old);
+    unlink(fn_new);
+
+    test_fs_teardown();
+}
+
+/**
+ * Diffs at every window size patch back, and the device reports the
+ * largest one it can take.
+ */
+TEST_CASE("Window bits", "[hdiffz]")
+{
+    const char fn_old[] = "/spiffs/old.txt";
+    const char fn_new[] = "/spiffs/new.txt";
+    const esp_hdiffz_mem_policy_t no_caches = {
+        .caps = {
+            [ESP_HDIFFZ_MEM_STATE] = MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT,
+            [ESP_HDIFFZ_MEM_IO] = MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT,
+            /* PSRAM is never DMA capable; nothing has these */
+            [ESP_HDIFFZ_MEM_CACHE] = MALLOC_CAP_SPIRAM | MALLOC_CAP_DMA,
+        },
+        .fallback = false,
+    };
+    int8_t max_window_bits;
+
+    max_window_bits = esp_hdiffz_max_window_bits(NULL);
+    printf("Max window bits %d\n", max_window_bits);
+    TEST_ASSERT_GREATER_OR_EQUAL(9, max_window_bits);
+    TEST_ASSERT_LESS_OR_EQUAL(15, max_window_bits);
+
+    /* Windows over 4 KB are placed with the caches */
+    TEST_ASSERT_EQUAL(12, esp_hdiffz_max_window_bits(&no_caches));
+
+    test_fs_setup();
+
+    write_config(fn_old, 2000, 0);
+    write_config(fn_new, 2000, 13);
+    for(int8_t window_bits=9; window_bits <= max_window_bits; window_bits += 3) {
+        esp_hdiffz_diff_config_t config = ESP_HDIFFZ_DIFF_CONFIG_DEFAULT();
+        esp_hdiffz_diff_stats_t stats;
+
+        /* Enough for the compressor */
+        config.budget = 512 * 1024;
+        config.window_bits = window_bits;
+        diff_round_trip(fn_old, fn_new, &config, &stats);
+        printf("window bits %d: %d byte diff\n", window_bits, (int)stats.diff_size);
+    }
+
+    unlink(fn_old);
+    unlink(fn_new);
+
+    test_fs_teardown();
+}
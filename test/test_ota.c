@@ -1,12 +1,21 @@
 #include "esp_hdiffz.h"
+#include "rw.h"
+#include "engine.h"
+#include "prefetch.h"
+#include "miniz_plugin.h"
+#include "miniz.h"
 
 #include "unity.h"
 #include "common.h"
 
 #include "sodium.h"
 #include "esp_ota_ops.h"
+#include "esp_heap_caps.h"
+#include "mbedtls/sha256.h"
+#include "esp_timer.h"
 
-static char hello_world_diff[] = {
+/* bin/hello_world_diff.bin; shared with the other test files */
+char hello_world_diff[] = {
   0x48, 0x44, 0x49, 0x46, 0x46, 0x31, 0x33, 0x26, 0x7a, 0x6c, 0x69, 0x62,
   0x00, 0x89, 0x8d, 0x60, 0x89, 0x8d, 0x50, 0x0c, 0x35, 0x00, 0x87, 0x02,
   0x83, 0x26, 0x84, 0x7d, 0x81, 0x6d, 0x49, 0x00, 0x00, 0x00, 0xd3, 0x7b,
@@ -77,6 +86,101 @@ static char hello_world_diff[] = {
   0xc7, 0x80, 0x18, 0xa5, 0x7d, 0x8e, 0x1e, 0x60, 0x14, 0x97, 0xed, 0xee,
   0x28
 };
+const size_t hello_world_diff_size = sizeof(hello_world_diff);
+
+/* bin/hello_world_dict_diff.bin; host/hdiffz_dict.py applied to hello_world_diff */
+static const char hello_world_dict_diff[] = {
+  0x48, 0x44, 0x49, 0x46, 0x46, 0x31, 0x33, 0x26, 0x7a, 0x6c, 0x69, 0x62,
+  0x00, 0x89, 0x8d, 0x60, 0x89, 0x8d, 0x50, 0x0c, 0x35, 0x00, 0x87, 0x02,
+  0x83, 0x23, 0x84, 0x7d, 0x81, 0x6a, 0x49, 0x00, 0x00, 0x00, 0xd3, 0x7b,
+  0x00, 0x0c, 0x93, 0x29, 0x04, 0x00, 0x81, 0xb0, 0x14, 0x34, 0x00, 0x2f,
+  0x83, 0x01, 0x1c, 0xc0, 0x70, 0x08, 0x28, 0x40, 0x48, 0x00, 0x81, 0x9f,
+  0x27, 0x4d, 0x1b, 0x03, 0x85, 0x59, 0xd2, 0x74, 0x00, 0x8d, 0x18, 0x45,
+  0x5c, 0x00, 0xb5, 0x35, 0x08, 0x00, 0x84, 0xdb, 0x38, 0x00, 0x08, 0xb1,
+  0x67, 0x8c, 0x00, 0xa0, 0x00, 0x7d, 0x52, 0xb9, 0x4e, 0xc3, 0x40, 0x10,
+  0x55, 0xb0, 0x59, 0x81, 0x15, 0x9b, 0x24, 0xe4, 0x22, 0x17, 0x63, 0xe7,
+  0x40, 0x09, 0x48, 0x08, 0xc4, 0x21, 0x40, 0xa4, 0xa0, 0x80, 0x8e, 0x82,
+  0x2f, 0x80, 0x0a, 0x89, 0x8a, 0x2a, 0x05, 0x05, 0x9a, 0xbf, 0xa1, 0xe7,
+  0x0f, 0x5e, 0x88, 0x25, 0xfe, 0x82, 0x9a, 0x2f, 0xa0, 0xa0, 0x61, 0x76,
+  0x6d, 0x56, 0x26, 0x91, 0xd0, 0xdb, 0x9d, 0x63, 0x77, 0x76, 0x66, 0x76,
+  0x66, 0x9a, 0x4c, 0xa3, 0x98, 0xfa, 0x6f, 0xb4, 0x1b, 0xe7, 0x3e, 0xe8,
+  0xeb, 0x9e, 0x4b, 0xff, 0x80, 0x3e, 0x9f, 0x79, 0x69, 0x01, 0xf4, 0xcc,
+  0x14, 0x21, 0x87, 0x65, 0xd9, 0x09, 0xf5, 0x53, 0xb9, 0x3b, 0x64, 0x65,
+  0x70, 0x70, 0x64, 0xf4, 0x04, 0xc3, 0x3d, 0xee, 0x3f, 0xc8, 0x3b, 0xc5,
+  0x74, 0x99, 0xba, 0x50, 0xd6, 0x99, 0x97, 0x6e, 0x71, 0x7b, 0x64, 0x58,
+  0xc9, 0xd0, 0x70, 0x6c, 0x15, 0x95, 0xb1, 0xef, 0x3e, 0x19, 0xd6, 0x90,
+  0x1d, 0x05, 0x4c, 0xd7, 0xc2, 0x7b, 0x9b, 0xb1, 0x33, 0xd5, 0x70, 0xa7,
+  0x6e, 0x4c, 0xdf, 0x7b, 0x70, 0x66, 0x2e, 0x04, 0x53, 0xf7, 0xbd, 0x85,
+  0xf3, 0x3a, 0x8a, 0x33, 0xcf, 0xe4, 0xb7, 0x22, 0x3b, 0x00, 0x85, 0x50,
+  0xa8, 0xc2, 0x9d, 0x39, 0xc2, 0xd7, 0xe4, 0xc2, 0x03, 0x1d, 0xcb, 0x8d,
+  0x42, 0x39, 0x43, 0x8b, 0x86, 0xd2, 0x96, 0x30, 0x1a, 0xa0, 0x02, 0x3a,
+  0xc8, 0x1c, 0x37, 0xc5, 0x55, 0xb8, 0x2a, 0x62, 0x8b, 0xdb, 0x5c, 0x44,
+  0x85, 0x8b, 0xec, 0x72, 0x1b, 0x3e, 0xd3, 0x36, 0x68, 0x5f, 0xf8, 0x1a,
+  0xf2, 0x28, 0xa5, 0xc8, 0x83, 0x0e, 0xb9, 0x82, 0x02, 0x1c, 0xd4, 0x24,
+  0x5a, 0x5d, 0x24, 0x5f, 0xe4, 0xb6, 0x89, 0xed, 0x88, 0x4e, 0x11, 0xeb,
+  0x35, 0xd2, 0xd4, 0x95, 0xb3, 0x15, 0x94, 0x8d, 0xc8, 0x81, 0x88, 0x3e,
+  0x3a, 0x89, 0xc4, 0x65, 0x50, 0x0f, 0xd4, 0x65, 0x3a, 0xe1, 0x02, 0x07,
+  0x62, 0x59, 0x00, 0xf5, 0x41, 0x43, 0x90, 0x7c, 0x18, 0xb4, 0x83, 0x75,
+  0x84, 0xb7, 0x52, 0x1e, 0x39, 0xe2, 0xd0, 0xe7, 0x1a, 0xf7, 0x37, 0xb8,
+  0xc9, 0x61, 0x4e, 0x7f, 0xe3, 0x8a, 0xe9, 0xe5, 0x4c, 0x57, 0x6a, 0xc2,
+  0x55, 0x81, 0x6d, 0xe3, 0x45, 0xc2, 0x6e, 0x74, 0x95, 0x91, 0x9b, 0x6f,
+  0xb3, 0x6e, 0x9d, 0xf0, 0x4e, 0xb6, 0x37, 0xa6, 0x11, 0xa9, 0xa9, 0xfa,
+  0xfb, 0x28, 0x35, 0x9f, 0x87, 0x34, 0x69, 0x90, 0xbc, 0xaf, 0x2e, 0x78,
+  0xa8, 0xa6, 0x9d, 0x5c, 0xca, 0x0c, 0x85, 0xb2, 0x6d, 0x4f, 0x6e, 0x68,
+  0x6c, 0xa7, 0x44, 0x9b, 0xd3, 0x64, 0x61, 0x80, 0x7e, 0xb5, 0xc0, 0xc6,
+  0xa7, 0x53, 0x93, 0x50, 0xc5, 0x4e, 0x98, 0xf7, 0xf7, 0xc7, 0xd9, 0x48,
+  0x6a, 0x21, 0x63, 0x6f, 0x6e, 0xe4, 0xd2, 0xdf, 0x59, 0x5d, 0x99, 0x44,
+  0x3a, 0x99, 0x42, 0x66, 0x51, 0xb2, 0xe3, 0xdc, 0x10, 0x44, 0x77, 0x08,
+  0x1f, 0x63, 0xd7, 0xa0, 0xf7, 0x36, 0xd2, 0x29, 0xbc, 0x36, 0x7e, 0x00,
+  0x8c, 0x00, 0xa0, 0x00, 0xe3, 0xd0, 0x4d, 0xc9, 0x2c, 0x2a, 0xa9, 0x64,
+  0x62, 0xf8, 0xf3, 0x1f, 0xc2, 0xb2, 0x7c, 0xb7, 0xb0, 0x31, 0x74, 0xc9,
+  0xdd, 0x94, 0xb0, 0x8c, 0x5f, 0x73, 0xb3, 0x17, 0xed, 0xfe, 0x94, 0xb5,
+  0x43, 0xfd, 0xd1, 0xc4, 0x94, 0x4d, 0x2f, 0x83, 0x58, 0x8e, 0x4d, 0x51,
+  0xcd, 0xb4, 0x7e, 0xc0, 0x81, 0x0a, 0x78, 0xe0, 0x80, 0xe3, 0x0e, 0x33,
+  0x10, 0x32, 0x81, 0x49, 0x24, 0x08, 0x52, 0x04, 0xe7, 0x01, 0x65, 0x7f,
+  0x80, 0x94, 0x12, 0x07, 0x1a, 0xa6, 0xff, 0x6f, 0x98, 0xf6, 0x1f, 0x85,
+  0x84, 0x32, 0x40, 0xc4, 0x74, 0x10, 0x85, 0x2a, 0x33, 0x93, 0x71, 0x26,
+  0x23, 0xc3, 0x32, 0x26, 0x10, 0x05, 0x21, 0x21, 0xac, 0x86, 0x2c, 0x90,
+  0x30, 0xe3, 0x32, 0xc6, 0x99, 0x48, 0x70, 0x3d, 0x58, 0x6a, 0x16, 0x8c,
+  0x04, 0x62, 0xa0, 0x16, 0x26, 0x30, 0x06, 0xf1, 0x80, 0x10, 0x46, 0xce,
+  0x64, 0xf2, 0xfc, 0x0f, 0x84, 0x31, 0x20, 0x1c, 0x04, 0x24, 0x3c, 0xff,
+  0x47, 0xff, 0xf7, 0x8c, 0xfe, 0xef, 0x09, 0x87, 0x0e, 0x97, 0x80, 0x62,
+  0x31, 0xff, 0x83, 0x80, 0xe2, 0x31, 0x50, 0xa1, 0xe8, 0xff, 0xd1, 0x08,
+  0x1a, 0x08, 0xa0, 0xca, 0x3d, 0xa3, 0xa1, 0x7a, 0xa2, 0xc1, 0xe6, 0x00,
+  0xe5, 0xc1, 0x72, 0xd1, 0x28, 0xba, 0x84, 0x84, 0x18, 0xbf, 0x80, 0xc1,
+  0x7f, 0x20, 0x44, 0x0d, 0x62, 0x0e, 0x46, 0x38, 0x8f, 0x11, 0x08, 0x11,
+  0x80, 0x11, 0x89, 0x44, 0x93, 0x82, 0x47, 0x14, 0x23, 0x07, 0xd1, 0x80,
+  0x11, 0x8d, 0x26, 0x52, 0x39, 0xd6, 0x48, 0x84, 0x44, 0x16, 0x0c, 0x21,
+  0xe2, 0xf0, 0xff, 0x0f, 0x0e, 0x00, 0x20, 0x61, 0x66, 0x74, 0x65, 0x72,
+  0x20, 0x70, 0x61, 0x74, 0x63, 0x68, 0x70, 0xff, 0xff, 0xff, 0xbf, 0xff,
+  0xff, 0xff, 0x0f, 0x21, 0xf7, 0xeb, 0x48, 0x0b, 0x97, 0x14, 0x0a, 0x1b,
+  0x88, 0xa6, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xc6, 0xb8,
+  0x6c, 0x28, 0x12, 0x55, 0x78, 0x0f, 0xd2, 0x53, 0x69, 0x1c, 0xf8, 0x89,
+  0x79, 0xed, 0x7a, 0x73, 0xcf, 0x43, 0xc7, 0x80, 0x18, 0xa5, 0x7d, 0x8e,
+  0x1e, 0x60, 0x14, 0x97, 0xed, 0xee, 0x28
+};
+
+/* Old data checksums host/hdiffz_oldcheck.py appends to hello_world_diff;
+ * bin/hello_world_oldcheck_diff.bin */
+static const char hello_world_oldcheck[] = {
+  0x0c, 0x25, 0x01, 0x13, 0xf3, 0xde, 0xc7, 0x01, 0x20, 0xa6, 0xfa, 0x87,
+  0x01, 0x11, 0x8d, 0xa1, 0x96, 0x01, 0xd2, 0x7d, 0x67, 0xa4, 0x01, 0x50,
+  0x31, 0x2a, 0xf3, 0x01, 0xd4, 0xfe, 0xf9, 0x21, 0x01, 0x0b, 0xfe, 0x95,
+  0x26, 0x01, 0xe5, 0x84, 0xcb, 0xce, 0x01, 0xf2, 0xa1, 0xf2, 0xa3, 0x01,
+  0x6e, 0x7c, 0xef, 0xf7, 0x01, 0x52, 0x5c, 0x63, 0xd0, 0x01, 0x6a, 0xe6,
+  0x22, 0xdc, 0x01, 0x1c, 0x72, 0x38, 0x65, 0x01, 0x4e, 0x13, 0x7c, 0x90,
+  0x01, 0xcf, 0x51, 0xb3, 0xf6, 0x01, 0x3c, 0x31, 0x95, 0x50, 0x01, 0x2d,
+  0x73, 0x1b, 0xa3, 0x01, 0xe7, 0xf6, 0xa6, 0xf7, 0x01, 0x9b, 0xd1, 0x33,
+  0xb8, 0x01, 0xa2, 0x9b, 0xf7, 0x05, 0x01, 0xf6, 0x54, 0xe6, 0xf4, 0x01,
+  0xea, 0xcb, 0x65, 0x68, 0x01, 0x31, 0x92, 0xcf, 0x05, 0x01, 0x5d, 0x94,
+  0xd9, 0x59, 0x01, 0x3e, 0x77, 0x49, 0x9c, 0x01, 0xeb, 0x8a, 0xf5, 0x3e,
+  0x01, 0xdd, 0x12, 0xf2, 0xb9, 0x01, 0x89, 0x3e, 0x76, 0x66, 0x01, 0x09,
+  0x83, 0x45, 0x83, 0x01, 0x98, 0x47, 0x62, 0x32, 0x01, 0x30, 0xe2, 0xbe,
+  0x75, 0x01, 0x3f, 0x5b, 0x95, 0x2c, 0x01, 0xf2, 0xa8, 0xc5, 0xa9, 0x01,
+  0xb2, 0xaa, 0xdd, 0xb4, 0x01, 0xf7, 0xbb, 0xb2, 0x1d, 0x01, 0x3c, 0xb7,
+  0x2b, 0x1c, 0x01, 0x2f, 0x74, 0x8b, 0x56, 0xbb, 0x00, 0x00, 0x00, 0x4f,
+  0x43, 0x52, 0x43
+};
 
 static void print_partition_hash( const char *msg, const esp_partition_t *part ){
     uint8_t sha256[32];
@@ -86,6 +190,25 @@ static void print_partition_hash( const char *msg, const esp_partition_t *part )
     printf("\n%s%s\n", msg, hex);
 }
 
+/**
+ * SHA-256 of the first size bytes of a partition.
+ */
+static void partition_prefix_sha256(const esp_partition_t *part, size_t size, uint8_t sha256[32]){
+    mbedtls_sha256_context sha;
+    char buf[512];
+
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts_ret(&sha, 0);
+    for(size_t offset = 0; offset < size; offset += sizeof(buf)) {
+        size_t n = size - offset;
+        if(n > sizeof(buf)) n = sizeof(buf);
+        TEST_ESP_OK(esp_partition_read(part, offset, buf, n));
+        mbedtls_sha256_update_ret(&sha, (unsigned char *)buf, n);
+    }
+    mbedtls_sha256_finish_ret(&sha, sha256);
+    mbedtls_sha256_free(&sha);
+}
+
 /**
  * Proxy for testing OTA update.
  *
@@ -106,7 +229,7 @@ TEST_CASE("ota_from_file", "[hdiffz]")
             running->type, running->subtype, running->address);
 
     const char fn_diff[] = "/spiffs/diff";
-    test_spiffs_create_file_with_data(fn_diff, hello_world_diff, sizeof(hello_world_diff));
+    test_spiffs_create_file_with_data(fn_diff, hello_world_diff, hello_world_diff_size);
 
     const esp_partition_t *ota_0, *ota_1, *ota_2;
     uint8_t ota_0_sha256[32], ota_1_sha256[32], ota_2_sha256[32];
@@ -142,6 +265,877 @@ TEST_CASE("ota_from_file", "[hdiffz]")
     test_fs_teardown();
 }
 
+/**
+ * Same as ota_from_file, but the diff is applied directly from memory.
+ */
+TEST_CASE("ota_from_mem", "[hdiffz]")
+{
+    const esp_partition_t *ota_0, *ota_1, *ota_2;
+    uint8_t ota_1_sha256[32], ota_2_sha256[32];
+    int8_t progress = -1;
+    esp_hdiffz_patch_stats_t stats;
+    esp_hdiffz_ota_opts_t opts = ESP_HDIFFZ_OTA_OPTS_DEFAULT();
+
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    TEST_ASSERT_NOT_NULL(running);
+
+    ota_0 = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, NULL);
+    TEST_ASSERT_NOT_NULL(ota_0);
+
+    ota_1 = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_1, NULL);
+    TEST_ASSERT_NOT_NULL(ota_1);
+    TEST_ESP_OK(esp_partition_erase_range(ota_1, 0, ota_1->size)); // Ensure there's nothing left over in target partition
+
+    ota_2 = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_2, NULL);
+    TEST_ASSERT_NOT_NULL(ota_2);
+    TEST_ESP_OK(esp_partition_get_sha256(ota_2, ota_2_sha256));
+
+    opts.stats = &stats;
+    TEST_ESP_OK(esp_hdiffz_ota_mem_opts(hello_world_diff, hello_world_diff_size,
+                ota_0, ota_1, &progress, &opts));
+    TEST_ASSERT_EQUAL_INT8(100, progress);
+
+    /* Most of the firmware is unchanged and should bypass the add step */
+    TEST_ASSERT_EQUAL(12, stats.n_covers);
+    TEST_ASSERT_EQUAL(149216, stats.cover_bytes + stats.diff_bytes);
+    TEST_ASSERT_GREATER_THAN(stats.cover_bytes / 2, stats.copy_bytes);
+    printf("%d of %d cover bytes copied\n", (int)stats.copy_bytes, (int)stats.cover_bytes);
+    /* Every prefetched chunk is either used or discarded */
+    TEST_ASSERT_EQUAL(stats.n_prefetch,
+            stats.n_prefetch_ready + stats.n_prefetch_late + stats.n_prefetch_unused);
+    TEST_ASSERT_LESS_OR_EQUAL(stats.cover_bytes, stats.prefetch_miss_bytes);
+    printf("%d prefetched, %d in time, %d late\n", (int)stats.n_prefetch,
+            (int)stats.n_prefetch_ready, (int)stats.n_prefetch_late);
+    /* The placement report covers this patch's buffers only */
+    TEST_ASSERT_GREATER_THAN(0, stats.mem.cls[ESP_HDIFFZ_MEM_STATE].n_allocs);
+    TEST_ASSERT_GREATER_THAN(0, stats.mem.cls[ESP_HDIFFZ_MEM_IO].n_allocs);
+    TEST_ASSERT_EQUAL(0, stats.mem.cls[ESP_HDIFFZ_MEM_STATE].n_failed);
+
+    TEST_ESP_OK(esp_ota_set_boot_partition(running));
+
+    TEST_ESP_OK(esp_partition_get_sha256(ota_1, ota_1_sha256));
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(ota_2_sha256, ota_1_sha256, 32);
+    print_partition_hash("ota_1: ", ota_1);
+}
+
+static hpatch_BOOL partition_stream_read(const hpatch_TStreamInput *stream, hpatch_StreamPos_t pos,
+        unsigned char *out, unsigned char *out_end) {
+    return ESP_OK == esp_partition_read(stream->streamImport, pos, out, out_end - out);
+}
+
+static hpatch_BOOL discard_write(const hpatch_TStreamOutput *stream, hpatch_StreamPos_t pos,
+        const unsigned char *data, const unsigned char *data_end) {
+    return hpatch_TRUE;
+}
+
+/**
+ * The heap estimate covers everything the engine, the decompressor and the
+ * prefetcher allocate. The mem report counts every allocation, so it bounds
+ * their peak from above.
+ */
+TEST_CASE("ota_heap_estimate", "[hdiffz]")
+{
+    const esp_partition_t *ota_0;
+    hpatch_TStreamInput diff_stream, old_stream = { 0 }, prefetch_stream;
+    hpatch_TStreamOutput out_stream = { 0 };
+    esp_hdiffz_info_t info;
+    esp_hdiffz_mem_report_t report;
+    const esp_hdiffz_mem_t mem = { .report = &report };
+
+    ota_0 = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, NULL);
+    TEST_ASSERT_NOT_NULL(ota_0);
+
+    esp_hdiffz_mem_as_stream_input(&diff_stream, (const unsigned char *)hello_world_diff, hello_world_diff_size);
+    TEST_ESP_OK(esp_hdiffz_get_info(&diff_stream, &info));
+    old_stream.streamImport = (void *)ota_0;
+    old_stream.streamSize = info.old_size;
+    old_stream.read = partition_stream_read;
+    out_stream.streamSize = info.new_size;
+    out_stream.write = discard_write;
+
+    for(int with_prefetch=0; with_prefetch < 2; with_prefetch++) {
+        esp_hdiffz_miniz_plugin_t plugin;
+        esp_hdiffz_engine_cfg_t cfg = { 0 };
+        esp_hdiffz_prefetch_t *prefetch = NULL;
+        size_t measured = 0, estimate = info.heap_worst;
+
+        memset(&report, 0, sizeof(report));
+        esp_hdiffz_miniz_plugin_init(&plugin);
+        plugin.dict_src = &old_stream;
+        plugin.mem_report = &report;
+        cfg.out = &out_stream;
+        cfg.old = &old_stream;
+        cfg.diff = &diff_stream;
+        cfg.plugin = &plugin.base;
+        cfg.mem = &mem;
+
+        if( with_prefetch ) {
+            TEST_ESP_OK(esp_hdiffz_prefetch_create(&old_stream, 4096, 4, &mem, &prefetch));
+            esp_hdiffz_prefetch_as_input(prefetch, &prefetch_stream);
+            cfg.old = &prefetch_stream;
+            cfg.hint = esp_hdiffz_prefetch_hint;
+            cfg.hint_ctx = prefetch;
+            estimate += esp_hdiffz_prefetch_heap(4096, 4);
+        }
+        TEST_ESP_OK(esp_hdiffz_engine_patch(&cfg));
+        esp_hdiffz_prefetch_del(prefetch, NULL);
+
+        for(int c=0; c < ESP_HDIFFZ_MEM_N; c++) {
+            measured += report.cls[c].internal_bytes + report.cls[c].external_bytes;
+        }
+        printf("prefetch %d: %d bytes allocated, %d estimated\n",
+                with_prefetch, (int)measured, (int)estimate);
+        TEST_ASSERT_LESS_OR_EQUAL(estimate, measured);
+        /* Nothing but the decompressor's own allocations is left out */
+        TEST_ASSERT_GREATER_THAN(info.dec_heap, measured);
+    }
+}
+
+/**
+ * Dry run; nothing may be written to flash and the digest must match ota_2.
+ */
+TEST_CASE("ota_validate", "[hdiffz]")
+{
+    const esp_partition_t *ota_0, *ota_1, *ota_2;
+    uint8_t ota_1_sha256[32], ota_1_sha256_after[32], expected[32], old_sha256[32];
+    esp_hdiffz_digest_t digest;
+
+    ota_0 = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, NULL);
+    TEST_ASSERT_NOT_NULL(ota_0);
+    ota_1 = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_1, NULL);
+    TEST_ASSERT_NOT_NULL(ota_1);
+    ota_2 = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_2, NULL);
+    TEST_ASSERT_NOT_NULL(ota_2);
+
+    TEST_ESP_OK(esp_partition_get_sha256(ota_1, ota_1_sha256));
+
+    TEST_ESP_OK(esp_hdiffz_ota_mem_validate(hello_world_diff, hello_world_diff_size, ota_0, &digest));
+    TEST_ASSERT_EQUAL(149216, digest.size);
+
+    /* Hash the same number of bytes of the expected firmware */
+    partition_prefix_sha256(ota_2, digest.size, expected);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, digest.sha256, 32);
+
+    /* Truncated diffs are rejected */
+    TEST_ASSERT_NOT_EQUAL(ESP_OK, esp_hdiffz_ota_mem_validate(hello_world_diff,
+                hello_world_diff_size - 1, ota_0, &digest));
+
+    TEST_ESP_OK(esp_partition_get_sha256(ota_1, ota_1_sha256_after));
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(ota_1_sha256, ota_1_sha256_after, 32);
+
+    /* Old firmware hash a fleet manifest is keyed by */
+    TEST_ESP_OK(esp_hdiffz_ota_old_sha256(ota_0, 149200, old_sha256));
+    partition_prefix_sha256(ota_0, 149200, expected);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, old_sha256, 32);
+}
+
+/**
+ * Forward patch ota_0 -> ota_1 while writing a rollback diff; applying the
+ * rollback diff to ota_1 must reproduce ota_0.
+ */
+TEST_CASE("ota_rollback", "[hdiffz]")
+{
+    const esp_partition_t *ota_0, *ota_1;
+    uint8_t expected[32];
+    esp_hdiffz_rollback_t rollback = { 0 };
+    esp_hdiffz_ota_opts_t opts = ESP_HDIFFZ_OTA_OPTS_DEFAULT();
+    esp_hdiffz_digest_t digest;
+    const char fn_rollback[] = "/spiffs/rollback";
+    int64_t start;
+
+    test_fs_setup();
+
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    TEST_ASSERT_NOT_NULL(running);
+
+    ota_0 = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, NULL);
+    TEST_ASSERT_NOT_NULL(ota_0);
+    ota_1 = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_1, NULL);
+    TEST_ASSERT_NOT_NULL(ota_1);
+
+    /* A rollback partition may not overwrite either image */
+    opts.rollback = &rollback;
+    rollback.part = ota_0;
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, esp_hdiffz_ota_mem_opts(hello_world_diff,
+                hello_world_diff_size, ota_0, ota_1, NULL, &opts));
+    rollback.part = ota_1;
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, esp_hdiffz_ota_mem_opts(hello_world_diff,
+                hello_world_diff_size, ota_0, ota_1, NULL, &opts));
+    rollback.part = NULL;
+
+    rollback.file = fopen(fn_rollback, "wb");
+    TEST_ASSERT_NOT_NULL(rollback.file);
+    TEST_ESP_OK(esp_hdiffz_ota_mem_opts(hello_world_diff, hello_world_diff_size, ota_0, ota_1, NULL, &opts));
+    fclose(rollback.file);
+    TEST_ESP_OK(esp_ota_set_boot_partition(running));
+
+    TEST_ASSERT_GREATER_THAN(0, rollback.size);
+    printf("Rollback diff %d bytes (forward %d bytes), written in %d us\n",
+            (int)rollback.size, (int)hello_world_diff_size, (int)rollback.time_us);
+
+    /* Dry run the rollback diff against the patched firmware */
+    FILE *f_rollback = fopen(fn_rollback, "rb");
+    TEST_ASSERT_NOT_NULL(f_rollback);
+    start = esp_timer_get_time();
+    TEST_ESP_OK(esp_hdiffz_ota_file_validate(f_rollback, ota_1, &digest));
+    printf("Rollback diff applied in %d us\n", (int)(esp_timer_get_time() - start));
+    fclose(f_rollback);
+
+    TEST_ASSERT_EQUAL(149200, digest.size);
+    partition_prefix_sha256(ota_0, digest.size, expected);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, digest.sha256, 32);
+
+    test_fs_teardown();
+}
+
+/**
+ * Same update with nodes that preset their window from ota_0.
+ */
+TEST_CASE("ota_dict", "[hdiffz]")
+{
+    const esp_partition_t *ota_0, *ota_1, *ota_2;
+    uint8_t expected[32], actual[32];
+    esp_hdiffz_digest_t digest;
+    esp_hdiffz_info_t info;
+    hpatch_TStreamInput diff_stream;
+
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    TEST_ASSERT_NOT_NULL(running);
+
+    ota_0 = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, NULL);
+    TEST_ASSERT_NOT_NULL(ota_0);
+    ota_1 = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_1, NULL);
+    TEST_ASSERT_NOT_NULL(ota_1);
+    ota_2 = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_2, NULL);
+    TEST_ASSERT_NOT_NULL(ota_2);
+
+    esp_hdiffz_mem_as_stream_input(&diff_stream, (const unsigned char *)hello_world_dict_diff,
+            sizeof(hello_world_dict_diff));
+    TEST_ESP_OK(esp_hdiffz_get_info(&diff_stream, &info));
+    TEST_ASSERT_GREATER_THAN(0, info.dict_size);
+    printf("Dictionary diff %d bytes (plain %d bytes), %d dictionary bytes\n",
+            (int)sizeof(hello_world_dict_diff), (int)hello_world_diff_size, (int)info.dict_size);
+
+    TEST_ESP_OK(esp_hdiffz_ota_mem_validate(hello_world_dict_diff, sizeof(hello_world_dict_diff), ota_0, &digest));
+    TEST_ASSERT_EQUAL(149216, digest.size);
+    partition_prefix_sha256(ota_2, digest.size, expected);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, digest.sha256, 32);
+
+    TEST_ESP_OK(esp_hdiffz_ota_mem_adv(hello_world_dict_diff, sizeof(hello_world_dict_diff), ota_0, ota_1));
+    TEST_ESP_OK(esp_ota_set_boot_partition(running));
+    partition_prefix_sha256(ota_1, digest.size, actual);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, actual, 32);
+}
+
+/**
+ * Same update with checksums of the old firmware the diff reads; a source
+ * that differs is rejected.
+ */
+TEST_CASE("ota_oldcheck", "[hdiffz]")
+{
+    const esp_partition_t *ota_0, *ota_1, *ota_2;
+    uint8_t expected[32], actual[32];
+    esp_hdiffz_digest_t digest;
+    esp_hdiffz_info_t info;
+    esp_hdiffz_patch_stats_t stats;
+    esp_hdiffz_ota_opts_t opts = ESP_HDIFFZ_OTA_OPTS_DEFAULT();
+    hpatch_TStreamInput diff_stream;
+    size_t diff_size = hello_world_diff_size + sizeof(hello_world_oldcheck);
+    char *diff;
+
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    TEST_ASSERT_NOT_NULL(running);
+
+    ota_0 = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, NULL);
+    TEST_ASSERT_NOT_NULL(ota_0);
+    ota_1 = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_1, NULL);
+    TEST_ASSERT_NOT_NULL(ota_1);
+    ota_2 = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_2, NULL);
+    TEST_ASSERT_NOT_NULL(ota_2);
+
+    diff = malloc(diff_size);
+    TEST_ASSERT_NOT_NULL(diff);
+    memcpy(diff, hello_world_diff, hello_world_diff_size);
+    memcpy(diff + hello_world_diff_size, hello_world_oldcheck, sizeof(hello_world_oldcheck));
+
+    esp_hdiffz_mem_as_stream_input(&diff_stream, (const unsigned char *)diff, diff_size);
+    TEST_ESP_OK(esp_hdiffz_get_info(&diff_stream, &info));
+    TEST_ASSERT_EQUAL(sizeof(hello_world_oldcheck), info.old_check_size);
+
+    TEST_ESP_OK(esp_hdiffz_ota_mem_validate(diff, diff_size, ota_0, &digest));
+    partition_prefix_sha256(ota_2, digest.size, expected);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, digest.sha256, 32);
+
+    opts.stats = &stats;
+    TEST_ESP_OK(esp_hdiffz_ota_mem_opts(diff, diff_size, ota_0, ota_1, NULL, &opts));
+    TEST_ESP_OK(esp_ota_set_boot_partition(running));
+    partition_prefix_sha256(ota_1, digest.size, actual);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, actual, 32);
+    printf("%d old bytes verified, %d read only for verification\n",
+            (int)stats.old_checked_bytes, (int)stats.old_check_extra_bytes);
+    TEST_ASSERT_GREATER_THAN(0, stats.old_checked_bytes);
+
+    /* ota_2 holds the new firmware, not the old one the diff was made from */
+    TEST_ASSERT_EQUAL(ESP_ERR_HDIFFZ_OLD_MISMATCH, esp_hdiffz_ota_mem_validate(diff, diff_size, ota_2, &digest));
+    TEST_ASSERT_EQUAL(ESP_ERR_HDIFFZ_OLD_MISMATCH, esp_hdiffz_ota_mem_adv(diff, diff_size, ota_2, ota_1));
+    TEST_ASSERT_EQUAL(running, esp_ota_get_boot_partition());
+
+    free(diff);
+}
+
+/**
+ * Patch on a task pinned to the other core while this one stays free; then
+ * cancel a second run, which must leave the boot partition alone.
+ */
+TEST_CASE("ota_async", "[hdiffz]")
+{
+    const esp_partition_t *ota_0, *ota_1, *ota_2;
+    uint8_t expected[32], actual[32];
+    esp_hdiffz_ota_async_config_t config = ESP_HDIFFZ_OTA_ASYNC_CONFIG_DEFAULT();
+    esp_hdiffz_ota_async_t *handle;
+    esp_err_t err;
+    int8_t progress = -1;
+    int n_polls = 0;
+
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    TEST_ASSERT_NOT_NULL(running);
+
+    ota_0 = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, NULL);
+    TEST_ASSERT_NOT_NULL(ota_0);
+    ota_1 = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_1, NULL);
+    TEST_ASSERT_NOT_NULL(ota_1);
+    ota_2 = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_2, NULL);
+    TEST_ASSERT_NOT_NULL(ota_2);
+    partition_prefix_sha256(ota_2, 149216, expected);
+
+    config.diff_mem = hello_world_diff;
+    config.diff_mem_size = hello_world_diff_size;
+    config.src = ota_0;
+    config.dst = ota_1;
+    config.progress = &progress;
+    config.core = !xPortGetCoreID();
+
+    TEST_ESP_OK(esp_hdiffz_ota_start_async(&config, &handle));
+    while( ESP_ERR_TIMEOUT == (err = esp_hdiffz_ota_wait(handle, pdMS_TO_TICKS(10))) ) n_polls++;
+    TEST_ESP_OK(err);
+    TEST_ASSERT_EQUAL_INT8(100, progress);
+    printf("Polled %d times while patching\n", n_polls);
+    TEST_ESP_OK(esp_ota_set_boot_partition(running));
+    partition_prefix_sha256(ota_1, 149216, actual);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, actual, 32);
+
+    TEST_ESP_OK(esp_hdiffz_ota_start_async(&config, &handle));
+    esp_hdiffz_ota_cancel(handle);
+    TEST_ASSERT_EQUAL(ESP_ERR_HDIFFZ_CANCELLED, esp_hdiffz_ota_wait(handle, portMAX_DELAY));
+    TEST_ASSERT_EQUAL_PTR(running, esp_ota_get_boot_partition());
+
+    /* A released handle is freed by the task, whether or not it finished first */
+    config.progress = NULL;
+    for(int delay_ms=0; delay_ms <= 50; delay_ms += 50) {
+        size_t free_before = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+
+        TEST_ESP_OK(esp_hdiffz_ota_start_async(&config, &handle));
+        esp_hdiffz_ota_cancel(handle);
+        vTaskDelay(pdMS_TO_TICKS(delay_ms));
+        esp_hdiffz_ota_release(handle);
+        vTaskDelay(pdMS_TO_TICKS(100));
+        TEST_ASSERT_EQUAL(free_before, heap_caps_get_free_size(MALLOC_CAP_8BIT));
+    }
+    TEST_ASSERT_EQUAL_PTR(running, esp_ota_get_boot_partition());
+
+    config.diff_mem = NULL;
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, esp_hdiffz_ota_start_async(&config, &handle));
+}
+
+typedef struct progress_log_t {
+    int n_events;
+    esp_hdiffz_progress_t last;
+} progress_log_t;
+
+static void progress_log(const esp_hdiffz_progress_t *progress, void *arg) {
+    progress_log_t *log = arg;
+
+    /* Phases only move forward and counters never go back */
+    TEST_ASSERT_GREATER_OR_EQUAL(log->last.phase, progress->phase);
+    TEST_ASSERT_GREATER_OR_EQUAL(log->last.erase_done, progress->erase_done);
+    TEST_ASSERT_GREATER_OR_EQUAL(log->last.new_done, progress->new_done);
+    TEST_ASSERT_LESS_OR_EQUAL(progress->new_total, progress->new_done);
+    printf("phase %d: erased %d/%d, patched %d/%d, %d B/s (avg %d), ETA %d ms\n",
+            progress->phase, (int)progress->erase_done, (int)progress->erase_total,
+            (int)progress->new_done, (int)progress->new_total,
+            (int)progress->rate, (int)progress->avg_rate, (int)progress->eta_ms);
+    log->last = *progress;
+    log->n_events++;
+}
+
+TEST_CASE("ota_progress_cb", "[hdiffz]")
+{
+    const esp_partition_t *ota_0, *ota_1;
+    progress_log_t log = { 0 };
+    esp_hdiffz_progress_config_t config = {
+        .cb = progress_log,
+        .arg = &log,
+        .byte_step = 32 * 1024,
+    };
+    esp_hdiffz_ota_opts_t opts = ESP_HDIFFZ_OTA_OPTS_DEFAULT();
+
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    TEST_ASSERT_NOT_NULL(running);
+
+    ota_0 = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, NULL);
+    TEST_ASSERT_NOT_NULL(ota_0);
+    ota_1 = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_1, NULL);
+    TEST_ASSERT_NOT_NULL(ota_1);
+
+    opts.progress_cb = &config;
+    TEST_ESP_OK(esp_hdiffz_ota_mem_opts(hello_world_diff, hello_world_diff_size, ota_0, ota_1, NULL, &opts));
+    TEST_ESP_OK(esp_ota_set_boot_partition(running));
+
+    TEST_ASSERT_EQUAL(ESP_HDIFFZ_PHASE_DONE, log.last.phase);
+    TEST_ESP_OK(log.last.err);
+    TEST_ASSERT_EQUAL(149216, log.last.new_done);
+    TEST_ASSERT_EQUAL(log.last.erase_total, log.last.erase_done);
+    /* Phase starts, the end, and at most one event per byte step in between */
+    TEST_ASSERT_LESS_OR_EQUAL(3 + (log.last.erase_total + 149216) / config.byte_step, log.n_events);
+
+    /* No events once disarmed */
+    log.n_events = 0;
+    TEST_ESP_OK(esp_hdiffz_ota_mem_adv(hello_world_diff, hello_world_diff_size, ota_0, ota_1));
+    TEST_ESP_OK(esp_ota_set_boot_partition(running));
+    TEST_ASSERT_EQUAL(0, log.n_events);
+}
+
+TEST_CASE("ota_trace", "[hdiffz]")
+{
+    const esp_hdiffz_readahead_config_t readahead = { .refill_size = 2048, .depth = 2 };
+    const esp_hdiffz_ota_opts_t opts = { .readahead = &readahead };
+    const char fn_diff[] = "/spiffs/diff";
+    const char fn_trace[] = "/spiffs/trace.json";
+    const esp_partition_t *running, *ota_0, *ota_1;
+    FILE *f;
+    char *json;
+    long size;
+
+    test_fs_setup();
+    test_spiffs_create_file_with_data(fn_diff, hello_world_diff, hello_world_diff_size);
+
+    running = esp_ota_get_running_partition();
+    TEST_ASSERT_NOT_NULL(running);
+    ota_0 = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, NULL);
+    TEST_ASSERT_NOT_NULL(ota_0);
+    ota_1 = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_1, NULL);
+    TEST_ASSERT_NOT_NULL(ota_1);
+
+#if CONFIG_HDIFFZ_TRACE_RECORDER
+    TEST_ESP_OK(esp_hdiffz_trace_start(4096));
+    f = fopen(fn_diff, "rb");
+    TEST_ASSERT_NOT_NULL(f);
+    TEST_ESP_OK(esp_hdiffz_ota_file_opts(f, ota_0, ota_1, NULL, &opts));
+    fclose(f);
+    TEST_ESP_OK(esp_ota_set_boot_partition(running));
+
+    /* Not while recording */
+    f = fopen(fn_trace, "w");
+    TEST_ASSERT_NOT_NULL(f);
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_STATE, esp_hdiffz_trace_export(f));
+    esp_hdiffz_trace_stop();
+    TEST_ESP_OK(esp_hdiffz_trace_export(f));
+    fclose(f);
+    esp_hdiffz_trace_free();
+
+    f = fopen(fn_trace, "rb");
+    TEST_ASSERT_NOT_NULL(f);
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    rewind(f);
+    json = malloc(size + 1);
+    TEST_ASSERT_NOT_NULL(json);
+    TEST_ASSERT_EQUAL(size, fread(json, 1, size, f));
+    json[size] = '\0';
+    fclose(f);
+    printf("%ld byte trace\n", size);
+
+    /* The erase, the patch and the read-ahead worker are all on the timeline */
+    TEST_ASSERT_EQUAL_STRING_LEN("{\"traceEvents\":[", json, 16);
+    TEST_ASSERT_NOT_NULL(strstr(json, "\"name\":\"erase\""));
+    TEST_ASSERT_NOT_NULL(strstr(json, "\"name\":\"inflate\""));
+    TEST_ASSERT_NOT_NULL(strstr(json, "\"name\":\"write\""));
+    TEST_ASSERT_NOT_NULL(strstr(json, "\"tid\":1,"));
+    TEST_ASSERT_NOT_NULL(strstr(json, "\"dropped\":0}"));
+    free(json);
+#else
+    (void)readahead;
+    (void)fn_trace;
+    (void)f;
+    (void)json;
+    (void)size;
+    TEST_ASSERT_EQUAL(ESP_ERR_NOT_SUPPORTED, esp_hdiffz_trace_start(4096));
+#endif
+
+    test_fs_teardown();
+}
+
+TEST_CASE("ota_flash_report", "[hdiffz]")
+{
+    const esp_hdiffz_flash_timing_t timing = {
+        .sector_erase_us = 1,
+        .block_erase_us = 16,
+        .page_program_us = 256,
+        .byte_program_us = 1,
+    };
+    const esp_partition_t *running, *ota_0, *ota_1;
+    esp_hdiffz_ota_opts_t opts = ESP_HDIFFZ_OTA_OPTS_DEFAULT();
+    esp_hdiffz_patch_stats_t stats;
+    const esp_hdiffz_flash_report_t *report = &stats.flash;
+    esp_hdiffz_flash_t flash;
+
+    running = esp_ota_get_running_partition();
+    TEST_ASSERT_NOT_NULL(running);
+    ota_0 = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, NULL);
+    TEST_ASSERT_NOT_NULL(ota_0);
+    ota_1 = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_1, NULL);
+    TEST_ASSERT_NOT_NULL(ota_1);
+
+    opts.stats = &stats;
+    opts.flash_timing = &timing;
+    TEST_ESP_OK(esp_hdiffz_ota_mem_opts(hello_world_diff, hello_world_diff_size, ota_0, ota_1, NULL, &opts));
+    TEST_ESP_OK(esp_ota_set_boot_partition(running));
+    printf("%d reads, %d writes, %d pages, %d sector and %d block erases; modeled %d ms\n",
+            (int)report->n_reads, (int)report->n_writes, (int)report->n_page_programs,
+            (int)report->n_sector_erases, (int)report->n_block_erases,
+            (int)((report->read_us + report->write_us + report->erase_us) / 1000));
+
+    /* Only the sectors of the patched image are erased, once each */
+    TEST_ASSERT_EQUAL(149216, report->write_bytes);
+    TEST_ASSERT_EQUAL(37, report->sectors_erased);
+    TEST_ASSERT_EQUAL(37, report->sectors_touched);
+    TEST_ASSERT_EQUAL(1, report->max_sector_erases);
+    TEST_ASSERT_EQUAL(37, report->n_sector_erases + 16 * report->n_block_erases);
+    TEST_ASSERT_GREATER_OR_EQUAL(149216 / 256, report->n_page_programs);
+    TEST_ASSERT_GREATER_THAN(0, report->n_reads);
+
+    /* Charged at the given timings */
+    TEST_ASSERT_EQUAL(report->n_sector_erases + 16 * report->n_block_erases, report->erase_us);
+    TEST_ASSERT_GREATER_OR_EQUAL(149216, report->write_us);
+    TEST_ASSERT_EQUAL(0, report->read_us);
+
+    /* Each patch counts from zero */
+    TEST_ESP_OK(esp_hdiffz_ota_mem_opts(hello_world_diff, hello_world_diff_size, ota_0, ota_1, NULL, &opts));
+    TEST_ESP_OK(esp_ota_set_boot_partition(running));
+    TEST_ASSERT_EQUAL(37, report->sectors_erased);
+    TEST_ASSERT_EQUAL(1, report->max_sector_erases);
+
+    /* Per sector counts of a context */
+    esp_hdiffz_flash_init(&flash, NULL);
+    TEST_ESP_OK(esp_hdiffz_flash_erase_range(&flash, ota_1, 0, 2 * 4096));
+    TEST_ESP_OK(esp_hdiffz_flash_erase_range(&flash, ota_1, 4096, 4096));
+    TEST_ASSERT_EQUAL(1, esp_hdiffz_flash_sector_erases(&flash, ota_1, 0));
+    TEST_ASSERT_EQUAL(2, esp_hdiffz_flash_sector_erases(&flash, ota_1, 4096));
+    TEST_ASSERT_EQUAL(0, esp_hdiffz_flash_sector_erases(&flash, ota_1, 2 * 4096));
+    esp_hdiffz_flash_deinit(&flash);
+}
+
+/**
+ * Per byte decode costs and heap for host/hdiffz_tune.py; save the printed
+ * JSON line and pass it as --profile.
+ */
+TEST_CASE("Decode profile", "[hdiffz][perf]")
+{
+    const esp_partition_t *ota_0;
+    hpatch_TStreamInput diff_stream;
+    esp_hdiffz_head_t head;
+    esp_hdiffz_info_t info;
+    esp_hdiffz_miniz_plugin_t plugin;
+    esp_hdiffz_digest_t digest;
+    unsigned char buf[512];
+    size_t n_inflated = 0;
+    int64_t t0, t_inflate, t_patch;
+    const int rounds = 8;
+
+    ota_0 = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, NULL);
+    TEST_ASSERT_NOT_NULL(ota_0);
+
+    esp_hdiffz_mem_as_stream_input(&diff_stream, (const unsigned char *)hello_world_diff, hello_world_diff_size);
+    TEST_ESP_OK(esp_hdiffz_read_head(&diff_stream, &head));
+    TEST_ESP_OK(esp_hdiffz_get_info(&diff_stream, &info));
+    esp_hdiffz_miniz_plugin_init(&plugin);
+
+    /* Decompress every node on its own */
+    t0 = esp_timer_get_time();
+    for(int r=0; r < rounds; r++) {
+        for(uint8_t i=0; i < ESP_HDIFFZ_SEC_N; i++) {
+            hpatch_decompressHandle dec;
+            hpatch_StreamPos_t left = head.sec[i].size;
+
+            if( 0 == head.sec[i].compress_size ) continue;
+            dec = plugin.base.open(&plugin.base, head.sec[i].size, &diff_stream,
+                    head.sec[i].pos, head.sec[i].pos + head.sec[i].compress_size);
+            TEST_ASSERT_NOT_NULL(dec);
+            while(left > 0) {
+                size_t n = left < sizeof(buf) ? left : sizeof(buf);
+                TEST_ASSERT_TRUE(plugin.base.decompress_part(dec, buf, buf + n));
+                left -= n;
+            }
+            TEST_ASSERT_TRUE(plugin.base.close(&plugin.base, dec));
+            n_inflated += head.sec[i].size;
+        }
+    }
+    t_inflate = esp_timer_get_time() - t0;
+
+    /* The rest of a dry run is the per new byte cost */
+    t0 = esp_timer_get_time();
+    for(int r=0; r < rounds; r++) {
+        TEST_ESP_OK(esp_hdiffz_ota_mem_validate(hello_world_diff, hello_world_diff_size, ota_0, &digest));
+    }
+    t_patch = esp_timer_get_time() - t0 - t_inflate;
+
+    printf("{\"inflate_ns_per_byte\": %d, \"patch_ns_per_byte\": %d, \"node_heap_fixed\": %d, \"patch_heap\": %d}\n",
+            (int)(t_inflate * 1000 / n_inflated),
+            (int)(t_patch * 1000 / ((int64_t)rounds * digest.size)),
+            (int)esp_hdiffz_miniz_plugin_node_heap(9, true),
+            (int)(info.heap_worst - info.dec_heap));
+}
+
+/**
+ * Inflate a node through mz_stream, as the miniz plugin did before it drove
+ * tinfl directly: a partial flush inflate per request and a fresh inflater
+ * per node.
+ */
+static bool mz_stream_inflate(const unsigned char *node, size_t node_len,
+        unsigned char *out, size_t size, size_t part_size) {
+    mz_stream s = { 0 };
+    int window_bits = node[0];
+    size_t done = 0;
+
+    if( MZ_OK != inflateInit2(&s, window_bits) ) return false;
+    s.next_in = (unsigned char *)node + 1;
+    s.avail_in = node_len - 1;
+    while( done < size ) {
+        size_t n = size - done < part_size ? size - done : part_size;
+        s.next_out = out + done;
+        s.avail_out = n;
+        while( s.avail_out > 0 ) {
+            int ret = inflate(&s, MZ_PARTIAL_FLUSH);
+            if( MZ_STREAM_END == ret && s.avail_in > 0 ) {
+                const unsigned char *next_in = s.next_in;
+                unsigned char *next_out = s.next_out;
+                unsigned int avail_in = s.avail_in, avail_out = s.avail_out;
+
+                inflateEnd(&s);
+                if( MZ_OK != inflateInit2(&s, window_bits) ) return false;
+                s.next_in = (unsigned char *)next_in;
+                s.avail_in = avail_in;
+                s.next_out = next_out;
+                s.avail_out = avail_out;
+                continue;
+            }
+            if( MZ_OK != ret ) break;
+        }
+        if( s.avail_out > 0 ) break;
+        done += n;
+    }
+    inflateEnd(&s);
+    return done == size;
+}
+
+/**
+ * Decode throughput of the miniz plugin's tinfl path against mz_stream
+ * inflate, for a range of request sizes, on the same sections.
+ */
+TEST_CASE("Inflate benchmark", "[hdiffz][perf]")
+{
+    const size_t part_sizes[] = { 64, 512, 4096 };
+    const unsigned char *diff = (const unsigned char *)hello_world_diff;
+    hpatch_TStreamInput diff_stream;
+    esp_hdiffz_head_t head;
+    esp_hdiffz_miniz_plugin_t plugin;
+    unsigned char *ref, *out;
+    size_t max_size = 0;
+    const int rounds = 32;
+
+    esp_hdiffz_mem_as_stream_input(&diff_stream, diff, hello_world_diff_size);
+    TEST_ESP_OK(esp_hdiffz_read_head(&diff_stream, &head));
+    esp_hdiffz_miniz_plugin_init(&plugin);
+    for(uint8_t i=0; i < ESP_HDIFFZ_SEC_N; i++) {
+        if( head.sec[i].size > max_size ) max_size = head.sec[i].size;
+    }
+    ref = malloc(max_size);
+    out = malloc(max_size);
+    TEST_ASSERT_NOT_NULL(ref);
+    TEST_ASSERT_NOT_NULL(out);
+
+    printf("%8s %12s %12s\n", "part", "tinfl KB/s", "mz_stream KB/s");
+    for(size_t p=0; p < sizeof(part_sizes) / sizeof(part_sizes[0]); p++) {
+        int64_t t_tinfl = 0, t_mz = 0;
+        size_t n_inflated = 0;
+
+        for(uint8_t i=0; i < ESP_HDIFFZ_SEC_N; i++) {
+            const unsigned char *node = &diff[head.sec[i].pos];
+            size_t size = head.sec[i].size;
+            int64_t t0;
+
+            if( 0 == head.sec[i].compress_size ) continue;
+
+            t0 = esp_timer_get_time();
+            for(int r=0; r < rounds; r++) {
+                TEST_ASSERT_TRUE(mz_stream_inflate(node, head.sec[i].compress_size, ref, size, part_sizes[p]));
+            }
+            t_mz += esp_timer_get_time() - t0;
+
+            t0 = esp_timer_get_time();
+            for(int r=0; r < rounds; r++) {
+                hpatch_decompressHandle dec;
+                dec = plugin.base.open(&plugin.base, size, &diff_stream,
+                        head.sec[i].pos, head.sec[i].pos + head.sec[i].compress_size);
+                TEST_ASSERT_NOT_NULL(dec);
+                for(size_t done=0; done < size; done += part_sizes[p]) {
+                    size_t n = size - done < part_sizes[p] ? size - done : part_sizes[p];
+                    TEST_ASSERT_TRUE(plugin.base.decompress_part(dec, out + done, out + done + n));
+                }
+                TEST_ASSERT_TRUE(plugin.base.close(&plugin.base, dec));
+            }
+            t_tinfl += esp_timer_get_time() - t0;
+
+            TEST_ASSERT_EQUAL_HEX8_ARRAY(ref, out, size);
+            n_inflated += rounds * size;
+        }
+
+        printf("%8d %12d %12d\n", (int)part_sizes[p],
+                (int)((int64_t)n_inflated * 1000 / t_tinfl), (int)((int64_t)n_inflated * 1000 / t_mz));
+    }
+
+    free(ref);
+    free(out);
+}
+
+/**
+ * Patch throughput with buffers in internal RAM, in PSRAM, and split by the
+ * default memory policy.
+ */
+TEST_CASE("Memory placement", "[hdiffz][perf]")
+{
+    static const char *names[] = { "default", "internal", "psram" };
+    const esp_hdiffz_mem_policy_t policies[] = {
+        ESP_HDIFFZ_MEM_POLICY_DEFAULT(),
+        { .caps = { MALLOC_CAP_INTERNAL, MALLOC_CAP_INTERNAL, MALLOC_CAP_INTERNAL } },
+        { .caps = { MALLOC_CAP_SPIRAM, MALLOC_CAP_SPIRAM, MALLOC_CAP_SPIRAM } },
+    };
+    const esp_partition_t *ota_0;
+    hpatch_TStreamInput diff_stream, old_stream = { 0 };
+    hpatch_TStreamOutput out_stream = { 0 };
+    esp_hdiffz_info_t info;
+    esp_hdiffz_mem_report_t report;
+    int n_policies = 3;
+    const int rounds = 8;
+
+    ota_0 = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, NULL);
+    TEST_ASSERT_NOT_NULL(ota_0);
+    if( 0 == heap_caps_get_free_size(MALLOC_CAP_SPIRAM) ) {
+        printf("No PSRAM; only comparing the default policy to internal RAM\n");
+        n_policies = 2;
+    }
+
+    esp_hdiffz_mem_as_stream_input(&diff_stream, (const unsigned char *)hello_world_diff, hello_world_diff_size);
+    TEST_ESP_OK(esp_hdiffz_get_info(&diff_stream, &info));
+    old_stream.streamImport = (void *)ota_0;
+    old_stream.streamSize = info.old_size;
+    old_stream.read = partition_stream_read;
+    out_stream.streamSize = info.new_size;
+    out_stream.write = discard_write;
+
+    for(int p=0; p < n_policies; p++) {
+        const esp_hdiffz_mem_t mem = { .policy = &policies[p], .report = &report };
+        int64_t t0;
+        int us;
+
+        memset(&report, 0, sizeof(report));
+        t0 = esp_timer_get_time();
+        for(int r=0; r < rounds; r++) {
+            esp_hdiffz_miniz_plugin_t plugin;
+            esp_hdiffz_engine_cfg_t cfg = { 0 };
+
+            esp_hdiffz_miniz_plugin_init(&plugin);
+            plugin.dict_src = &old_stream;
+            plugin.mem_policy = mem.policy;
+            plugin.mem_report = mem.report;
+            cfg.out = &out_stream;
+            cfg.old = &old_stream;
+            cfg.diff = &diff_stream;
+            cfg.plugin = &plugin.base;
+            cfg.mem = &mem;
+            TEST_ESP_OK(esp_hdiffz_engine_patch(&cfg));
+        }
+        us = (int)((esp_timer_get_time() - t0) / rounds);
+
+        printf("%-8s %6d us %6d KB/s;", names[p], us, (int)((int64_t)info.new_size * 1000 / us));
+        for(int c=0; c < ESP_HDIFFZ_MEM_N; c++) {
+            printf(" [%d] %d int %d ext", c, (int)report.cls[c].internal_bytes / rounds,
+                    (int)report.cls[c].external_bytes / rounds);
+        }
+        printf("\n");
+
+        TEST_ASSERT_GREATER_THAN(0, report.cls[ESP_HDIFFZ_MEM_STATE].n_allocs);
+        TEST_ASSERT_EQUAL(0, report.cls[ESP_HDIFFZ_MEM_STATE].n_failed);
+        if( 0 == p ) TEST_ASSERT_EQUAL(0, report.cls[ESP_HDIFFZ_MEM_STATE].external_bytes);
+        if( 1 == p ) {
+            for(int c=0; c < ESP_HDIFFZ_MEM_N; c++) TEST_ASSERT_EQUAL(0, report.cls[c].external_bytes);
+        }
+    }
+}
+
+/**
+ * Patch time from a file diff and how long the patch waited for diff data,
+ * without read-ahead and with a few ring shapes.
+ */
+TEST_CASE("Diff read-ahead", "[hdiffz][perf]")
+{
+    const esp_hdiffz_readahead_config_t configs[] = {
+        { .refill_size = 2048, .depth = 0 },
+        { .refill_size = 2048, .depth = 2 },
+        { .refill_size = 2048, .depth = 4 },
+        { .refill_size = 4096, .depth = 2 },
+    };
+    const char fn_diff[] = "/spiffs/diff";
+    const esp_partition_t *running, *ota_0, *ota_1;
+    esp_hdiffz_patch_stats_t stats;
+    esp_hdiffz_ota_opts_t opts = ESP_HDIFFZ_OTA_OPTS_DEFAULT();
+
+    test_fs_setup();
+    test_spiffs_create_file_with_data(fn_diff, hello_world_diff, hello_world_diff_size);
+
+    running = esp_ota_get_running_partition();
+    TEST_ASSERT_NOT_NULL(running);
+    ota_0 = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, NULL);
+    TEST_ASSERT_NOT_NULL(ota_0);
+    ota_1 = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_1, NULL);
+    TEST_ASSERT_NOT_NULL(ota_1);
+
+    printf("%6s %5s %8s %8s %6s %7s\n", "refill", "depth", "total us", "wait us", "stalls", "refills");
+    for(size_t c=0; c < sizeof(configs) / sizeof(configs[0]); c++) {
+        FILE *f_diff;
+        int64_t t0;
+        int us;
+
+        opts.readahead = &configs[c];
+        opts.stats = &stats;
+        f_diff = fopen(fn_diff, "rb");
+        TEST_ASSERT_NOT_NULL(f_diff);
+        t0 = esp_timer_get_time();
+        TEST_ESP_OK(esp_hdiffz_ota_file_opts(f_diff, ota_0, ota_1, NULL, &opts));
+        us = (int)(esp_timer_get_time() - t0);
+        fclose(f_diff);
+        TEST_ESP_OK(esp_ota_set_boot_partition(running));
+
+        printf("%6d %5d %8d %8d %6d %7d\n", (int)configs[c].refill_size, configs[c].depth, us,
+                (int)stats.diff_wait_us, (int)stats.n_diff_stalls, (int)stats.n_diff_refills);
+        TEST_ASSERT_GREATER_THAN(0, stats.n_diff_reads);
+        if( 0 == configs[c].depth ) TEST_ASSERT_EQUAL(0, stats.n_diff_refills);
+        else TEST_ASSERT_GREATER_THAN(0, stats.n_diff_refills);
+    }
+
+    test_fs_teardown();
+}
+
 #if 0
 /**
  * Proxy for testing OTA update.
@@ -183,8 +1177,8 @@ TEST_CASE("ota_streaming", "[hdiffz]")
 
 
     esp_hdiffz_ota_handle_t *ota_handle;
-    TEST_ESP_OK(esp_hdiffz_ota_begin_adv(ota_0, ota_1, OTA_SIZE_UNKNOWN, sizeof(hello_world_diff), &ota_handle));
-    TEST_ESP_OK(esp_hdiffz_ota_write(ota_handle, hello_world_diff, sizeof(hello_world_diff)));
+    TEST_ESP_OK(esp_hdiffz_ota_begin_adv(ota_0, ota_1, OTA_SIZE_UNKNOWN, hello_world_diff_size, &ota_handle));
+    TEST_ESP_OK(esp_hdiffz_ota_write(ota_handle, hello_world_diff, hello_world_diff_size));
     TEST_ESP_OK(esp_hdiffz_ota_end(ota_handle));
 
     TEST_ESP_OK(esp_partition_get_sha256(ota_1, ota_1_sha256));